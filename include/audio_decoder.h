@@ -0,0 +1,32 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+/* raw bytes read from the source at once */
+#define AUDIO_DECODER_READ_SIZE (32 * 1024)
+/* frames converted to float and mixed to stereo at once */
+#define AUDIO_DECODER_MIX_FRAMES 1024
+
+typedef struct audio_decoder_s audio_decoder_t;
+
+/**
+ * @brief Opens a source that can be decoded in process, without ffmpeg
+ *
+ * Supported are WAV files with 8, 16, 24 or 32 bit integer or 32 bit float samples
+ * and FLAC files with up to 24 bit and 8 channels. MP3 and Vorbis stay with ffmpeg.
+ * Any channel count is mixed to stereo, any rate is resampled to 48 kHz.
+ *
+ * @return Decoder or NULL if the source needs ffmpeg
+ */
+audio_decoder_t *audio_decoder_open(const char *source, size_t skip_seconds);
+void audio_decoder_close(audio_decoder_t *decoder);
+
+/**
+ * @brief Reads interleaved 48 kHz stereo samples
+ *
+ * Only returns fewer than frames at the end of the source.
+ *
+ * @return NO_ERROR, ERROR_END_OF_STREAM once everything was read, ERROR_READ_FAILED
+ */
+error_t audio_decoder_read(audio_decoder_t *decoder, int16_t *buffer, size_t frames, size_t *frames_read);
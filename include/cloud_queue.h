@@ -0,0 +1,37 @@
+#pragma once
+
+#include "error.h"
+#include "handler.h"
+
+#define CLOUD_QUEUE_PATH "config/cloud_queue.bin"
+#define CLOUD_QUEUE_ENTRIES 64
+#define CLOUD_QUEUE_URI_LENGTH 128
+#define CLOUD_QUEUE_QUERY_LENGTH 256
+#define CLOUD_QUEUE_BODY_LENGTH 2048
+
+/* retry delay doubles with every failed attempt, up to the maximum */
+#define CLOUD_QUEUE_RETRY_MIN_S 10
+#define CLOUD_QUEUE_RETRY_MAX_S (30 * 60)
+/* entries which could not be delivered within this time are dropped */
+#define CLOUD_QUEUE_MAX_AGE_S (24 * 60 * 60)
+
+void cloud_queue_init();
+void cloud_queue_deinit();
+
+/**
+ * @brief Queue a request for asynchronous delivery to the tonies cloud
+ *
+ * The request is copied, persisted and sent by the queue thread. When the
+ * queue is full, the oldest entry is dropped.
+ *
+ * @param[in] api Cloud API the request belongs to (V1_LOG, V1_CLAIM)
+ * @param[in] method HTTP method, "GET" or "POST"
+ * @param[in] uri Request URI
+ * @param[in] queryString Query string, may be NULL
+ * @param[in] body Request body, may be NULL
+ * @param[in] bodyLen Length of the request body
+ * @param[in] token Authentication token of the box, may be NULL
+ * @param[in] client_ctx Client context of the requesting box
+ * @return Error code
+ */
+error_t cloud_queue_add(cloudapi_t api, const char *method, const char *uri, const char *queryString, const uint8_t *body, size_t bodyLen, const uint8_t *token, client_ctx_t *client_ctx);
@@ -12,7 +12,6 @@ typedef struct
     bool_t cache;
 
     bool_t _stream;
-    char *_streamFile;
     uint32_t _version;
     bool_t _updated;
 
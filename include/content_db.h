@@ -0,0 +1,35 @@
+#pragma once
+
+#include "error.h"
+#include "contentJson.h"
+
+#define CONTENT_DB_PATH "config/content.db"
+#define CONTENT_DB_BUCKETS 1024
+/* pending changes are appended to the log at least this often */
+#define CONTENT_DB_FLUSH_MS 2000
+/* the log is rewritten when it is this big and more than half of it are outdated records */
+#define CONTENT_DB_COMPACT_MIN (64 * 1024)
+
+void content_db_init();
+void content_db_deinit();
+
+/**
+ * @brief Reads the stored settings (live, nocloud, source, skip_seconds, cache) of a content file
+ *
+ * @param[in] content_path Absolute path of the TAF
+ * @param[out] content_json Settings, source is allocated and has to be freed
+ * @param[out] sidecarTime Modification time of the imported sidecar, 0 if none was imported. May be NULL.
+ * @return NO_ERROR, ERROR_NOT_FOUND if nothing is stored for the file yet
+ */
+error_t content_db_get(const char *content_path, contentJson_t *content_json, uint32_t *sidecarTime);
+
+/**
+ * @brief Stores the settings of a content file. The change is visible immediately and written
+ * to disk in background.
+ */
+error_t content_db_set(const char *content_path, const contentJson_t *content_json);
+
+/**
+ * @brief Stores the settings read from a sidecar, together with the modification time of the sidecar
+ */
+error_t content_db_import(const char *content_path, const contentJson_t *content_json, uint32_t sidecarTime);
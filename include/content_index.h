@@ -0,0 +1,47 @@
+#pragma once
+
+#include "error.h"
+#include "handler.h"
+#include "taf_verify.h"
+#include "fs_port.h"
+
+#define CONTENT_INDEX_BUCKETS 1024
+/* the whole index is dropped when it grows beyond this, it is rebuilt on demand */
+#define CONTENT_INDEX_MAX_ENTRIES 16384
+
+void content_index_init();
+void content_index_deinit();
+
+/**
+ * @brief Fills the file and sidecar information of a TAF into tonieInfo
+ *
+ * Served from memory when possible, otherwise the TAF header and (for content
+ * files) the .json sidecar are read from disk and added to the index.
+ * contentPath of tonieInfo is left untouched.
+ *
+ * @param[in] contentPath Absolute path of the TAF
+ * @param[in] isContent Path is a tonie in the content dir, which has a sidecar
+ * @param[out] tonieInfo Information of the file
+ */
+void content_index_get(const char *contentPath, bool_t isContent, tonie_info_t *tonieInfo);
+
+/**
+ * @brief Stores the result of taf_verify_file() in the entry of a file
+ *
+ * Only done if the entry, created by content_index_get(), still describes the checked file.
+ *
+ * @param[in] stat Size and modification time of the file when it was checked
+ */
+void content_index_set_verify(const char *path, const FsFileStat *stat, taf_verify_result_t result);
+
+/**
+ * @brief Drops the entry of a file, to be called after it was written, moved or deleted.
+ *
+ * Passing a sidecar (.json) drops the entry of the TAF it belongs to.
+ */
+void content_index_invalidate(const char *path);
+
+/**
+ * @brief Drops the entries of all files below a directory
+ */
+void content_index_invalidate_dir(const char *dir);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "error.h"
+#include "fs_port.h"
+#include "settings.h"
+
+/* number of directories kept in memory, least recently used ones are dropped */
+#define DIR_CACHE_DIRS 32
+#define DIR_CACHE_DESC_LENGTH 64
+
+typedef struct
+{
+    char *name;
+    uint32_t size;
+    DateTime modified;
+    bool_t isDir;
+    /* "TAF:<audio id>:<sha1>" for valid TAFs, empty otherwise */
+    char desc[DIR_CACHE_DESC_LENGTH];
+} dir_cache_entry_t;
+
+typedef enum
+{
+    DIR_CACHE_SORT_NAME = 0,
+    DIR_CACHE_SORT_DATE,
+    DIR_CACHE_SORT_SIZE
+} dir_cache_sort_t;
+
+typedef struct dir_cache_listing_s dir_cache_listing_t;
+
+void dir_cache_init();
+void dir_cache_deinit();
+
+/**
+ * @brief Returns the listing of a directory, from memory if it did not change
+ *
+ * Entries of a changed directory whose name, size and date are unchanged keep
+ * their TAF description, only new or modified files are read.
+ * The listing is immutable and has to be released with dir_cache_release().
+ *
+ * @return Listing or NULL if the directory can't be opened
+ */
+dir_cache_listing_t *dir_cache_get(const char *path, settings_t *settings);
+void dir_cache_release(dir_cache_listing_t *listing);
+
+size_t dir_cache_count(const dir_cache_listing_t *listing);
+
+/**
+ * @brief Returns the entries of a listing in the requested order, directories first
+ *
+ * The returned array has dir_cache_count() elements and has to be freed with osFreeMem().
+ * The entries are valid until the listing is released.
+ */
+const dir_cache_entry_t **dir_cache_sorted(const dir_cache_listing_t *listing, dir_cache_sort_t sort, bool_t descending);
+
+/**
+ * @brief Returns the position of the entry after the named one in a sorted array, 0 if not found
+ */
+size_t dir_cache_after(const dir_cache_entry_t **sorted, size_t count, size_t hint, const char *name);
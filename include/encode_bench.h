@@ -0,0 +1,22 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+/* length of the synthetic signals */
+#define ENCODE_BENCH_SECONDS 60
+/* sources given on the command line are cut to this length */
+#define ENCODE_BENCH_MAX_SECONDS 600
+
+/**
+ * @brief Encodes synthetic signals and the given audio files and reports where the time goes
+ *
+ * Every source is decoded into memory first, so only the encoder is measured. It is encoded
+ * once serially with the stages profiled and once with the parallel encoder. For the audio files
+ * the decoding time of audio_decoder is compared to ffmpeg as well. The results are written as
+ * JSON, the TAFs are deleted afterwards.
+ *
+ * @param[in] output JSON file, "-" prints to stdout
+ * @param[in] target Path of the temporary TAF
+ */
+error_t encode_bench_run(const char *output, const char *target, const char *const *sources, size_t count);
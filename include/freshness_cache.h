@@ -0,0 +1,40 @@
+#pragma once
+
+#include "error.h"
+#include "handler.h"
+
+/* don't ask the cloud again if the cached answer is younger than this */
+#define FRESHNESS_CACHE_REVALIDATE_MIN_S 60
+#define FRESHNESS_CACHE_BODY_MAX (64 * 1024)
+/* freshness_cache_deinit waits this long for running revalidations */
+#define FRESHNESS_CACHE_STOP_TIMEOUT_MS 10000
+
+void freshness_cache_init();
+void freshness_cache_deinit();
+
+/**
+ * @brief Calculates the cache key of a freshness check request
+ *
+ * The key covers the uid and audio id of every tonie, independent of their order.
+ */
+uint64_t freshness_cache_key(const TonieFreshnessCheckRequest *freshReq);
+
+/**
+ * @brief Returns the cached upstream response of the box, if the key matches and
+ * the entry is not older than cloud.freshnessCacheMaxAge.
+ *
+ * The returned response has to be freed with tonie_freshness_check_response__free_unpacked().
+ */
+TonieFreshnessCheckResponse *freshness_cache_get(client_ctx_t *client_ctx, uint64_t key);
+
+/**
+ * @brief Sends the packed request to the cloud, stores the answer and returns it.
+ *
+ * Returns NULL if the cloud did not answer properly.
+ */
+TonieFreshnessCheckResponse *freshness_cache_fetch(client_ctx_t *client_ctx, uint64_t key, const uint8_t *data, size_t dataLen);
+
+/**
+ * @brief Refreshes the cached response in background. At most one refresh per box is running.
+ */
+void freshness_cache_revalidate(client_ctx_t *client_ctx, uint64_t key, const uint8_t *data, size_t dataLen);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "error.h"
+#include "fs_port.h"
+
+/* changes of a watched file are reported once it was left alone this long, editors save in several steps */
+#define FS_WATCH_DEBOUNCE_MS 500
+/* interval watched files are checked in while there are no notifications for them */
+#define FS_WATCH_FALLBACK_MS 2000
+
+/**
+ * @brief Called from the watcher thread when an entry of a watched directory changed
+ *
+ * @param[in] ctx Context passed to fs_watch_add_dir()
+ * @param[in] dir Watched directory, as passed to fs_watch_add_dir()
+ * @param[in] name Name of the changed entry, NULL if the directory itself was removed
+ *                 or events were lost and everything below dir has to be considered changed
+ * @param[in] isDir The changed entry is a directory
+ */
+typedef void (*fs_watch_cbr_t)(void *ctx, const char *dir, const char *name, bool_t isDir);
+
+/**
+ * @brief Called from the watcher thread when a watched file changed
+ *
+ * @param[in] ctx Context passed to fs_watch_add_file()
+ * @param[in] path Watched file, as passed to fs_watch_add_file()
+ */
+typedef void (*fs_watch_file_cbr_t)(void *ctx, const char *path);
+
+void fs_watch_init();
+void fs_watch_deinit();
+
+/**
+ * @brief Returns TRUE if change notifications are supported and the watcher is running
+ */
+bool_t fs_watch_available();
+
+/**
+ * @brief Subscribe to changes of the entries of a directory (not recursive)
+ *
+ * Adding the same directory with the same callback again is a no-op. When the
+ * directory is removed, the watch is dropped and has to be added again.
+ *
+ * @return NO_ERROR if changes will be reported, an error if the caller has to
+ *         detect changes on its own
+ */
+error_t fs_watch_add_dir(const char *dir, fs_watch_cbr_t cbr, void *ctx);
+
+/**
+ * @brief Subscribe to changes of a single file or directory
+ *
+ * The file does not have to exist, creating, changing, removing and renaming it
+ * are reported. Several changes within FS_WATCH_DEBOUNCE_MS are reported once.
+ * Without change notifications the file is checked every FS_WATCH_FALLBACK_MS.
+ * Adding the same path with the same callback again is a no-op.
+ *
+ * @return NO_ERROR if changes will be reported, an error if the watcher is not running
+ */
+error_t fs_watch_add_file(const char *path, fs_watch_file_cbr_t cbr, void *ctx);
+
+/**
+ * @brief Drops all files added with this callback and context
+ */
+void fs_watch_remove_files(fs_watch_file_cbr_t cbr, void *ctx);
@@ -16,6 +16,9 @@
 #include "cloud_request.h"
 
 #include "contentJson.h"
+#include "toniefile.h"
+#include "taf_playlist.h"
+#include "taf_verify.h"
 
 #define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
 
@@ -27,7 +30,9 @@ typedef struct
     bool_t updated;
     bool_t stream;
     contentJson_t contentConfig;
-    TonieboxAudioFileHeader *tafHeader;
+    toniefile_header_t tafHeader;
+    /* result of the last background check, TAF_VERIFY_UNKNOWN if not checked yet */
+    taf_verify_result_t verify;
 } tonie_info_t;
 
 #define PROX_STATUS_IDLE 0
@@ -93,4 +98,15 @@ error_t httpWriteResponseString(HttpConnection *connection, char_t *data, bool_t
 error_t httpWriteResponse(HttpConnection *connection, void *data, size_t size, bool_t freeMemory);
 error_t httpWriteString(HttpConnection *connection, const char_t *content);
 error_t httpFlushStream(HttpConnection *connection);
+/**
+ * @brief Sends a live stream to the client until it ends or the connection is closed
+ *
+ * @param[in] backlog Distance behind the newest data to start at, see stream_reader_create()
+ * @param[in] requestTime System time the request arrived, for the time to first byte statistics
+ */
+error_t httpSendStreamBuffer(HttpConnection *connection, stream_buffer_t *buffer, size_t backlog, systime_t requestTime);
+/**
+ * @brief Sends the TAF assembled from a playlist, byte ranges are answered from the parts they fall into
+ */
+error_t httpSendTafPlaylist(HttpConnection *connection, taf_playlist_t *playlist);
 #endif
\ No newline at end of file
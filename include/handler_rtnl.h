@@ -81,6 +81,10 @@ typedef enum
     RTNL3_TYPE_PLAYBACK_STOPPED = 13,
 } rtnl_log3_type;
 
+/**
+ * @brief Resolves the settings the RTNL events are stored in, before the server starts
+ */
+void rtnl_init();
 error_t handleRtnl(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx);
 void rtnlEvent(HttpConnection *connection, TonieRtnlRPC *rpc, client_ctx_t *client_ctx);
 void rtnlEventLog(HttpConnection *connection, TonieRtnlRPC *rpc);
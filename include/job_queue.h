@@ -0,0 +1,68 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+#include "cJSON.h"
+#include "toniefile.h"
+
+#define JOB_QUEUE_PATH "config/jobs.bin"
+/* finished jobs kept for the status listing, the oldest are dropped first */
+#define JOB_QUEUE_HISTORY 64
+#define JOB_QUEUE_MAX_SOURCES 99
+/* interval progress events of a running job are sent in */
+#define JOB_QUEUE_PROGRESS_MS 1000
+
+typedef enum
+{
+    JOB_QUEUED = 0,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELED
+} job_state_t;
+
+void job_queue_init();
+void job_queue_deinit();
+
+/**
+ * @brief Queues the conversion of audio files into one TAF, each source becomes a chapter
+ *
+ * The job is persisted and picked up by the worker pool, jobs interrupted by a
+ * restart are started again.
+ *
+ * @param[in] target Absolute path of the TAF, written once the job succeeded
+ * @param[in] sources Absolute paths of the sources, in chapter order
+ * @param[in] count Number of sources, at most JOB_QUEUE_MAX_SOURCES
+ * @param[in] audio_id Audio id of the TAF, 0 uses the time the job starts
+ * @param[in] quality Encoder quality of the TAF
+ * @param[out] id Id of the new job, may be NULL
+ * @return Error code
+ */
+error_t job_queue_add(const char *target, const char *const *sources, size_t count, uint32_t audio_id, toniefile_quality_t quality, uint32_t *id);
+
+/**
+ * @brief Queues a job for a file, or for every folder containing audio files
+ *
+ * A file becomes a TAF next to it. The audio files of a folder become the chapters
+ * of <folder>/<folder name>.taf, sorted by name. Existing TAFs are only replaced
+ * with overwrite set.
+ *
+ * @param[in] path Absolute path of a file or folder
+ * @param[in] recursive Also queue the subfolders of a folder
+ * @param[in] quality Encoder quality of the TAFs
+ * @param[out] added Number of jobs queued
+ * @return Error code
+ */
+error_t job_queue_add_path(const char *path, bool_t recursive, bool_t overwrite, toniefile_quality_t quality, size_t *added);
+
+/**
+ * @brief Cancels a queued or running job, the partial TAF of a running one is deleted
+ *
+ * @return NO_ERROR, ERROR_NOT_FOUND if there is no unfinished job with this id
+ */
+error_t job_queue_cancel(uint32_t id);
+
+/**
+ * @brief Returns a JSON array describing the queued, running and finished jobs
+ */
+cJSON *job_queue_list();
@@ -12,6 +12,19 @@ typedef enum
     MUTEX_RTNL_FILE,
     MUTEX_MQTT_TX_BUFFER,
     MUTEX_MQTT_BOX,
+    MUTEX_CLOUD_QUEUE,
+    MUTEX_FRESHNESS_CACHE,
+    MUTEX_CONTENT_INDEX,
+    MUTEX_FS_WATCH,
+    MUTEX_CONTENT_DB,
+    MUTEX_DIR_CACHE,
+    MUTEX_TAF_INDEX,
+    MUTEX_STREAM_BUFFER,
+    MUTEX_STREAM_SESSION,
+    MUTEX_TONIEFILE_PARALLEL,
+    MUTEX_JOB_QUEUE,
+    MUTEX_TAF_PLAYLIST,
+    MUTEX_SERVER_EVENT,
     MUTEX_LAST
 } mutex_id_t;
 
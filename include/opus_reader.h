@@ -0,0 +1,37 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+/* upper bound for a single packet of the source, larger ones are treated as corrupt */
+#define OPUS_READER_PACKET_MAX (16 * 1024)
+
+typedef struct opus_reader_s opus_reader_t;
+
+/**
+ * @brief Opens an Ogg Opus file whose packets can be copied into a TAF as they are
+ *
+ * The page headers of the whole file are checked first, so a source that is accepted
+ * does not fail halfway. Chained or multiplexed streams, more than two channels,
+ * an output gain and a pre-skip other than OPUS_PRE_SKIP are left to the decoder,
+ * they can't be represented in a TAF without encoding again. The end trim of the
+ * last page is not carried over, a TAF ends on whole frames like encoded sources.
+ *
+ * @return Reader or NULL if the source has to be decoded
+ */
+opus_reader_t *opus_reader_open(const char *source);
+void opus_reader_close(opus_reader_t *reader);
+
+/**
+ * @brief Returns the next audio packet, the header packets are skipped
+ *
+ * @param[out] packet Points to the packet, valid until the next call
+ * @param[out] samples Duration of the packet at 48 kHz
+ * @return NO_ERROR, ERROR_END_OF_STREAM, ERROR_INVALID_FILE if a page is corrupt
+ */
+error_t opus_reader_read(opus_reader_t *reader, const uint8_t **packet, size_t *length, uint32_t *samples);
+
+/**
+ * @brief Returns the duration of the source at 48 kHz, from the granule position of its last page without the pre-skip
+ */
+uint64_t opus_reader_duration(opus_reader_t *reader);
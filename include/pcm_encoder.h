@@ -0,0 +1,43 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+#include "toniefile.h"
+
+/* received PCM waiting for the encoder, about 5 seconds of 48 kHz stereo */
+#define PCM_ENCODER_RING_SIZE (1024 * 1024)
+/* producers give up when the encoder did not take any data for this long */
+#define PCM_ENCODER_TIMEOUT_MS 30000
+
+/*
+ * Encodes raw 48 kHz stereo PCM into a TAF on a task of its own, so a connection can
+ * receive the next data while the previous one is encoded. The data is passed through a
+ * bounded ring, writers block while it is full.
+ */
+typedef struct pcm_encoder_s pcm_encoder_t;
+
+/**
+ * @brief Creates the TAF and starts the encoder task
+ *
+ * @return Encoder or NULL if the file could not be created
+ */
+pcm_encoder_t *pcm_encoder_start(const char *path, uint32_t audio_id, toniefile_quality_t quality);
+
+/**
+ * @brief Queues PCM, samples may be split between calls
+ *
+ * @return NO_ERROR, ERROR_TIMEOUT or the error the encoder stopped with
+ */
+error_t pcm_encoder_write(pcm_encoder_t *encoder, const void *data, size_t length);
+
+/**
+ * @brief Starts a chapter with the audio written next
+ */
+error_t pcm_encoder_chapter(pcm_encoder_t *encoder);
+
+/**
+ * @brief Waits until all audio is encoded, closes the TAF and frees the encoder
+ *
+ * @return Error of the encoder or of closing the TAF
+ */
+error_t pcm_encoder_finish(pcm_encoder_t *encoder);
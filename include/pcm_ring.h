@@ -0,0 +1,48 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+typedef struct pcm_ring_s pcm_ring_t;
+
+/**
+ * @brief Creates a ring passing raw audio from one producer task to one consumer task
+ *
+ * The data path is lock free, the tasks only block on events when the ring is full or empty.
+ *
+ * @return The ring or NULL if it could not be allocated
+ */
+pcm_ring_t *pcm_ring_create(size_t size);
+void pcm_ring_free(pcm_ring_t *ring);
+
+/**
+ * @brief Returns the contiguous free space the producer may fill directly, waiting up to timeout for it
+ *
+ * @return NO_ERROR, ERROR_TIMEOUT or ERROR_ABORTED if the consumer gave up
+ */
+error_t pcm_ring_write_begin(pcm_ring_t *ring, uint8_t **data, size_t *size, systime_t timeout);
+
+/**
+ * @brief Publishes length bytes filled after pcm_ring_write_begin()
+ */
+void pcm_ring_write_commit(pcm_ring_t *ring, size_t length);
+
+/**
+ * @brief Marks the end of the data, the consumer drains the ring and then gets ERROR_END_OF_STREAM
+ */
+void pcm_ring_close(pcm_ring_t *ring);
+
+/**
+ * @brief Tells the producer to stop, a waiting pcm_ring_write_begin() returns ERROR_ABORTED
+ */
+void pcm_ring_abort(pcm_ring_t *ring);
+
+/**
+ * @brief Reads a multiple of align bytes, at most size
+ *
+ * Waits until at least align bytes are available. Only after the producer closed the
+ * ring a shorter remainder is returned.
+ *
+ * @return NO_ERROR, ERROR_TIMEOUT or ERROR_END_OF_STREAM
+ */
+error_t pcm_ring_read(pcm_ring_t *ring, void *data, size_t size, size_t align, size_t *length, systime_t timeout);
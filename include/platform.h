@@ -8,4 +8,53 @@ void *resolve_host(const char *hostname);
 bool resolve_get_ip(void *res, int pos, IpAddr *ipAddr);
 void resolve_free(void *res);
 
+/**
+ * @brief Returns the number of online CPU cores, at least 1
+ */
+uint32_t platform_get_cpu_count();
+
+/**
+ * @brief Returns a monotonic time in nanoseconds, for measuring short intervals
+ */
+uint64_t platform_time_ns();
+
+/* nice value of background tasks, so they only get the CPU time the box connections leave */
+#define PLATFORM_BACKGROUND_NICE 10
+
+/**
+ * @brief Lowers the scheduling priority of the calling task below the one of the server tasks
+ */
+void platform_set_task_background();
+
+typedef struct platform_process_s platform_process_t;
+
+/**
+ * @brief Starts a program directly, without a shell, with its stdout connected to a pipe
+ *
+ * argv[0] is searched in PATH, argv has to be NULL terminated. stdin is read
+ * from the null device, stderr is inherited.
+ *
+ * @return Process or NULL if it could not be started
+ */
+platform_process_t *platform_process_spawn(const char *const argv[]);
+
+/**
+ * @brief Reads whatever the program wrote to stdout, blocks until there is data
+ *
+ * @return NO_ERROR, ERROR_END_OF_STREAM once the program closed stdout, ERROR_READ_FAILED
+ */
+error_t platform_process_read(platform_process_t *process, void *data, size_t size, size_t *length);
+
+/**
+ * @brief Asks the program to quit, a blocked platform_process_read() returns when it did
+ */
+void platform_process_terminate(platform_process_t *process);
+
+/**
+ * @brief Waits for the program to exit and frees the process
+ *
+ * @return Exit code of the program, -1 if it was ended by a signal
+ */
+int platform_process_wait(platform_process_t *process);
+
 #endif
\ No newline at end of file
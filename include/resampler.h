@@ -0,0 +1,46 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+/* FIR taps per output sample, a multiple of 4 for the SIMD dot product */
+#define RESAMPLER_TAPS 32
+/* upper bound for the interpolation factor after reducing the rates, limits the coefficient table */
+#define RESAMPLER_MAX_PHASES 1024
+/* input frames buffered in front of the filter */
+#define RESAMPLER_BUFFER_FRAMES 4096
+
+typedef struct resampler_s resampler_t;
+
+/**
+ * @brief Creates a polyphase windowed sinc resampler for stereo audio
+ *
+ * The rates are reduced by their greatest common divisor, every output sample
+ * is one filter phase applied to RESAMPLER_TAPS input samples. Downsampling
+ * moves the cutoff below the output Nyquist frequency.
+ *
+ * @return Resampler or NULL if the ratio needs more than RESAMPLER_MAX_PHASES phases
+ */
+resampler_t *resampler_create(uint32_t in_rate, uint32_t out_rate);
+void resampler_free(resampler_t *rs);
+
+/**
+ * @brief Returns how many input frames resampler_process() accepts right now
+ */
+size_t resampler_space(resampler_t *rs);
+
+/**
+ * @brief Resamples planar float input to interleaved 16 bit stereo
+ *
+ * @param[in] left,right Input frames, at most resampler_space(), NULL with a count
+ *            of 0 after the end of the input, which flushes the filter with silence
+ * @param[out] out Interleaved output frames
+ * @param[in] out_frames Space in out, in frames
+ * @return Number of frames written to out
+ */
+size_t resampler_process(resampler_t *rs, const float *left, const float *right, size_t in_frames, int16_t *out, size_t out_frames);
+
+/**
+ * @brief Converts a float sample in the range -1..1 to 16 bit, clipping what is outside
+ */
+int16_t resampler_clip(float sample);
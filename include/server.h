@@ -0,0 +1,8 @@
+#pragma once
+
+void server_init();
+
+/**
+ * @brief Wakes the main loop, so it notices internal.exit or other changes right away
+ */
+void server_wake();
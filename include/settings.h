@@ -43,6 +43,7 @@ typedef struct
     bool enableV1Claim;
     bool enableV1CloudReset;
     bool enableV1FreshnessCheck;
+    uint32_t freshnessCacheMaxAge;
     bool enableV1Log;
     bool enableV1Time;
     bool enableV1Ota;
@@ -187,6 +188,14 @@ typedef struct
 
     bool flex_enabled;
     char *flex_uid;
+    uint32_t stream_grace;
+    uint32_t transcode_cache_max_age;
+    char *encode_quality;
+    uint32_t encode_threads;
+    uint32_t job_threads;
+    uint32_t scrub_interval;
+    uint32_t scrub_rate;
+    bool scrub_quarantine;
 } settings_core_t;
 
 typedef struct
@@ -289,6 +298,20 @@ typedef struct
     bool overlayed;
 } setting_item_t;
 
+#define SETTING_HANDLE_INVALID UINT16_MAX
+
+/**
+ * @brief A setting resolved by settings_handle(), valid for the lifetime of the process.
+ *
+ * The option map has the same layout in every overlay, so one handle serves all of them.
+ * Callers on hot paths resolve the handle once and skip the lookup by name afterwards.
+ */
+typedef struct
+{
+    uint16_t index;
+    settings_type type;
+} setting_handle_t;
+
 #define OPTION_START() setting_item_t option_map_array[] = {
 #define OPTION_ADV_BOOL(o, p, d, short, desc, i, ov) {.option_name = o, .ptr = p, .init = {.bool_value = d}, .type = TYPE_BOOL, .description = desc, .label = short, .internal = i, .overlayed = ov},
 #define OPTION_ADV_SIGNED(o, p, d, minVal, maxVal, short, desc, i, ov) {.option_name = o, .ptr = p, .init = {.signed_value = d}, .min = {.signed_value = minVal}, .max = {.signed_value = maxVal}, .type = TYPE_SIGNED, .description = desc, .label = short, .internal = i, .overlayed = ov},
@@ -500,6 +523,25 @@ float settings_get_float_ovl(const char *item, const char *overlay_name);
 bool settings_set_float(const char *item, float value);
 bool settings_set_float_ovl(const char *item, float value, const char *overlay_name);
 
+/**
+ * @brief Resolves the name of a setting item into a handle.
+ *
+ * @param item The name of the setting item.
+ * @return The handle, its index is SETTING_HANDLE_INVALID if the item does not exist.
+ */
+setting_handle_t settings_handle(const char *item);
+
+/**
+ * @brief Gets the value of a setting item by its handle, from the main settings.
+ *
+ * @param handle The handle of the setting item.
+ * @return The current value, false, 0 or NULL if the handle is invalid or of another type.
+ */
+bool settings_get_bool_handle(setting_handle_t handle);
+uint32_t settings_get_unsigned_handle(setting_handle_t handle);
+const char *settings_get_string_handle_id(setting_handle_t handle, uint8_t settingsId);
+bool settings_set_string_handle_id(setting_handle_t handle, const char *value, uint8_t settingsId);
+
 char *settings_sanitize_box_id(const char *input_id);
 
 void settings_load_all_certs();
@@ -19,4 +19,5 @@ typedef struct
     ;
 
 void stats_update(const char *item, int count);
+void stats_set(const char *item, int value);
 stat_t *stats_get(int index);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+/* about 40 seconds of audio at the encoder bitrate */
+#define STREAM_BUFFER_SIZE (512 * 1024)
+
+typedef struct stream_buffer_s stream_buffer_t;
+typedef struct stream_reader_s stream_reader_t;
+
+/**
+ * @brief Creates a buffer a producer publishes a live stream to and any number of readers consume from
+ *
+ * The first prefixLength bytes (e.g. TAF header and ogg headers) are kept for the whole
+ * lifetime, the rest is held in a ring of size bytes. Readers falling behind further than
+ * the ring continue at the oldest available multiple of blockSize.
+ * The creator holds a reference that has to be dropped with stream_buffer_release().
+ */
+stream_buffer_t *stream_buffer_create(size_t size, size_t prefixLength, size_t blockSize);
+void stream_buffer_release(stream_buffer_t *buffer);
+
+/**
+ * @brief Appends data and wakes up all waiting readers, never blocks
+ */
+error_t stream_buffer_write(stream_buffer_t *buffer, const void *data, size_t length);
+
+/**
+ * @brief Marks the end of the stream, readers get ERROR_END_OF_STREAM when they consumed everything
+ */
+void stream_buffer_close(stream_buffer_t *buffer);
+
+/**
+ * @brief Returns the number of bytes written so far
+ */
+uint64_t stream_buffer_written(stream_buffer_t *buffer);
+
+/**
+ * @brief Adds a reader, it holds a reference to the buffer
+ *
+ * The reader gets the prefix first and continues at the block starting about backlog
+ * bytes before the newest data, or right after the prefix if the stream is younger.
+ */
+stream_reader_t *stream_reader_create(stream_buffer_t *buffer, size_t backlog);
+void stream_reader_free(stream_reader_t *reader);
+
+/**
+ * @brief Reads the next available data, waiting up to timeout for the producer
+ *
+ * @return NO_ERROR, ERROR_TIMEOUT if nothing was published in time, ERROR_END_OF_STREAM
+ */
+error_t stream_reader_read(stream_reader_t *reader, void *data, size_t size, size_t *length, systime_t timeout);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "error.h"
+#include "cJSON.h"
+#include "stream_buffer.h"
+
+/* interval the idle sessions are checked in */
+#define STREAM_SESSION_CHECK_MS 1000
+/* listeners give up when the source did not deliver enough audio in this time */
+#define STREAM_SESSION_START_TIMEOUT_MS 30000
+
+typedef struct stream_session_s stream_session_t;
+
+void stream_session_init();
+void stream_session_deinit();
+
+/**
+ * @brief Attaches a listener to the live stream of a source, starting the encoder if none is running
+ *
+ * Listeners of the same source and skip_seconds share one ffmpeg process and opus encoder.
+ * Every successful join has to be followed by stream_session_leave().
+ *
+ * @param[in] cache Keep the TAF in the transcode cache if a new encoder runs to the end of the source
+ * @return Session or NULL if no encoder could be started
+ */
+stream_session_t *stream_session_join(const char *source, size_t skip_seconds, bool_t cache);
+
+/**
+ * @brief Detaches a listener, the session is stopped after the grace period without listeners
+ */
+void stream_session_leave(stream_session_t *session);
+
+/**
+ * @brief Waits until the encoder buffered enough audio to start sending
+ *
+ * @return NO_ERROR, ERROR_TIMEOUT or the error the encoder stopped with
+ */
+error_t stream_session_wait(stream_session_t *session);
+
+stream_buffer_t *stream_session_buffer(stream_session_t *session);
+
+/**
+ * @brief Returns how far behind the newest audio a listener starts, follows the jitter of the source
+ */
+size_t stream_session_backlog(stream_session_t *session);
+
+/**
+ * @brief Returns a JSON array describing the running sessions
+ */
+cJSON *stream_session_list();
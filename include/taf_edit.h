@@ -0,0 +1,41 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+/*
+ * Editing of TAFs on the level of their 4 KiB blocks, nothing is decoded or encoded.
+ * Chapters start with a block, like the Toniebox plays them. The target is written
+ * to <target>.tmp and replaces an existing file once it is complete, so it may be
+ * one of the sources. An audio id of 0 keeps the one of the (first) source.
+ */
+
+/**
+ * @brief Joins TAFs into one, keeping the chapters of each
+ */
+error_t taf_edit_concat(const char *target, const char *const *sources, size_t count, uint32_t audio_id);
+
+/**
+ * @brief Copies a range of chapters into a TAF of its own
+ *
+ * @param[in] chapters Number of chapters, ranges beyond the last chapter are cut
+ */
+error_t taf_edit_extract(const char *source, const char *target, size_t first_chapter, size_t chapters, uint32_t audio_id);
+
+/**
+ * @brief Splits a TAF in front of a chapter into two, the targets must not be the source
+ */
+error_t taf_edit_split(const char *source, size_t chapter, const char *first_target, const char *second_target, uint32_t audio_id);
+
+/**
+ * @brief Replaces the chapters of a TAF
+ *
+ * @param[in] starts Start of each chapter in seconds, moved to the start of the block
+ *            playing at that time, the first chapter always starts with the first block
+ */
+error_t taf_edit_chapters(const char *source, const char *target, const double *starts, size_t count, uint32_t audio_id);
+
+/**
+ * @brief Changes the audio id of a TAF, also in the serial number of its Ogg pages
+ */
+error_t taf_edit_audio_id(const char *source, const char *target, uint32_t audio_id);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "error.h"
+#include "fs_port.h"
+#include "toniefile.h"
+
+/* number of seek indexes kept in memory, least recently used ones are dropped */
+#define TAF_INDEX_FILES 16
+
+typedef struct
+{
+    uint32_t refCount;
+    uint32_t audio_id;
+    uint32_t size;
+    DateTime modified;
+    uint16_t pre_skip;
+    /* length of the OpusHead and OpusTags pages at the start of the first block */
+    uint32_t header_length;
+    /* audio blocks following the TAF header */
+    uint32_t blocks;
+    /* granule position at the start of every block */
+    uint64_t *granules;
+    uint64_t end_granule;
+    size_t chapters;
+    uint32_t chapter_blocks[TONIEFILE_MAX_CHAPTERS];
+} taf_index_t;
+
+void taf_index_init();
+void taf_index_deinit();
+
+/**
+ * @brief Returns the seek index of a TAF, built on first access
+ *
+ * The index is kept until the file changes and has to be released with taf_index_release().
+ *
+ * @return Index or NULL if the file is no valid TAF or its blocks are not page aligned
+ */
+taf_index_t *taf_index_get(const char *path);
+void taf_index_release(taf_index_t *index);
+
+/**
+ * @brief Returns the block that has to be played to reach the given position in seconds
+ */
+uint32_t taf_index_block_at(const taf_index_t *index, double seconds);
+
+/**
+ * @brief Returns the position in seconds at the start of a block
+ */
+double taf_index_time(const taf_index_t *index, uint32_t block);
+
+/**
+ * @brief Returns the playing time in seconds
+ */
+double taf_index_duration(const taf_index_t *index);
+
+/**
+ * @brief Returns the offset of a block in the TAF file
+ */
+uint32_t taf_index_offset(uint32_t block);
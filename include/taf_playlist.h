@@ -0,0 +1,57 @@
+#pragma once
+
+#include "error.h"
+#include "fs_port.h"
+
+/* number of assembled playlists kept in memory, least recently used ones are dropped */
+#define TAF_PLAYLIST_FILES 4
+/* upper bound for the size of a playlist file */
+#define TAF_PLAYLIST_MAX_SIZE (64 * 1024)
+
+/*
+ * A playlist is an M3U file listing TAFs, one per line, relative to the playlist or absolute.
+ * Used as the source of a tonie, the TAFs are sent to the box as a single one that only
+ * exists in memory: a new header with the chapters of all parts, followed by their blocks
+ * with the pages numbered through. Each part starts a chapter.
+ */
+typedef struct taf_playlist_s taf_playlist_t;
+typedef struct taf_playlist_reader_s taf_playlist_reader_t;
+
+void taf_playlist_init();
+void taf_playlist_deinit();
+
+/**
+ * @brief Tells if a content source is a playlist of TAFs
+ */
+bool_t taf_playlist_is_playlist(const char *source);
+
+/**
+ * @brief Returns the assembled TAF of a playlist, built on first access
+ *
+ * Building reads all parts once for the SHA-1 of the header. The result is kept until the
+ * playlist or one of its parts changes and has to be released with taf_playlist_release().
+ *
+ * @return Playlist or NULL if it is empty or a part is no TAF with page aligned blocks
+ */
+taf_playlist_t *taf_playlist_get(const char *path);
+void taf_playlist_release(taf_playlist_t *playlist);
+
+/**
+ * @brief Returns the size of the assembled TAF, including its header
+ */
+uint32_t taf_playlist_size(const taf_playlist_t *playlist);
+
+/**
+ * @brief Creates a reader of the assembled TAF, it keeps the part being read open
+ *
+ * @return The reader or NULL if it could not be allocated
+ */
+taf_playlist_reader_t *taf_playlist_reader_create(taf_playlist_t *playlist);
+void taf_playlist_reader_free(taf_playlist_reader_t *reader);
+
+/**
+ * @brief Reads from any position of the assembled TAF
+ *
+ * @return NO_ERROR, ERROR_END_OF_STREAM at the end, ERROR_INVALID_FILE if a part changed since the playlist was built
+ */
+error_t taf_playlist_read(taf_playlist_reader_t *reader, uint32_t offset, uint8_t *data, size_t length, size_t *read);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+/* the first pass starts this long after the server, so it does not slow down the start */
+#define TAF_SCRUB_START_DELAY_MS (5 * 60 * 1000)
+/* interval the task checks its settings in while there is nothing to do */
+#define TAF_SCRUB_IDLE_MS (60 * 1000)
+/* files written more recently are left for the next pass, they might still be written */
+#define TAF_SCRUB_MIN_AGE_S 300
+#define TAF_SCRUB_MAX_DEPTH 8
+
+/*
+ * Checks every TAF of the content dir, the library and the transcode cache with
+ * taf_verify_file() every core.scrub_interval hours, reading at most core.scrub_rate
+ * MB/s. The results of content files are stored in the content index. Broken content
+ * files are moved aside to <file>.bad with core.scrub_quarantine, so the box gets
+ * them from the cloud again. That only happens with cloud.enabled and
+ * cloud.enableV2Content, otherwise the result is just recorded. Broken transcodes are
+ * deleted and encoded again on their next use. Broken library files are only reported.
+ */
+void taf_scrub_init();
+void taf_scrub_deinit();
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "error.h"
+#include "os_port.h"
+
+/* blocks read at once, the checks run at disk speed with bigger reads */
+#define TAF_VERIFY_READ_BLOCKS 16
+
+typedef enum
+{
+    /* not checked yet */
+    TAF_VERIFY_UNKNOWN = 0,
+    TAF_VERIFY_OK,
+    TAF_VERIFY_READ_FAILED,
+    /* no TAF header or one that does not decode */
+    TAF_VERIFY_BAD_HEADER,
+    /* not a multiple of the block size, or not the length in the header */
+    TAF_VERIFY_BAD_LENGTH,
+    /* a block that does not start with a page or pages crossing the block boundary */
+    TAF_VERIFY_BAD_ALIGNMENT,
+    TAF_VERIFY_BAD_CRC,
+    /* the audio does not match the SHA-1 of the header */
+    TAF_VERIFY_BAD_HASH,
+    /* stopped by the caller */
+    TAF_VERIFY_CANCELED
+} taf_verify_result_t;
+
+typedef struct
+{
+    taf_verify_result_t result;
+    /* audio block the check failed in, counted from the one behind the header */
+    uint32_t block;
+    uint32_t blocks;
+    uint64_t bytes;
+    /* a stream, its length and hash are not known */
+    bool_t stream;
+} taf_verify_info_t;
+
+/**
+ * @brief Builds the CRC tables and selects the SHA-1 implementation, called once before verifying
+ */
+void taf_verify_init();
+
+/**
+ * @brief Checks the structure of a TAF, the CRC of every Ogg page and the SHA-1 of the audio
+ *
+ * @param[in] rate Bytes per second to read at most, 0 reads as fast as possible
+ * @param[in] cancel Checked between reads, stops with TAF_VERIFY_CANCELED when set. May be NULL.
+ * @param[out] info Result and where the file failed
+ * @return The result, also stored in info
+ */
+taf_verify_result_t taf_verify_file(const char *path, uint32_t rate, const bool_t *cancel, taf_verify_info_t *info);
+
+/**
+ * @brief Short name of a result for logs and JSON
+ */
+const char *taf_verify_result_name(taf_verify_result_t result);
+
+/**
+ * @brief Whether the file was checked and found broken
+ */
+bool_t taf_verify_failed(taf_verify_result_t result);
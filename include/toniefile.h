@@ -1,44 +1,268 @@
+#pragma once
+
 
 #include <stdint.h>
 
 #include "fs_port.h"
+#include "stream_buffer.h"
 
 #define OPUS_FRAME_SIZE_MS OPUS_FRAMESIZE_60_MS
 #define OPUS_SAMPLING_RATE 48000
 #define OPUS_BIT_RATE 96000
 #define OPUS_FRAME_SIZE 2880 /* samples: 60ms at 48kHz */
 #define OPUS_CHANNELS 2
+/* pre-skip declared in the OpusHead of every TAF, what libopus needs at 48 kHz */
+#define OPUS_PRE_SKIP 312
 #define OPUS_PACKET_PAD 64
 #define OPUS_PACKET_MINSIZE 64
+/* a frame closing a segment may be squeezed this far */
+#define OPUS_PACKET_LAST_MINSIZE 16
 
 #define TONIEFILE_FRAME_SIZE 4096
 #define TONIEFILE_MAX_CHAPTERS 100
 #define TONIEFILE_PAD_END 64
+/* lacing values remuxed packets may use in a page, the rest is kept for the padding that fills the block */
+#define TONIEFILE_REMUX_LACING (255 - TONIEFILE_FRAME_SIZE / 255 - 2)
+/* frames with at most this much more space left than the last frame took may end up padded, they keep the encoder state to encode them again */
+#define TONIEFILE_FILL_RANGE 128
+/* smaller gaps left by those are padded, they are not worth a second encode */
+#define TONIEFILE_FILL_MIN 8
+/* bytes per frame the following frames give up for the ones that were filled */
+#define TONIEFILE_NUDGE_MAX 48
+/* copies of streams growing beyond this, about 12 hours of audio, are given up */
+#define TONIEFILE_COPY_MAX_SIZE (512 * 1024 * 1024)
+
+/* bounds of the audio buffered before a live stream is sent */
+#define STREAM_JITTER_MIN_MS 250
+#define STREAM_JITTER_MAX_MS 5000
+/* the input rate is judged after this time */
+#define STREAM_JITTER_RATE_MS 2000
+
+/* PCM from ffmpeg: about 1.4 seconds buffered between the decoder and the encoder task */
+#define FFMPEG_PCM_RING_SIZE (256 * 1024)
+#define FFMPEG_PCM_READ_SIZE (64 * 1024)
+#define FFMPEG_PCM_FRAME_BYTES (OPUS_FRAME_SIZE * OPUS_CHANNELS * sizeof(int16_t))
+/* whole opus frames handed to the encoder at once */
+#define FFMPEG_PCM_FRAMES 4
+#define FFMPEG_PCM_TIMEOUT_MS 1000
 
 typedef struct toniefile_s toniefile_t;
+typedef struct ffmpeg_decoder_s ffmpeg_decoder_t;
+
+/* the TAF header fields teddycloud needs, without any allocations */
+typedef struct
+{
+    uint32_t audio_id;
+    uint64_t num_bytes;
+    uint8_t sha1_hash[20];
+    size_t sha1_hash_len;
+    uint32_t track_page_nums[TONIEFILE_MAX_CHAPTERS];
+    size_t n_track_page_nums;
+} toniefile_header_t;
+
+/* where a serial encoder spends its time, see toniefile_profile() */
+typedef struct
+{
+    uint64_t opus_ns;
+    /* building the pages of the ogg stream */
+    uint64_t ogg_ns;
+    uint64_t sha1_ns;
+    /* filling the blocks and writing them out */
+    uint64_t io_ns;
+    uint64_t frames;
+    /* frames grown by opus_packet_pad() to end a page on the block boundary, and the bytes added */
+    uint64_t padded_frames;
+    uint64_t pad_bytes;
+    /* frames encoded in CBR to fill the rest of their block with audio instead of padding */
+    uint64_t filled_frames;
+} toniefile_profile_t;
+
+/* bitrate and complexity of the encoder, DEFAULT is the one selected by core.encode_quality */
+typedef enum
+{
+    TONIEFILE_QUALITY_DEFAULT = 0,
+    TONIEFILE_QUALITY_STANDARD,
+    TONIEFILE_QUALITY_FAST,
+    TONIEFILE_QUALITY_SMALL,
+    TONIEFILE_QUALITY_COUNT
+} toniefile_quality_t;
+
+/* how well the frames of a segment filled their blocks */
+typedef struct
+{
+    uint64_t pad_bytes;
+    uint64_t filled_frames;
+} toniefile_padding_t;
 
 typedef struct
 {
+    /* cleared to stop the encoder */
     bool_t active;
     char *source;
     size_t skip_seconds;
-    char *targetFile;
+    /* encoded TAF is published here */
+    stream_buffer_t *buffer;
+    /* keep the encode in the transcode cache once it completed */
+    bool_t cache;
     OsTaskId taskId;
     error_t error;
     bool_t quit;
+    /* set once the encoder task ended */
+    OsEvent stopped_event;
 
+    /* set once enough audio is buffered to start sending, or when the encoder stopped */
+    OsEvent ready_event;
+    bool_t ready;
+    uint32_t startup_ms;
+    /* buffer depth following the measured input jitter */
+    uint32_t jitter_target_ms;
+    /* encoded audio duration per wall clock time in percent */
+    uint32_t speed_pct;
 } ffmpeg_stream_ctx_t;
 
+/**
+ * @brief Decodes the TAF header protobuf (without the 4 byte length prefix)
+ *
+ * Only the fields listed in toniefile_header_t are extracted, _fill and unknown
+ * fields are skipped, nothing is allocated. Sha1 hash and chapter table are
+ * truncated to the size of the struct.
+ */
+error_t toniefile_header_decode(const uint8_t *data, size_t length, toniefile_header_t *header);
+/**
+ * @brief Builds the header block of a TAF, the protobuf with its length prefix padded to TONIEFILE_FRAME_SIZE
+ */
+error_t toniefile_header_encode(const toniefile_header_t *header, uint8_t *block);
+
 toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id);
+/**
+ * @brief Like toniefile_create(), but always encodes on the calling task
+ *
+ * For callers that already run several encoders side by side, like the conversion jobs.
+ */
+toniefile_t *toniefile_create_serial(const char *fullPath, uint32_t audio_id);
+/**
+ * @brief Creates a TAF that is published to a stream buffer instead of a file
+ *
+ * The header (with unknown length and hash) is written first, toniefile_close() ends the stream.
+ */
+toniefile_t *toniefile_create_stream(stream_buffer_t *stream, uint32_t audio_id);
+/**
+ * @brief Like toniefile_create_stream(), but also writes the TAF to a file
+ *
+ * The file gets the final header on toniefile_close(). It is deleted when writing fails or
+ * it grows beyond TONIEFILE_COPY_MAX_SIZE, the stream goes on without it.
+ */
+toniefile_t *toniefile_create_stream_copy(stream_buffer_t *stream, uint32_t audio_id, const char *copyPath);
+/**
+ * @brief Adds the time of the encoding stages and the padding to the counters of profile
+ *
+ * Only for serial encoders, like the ones of toniefile_create_serial(). The profile has to
+ * outlive the encoder, NULL stops measuring.
+ */
+error_t toniefile_profile(toniefile_t *ctx, toniefile_profile_t *profile);
+/**
+ * @brief Sets bitrate and complexity of the encoder, before any audio was encoded
+ *
+ * Encoders start with TONIEFILE_QUALITY_DEFAULT.
+ *
+ * @return NO_ERROR, ERROR_WRONG_STATE once audio was encoded
+ */
+error_t toniefile_set_quality(toniefile_t *ctx, toniefile_quality_t quality);
+/**
+ * @brief Looks up a quality by its name, an empty name or NULL is TONIEFILE_QUALITY_DEFAULT
+ *
+ * @return NO_ERROR, ERROR_INVALID_PARAMETER for unknown names
+ */
+error_t toniefile_quality_parse(const char *name, toniefile_quality_t *quality);
+/**
+ * @brief Name of a quality, TONIEFILE_QUALITY_DEFAULT gives the name of the configured one
+ */
+const char *toniefile_quality_name(toniefile_quality_t quality);
 error_t toniefile_close(toniefile_t *ctx);
 error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available);
 error_t toniefile_write_header(toniefile_t *ctx);
 error_t toniefile_new_chapter(toniefile_t *ctx);
+/**
+ * @brief Adds an Opus packet of a 48 kHz source as it is, without decoding and encoding it again
+ *
+ * The frames are merged into packets of up to OPUS_FRAME_SIZE samples. A packet that does
+ * not fit into the current block is split between its frames, the last packets of the block
+ * are padded to fill it. Not for TAFs encoded in parallel, encoded audio may follow, it starts
+ * with the next block.
+ */
+error_t toniefile_remux_packet(toniefile_t *ctx, const uint8_t *packet, size_t length);
+
+/**
+ * @brief Creates an encoder for a part of a TAF, used by the parallel encoder
+ *
+ * The pages are collected in memory, start_pos is the position of the segment within
+ * its first block. No headers are written. A resolved quality is used as it is,
+ * without looking up core.encode_quality.
+ */
+toniefile_t *toniefile_create_segment(uint32_t audio_id, size_t start_pos, toniefile_quality_t quality);
+/**
+ * @brief Feeds the audio preceding a segment to the encoder without writing it
+ */
+error_t toniefile_warmup(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available);
+/**
+ * @brief Encodes the samples and fills up the last block, then frees the segment encoder
+ *
+ * @param[out] data Pages of the segment, to be freed by the caller
+ * @param[out] granules Number of samples encoded, including the silence the last frame was padded with
+ * @param[out] padding Padding of the segment, may be NULL
+ */
+error_t toniefile_finish_segment(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available, uint8_t **data, size_t *length, uint64_t *granules, toniefile_padding_t *padding);
+/**
+ * @brief Adds the padding of an appended segment to the statistics of the TAF
+ */
+void toniefile_add_padding(toniefile_t *ctx, const toniefile_padding_t *padding);
+/**
+ * @brief Appends the pages of a segment, their sequence numbers, granule positions and checksums are updated in place
+ */
+error_t toniefile_append_segment(toniefile_t *ctx, uint8_t *data, size_t length, uint64_t granules, bool_t chapter);
+/**
+ * @brief Appends the audio pages of a block of another TAF, without decoding them
+ *
+ * If the pages line up with the end of the file they are copied, with new sequence numbers,
+ * serial, granule positions and checksums. Otherwise their packets are laid out again like
+ * remuxed ones, which costs one padded block at most.
+ *
+ * @param[in] start Offset of the first audio page, behind the OpusHead and OpusTags pages in the first block
+ * @param[in] granule_start,granule_end Granule positions of the source at the start and end of the block
+ * @param[in] chapter Start a chapter with this block
+ */
+error_t toniefile_append_block(toniefile_t *ctx, const uint8_t *block, size_t length, size_t start, uint64_t granule_start, uint64_t granule_end, bool_t chapter);
+/**
+ * @brief Lays out the audio pages of a block again, so they fill whole blocks of their own
+ *
+ * Used for the first block of a TAF, whose audio has to move in front of the OpusHead and
+ * OpusTags pages. The pages are numbered from 0 and their granule positions start at 0.
+ *
+ * @param[out] data Pages, a multiple of TONIEFILE_FRAME_SIZE, to be freed by the caller
+ * @param[out] granules Samples in the pages
+ */
+error_t toniefile_repack_block(const uint8_t *block, size_t length, size_t start, uint32_t serial, uint8_t **data, size_t *data_length, uint64_t *granules);
 
-FILE *ffmpeg_decode_audio_start(const char *input_source);
-FILE *ffmpeg_decode_audio_start_skip(const char *input_source, size_t skip_seconds);
-error_t ffmpeg_decode_audio_end(FILE *ffmpeg_pipe, error_t error);
-error_t ffmpeg_decode_audio(FILE *ffmpeg_pipe, int16_t *buffer, size_t size, size_t *bytes_read);
+/**
+ * @brief Starts ffmpeg decoding the source to 48 kHz stereo PCM
+ *
+ * ffmpeg is spawned without a shell, a decoder task reads its output in large
+ * blocks into a ring, so decoding overlaps with the opus encoding of the caller.
+ */
+ffmpeg_decoder_t *ffmpeg_decode_audio_start(const char *input_source);
+ffmpeg_decoder_t *ffmpeg_decode_audio_start_skip(const char *input_source, size_t skip_seconds);
+/**
+ * @brief Like ffmpeg_decode_audio_start_skip, but always spawns ffmpeg, even for sources audio_decoder can read
+ */
+ffmpeg_decoder_t *ffmpeg_decode_audio_start_process(const char *input_source, size_t skip_seconds);
+error_t ffmpeg_decode_audio_end(ffmpeg_decoder_t *decoder, error_t error);
+/**
+ * @brief Reads whole opus frames of interleaved samples, only the last read may be shorter
+ *
+ * @return NO_ERROR, ERROR_TIMEOUT if ffmpeg delivered nothing for FFMPEG_PCM_TIMEOUT_MS, ERROR_END_OF_STREAM
+ */
+error_t ffmpeg_decode_audio(ffmpeg_decoder_t *decoder, int16_t *buffer, size_t size, size_t *samples_read);
 error_t ffmpeg_stream(char *source, char *target_taf, size_t skip_seconds, bool_t *active);
+error_t ffmpeg_stream_buffer(ffmpeg_stream_ctx_t *ctx);
 error_t ffmpeg_convert(char *source, char *target_taf, size_t skip_seconds);
 void ffmpeg_stream_task(void *param);
\ No newline at end of file
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "error.h"
+#include "toniefile.h"
+
+/* audio encoded as one piece by a worker, chapters start a new segment as well */
+#define TONIEFILE_SEGMENT_SAMPLES (30 * OPUS_SAMPLING_RATE)
+/* frames encoded and dropped in front of a segment, so the encoder state follows the preceding audio */
+#define TONIEFILE_SEGMENT_WARMUP_FRAMES 2
+
+typedef struct toniefile_parallel_s toniefile_parallel_t;
+
+/**
+ * @brief Starts a worker pool encoding the audio of a TAF file in segments
+ *
+ * Each worker has an opus encoder of its own. The finished segments are appended in
+ * order by the task feeding the samples, every segment ends block aligned.
+ *
+ * @param[in] start_pos Position of the first audio page, behind the ogg headers
+ * @param[in] quality Resolved quality of the segments, never TONIEFILE_QUALITY_DEFAULT
+ * @return Pool, or NULL if the file is encoded serially (core.encode_threads, single core)
+ */
+toniefile_parallel_t *toniefile_parallel_create(toniefile_t *taf, uint32_t audio_id, size_t start_pos, toniefile_quality_t quality);
+error_t toniefile_parallel_encode(toniefile_parallel_t *ctx, int16_t *sample_buffer, size_t samples_available);
+error_t toniefile_parallel_new_chapter(toniefile_parallel_t *ctx);
+/**
+ * @brief Sets the resolved quality the segments are encoded with, before any samples were passed
+ */
+error_t toniefile_parallel_set_quality(toniefile_parallel_t *ctx, toniefile_quality_t quality);
+
+/**
+ * @brief Encodes the remaining samples, appends all segments and stops the workers
+ */
+error_t toniefile_parallel_close(toniefile_parallel_t *ctx);
@@ -21,5 +21,6 @@ typedef struct
 
 void tonies_init();
 void tonies_readJson();
+char *tonies_jsonPath();
 toniesJson_item_t *tonies_byAudioId(uint32_t audio_id);
 void tonies_deinit();
\ No newline at end of file
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "error.h"
+#include "fs_port.h"
+
+/* below the data directory, so cached TAFs are served like regular content */
+#define TRANSCODE_CACHE_DIR "cache/transcode"
+/* part of the key, raised when the encoder output changes */
+#define TRANSCODE_CACHE_VERSION 1
+
+/*
+ * Finished encodes of streamed sources whose content.json sets "cache". Every entry is a
+ * <key>.taf with a <key>.json next to it, the key is a hash of the source, skip_seconds
+ * and the encoder settings. Entries of files are dropped once the size or modification
+ * time of the source changes, the ones of URLs after core.transcode_cache_max_age.
+ */
+typedef struct transcode_cache_entry_s transcode_cache_entry_t;
+
+/**
+ * @brief Returns the cached TAF of a source, stale entries are deleted
+ *
+ * @return Absolute path to be freed with osFreeMem() or NULL if there is no valid entry
+ */
+char *transcode_cache_lookup(const char *source, size_t skip_seconds);
+
+/**
+ * @brief Starts caching an encode of a source
+ *
+ * @return Entry to be passed to transcode_cache_commit() or NULL if the source can't be cached
+ */
+transcode_cache_entry_t *transcode_cache_begin(const char *source, size_t skip_seconds);
+
+/**
+ * @brief Path the TAF of the entry is written to until it is committed
+ */
+const char *transcode_cache_path(const transcode_cache_entry_t *entry);
+
+/**
+ * @brief Publishes the written TAF if the encode is complete and the source did not change meanwhile, frees the entry
+ */
+void transcode_cache_commit(transcode_cache_entry_t *entry, bool_t complete);
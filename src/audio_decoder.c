@@ -0,0 +1,985 @@
+#include <math.h>
+#include <string.h>
+
+#include "audio_decoder.h"
+#include "resampler.h"
+#include "toniefile.h"
+#include "fs_port.h"
+#include "debug.h"
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+/* channels of the WAVE_FORMAT_EXTENSIBLE default order that can be mixed down */
+#define AUDIO_DECODER_MAX_CHANNELS 8
+/* chunks searched for fmt and data before giving up */
+#define AUDIO_DECODER_MAX_CHUNKS 32
+/* wider FLAC samples, 32 bit, overflow the 32 bit prediction with the side channel */
+#define AUDIO_DECODER_FLAC_MAX_BITS 24
+
+typedef enum
+{
+    AUDIO_DECODER_WAV,
+    AUDIO_DECODER_FLAC
+} audio_decoder_type_t;
+
+typedef struct
+{
+    uint32_t blockSize;
+    uint8_t assignment;
+    uint8_t bits;
+} audio_decoder_flac_frame_t;
+
+struct audio_decoder_s
+{
+    audio_decoder_type_t type;
+    FsFile *file;
+    uint16_t format;
+    uint16_t channels;
+    uint16_t bits;
+    uint16_t blockAlign;
+    uint32_t rate;
+    /* bytes of the data chunk not read yet */
+    uint64_t remaining;
+    bool_t eof;
+    bool_t readFailed;
+
+    uint8_t raw[AUDIO_DECODER_READ_SIZE];
+    size_t rawLength;
+    size_t rawPos;
+
+    /* FLAC bits read from raw but not used yet, zeros are returned behind the end of the file */
+    uint64_t bitCache;
+    uint32_t bitCount;
+    bool_t bitEof;
+    uint32_t flacMaxBlock;
+    /* decoded block, one buffer of flacMaxBlock samples per channel */
+    int32_t *flacSamples[AUDIO_DECODER_MAX_CHANNELS];
+    size_t flacLength;
+    size_t flacPos;
+    float flacScale;
+
+    /* contribution of each source channel to the left and right output */
+    float weightLeft[AUDIO_DECODER_MAX_CHANNELS];
+    float weightRight[AUDIO_DECODER_MAX_CHANNELS];
+    float left[AUDIO_DECODER_MIX_FRAMES];
+    float right[AUDIO_DECODER_MIX_FRAMES];
+    size_t mixLength;
+    size_t mixPos;
+
+    /* NULL if the source already has 48 kHz */
+    resampler_t *resampler;
+};
+
+static uint16_t audio_decoder_le16(const uint8_t *data)
+{
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+static uint32_t audio_decoder_le32(const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static bool_t audio_decoder_read_exact(FsFile *file, void *data, size_t size)
+{
+    size_t read = 0;
+    return fsReadFile(file, data, size, &read) == NO_ERROR && read == size;
+}
+
+/* mono is played on both sides, more channels follow the FL FR FC LFE BL BR SL SR order */
+static void audio_decoder_init_weights(audio_decoder_t *decoder)
+{
+    static const float left[AUDIO_DECODER_MAX_CHANNELS] = {1.0f, 0.0f, 0.7071f, 0.0f, 0.7071f, 0.0f, 0.7071f, 0.0f};
+    static const float right[AUDIO_DECODER_MAX_CHANNELS] = {0.0f, 1.0f, 0.7071f, 0.0f, 0.0f, 0.7071f, 0.0f, 0.7071f};
+    /* FLAC orders 4, 5 and 7 channels differently, its back center is mixed like the center */
+    static const uint8_t flacSpeakers[AUDIO_DECODER_MAX_CHANNELS][AUDIO_DECODER_MAX_CHANNELS] = {
+        {0}, {0, 1}, {0, 1, 2}, {0, 1, 4, 5}, {0, 1, 2, 4, 5}, {0, 1, 2, 3, 4, 5}, {0, 1, 2, 3, 2, 6, 7}, {0, 1, 2, 3, 4, 5, 6, 7}};
+
+    if (decoder->channels == 1)
+    {
+        decoder->weightLeft[0] = 1.0f;
+        decoder->weightRight[0] = 1.0f;
+        return;
+    }
+
+    float sumLeft = 0.0f;
+    float sumRight = 0.0f;
+    for (uint16_t channel = 0; channel < decoder->channels; channel++)
+    {
+        uint8_t speaker = (decoder->type == AUDIO_DECODER_FLAC) ? flacSpeakers[decoder->channels - 1][channel] : channel;
+        decoder->weightLeft[channel] = left[speaker];
+        decoder->weightRight[channel] = right[speaker];
+        sumLeft += left[speaker];
+        sumRight += right[speaker];
+    }
+    /* keeps the mix from clipping */
+    for (uint16_t channel = 0; channel < decoder->channels; channel++)
+    {
+        decoder->weightLeft[channel] /= sumLeft;
+        decoder->weightRight[channel] /= sumRight;
+    }
+}
+
+static float audio_decoder_sample(const audio_decoder_t *decoder, const uint8_t *data)
+{
+    switch (decoder->bits)
+    {
+    case 8:
+        return ((int)data[0] - 128) / 128.0f;
+    case 16:
+        return (int16_t)audio_decoder_le16(data) / 32768.0f;
+    case 24:
+        return (int32_t)(((uint32_t)data[0] << 8) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 24)) / 2147483648.0f;
+    default:
+        if (decoder->format == WAVE_FORMAT_IEEE_FLOAT)
+        {
+            uint32_t bits = audio_decoder_le32(data);
+            float sample;
+            osMemcpy(&sample, &bits, sizeof(sample));
+            return isfinite(sample) ? sample : 0.0f;
+        }
+        return (int32_t)audio_decoder_le32(data) / 2147483648.0f;
+    }
+}
+
+/* parses the RIFF chunks up to the start of the audio data */
+static bool_t audio_decoder_parse_wav(audio_decoder_t *decoder, size_t skip_seconds)
+{
+    uint8_t header[40];
+    uint32_t pos = 12;
+    bool_t hasFormat = FALSE;
+
+    if (!audio_decoder_read_exact(decoder->file, header, 12) || osMemcmp(header, "RIFF", 4) || osMemcmp(&header[8], "WAVE", 4))
+    {
+        return FALSE;
+    }
+
+    for (size_t chunk = 0; chunk < AUDIO_DECODER_MAX_CHUNKS; chunk++)
+    {
+        if (!audio_decoder_read_exact(decoder->file, header, 8))
+        {
+            return FALSE;
+        }
+        uint32_t size = audio_decoder_le32(&header[4]);
+        pos += 8;
+
+        if (!osMemcmp(header, "fmt ", 4))
+        {
+            if (size < 16 || !audio_decoder_read_exact(decoder->file, header, MIN(size, sizeof(header))))
+            {
+                return FALSE;
+            }
+            decoder->format = audio_decoder_le16(&header[0]);
+            decoder->channels = audio_decoder_le16(&header[2]);
+            decoder->rate = audio_decoder_le32(&header[4]);
+            decoder->blockAlign = audio_decoder_le16(&header[12]);
+            decoder->bits = audio_decoder_le16(&header[14]);
+            if (decoder->format == WAVE_FORMAT_EXTENSIBLE && size >= 26)
+            {
+                /* the format code is in front of the sub format GUID */
+                decoder->format = audio_decoder_le16(&header[24]);
+            }
+            hasFormat = TRUE;
+        }
+        else if (!osMemcmp(header, "data", 4))
+        {
+            if (!hasFormat || decoder->blockAlign == 0)
+            {
+                return FALSE;
+            }
+            /* streamed files have no length yet */
+            decoder->remaining = (size == 0 || size == UINT32_MAX) ? UINT64_MAX : size;
+
+            uint64_t skip = (uint64_t)skip_seconds * decoder->rate * decoder->blockAlign;
+            if (skip > 0)
+            {
+                skip = MIN(skip, decoder->remaining == UINT64_MAX ? skip : decoder->remaining / decoder->blockAlign * decoder->blockAlign);
+                fsSeekFile(decoder->file, (int_t)(pos + skip), FS_SEEK_SET);
+                if (decoder->remaining != UINT64_MAX)
+                {
+                    decoder->remaining -= skip;
+                }
+            }
+            return TRUE;
+        }
+        /* chunks are padded to an even size */
+        pos += size + (size & 1);
+        if (fsSeekFile(decoder->file, (int_t)pos, FS_SEEK_SET) != NO_ERROR)
+        {
+            return FALSE;
+        }
+    }
+    return FALSE;
+}
+
+static uint32_t audio_decoder_be24(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | (uint32_t)data[2];
+}
+
+/* skips an ID3v2 tag in front of the stream marker, some taggers put one there */
+static bool_t audio_decoder_skip_id3(audio_decoder_t *decoder, uint8_t *marker)
+{
+    uint8_t header[10];
+
+    if (osMemcmp(marker, "ID3", 3))
+    {
+        return TRUE;
+    }
+    osMemcpy(header, marker, 4);
+    if (!audio_decoder_read_exact(decoder->file, &header[4], 6))
+    {
+        return FALSE;
+    }
+    uint32_t size = ((uint32_t)(header[6] & 0x7F) << 21) | ((uint32_t)(header[7] & 0x7F) << 14) | ((uint32_t)(header[8] & 0x7F) << 7) | (header[9] & 0x7F);
+    /* with a footer the tag is 10 bytes longer */
+    size += (header[5] & 0x10) ? 20 : 10;
+
+    return fsSeekFile(decoder->file, (int_t)size, FS_SEEK_SET) == NO_ERROR && audio_decoder_read_exact(decoder->file, marker, 4);
+}
+
+/* reads the STREAMINFO block and skips the other metadata up to the first frame */
+static bool_t audio_decoder_parse_flac(audio_decoder_t *decoder)
+{
+    uint8_t header[34];
+    bool_t hasInfo = FALSE;
+    bool_t last = FALSE;
+
+    if (!audio_decoder_read_exact(decoder->file, header, 4) || !audio_decoder_skip_id3(decoder, header) || osMemcmp(header, "fLaC", 4))
+    {
+        return FALSE;
+    }
+
+    while (!last)
+    {
+        if (!audio_decoder_read_exact(decoder->file, header, 4))
+        {
+            return FALSE;
+        }
+        last = (header[0] & 0x80) != 0;
+        uint8_t type = header[0] & 0x7F;
+        uint32_t length = audio_decoder_be24(&header[1]);
+
+        if (type == 0 && length == 34)
+        {
+            if (!audio_decoder_read_exact(decoder->file, header, 34))
+            {
+                return FALSE;
+            }
+            decoder->flacMaxBlock = ((uint32_t)header[2] << 8) | header[3];
+            decoder->rate = ((uint32_t)header[10] << 12) | ((uint32_t)header[11] << 4) | (header[12] >> 4);
+            decoder->channels = ((header[12] >> 1) & 0x07) + 1;
+            decoder->bits = (((header[12] & 0x01) << 4) | (header[13] >> 4)) + 1;
+            hasInfo = TRUE;
+        }
+        else if (type == 127)
+        {
+            return FALSE;
+        }
+        else
+        {
+            /* the file position is not tracked, the blocks are read past */
+            while (length > 0)
+            {
+                uint32_t size = MIN(length, (uint32_t)sizeof(header));
+                if (!audio_decoder_read_exact(decoder->file, header, size))
+                {
+                    return FALSE;
+                }
+                length -= size;
+            }
+        }
+    }
+    return hasInfo;
+}
+
+static bool_t audio_decoder_flac_byte(audio_decoder_t *decoder, uint8_t *byte)
+{
+    if (decoder->rawPos == decoder->rawLength)
+    {
+        size_t read = 0;
+        error_t error = fsReadFile(decoder->file, decoder->raw, sizeof(decoder->raw), &read);
+        decoder->rawPos = 0;
+        decoder->rawLength = read;
+        if (read == 0)
+        {
+            decoder->readFailed = (error != NO_ERROR && error != ERROR_END_OF_STREAM && error != ERROR_END_OF_FILE);
+            decoder->bitEof = TRUE;
+            return FALSE;
+        }
+    }
+    *byte = decoder->raw[decoder->rawPos++];
+    return TRUE;
+}
+
+/* reads up to 32 bits, MSB first */
+static uint32_t audio_decoder_bits(audio_decoder_t *decoder, uint32_t count)
+{
+    while (decoder->bitCount < count)
+    {
+        uint8_t byte = 0;
+        audio_decoder_flac_byte(decoder, &byte);
+        decoder->bitCache = (decoder->bitCache << 8) | byte;
+        decoder->bitCount += 8;
+    }
+    decoder->bitCount -= count;
+    return (uint32_t)((decoder->bitCache >> decoder->bitCount) & ((1ULL << count) - 1));
+}
+
+static int32_t audio_decoder_signed_bits(audio_decoder_t *decoder, uint32_t count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    uint32_t value = audio_decoder_bits(decoder, count);
+    return (int32_t)(value << (32 - count)) >> (32 - count);
+}
+
+/* counts the zeros in front of the next one bit */
+static uint32_t audio_decoder_unary(audio_decoder_t *decoder)
+{
+    uint32_t zeros = 0;
+
+    while (TRUE)
+    {
+        uint64_t bits = decoder->bitCache & ((1ULL << decoder->bitCount) - 1);
+        if (bits == 0)
+        {
+            zeros += decoder->bitCount;
+            decoder->bitCount = 0;
+            uint8_t byte = 0;
+            if (!audio_decoder_flac_byte(decoder, &byte))
+            {
+                return zeros;
+            }
+            decoder->bitCache = (decoder->bitCache << 8) | byte;
+            decoder->bitCount = 8;
+            continue;
+        }
+        uint32_t position = decoder->bitCount;
+        while (!((bits >> (position - 1)) & 1))
+        {
+            position--;
+        }
+        zeros += decoder->bitCount - position;
+        decoder->bitCount = position - 1;
+        return zeros;
+    }
+}
+
+static uint8_t audio_decoder_crc8(const uint8_t *data, size_t length)
+{
+    uint8_t crc = 0;
+    for (size_t pos = 0; pos < length; pos++)
+    {
+        crc ^= data[pos];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/* searches the next frame sync code and parses the header behind it, FALSE if it is no valid header */
+static bool_t audio_decoder_flac_header(audio_decoder_t *decoder, audio_decoder_flac_frame_t *frame)
+{
+    static const uint32_t rates[12] = {0, 88200, 176400, 192000, 8000, 16000, 22050, 24000, 32000, 44100, 48000, 96000};
+    static const uint8_t sizes[8] = {0, 8, 12, 0, 16, 20, 24, 32};
+    uint8_t header[16];
+    size_t length = 0;
+    uint8_t previous = 0;
+
+    /* frames start byte aligned */
+    decoder->bitCount -= decoder->bitCount % 8;
+    while (TRUE)
+    {
+        uint8_t byte = (uint8_t)audio_decoder_bits(decoder, 8);
+        if (decoder->bitEof)
+        {
+            return FALSE;
+        }
+        if (previous == 0xFF && (byte & 0xFE) == 0xF8)
+        {
+            header[length++] = previous;
+            header[length++] = byte;
+            break;
+        }
+        previous = byte;
+    }
+
+    header[length++] = (uint8_t)audio_decoder_bits(decoder, 8);
+    header[length++] = (uint8_t)audio_decoder_bits(decoder, 8);
+    uint8_t blockCode = header[2] >> 4;
+    uint8_t rateCode = header[2] & 0x0F;
+    frame->assignment = header[3] >> 4;
+    uint8_t sizeCode = (header[3] >> 1) & 0x07;
+    if (blockCode == 0 || rateCode == 15 || frame->assignment > 10 || sizeCode == 3 || (header[3] & 0x01))
+    {
+        return FALSE;
+    }
+
+    /* the frame or sample number, coded like UTF-8 */
+    uint8_t first = (uint8_t)audio_decoder_bits(decoder, 8);
+    size_t extra = 0;
+    header[length++] = first;
+    while (extra < 8 && (first & (0x80 >> extra)))
+    {
+        extra++;
+    }
+    if (extra == 1 || extra == 8)
+    {
+        return FALSE;
+    }
+    for (size_t pos = 1; pos < extra; pos++)
+    {
+        header[length] = (uint8_t)audio_decoder_bits(decoder, 8);
+        if ((header[length++] & 0xC0) != 0x80)
+        {
+            return FALSE;
+        }
+    }
+
+    if (blockCode == 1)
+    {
+        frame->blockSize = 192;
+    }
+    else if (blockCode <= 5)
+    {
+        frame->blockSize = 576 << (blockCode - 2);
+    }
+    else if (blockCode == 6)
+    {
+        header[length] = (uint8_t)audio_decoder_bits(decoder, 8);
+        frame->blockSize = header[length++] + 1;
+    }
+    else if (blockCode == 7)
+    {
+        header[length] = (uint8_t)audio_decoder_bits(decoder, 8);
+        header[length + 1] = (uint8_t)audio_decoder_bits(decoder, 8);
+        frame->blockSize = (((uint32_t)header[length] << 8) | header[length + 1]) + 1;
+        length += 2;
+    }
+    else
+    {
+        frame->blockSize = 256 << (blockCode - 8);
+    }
+
+    uint32_t rate = (rateCode == 0) ? decoder->rate : 0;
+    if (rateCode >= 1 && rateCode <= 11)
+    {
+        rate = rates[rateCode];
+    }
+    else if (rateCode >= 12)
+    {
+        header[length] = (uint8_t)audio_decoder_bits(decoder, 8);
+        rate = header[length++];
+        if (rateCode != 12)
+        {
+            header[length] = (uint8_t)audio_decoder_bits(decoder, 8);
+            rate = (rate << 8) | header[length++];
+        }
+        rate *= (rateCode == 12) ? 1000 : (rateCode == 14) ? 10 : 1;
+    }
+    frame->bits = (sizeCode == 0) ? (uint8_t)decoder->bits : sizes[sizeCode];
+
+    uint8_t crc = (uint8_t)audio_decoder_bits(decoder, 8);
+    uint16_t channels = (frame->assignment < 8) ? frame->assignment + 1 : 2;
+
+    /* a change of the format within the stream is not supported, neither by ffmpeg */
+    return !decoder->bitEof && crc == audio_decoder_crc8(header, length) && frame->blockSize <= decoder->flacMaxBlock &&
+           rate == decoder->rate && channels == decoder->channels && frame->bits > 0 && frame->bits <= AUDIO_DECODER_FLAC_MAX_BITS;
+}
+
+/* Rice coded residual behind the warm-up samples of a predictor */
+static bool_t audio_decoder_flac_residual(audio_decoder_t *decoder, int32_t *samples, uint32_t blockSize, uint32_t order)
+{
+    uint32_t method = audio_decoder_bits(decoder, 2);
+    if (method > 1)
+    {
+        return FALSE;
+    }
+    uint32_t paramBits = method ? 5 : 4;
+    uint32_t escape = method ? 31 : 15;
+    uint32_t partitionOrder = audio_decoder_bits(decoder, 4);
+    uint32_t partitionSize = blockSize >> partitionOrder;
+    if ((partitionSize << partitionOrder) != blockSize || partitionSize < order)
+    {
+        return FALSE;
+    }
+
+    uint32_t pos = order;
+    for (uint32_t partition = 0; partition < (1U << partitionOrder); partition++)
+    {
+        uint32_t end = (partition + 1) * partitionSize;
+        uint32_t param = audio_decoder_bits(decoder, paramBits);
+        if (param == escape)
+        {
+            uint32_t bits = audio_decoder_bits(decoder, 5);
+            for (; pos < end; pos++)
+            {
+                samples[pos] = audio_decoder_signed_bits(decoder, bits);
+            }
+        }
+        else
+        {
+            for (; pos < end; pos++)
+            {
+                uint32_t value = (audio_decoder_unary(decoder) << param) | audio_decoder_bits(decoder, param);
+                samples[pos] = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+            }
+        }
+        if (decoder->bitEof)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static bool_t audio_decoder_flac_subframe(audio_decoder_t *decoder, int32_t *samples, uint32_t blockSize, uint32_t bits)
+{
+    if (audio_decoder_bits(decoder, 1) != 0)
+    {
+        return FALSE;
+    }
+    uint32_t type = audio_decoder_bits(decoder, 6);
+    uint32_t wasted = 0;
+    if (audio_decoder_bits(decoder, 1))
+    {
+        wasted = audio_decoder_unary(decoder) + 1;
+        if (wasted >= bits)
+        {
+            return FALSE;
+        }
+        bits -= wasted;
+    }
+
+    if (type == 0)
+    {
+        int32_t value = audio_decoder_signed_bits(decoder, bits);
+        for (uint32_t pos = 0; pos < blockSize; pos++)
+        {
+            samples[pos] = value;
+        }
+    }
+    else if (type == 1)
+    {
+        for (uint32_t pos = 0; pos < blockSize; pos++)
+        {
+            samples[pos] = audio_decoder_signed_bits(decoder, bits);
+        }
+    }
+    else if (type >= 8 && type <= 12)
+    {
+        /* fixed polynomial predictors */
+        uint32_t order = type - 8;
+        if (order > blockSize)
+        {
+            return FALSE;
+        }
+        for (uint32_t pos = 0; pos < order; pos++)
+        {
+            samples[pos] = audio_decoder_signed_bits(decoder, bits);
+        }
+        if (!audio_decoder_flac_residual(decoder, samples, blockSize, order))
+        {
+            return FALSE;
+        }
+        for (uint32_t pos = order; pos < blockSize; pos++)
+        {
+            const int32_t *prev = &samples[pos];
+            int64_t prediction = 0;
+            switch (order)
+            {
+            case 1:
+                prediction = prev[-1];
+                break;
+            case 2:
+                prediction = 2 * (int64_t)prev[-1] - prev[-2];
+                break;
+            case 3:
+                prediction = 3 * ((int64_t)prev[-1] - prev[-2]) + prev[-3];
+                break;
+            case 4:
+                prediction = 4 * ((int64_t)prev[-1] + prev[-3]) - 6 * (int64_t)prev[-2] - prev[-4];
+                break;
+            }
+            samples[pos] = (int32_t)(samples[pos] + prediction);
+        }
+    }
+    else if (type >= 32)
+    {
+        /* linear prediction with quantized coefficients */
+        uint32_t order = type - 31;
+        int32_t coefficients[32];
+        if (order > blockSize)
+        {
+            return FALSE;
+        }
+        for (uint32_t pos = 0; pos < order; pos++)
+        {
+            samples[pos] = audio_decoder_signed_bits(decoder, bits);
+        }
+        uint32_t precision = audio_decoder_bits(decoder, 4) + 1;
+        int32_t shift = audio_decoder_signed_bits(decoder, 5);
+        if (precision == 16 || shift < 0)
+        {
+            return FALSE;
+        }
+        for (uint32_t pos = 0; pos < order; pos++)
+        {
+            coefficients[pos] = audio_decoder_signed_bits(decoder, precision);
+        }
+        if (!audio_decoder_flac_residual(decoder, samples, blockSize, order))
+        {
+            return FALSE;
+        }
+        for (uint32_t pos = order; pos < blockSize; pos++)
+        {
+            int64_t sum = 0;
+            for (uint32_t coefficient = 0; coefficient < order; coefficient++)
+            {
+                sum += (int64_t)coefficients[coefficient] * samples[pos - 1 - coefficient];
+            }
+            samples[pos] = (int32_t)(samples[pos] + (sum >> shift));
+        }
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    if (wasted > 0)
+    {
+        for (uint32_t pos = 0; pos < blockSize; pos++)
+        {
+            samples[pos] = (int32_t)((uint32_t)samples[pos] << wasted);
+        }
+    }
+    return !decoder->bitEof;
+}
+
+/* decodes the next frame into flacSamples, FALSE at the end of the file */
+static bool_t audio_decoder_flac_frame(audio_decoder_t *decoder)
+{
+    while (!decoder->bitEof)
+    {
+        audio_decoder_flac_frame_t frame;
+        if (!audio_decoder_flac_header(decoder, &frame))
+        {
+            continue;
+        }
+
+        bool_t valid = TRUE;
+        for (uint16_t channel = 0; channel < decoder->channels && valid; channel++)
+        {
+            /* the side channel needs one bit more */
+            bool_t side = (frame.assignment == 8 && channel == 1) || (frame.assignment == 9 && channel == 0) || (frame.assignment == 10 && channel == 1);
+            valid = audio_decoder_flac_subframe(decoder, decoder->flacSamples[channel], frame.blockSize, frame.bits + (side ? 1 : 0));
+        }
+        if (!valid)
+        {
+            /* broken frames are skipped, the next sync code is searched from here */
+            continue;
+        }
+        /* the CRC-16 of the frame behind the padding to a full byte */
+        decoder->bitCount -= decoder->bitCount % 8;
+        audio_decoder_bits(decoder, 16);
+
+        int32_t *first = decoder->flacSamples[0];
+        int32_t *second = decoder->flacSamples[1];
+        for (uint32_t pos = 0; pos < frame.blockSize && frame.assignment >= 8; pos++)
+        {
+            switch (frame.assignment)
+            {
+            case 8:
+                /* left, side */
+                second[pos] = first[pos] - second[pos];
+                break;
+            case 9:
+                /* side, right */
+                first[pos] += second[pos];
+                break;
+            default:
+            {
+                /* mid, side */
+                int32_t side = second[pos];
+                int32_t mid = (int32_t)(((uint32_t)first[pos] << 1) | (side & 1));
+                first[pos] = (mid + side) >> 1;
+                second[pos] = (mid - side) >> 1;
+                break;
+            }
+            }
+        }
+
+        decoder->flacLength = frame.blockSize;
+        decoder->flacPos = 0;
+        decoder->flacScale = 1.0f / (float)(1U << (frame.bits - 1));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static bool_t audio_decoder_has_extension(const char *source, const char *extension)
+{
+    size_t length = osStrlen(source);
+    size_t extensionLength = osStrlen(extension);
+    return length > extensionLength && !osStrcasecmp(&source[length - extensionLength], extension);
+}
+
+static bool_t audio_decoder_open_flac(audio_decoder_t *decoder, size_t skip_seconds)
+{
+    if (!audio_decoder_parse_flac(decoder) || decoder->channels > AUDIO_DECODER_MAX_CHANNELS || decoder->bits < 4 ||
+        decoder->bits > AUDIO_DECODER_FLAC_MAX_BITS || decoder->rate == 0 || decoder->flacMaxBlock < 16)
+    {
+        return FALSE;
+    }
+    for (uint16_t channel = 0; channel < decoder->channels; channel++)
+    {
+        decoder->flacSamples[channel] = osAllocMem(decoder->flacMaxBlock * sizeof(int32_t));
+        if (!decoder->flacSamples[channel])
+        {
+            return FALSE;
+        }
+    }
+
+    /* FLAC has no fixed frame size to seek to, the frames in front are decoded and dropped */
+    uint64_t skip = (uint64_t)skip_seconds * decoder->rate;
+    while (skip > 0 && audio_decoder_flac_frame(decoder))
+    {
+        size_t count = (size_t)MIN(skip, (uint64_t)decoder->flacLength);
+        decoder->flacPos = count;
+        skip -= count;
+    }
+    return TRUE;
+}
+
+static bool_t audio_decoder_open_wav(audio_decoder_t *decoder, size_t skip_seconds)
+{
+    if (!audio_decoder_parse_wav(decoder, skip_seconds))
+    {
+        return FALSE;
+    }
+    bool_t pcm = decoder->format == WAVE_FORMAT_PCM && (decoder->bits == 8 || decoder->bits == 16 || decoder->bits == 24 || decoder->bits == 32);
+    bool_t ieee = decoder->format == WAVE_FORMAT_IEEE_FLOAT && decoder->bits == 32;
+
+    return (pcm || ieee) && decoder->channels > 0 && decoder->channels <= AUDIO_DECODER_MAX_CHANNELS &&
+           decoder->blockAlign == decoder->channels * decoder->bits / 8 && decoder->rate > 0;
+}
+
+audio_decoder_t *audio_decoder_open(const char *source, size_t skip_seconds)
+{
+    audio_decoder_type_t type;
+    if (audio_decoder_has_extension(source, ".wav"))
+    {
+        type = AUDIO_DECODER_WAV;
+    }
+    else if (audio_decoder_has_extension(source, ".flac"))
+    {
+        type = AUDIO_DECODER_FLAC;
+    }
+    else
+    {
+        return NULL;
+    }
+    if (!fsFileExists(source))
+    {
+        return NULL;
+    }
+
+    audio_decoder_t *decoder = osAllocMem(sizeof(audio_decoder_t));
+    osMemset(decoder, 0x00, sizeof(audio_decoder_t));
+    decoder->type = type;
+    decoder->file = fsOpenFile(source, FS_FILE_MODE_READ);
+    if (decoder->file == NULL)
+    {
+        osFreeMem(decoder);
+        return NULL;
+    }
+
+    bool_t supported = (type == AUDIO_DECODER_FLAC) ? audio_decoder_open_flac(decoder, skip_seconds) : audio_decoder_open_wav(decoder, skip_seconds);
+    if (supported && decoder->rate != OPUS_SAMPLING_RATE)
+    {
+        decoder->resampler = resampler_create(decoder->rate, OPUS_SAMPLING_RATE);
+        supported = (decoder->resampler != NULL);
+    }
+    if (!supported)
+    {
+        TRACE_INFO("%s can not be decoded natively, using ffmpeg\r\n", source);
+        audio_decoder_close(decoder);
+        return NULL;
+    }
+    audio_decoder_init_weights(decoder);
+
+    TRACE_INFO("Decoding %s natively, %" PRIu16 " channels with %" PRIu16 " bits at %" PRIu32 " Hz\r\n", source, decoder->channels, decoder->bits, decoder->rate);
+
+    return decoder;
+}
+
+void audio_decoder_close(audio_decoder_t *decoder)
+{
+    if (decoder->resampler)
+    {
+        resampler_free(decoder->resampler);
+    }
+    for (uint16_t channel = 0; channel < AUDIO_DECODER_MAX_CHANNELS; channel++)
+    {
+        osFreeMem(decoder->flacSamples[channel]);
+    }
+    fsCloseFile(decoder->file);
+    osFreeMem(decoder);
+}
+
+/* converts the next raw frames to float and mixes them to stereo, no frames are left at the end of the data */
+static error_t audio_decoder_mix_wav(audio_decoder_t *decoder, size_t *frames)
+{
+    *frames = 0;
+
+    if (decoder->rawLength - decoder->rawPos < decoder->blockAlign)
+    {
+        /* keep an incomplete frame in front of the new data */
+        size_t keep = decoder->rawLength - decoder->rawPos;
+        memmove(decoder->raw, &decoder->raw[decoder->rawPos], keep);
+        decoder->rawPos = 0;
+        decoder->rawLength = keep;
+
+        size_t size = (size_t)MIN((uint64_t)(sizeof(decoder->raw) - keep), decoder->remaining);
+        size_t read = 0;
+        if (size > 0)
+        {
+            error_t error = fsReadFile(decoder->file, &decoder->raw[keep], size, &read);
+            if (error != NO_ERROR && error != ERROR_END_OF_STREAM && error != ERROR_END_OF_FILE)
+            {
+                return ERROR_READ_FAILED;
+            }
+        }
+        decoder->rawLength += read;
+        if (decoder->remaining != UINT64_MAX)
+        {
+            decoder->remaining -= read;
+        }
+        if (read == 0)
+        {
+            decoder->remaining = 0;
+        }
+    }
+
+    size_t count = MIN((decoder->rawLength - decoder->rawPos) / decoder->blockAlign, (size_t)AUDIO_DECODER_MIX_FRAMES);
+    size_t bytes = decoder->bits / 8;
+
+    for (size_t frame = 0; frame < count; frame++)
+    {
+        const uint8_t *data = &decoder->raw[decoder->rawPos + frame * decoder->blockAlign];
+        float left = 0.0f;
+        float right = 0.0f;
+
+        for (uint16_t channel = 0; channel < decoder->channels; channel++)
+        {
+            float sample = audio_decoder_sample(decoder, &data[channel * bytes]);
+            left += sample * decoder->weightLeft[channel];
+            right += sample * decoder->weightRight[channel];
+        }
+        decoder->left[frame] = left;
+        decoder->right[frame] = right;
+    }
+    decoder->rawPos += count * decoder->blockAlign;
+    *frames = count;
+
+    return NO_ERROR;
+}
+
+/* mixes the next samples of the decoded block to stereo, decoding the next frame when it is used up */
+static error_t audio_decoder_mix_flac(audio_decoder_t *decoder, size_t *frames)
+{
+    *frames = 0;
+
+    if (decoder->flacPos == decoder->flacLength && !audio_decoder_flac_frame(decoder))
+    {
+        return decoder->readFailed ? ERROR_READ_FAILED : NO_ERROR;
+    }
+
+    size_t count = MIN(decoder->flacLength - decoder->flacPos, (size_t)AUDIO_DECODER_MIX_FRAMES);
+    for (size_t frame = 0; frame < count; frame++)
+    {
+        float left = 0.0f;
+        float right = 0.0f;
+
+        for (uint16_t channel = 0; channel < decoder->channels; channel++)
+        {
+            float sample = decoder->flacSamples[channel][decoder->flacPos + frame] * decoder->flacScale;
+            left += sample * decoder->weightLeft[channel];
+            right += sample * decoder->weightRight[channel];
+        }
+        decoder->left[frame] = left;
+        decoder->right[frame] = right;
+    }
+    decoder->flacPos += count;
+    *frames = count;
+
+    return NO_ERROR;
+}
+
+static error_t audio_decoder_mix(audio_decoder_t *decoder, size_t *frames)
+{
+    return (decoder->type == AUDIO_DECODER_FLAC) ? audio_decoder_mix_flac(decoder, frames) : audio_decoder_mix_wav(decoder, frames);
+}
+
+error_t audio_decoder_read(audio_decoder_t *decoder, int16_t *buffer, size_t frames, size_t *frames_read)
+{
+    size_t produced = 0;
+
+    while (produced < frames)
+    {
+        if (decoder->mixPos == decoder->mixLength && !decoder->eof)
+        {
+            decoder->mixPos = 0;
+            if (audio_decoder_mix(decoder, &decoder->mixLength) != NO_ERROR)
+            {
+                *frames_read = produced;
+                return ERROR_READ_FAILED;
+            }
+            decoder->eof = (decoder->mixLength == 0);
+        }
+
+        size_t pending = decoder->mixLength - decoder->mixPos;
+        int16_t *out = &buffer[produced * OPUS_CHANNELS];
+        size_t count;
+
+        if (!decoder->resampler)
+        {
+            if (pending == 0)
+            {
+                break;
+            }
+            count = MIN(pending, frames - produced);
+            for (size_t frame = 0; frame < count; frame++)
+            {
+                out[frame * 2] = resampler_clip(decoder->left[decoder->mixPos + frame]);
+                out[frame * 2 + 1] = resampler_clip(decoder->right[decoder->mixPos + frame]);
+            }
+            decoder->mixPos += count;
+        }
+        else if (pending > 0)
+        {
+            size_t accepted = MIN(pending, resampler_space(decoder->resampler));
+            count = resampler_process(decoder->resampler, &decoder->left[decoder->mixPos], &decoder->right[decoder->mixPos], accepted, out, frames - produced);
+            decoder->mixPos += accepted;
+        }
+        else
+        {
+            /* the end of the source, drain the filter */
+            count = resampler_process(decoder->resampler, NULL, NULL, 0, out, frames - produced);
+            if (count == 0)
+            {
+                break;
+            }
+        }
+        produced += count;
+    }
+    *frames_read = produced;
+
+    return (produced == 0 && decoder->eof) ? ERROR_END_OF_STREAM : NO_ERROR;
+}
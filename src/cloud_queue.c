@@ -0,0 +1,450 @@
+#include <time.h>
+#include <string.h>
+
+#include "cloud_queue.h"
+#include "cloud_request.h"
+#include "settings.h"
+#include "mutex_manager.h"
+#include "stats.h"
+#include "fs_port.h"
+#include "debug.h"
+#include "os_port.h"
+
+#define CLOUD_QUEUE_MAGIC 0x51435454 /* "TTCQ" */
+#define CLOUD_QUEUE_VERSION 1
+#define CLOUD_QUEUE_IDLE_MS 1000
+
+typedef struct
+{
+    uint32_t seq;
+    uint8_t used;
+    uint8_t api;
+    uint8_t overlay;
+    uint8_t hasToken;
+    uint8_t post;
+    uint32_t retries;
+    uint64_t created;
+    uint64_t nextTry;
+    char uri[CLOUD_QUEUE_URI_LENGTH];
+    char queryString[CLOUD_QUEUE_QUERY_LENGTH];
+    uint8_t token[AUTH_TOKEN_LENGTH];
+    uint32_t bodyLen;
+    uint8_t body[CLOUD_QUEUE_BODY_LENGTH];
+} cloud_queue_entry_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entrySize;
+    uint32_t count;
+} cloud_queue_file_header_t;
+
+typedef struct
+{
+    /* has to be the first member, cloud_request() casts the context to cbr_ctx_t */
+    cbr_ctx_t cbr_ctx;
+    uint_t statusCode;
+} cloud_queue_ctx_t;
+
+static cloud_queue_entry_t cloud_queue[CLOUD_QUEUE_ENTRIES];
+static uint32_t cloud_queue_seq = 0;
+static bool_t cloud_queue_dirty = FALSE;
+static bool_t cloud_queue_running = FALSE;
+static OsEvent cloud_queue_event;
+static OsEvent cloud_queue_stopped;
+
+static void cloud_queue_load()
+{
+    FsFile *file = fsOpenFile(CLOUD_QUEUE_PATH, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        return;
+    }
+
+    cloud_queue_file_header_t header;
+    size_t read = 0;
+    if (fsReadFile(file, &header, sizeof(header), &read) != NO_ERROR || read != sizeof(header) ||
+        header.magic != CLOUD_QUEUE_MAGIC || header.version != CLOUD_QUEUE_VERSION || header.entrySize != sizeof(cloud_queue_entry_t))
+    {
+        TRACE_WARNING("Ignoring incompatible cloud queue file %s\r\n", CLOUD_QUEUE_PATH);
+        fsCloseFile(file);
+        return;
+    }
+
+    size_t loaded = 0;
+    for (uint32_t pos = 0; pos < header.count && loaded < CLOUD_QUEUE_ENTRIES; pos++)
+    {
+        cloud_queue_entry_t *entry = &cloud_queue[loaded];
+        if (fsReadFile(file, entry, sizeof(cloud_queue_entry_t), &read) != NO_ERROR || read != sizeof(cloud_queue_entry_t))
+        {
+            osMemset(entry, 0x00, sizeof(cloud_queue_entry_t));
+            break;
+        }
+        if (!entry->used)
+        {
+            continue;
+        }
+        entry->uri[CLOUD_QUEUE_URI_LENGTH - 1] = '\0';
+        entry->queryString[CLOUD_QUEUE_QUERY_LENGTH - 1] = '\0';
+        entry->bodyLen = MIN(entry->bodyLen, CLOUD_QUEUE_BODY_LENGTH);
+        /* retry restored entries right away */
+        entry->nextTry = 0;
+        if (entry->seq >= cloud_queue_seq)
+        {
+            cloud_queue_seq = entry->seq + 1;
+        }
+        loaded++;
+    }
+    fsCloseFile(file);
+
+    if (loaded > 0)
+    {
+        TRACE_INFO("Restored %" PRIuSIZE " pending cloud requests\r\n", loaded);
+    }
+}
+
+static void cloud_queue_save()
+{
+    mutex_lock(MUTEX_CLOUD_QUEUE);
+    if (!cloud_queue_dirty)
+    {
+        mutex_unlock(MUTEX_CLOUD_QUEUE);
+        return;
+    }
+    cloud_queue_dirty = FALSE;
+
+    cloud_queue_file_header_t header = {
+        .magic = CLOUD_QUEUE_MAGIC,
+        .version = CLOUD_QUEUE_VERSION,
+        .entrySize = sizeof(cloud_queue_entry_t),
+        .count = 0};
+
+    for (size_t pos = 0; pos < CLOUD_QUEUE_ENTRIES; pos++)
+    {
+        if (cloud_queue[pos].used)
+        {
+            header.count++;
+        }
+    }
+
+    if (header.count == 0)
+    {
+        mutex_unlock(MUTEX_CLOUD_QUEUE);
+        fsDeleteFile(CLOUD_QUEUE_PATH);
+        return;
+    }
+
+    const char *tmpPath = CLOUD_QUEUE_PATH ".tmp";
+    FsFile *file = fsOpenFile(tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file == NULL)
+    {
+        mutex_unlock(MUTEX_CLOUD_QUEUE);
+        TRACE_ERROR("Could not open %s for writing\r\n", tmpPath);
+        return;
+    }
+
+    error_t error = fsWriteFile(file, &header, sizeof(header));
+    for (size_t pos = 0; pos < CLOUD_QUEUE_ENTRIES && error == NO_ERROR; pos++)
+    {
+        if (cloud_queue[pos].used)
+        {
+            error = fsWriteFile(file, &cloud_queue[pos], sizeof(cloud_queue_entry_t));
+        }
+    }
+    mutex_unlock(MUTEX_CLOUD_QUEUE);
+    fsCloseFile(file);
+
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Could not write %s, error=%" PRIu32 "\r\n", tmpPath, (uint32_t)error);
+        fsDeleteFile(tmpPath);
+        return;
+    }
+    fsDeleteFile(CLOUD_QUEUE_PATH);
+    fsRenameFile(tmpPath, CLOUD_QUEUE_PATH);
+}
+
+static uint64_t cloud_queue_backoff(uint32_t retries)
+{
+    uint64_t delay = CLOUD_QUEUE_RETRY_MIN_S;
+
+    while (retries-- > 0 && delay < CLOUD_QUEUE_RETRY_MAX_S)
+    {
+        delay *= 2;
+    }
+    return MIN(delay, CLOUD_QUEUE_RETRY_MAX_S);
+}
+
+static bool_t cloud_queue_forward_enabled(const cloud_queue_entry_t *entry, settings_t *settings)
+{
+    if (!settings->cloud.enabled)
+    {
+        return FALSE;
+    }
+    switch (entry->api)
+    {
+    case V1_LOG:
+        return settings->cloud.enableV1Log;
+    case V1_CLAIM:
+        return settings->cloud.enableV1Claim;
+    default:
+        return TRUE;
+    }
+}
+
+static void cbrCloudQueueResponse(void *src_ctx, HttpClientContext *cloud_ctx)
+{
+    cloud_queue_ctx_t *ctx = (cloud_queue_ctx_t *)src_ctx;
+
+    ctx->statusCode = cloud_ctx->statusCode;
+    ctx->cbr_ctx.status = PROX_STATUS_CONN;
+}
+
+static bool_t cloud_queue_send(cloud_queue_entry_t *entry)
+{
+    client_ctx_t client_ctx;
+    osMemset(&client_ctx, 0x00, sizeof(client_ctx));
+    client_ctx.settings = get_settings_id(entry->overlay);
+
+    if (!cloud_queue_forward_enabled(entry, client_ctx.settings))
+    {
+        TRACE_INFO("Dropping queued %s, forwarding got disabled\r\n", entry->uri);
+        return TRUE;
+    }
+
+    cloud_queue_ctx_t ctx;
+    osMemset(&ctx, 0x00, sizeof(ctx));
+    ctx.cbr_ctx.uri = entry->uri;
+    ctx.cbr_ctx.queryString = entry->queryString;
+    ctx.cbr_ctx.api = entry->api;
+    ctx.cbr_ctx.status = PROX_STATUS_IDLE;
+    ctx.cbr_ctx.client_ctx = &client_ctx;
+
+    /* the box already got its answer, so the response is only checked for its status code */
+    req_cbr_t cbr = {
+        .ctx = &ctx,
+        .response = &cbrCloudQueueResponse};
+
+    const char *queryString = osStrlen(entry->queryString) ? entry->queryString : NULL;
+    const uint8_t *token = entry->hasToken ? entry->token : NULL;
+
+    cloud_request(NULL, 0, true, entry->uri, queryString, entry->post ? "POST" : "GET", entry->bodyLen ? entry->body : NULL, entry->bodyLen, token, &cbr);
+
+    if (ctx.cbr_ctx.status == PROX_STATUS_IDLE)
+    {
+        TRACE_WARNING("Queued %s could not be delivered\r\n", entry->uri);
+        return FALSE;
+    }
+    if (ctx.statusCode >= 500 || ctx.statusCode == 429)
+    {
+        TRACE_WARNING("Queued %s was rejected with %u, retrying later\r\n", entry->uri, ctx.statusCode);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Delivers all due entries, oldest first. Stops at the first failure
+ * since the following requests would most likely run into the same problem.
+ */
+static void cloud_queue_process()
+{
+    setting_handle_t exitSetting = settings_handle("internal.exit");
+    while (!settings_get_bool_handle(exitSetting))
+    {
+        uint64_t now = (uint64_t)time(NULL);
+        cloud_queue_entry_t entry;
+        bool_t found = FALSE;
+
+        mutex_lock(MUTEX_CLOUD_QUEUE);
+        for (size_t pos = 0; pos < CLOUD_QUEUE_ENTRIES; pos++)
+        {
+            cloud_queue_entry_t *current = &cloud_queue[pos];
+            if (!current->used)
+            {
+                continue;
+            }
+            if (now > current->created + CLOUD_QUEUE_MAX_AGE_S)
+            {
+                TRACE_WARNING("Dropping queued %s after %" PRIu32 " retries\r\n", current->uri, current->retries);
+                current->used = 0;
+                cloud_queue_dirty = TRUE;
+                stats_update("cloud_queue_dropped", 1);
+                continue;
+            }
+            if (current->nextTry > now)
+            {
+                continue;
+            }
+            if (!found || current->seq < entry.seq)
+            {
+                osMemcpy(&entry, current, sizeof(entry));
+                found = TRUE;
+            }
+        }
+        mutex_unlock(MUTEX_CLOUD_QUEUE);
+
+        if (!found)
+        {
+            break;
+        }
+
+        bool_t delivered = cloud_queue_send(&entry);
+
+        mutex_lock(MUTEX_CLOUD_QUEUE);
+        for (size_t pos = 0; pos < CLOUD_QUEUE_ENTRIES; pos++)
+        {
+            cloud_queue_entry_t *current = &cloud_queue[pos];
+            /* the entry might have been dropped by an overflow in the meantime */
+            if (!current->used || current->seq != entry.seq)
+            {
+                continue;
+            }
+            if (delivered)
+            {
+                current->used = 0;
+                stats_update("cloud_queue_sent", 1);
+            }
+            else
+            {
+                current->retries++;
+                current->nextTry = (uint64_t)time(NULL) + cloud_queue_backoff(current->retries - 1);
+                stats_update("cloud_queue_retries", 1);
+            }
+            cloud_queue_dirty = TRUE;
+            break;
+        }
+        mutex_unlock(MUTEX_CLOUD_QUEUE);
+
+        if (!delivered)
+        {
+            break;
+        }
+    }
+}
+
+static void cloud_queue_thread(void *arg)
+{
+    setting_handle_t exitSetting = settings_handle("internal.exit");
+    while (!settings_get_bool_handle(exitSetting) && cloud_queue_running)
+    {
+        osWaitForEvent(&cloud_queue_event, CLOUD_QUEUE_IDLE_MS);
+        cloud_queue_process();
+        cloud_queue_save();
+    }
+    cloud_queue_save();
+    osSetEvent(&cloud_queue_stopped);
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void cloud_queue_init()
+{
+    osMemset(cloud_queue, 0x00, sizeof(cloud_queue));
+    cloud_queue_seq = 0;
+    cloud_queue_dirty = FALSE;
+    cloud_queue_load();
+
+    osCreateEvent(&cloud_queue_event);
+    osCreateEvent(&cloud_queue_stopped);
+    cloud_queue_running = TRUE;
+    osCreateTask("CloudQueue", &cloud_queue_thread, NULL, 1024, 0);
+}
+
+void cloud_queue_deinit()
+{
+    if (!cloud_queue_running)
+    {
+        return;
+    }
+    cloud_queue_running = FALSE;
+    osSetEvent(&cloud_queue_event);
+    /* an upstream request might still be running, don't wait forever */
+    if (!osWaitForEvent(&cloud_queue_stopped, 5000))
+    {
+        /* the task still uses the events */
+        TRACE_WARNING("Cloud queue did not stop in time\r\n");
+        return;
+    }
+    osDeleteEvent(&cloud_queue_event);
+    osDeleteEvent(&cloud_queue_stopped);
+}
+
+error_t cloud_queue_add(cloudapi_t api, const char *method, const char *uri, const char *queryString, const uint8_t *body, size_t bodyLen, const uint8_t *token, client_ctx_t *client_ctx)
+{
+    if (!queryString)
+    {
+        queryString = "";
+    }
+    if (osStrlen(uri) >= CLOUD_QUEUE_URI_LENGTH || osStrlen(queryString) >= CLOUD_QUEUE_QUERY_LENGTH || bodyLen > CLOUD_QUEUE_BODY_LENGTH)
+    {
+        TRACE_ERROR("Request %s too large for the cloud queue\r\n", uri);
+        stats_update("cloud_queue_dropped", 1);
+        return ERROR_BUFFER_OVERFLOW;
+    }
+
+    uint8_t overlay = client_ctx->settings->internal.overlayNumber;
+    bool_t post = !osStrcmp(method, "POST");
+    cloud_queue_entry_t *slot = NULL;
+
+    mutex_lock(MUTEX_CLOUD_QUEUE);
+    for (size_t pos = 0; pos < CLOUD_QUEUE_ENTRIES; pos++)
+    {
+        cloud_queue_entry_t *current = &cloud_queue[pos];
+        if (!current->used)
+        {
+            if (!slot || slot->used)
+            {
+                slot = current;
+            }
+            continue;
+        }
+        /* identical requests without a body (claims) are only forwarded once */
+        if (bodyLen == 0 && current->bodyLen == 0 && current->api == api && current->overlay == overlay && current->post == post &&
+            !osStrcmp(current->uri, uri) && !osStrcmp(current->queryString, queryString) &&
+            current->hasToken == (token != NULL) && (!token || !osMemcmp(current->token, token, AUTH_TOKEN_LENGTH)))
+        {
+            mutex_unlock(MUTEX_CLOUD_QUEUE);
+            stats_update("cloud_queue_merged", 1);
+            return NO_ERROR;
+        }
+        if (!slot || (slot->used && current->seq < slot->seq))
+        {
+            slot = current;
+        }
+    }
+
+    if (slot->used)
+    {
+        TRACE_WARNING("Cloud queue full, dropping oldest request %s\r\n", slot->uri);
+        stats_update("cloud_queue_dropped", 1);
+    }
+
+    osMemset(slot, 0x00, sizeof(cloud_queue_entry_t));
+    slot->used = 1;
+    slot->seq = cloud_queue_seq++;
+    slot->api = api;
+    slot->overlay = overlay;
+    slot->post = post;
+    slot->created = (uint64_t)time(NULL);
+    osStrcpy(slot->uri, uri);
+    osStrcpy(slot->queryString, queryString);
+    if (token)
+    {
+        slot->hasToken = 1;
+        osMemcpy(slot->token, token, AUTH_TOKEN_LENGTH);
+    }
+    if (body && bodyLen > 0)
+    {
+        osMemcpy(slot->body, body, bodyLen);
+        slot->bodyLen = bodyLen;
+    }
+    cloud_queue_dirty = TRUE;
+    mutex_unlock(MUTEX_CLOUD_QUEUE);
+
+    stats_update("cloud_queue_added", 1);
+    osSetEvent(&cloud_queue_event);
+
+    return NO_ERROR;
+}
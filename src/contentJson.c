@@ -1,4 +1,7 @@
 #include "contentJson.h"
+#include "content_index.h"
+#include "content_db.h"
+#include "server_helpers.h"
 
 #include "settings.h"
 #include "debug.h"
@@ -33,7 +36,8 @@ uint32_t content_jsonGetUInt32(cJSON *jsonElement, char *name)
     return 0;
 }
 
-error_t load_content_json(const char *content_path, contentJson_t *content_json)
+/* reads a <content>.json sidecar, they are only imported into the content database */
+static error_t content_json_import(const char *content_path, contentJson_t *content_json)
 {
     char *jsonPath = osAllocMem(osStrlen(content_path) + 5 + 1);
     osStrcpy(jsonPath, content_path);
@@ -104,53 +108,62 @@ error_t load_content_json(const char *content_path, contentJson_t *content_json)
         error = ERROR_FILE_NOT_FOUND;
     }
 
-    if (error != NO_ERROR)
-    {
-        error = save_content_json(content_path, content_json);
-    }
-
     osFreeMem(jsonPath);
 
     return error;
 }
-error_t save_content_json(const char *content_path, contentJson_t *content_json)
-{
-    char *jsonPath = osAllocMem(osStrlen(content_path) + 5 + 1);
-    osStrcpy(jsonPath, content_path);
-    osStrcat(jsonPath, ".json");
-    error_t error = NO_ERROR;
 
-    cJSON *contentJson = cJSON_CreateObject();
+static uint32_t content_json_sidecar_time(const char *content_path)
+{
+    char *jsonPath = custom_asprintf("%s.json", content_path);
+    FsFileStat stat;
+    uint32_t sidecarTime = 0;
 
-    cJSON_AddBoolToObject(contentJson, "live", content_json->live);
-    cJSON_AddBoolToObject(contentJson, "nocloud", content_json->nocloud);
-    if (content_json->source != NULL)
+    if (fsGetFileStat(jsonPath, &stat) == NO_ERROR)
     {
-        cJSON_AddStringToObject(contentJson, "source", content_json->source);
+        sidecarTime = (uint32_t)convertDateToUnixTime(&stat.modified);
     }
-    else
+    osFreeMem(jsonPath);
+
+    return sidecarTime;
+}
+
+error_t load_content_json(const char *content_path, contentJson_t *content_json)
+{
+    uint32_t sidecarTime = content_json_sidecar_time(content_path);
+    uint32_t importedTime = 0;
+
+    if (content_db_get(content_path, content_json, &importedTime) == NO_ERROR)
     {
-        cJSON_AddStringToObject(contentJson, "source", "");
+        /* a sidecar which was edited by hand is imported again */
+        if (sidecarTime == 0 || sidecarTime == importedTime)
+        {
+            return NO_ERROR;
+        }
+        osFreeMem(content_json->source);
+        content_json->source = NULL;
     }
-    cJSON_AddNumberToObject(contentJson, "skip_seconds", content_json->skip_seconds);
-    cJSON_AddBoolToObject(contentJson, "cache", content_json->cache);
-    cJSON_AddNumberToObject(contentJson, "_version", CONTENT_JSON_VERSION);
 
-    char *jsonRaw = cJSON_Print(contentJson);
-    FsFile *file = fsOpenFile(jsonPath, FS_FILE_MODE_WRITE);
-    if (file != NULL)
+    error_t error = content_json_import(content_path, content_json);
+    if (error == NO_ERROR)
     {
-        error = fsWriteFile(file, jsonRaw, osStrlen(jsonRaw));
-        fsCloseFile(file);
+        TRACE_INFO("Imported %s.json into the content database\r\n", content_path);
     }
-    else
+
+    /* defaults are stored as well, so there is no need to look for the sidecar again */
+    if (content_db_import(content_path, content_json, sidecarTime) == NO_ERROR)
     {
-        error = ERROR_FILE_OPENING_FAILED;
+        content_json->_updated = false;
+        content_json->_version = CONTENT_JSON_VERSION;
     }
 
-    cJSON_Delete(contentJson);
-    osFreeMem(jsonRaw);
-    osFreeMem(jsonPath);
+    return error;
+}
+error_t save_content_json(const char *content_path, contentJson_t *content_json)
+{
+    error_t error = content_db_set(content_path, content_json);
+
+    content_index_invalidate(content_path);
 
     if (error == NO_ERROR)
     {
@@ -163,5 +176,5 @@ error_t save_content_json(const char *content_path, contentJson_t *content_json)
 void free_content_json(contentJson_t *content_json)
 {
     osFreeMem(content_json->source);
-    osFreeMem(content_json->_streamFile);
+    content_json->source = NULL;
 }
\ No newline at end of file
@@ -0,0 +1,554 @@
+#include <string.h>
+
+#include "content_db.h"
+#include "settings.h"
+#include "mutex_manager.h"
+#include "fs_ext.h"
+#include "debug.h"
+#include "os_port.h"
+
+#define CONTENT_DB_MAGIC 0x44435454        /* "TTCD" */
+#define CONTENT_DB_RECORD_MAGIC 0x52435454 /* "TTCR" */
+#define CONTENT_DB_VERSION 1
+
+#define CONTENT_DB_OP_SET 1
+#define CONTENT_DB_OP_DEL 2
+
+#define CONTENT_DB_FLAG_LIVE 0x01
+#define CONTENT_DB_FLAG_NOCLOUD 0x02
+#define CONTENT_DB_FLAG_CACHE 0x04
+
+/*
+ * The database file is a header followed by a log of fixed size record headers,
+ * each followed by the key and the source string. Later records replace earlier ones.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+} content_db_file_header_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint8_t op;
+    uint8_t flags;
+    uint16_t keyLen;
+    uint16_t sourceLen;
+    uint16_t reserved;
+    uint32_t skip_seconds;
+    uint32_t sidecarTime;
+    uint32_t checksum;
+} content_db_record_t;
+
+typedef struct content_db_entry_s
+{
+    struct content_db_entry_s *next;
+    uint32_t hash;
+    char *key;
+    uint8_t flags;
+    uint32_t skip_seconds;
+    /* modification time of the sidecar when it was imported, 0 if there was none */
+    uint32_t sidecarTime;
+    char *source;
+} content_db_entry_t;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t length;
+    size_t size;
+} content_db_buffer_t;
+
+static content_db_entry_t *content_db[CONTENT_DB_BUCKETS];
+/* size of all current records, this is what a compacted log would need */
+static size_t content_db_live_size = 0;
+static size_t content_db_log_size = 0;
+static content_db_buffer_t content_db_pending;
+static bool_t content_db_compact_needed = FALSE;
+static bool_t content_db_running = FALSE;
+static OsEvent content_db_event;
+static OsEvent content_db_stopped;
+
+static uint32_t content_db_hash(const uint8_t *data, size_t length, uint32_t hash)
+{
+    /* FNV-1a */
+    for (size_t pos = 0; pos < length; pos++)
+    {
+        hash ^= data[pos];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static char *content_db_key(const char *content_path)
+{
+    const char *datadir = get_settings()->internal.datadirfull;
+    size_t len = osStrlen(datadir);
+
+    /* relative to the data dir, so the database survives moving it */
+    if (len > 0 && !osStrncmp(content_path, datadir, len) && (content_path[len] == '/' || content_path[len] == '\\'))
+    {
+        return strdup(&content_path[len + 1]);
+    }
+    return strdup(content_path);
+}
+
+static size_t content_db_record_size(const content_db_entry_t *entry)
+{
+    return sizeof(content_db_record_t) + osStrlen(entry->key) + (entry->source ? osStrlen(entry->source) : 0);
+}
+
+static void content_db_buffer_append(content_db_buffer_t *buffer, const void *data, size_t length)
+{
+    if (buffer->length + length > buffer->size)
+    {
+        size_t newSize = MAX(MAX(buffer->size * 2, buffer->length + length), 4096);
+        uint8_t *newData = osAllocMem(newSize);
+        if (buffer->data)
+        {
+            osMemcpy(newData, buffer->data, buffer->length);
+            osFreeMem(buffer->data);
+        }
+        buffer->data = newData;
+        buffer->size = newSize;
+    }
+    osMemcpy(&buffer->data[buffer->length], data, length);
+    buffer->length += length;
+}
+
+static void content_db_buffer_free(content_db_buffer_t *buffer)
+{
+    if (buffer->data)
+    {
+        osFreeMem(buffer->data);
+    }
+    osMemset(buffer, 0x00, sizeof(content_db_buffer_t));
+}
+
+static void content_db_serialize(content_db_buffer_t *buffer, uint8_t op, const content_db_entry_t *entry)
+{
+    size_t keyLen = osStrlen(entry->key);
+    size_t sourceLen = (op == CONTENT_DB_OP_SET && entry->source) ? osStrlen(entry->source) : 0;
+
+    content_db_record_t record;
+    osMemset(&record, 0x00, sizeof(record));
+    record.magic = CONTENT_DB_RECORD_MAGIC;
+    record.op = op;
+    record.flags = entry->flags;
+    record.keyLen = keyLen;
+    record.sourceLen = sourceLen;
+    record.skip_seconds = entry->skip_seconds;
+    record.sidecarTime = entry->sidecarTime;
+
+    uint32_t checksum = content_db_hash((const uint8_t *)&record, sizeof(record), 0x811c9dc5);
+    checksum = content_db_hash((const uint8_t *)entry->key, keyLen, checksum);
+    checksum = content_db_hash((const uint8_t *)entry->source, sourceLen, checksum);
+    record.checksum = checksum;
+
+    content_db_buffer_append(buffer, &record, sizeof(record));
+    content_db_buffer_append(buffer, entry->key, keyLen);
+    content_db_buffer_append(buffer, entry->source, sourceLen);
+}
+
+static void content_db_free_entry(content_db_entry_t *entry)
+{
+    osFreeMem(entry->key);
+    osFreeMem(entry->source);
+    osFreeMem(entry);
+}
+
+/* has to be called locked */
+static content_db_entry_t *content_db_find(const char *key, uint32_t hash)
+{
+    for (content_db_entry_t *entry = content_db[hash % CONTENT_DB_BUCKETS]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && !osStrcmp(entry->key, key))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* has to be called locked, takes ownership of key and source */
+static content_db_entry_t *content_db_apply_set(char *key, uint8_t flags, uint32_t skip_seconds, uint32_t sidecarTime, char *source)
+{
+    uint32_t hash = content_db_hash((const uint8_t *)key, osStrlen(key), 0x811c9dc5);
+    content_db_entry_t *entry = content_db_find(key, hash);
+
+    if (entry)
+    {
+        content_db_live_size -= content_db_record_size(entry);
+        osFreeMem(entry->key);
+        osFreeMem(entry->source);
+    }
+    else
+    {
+        entry = osAllocMem(sizeof(content_db_entry_t));
+        entry->hash = hash;
+        entry->next = content_db[hash % CONTENT_DB_BUCKETS];
+        content_db[hash % CONTENT_DB_BUCKETS] = entry;
+    }
+    entry->key = key;
+    entry->flags = flags;
+    entry->skip_seconds = skip_seconds;
+    entry->sidecarTime = sidecarTime;
+    entry->source = source;
+    content_db_live_size += content_db_record_size(entry);
+
+    return entry;
+}
+
+/* has to be called locked */
+static bool_t content_db_apply_remove(const char *key)
+{
+    uint32_t hash = content_db_hash((const uint8_t *)key, osStrlen(key), 0x811c9dc5);
+    content_db_entry_t **prev = &content_db[hash % CONTENT_DB_BUCKETS];
+
+    while (*prev)
+    {
+        content_db_entry_t *entry = *prev;
+        if (entry->hash == hash && !osStrcmp(entry->key, key))
+        {
+            *prev = entry->next;
+            content_db_live_size -= content_db_record_size(entry);
+            content_db_free_entry(entry);
+            return TRUE;
+        }
+        prev = &entry->next;
+    }
+    return FALSE;
+}
+
+static void content_db_load()
+{
+    uint32_t fileSize = 0;
+    if (fsGetFileSize(CONTENT_DB_PATH, &fileSize) != NO_ERROR)
+    {
+        return;
+    }
+    if (fileSize < sizeof(content_db_file_header_t))
+    {
+        content_db_compact_needed = TRUE;
+        return;
+    }
+
+    FsFile *file = fsOpenFile(CONTENT_DB_PATH, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        return;
+    }
+
+    uint8_t *data = osAllocMem(fileSize);
+    size_t pos = 0;
+    while (pos < fileSize)
+    {
+        size_t read = 0;
+        if (fsReadFile(file, &data[pos], fileSize - pos, &read) != NO_ERROR || read == 0)
+        {
+            break;
+        }
+        pos += read;
+    }
+    fsCloseFile(file);
+    size_t length = pos;
+
+    content_db_file_header_t header;
+    osMemset(&header, 0x00, sizeof(header));
+    if (length >= sizeof(header))
+    {
+        osMemcpy(&header, data, sizeof(header));
+    }
+    if (header.magic != CONTENT_DB_MAGIC || header.version != CONTENT_DB_VERSION)
+    {
+        TRACE_WARNING("Ignoring incompatible content database %s\r\n", CONTENT_DB_PATH);
+        osFreeMem(data);
+        content_db_compact_needed = TRUE;
+        return;
+    }
+
+    size_t records = 0;
+    pos = sizeof(header);
+    while (pos + sizeof(content_db_record_t) <= length)
+    {
+        content_db_record_t record;
+        osMemcpy(&record, &data[pos], sizeof(record));
+        size_t payloadLen = (size_t)record.keyLen + record.sourceLen;
+        if (record.magic != CONTENT_DB_RECORD_MAGIC || record.keyLen == 0 || pos + sizeof(record) + payloadLen > length)
+        {
+            break;
+        }
+        const char *key = (const char *)&data[pos + sizeof(record)];
+        const char *source = key + record.keyLen;
+
+        uint32_t checksum = record.checksum;
+        record.checksum = 0;
+        uint32_t expected = content_db_hash((const uint8_t *)&record, sizeof(record), 0x811c9dc5);
+        expected = content_db_hash((const uint8_t *)key, payloadLen, expected);
+        if (checksum != expected)
+        {
+            break;
+        }
+
+        char *keyStr = osAllocMem(record.keyLen + 1);
+        osMemcpy(keyStr, key, record.keyLen);
+        keyStr[record.keyLen] = '\0';
+
+        if (record.op == CONTENT_DB_OP_SET)
+        {
+            char *sourceStr = osAllocMem(record.sourceLen + 1);
+            osMemcpy(sourceStr, source, record.sourceLen);
+            sourceStr[record.sourceLen] = '\0';
+            content_db_apply_set(keyStr, record.flags, record.skip_seconds, record.sidecarTime, sourceStr);
+        }
+        else
+        {
+            content_db_apply_remove(keyStr);
+            osFreeMem(keyStr);
+        }
+        pos += sizeof(record) + payloadLen;
+        records++;
+    }
+    osFreeMem(data);
+
+    if (pos != length)
+    {
+        /* interrupted write, rewrite the file without the broken tail */
+        TRACE_WARNING("Content database %s has a damaged tail at offset %" PRIuSIZE ", dropping it\r\n", CONTENT_DB_PATH, pos);
+        content_db_compact_needed = TRUE;
+    }
+    content_db_log_size = pos;
+
+    TRACE_INFO("Loaded %" PRIuSIZE " content database records\r\n", records);
+}
+
+static void content_db_compact()
+{
+    content_db_buffer_t buffer;
+    osMemset(&buffer, 0x00, sizeof(buffer));
+    content_db_file_header_t header = {.magic = CONTENT_DB_MAGIC, .version = CONTENT_DB_VERSION};
+    content_db_buffer_append(&buffer, &header, sizeof(header));
+
+    mutex_lock(MUTEX_CONTENT_DB);
+    for (size_t bucket = 0; bucket < CONTENT_DB_BUCKETS; bucket++)
+    {
+        for (content_db_entry_t *entry = content_db[bucket]; entry; entry = entry->next)
+        {
+            content_db_serialize(&buffer, CONTENT_DB_OP_SET, entry);
+        }
+    }
+    /* everything pending is part of the snapshot */
+    content_db_buffer_free(&content_db_pending);
+    content_db_compact_needed = FALSE;
+    mutex_unlock(MUTEX_CONTENT_DB);
+
+    const char *tmpPath = CONTENT_DB_PATH ".tmp";
+    FsFile *file = fsOpenFile(tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    error_t error = ERROR_FILE_OPENING_FAILED;
+    if (file != NULL)
+    {
+        error = fsWriteFile(file, buffer.data, buffer.length);
+        fsCloseFile(file);
+    }
+
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Could not write %s, error=%" PRIu32 "\r\n", tmpPath, (uint32_t)error);
+        fsDeleteFile(tmpPath);
+        /* the snapshot was not written, try again with the next flush */
+        content_db_compact_needed = TRUE;
+    }
+    else
+    {
+        fsDeleteFile(CONTENT_DB_PATH);
+        fsRenameFile(tmpPath, CONTENT_DB_PATH);
+        content_db_log_size = buffer.length;
+    }
+    content_db_buffer_free(&buffer);
+}
+
+static void content_db_flush()
+{
+    if (content_db_compact_needed || (content_db_log_size > CONTENT_DB_COMPACT_MIN && content_db_log_size > 2 * content_db_live_size))
+    {
+        content_db_compact();
+        return;
+    }
+
+    mutex_lock(MUTEX_CONTENT_DB);
+    content_db_buffer_t pending = content_db_pending;
+    osMemset(&content_db_pending, 0x00, sizeof(content_db_pending));
+    mutex_unlock(MUTEX_CONTENT_DB);
+
+    if (pending.length == 0)
+    {
+        content_db_buffer_free(&pending);
+        return;
+    }
+
+    /* the log is only appended, records written before stay untouched */
+    FsFile *file = fsOpenFileEx(CONTENT_DB_PATH, "ab");
+    error_t error = ERROR_FILE_OPENING_FAILED;
+    if (file != NULL)
+    {
+        error = NO_ERROR;
+        if (content_db_log_size == 0)
+        {
+            content_db_file_header_t header = {.magic = CONTENT_DB_MAGIC, .version = CONTENT_DB_VERSION};
+            error = fsWriteFile(file, &header, sizeof(header));
+            content_db_log_size = sizeof(header);
+        }
+        if (error == NO_ERROR)
+        {
+            error = fsWriteFile(file, pending.data, pending.length);
+        }
+        fsCloseFile(file);
+    }
+
+    if (error != NO_ERROR)
+    {
+        /* the file might end with a partial record now, write a clean one next time */
+        TRACE_ERROR("Could not append to %s, error=%" PRIu32 "\r\n", CONTENT_DB_PATH, (uint32_t)error);
+        content_db_compact_needed = TRUE;
+    }
+    else
+    {
+        content_db_log_size += pending.length;
+    }
+    content_db_buffer_free(&pending);
+}
+
+static void content_db_thread(void *param)
+{
+    setting_handle_t exitSetting = settings_handle("internal.exit");
+    while (!settings_get_bool_handle(exitSetting) && content_db_running)
+    {
+        osWaitForEvent(&content_db_event, CONTENT_DB_FLUSH_MS);
+        content_db_flush();
+    }
+
+    osSetEvent(&content_db_stopped);
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void content_db_init()
+{
+    osMemset(content_db, 0x00, sizeof(content_db));
+    osMemset(&content_db_pending, 0x00, sizeof(content_db_pending));
+    content_db_live_size = 0;
+    content_db_log_size = 0;
+    content_db_load();
+
+    osCreateEvent(&content_db_event);
+    osCreateEvent(&content_db_stopped);
+    content_db_running = TRUE;
+    if (osCreateTask("ContentDb", &content_db_thread, NULL, 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start content database writer\r\n");
+    }
+}
+
+void content_db_deinit()
+{
+    if (!content_db_running)
+    {
+        return;
+    }
+    content_db_running = FALSE;
+    osSetEvent(&content_db_event);
+    osWaitForEvent(&content_db_stopped, 2 * CONTENT_DB_FLUSH_MS);
+    osDeleteEvent(&content_db_event);
+    osDeleteEvent(&content_db_stopped);
+
+    content_db_flush();
+
+    mutex_lock(MUTEX_CONTENT_DB);
+    for (size_t bucket = 0; bucket < CONTENT_DB_BUCKETS; bucket++)
+    {
+        while (content_db[bucket])
+        {
+            content_db_entry_t *entry = content_db[bucket];
+            content_db[bucket] = entry->next;
+            content_db_free_entry(entry);
+        }
+    }
+    content_db_buffer_free(&content_db_pending);
+    mutex_unlock(MUTEX_CONTENT_DB);
+}
+
+error_t content_db_get(const char *content_path, contentJson_t *content_json, uint32_t *sidecarTime)
+{
+    if (!content_db_running)
+    {
+        return ERROR_NOT_FOUND;
+    }
+
+    char *key = content_db_key(content_path);
+    uint32_t hash = content_db_hash((const uint8_t *)key, osStrlen(key), 0x811c9dc5);
+    error_t error = ERROR_NOT_FOUND;
+
+    mutex_lock(MUTEX_CONTENT_DB);
+    content_db_entry_t *entry = content_db_find(key, hash);
+    if (entry)
+    {
+        content_json->live = (entry->flags & CONTENT_DB_FLAG_LIVE) != 0;
+        content_json->nocloud = (entry->flags & CONTENT_DB_FLAG_NOCLOUD) != 0;
+        content_json->cache = (entry->flags & CONTENT_DB_FLAG_CACHE) != 0;
+        content_json->skip_seconds = entry->skip_seconds;
+        content_json->source = strdup(entry->source ? entry->source : "");
+        content_json->_stream = osStrlen(content_json->source) > 0;
+        content_json->_version = CONTENT_JSON_VERSION;
+        content_json->_updated = false;
+        if (sidecarTime)
+        {
+            *sidecarTime = entry->sidecarTime;
+        }
+        error = NO_ERROR;
+    }
+    mutex_unlock(MUTEX_CONTENT_DB);
+    osFreeMem(key);
+
+    return error;
+}
+
+static error_t content_db_store(const char *content_path, const contentJson_t *content_json, bool_t imported, uint32_t sidecarTime)
+{
+    if (!content_db_running)
+    {
+        return ERROR_NOT_READY;
+    }
+
+    const char *source = content_json->source ? content_json->source : "";
+    if (osStrlen(source) > UINT16_MAX || osStrlen(content_path) > UINT16_MAX)
+    {
+        return ERROR_INVALID_LENGTH;
+    }
+
+    uint8_t flags = (content_json->live ? CONTENT_DB_FLAG_LIVE : 0) |
+                    (content_json->nocloud ? CONTENT_DB_FLAG_NOCLOUD : 0) |
+                    (content_json->cache ? CONTENT_DB_FLAG_CACHE : 0);
+    char *key = content_db_key(content_path);
+
+    mutex_lock(MUTEX_CONTENT_DB);
+    if (!imported)
+    {
+        content_db_entry_t *entry = content_db_find(key, content_db_hash((const uint8_t *)key, osStrlen(key), 0x811c9dc5));
+        sidecarTime = entry ? entry->sidecarTime : 0;
+    }
+    content_db_entry_t *entry = content_db_apply_set(key, flags, content_json->skip_seconds, sidecarTime, strdup(source));
+    content_db_serialize(&content_db_pending, CONTENT_DB_OP_SET, entry);
+    mutex_unlock(MUTEX_CONTENT_DB);
+
+    return NO_ERROR;
+}
+
+error_t content_db_set(const char *content_path, const contentJson_t *content_json)
+{
+    return content_db_store(content_path, content_json, FALSE, 0);
+}
+
+error_t content_db_import(const char *content_path, const contentJson_t *content_json, uint32_t sidecarTime)
+{
+    return content_db_store(content_path, content_json, TRUE, sidecarTime);
+}
@@ -0,0 +1,443 @@
+#include <string.h>
+
+#include "content_index.h"
+#include "fs_watch.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+#include "stats.h"
+#include "debug.h"
+#include "os_port.h"
+
+typedef struct content_index_entry_s
+{
+    struct content_index_entry_s *next;
+    uint32_t hash;
+    char *path;
+    bool_t watched;
+
+    /* TAF */
+    bool_t exists;
+    uint32_t size;
+    DateTime modified;
+    bool_t valid;
+    bool_t stream;
+    toniefile_header_t header;
+    /* last check of the scrubber, the entry is dropped when the file changes */
+    taf_verify_result_t verify;
+
+    /* sidecar, only for tonies in the content dir */
+    bool_t isContent;
+    bool_t configExists;
+    DateTime configModified;
+    contentJson_t config;
+} content_index_entry_t;
+
+static content_index_entry_t *content_index[CONTENT_INDEX_BUCKETS];
+static size_t content_index_count = 0;
+/* incremented with every invalidation, probes racing with one are not added */
+static uint32_t content_index_generation = 0;
+static bool_t content_index_running = FALSE;
+
+static uint32_t content_index_hash(const char *path)
+{
+    /* FNV-1a */
+    uint32_t hash = 0x811c9dc5;
+    while (*path)
+    {
+        hash ^= (uint8_t)*path++;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static void content_index_free_entry(content_index_entry_t *entry)
+{
+    free_content_json(&entry->config);
+    osFreeMem(entry->path);
+    osFreeMem(entry);
+}
+
+/* has to be called locked */
+static void content_index_clear()
+{
+    for (size_t bucket = 0; bucket < CONTENT_INDEX_BUCKETS; bucket++)
+    {
+        while (content_index[bucket])
+        {
+            content_index_entry_t *entry = content_index[bucket];
+            content_index[bucket] = entry->next;
+            content_index_free_entry(entry);
+        }
+    }
+    content_index_count = 0;
+    content_index_generation++;
+}
+
+/* has to be called locked */
+static bool_t content_index_remove(const char *path, uint32_t hash)
+{
+    content_index_entry_t **prev = &content_index[hash % CONTENT_INDEX_BUCKETS];
+
+    while (*prev)
+    {
+        content_index_entry_t *entry = *prev;
+        if (entry->hash == hash && !osStrcmp(entry->path, path))
+        {
+            *prev = entry->next;
+            content_index_free_entry(entry);
+            content_index_count--;
+            return TRUE;
+        }
+        prev = &entry->next;
+    }
+    return FALSE;
+}
+
+/* has to be called locked */
+static content_index_entry_t *content_index_find(const char *path, uint32_t hash)
+{
+    for (content_index_entry_t *entry = content_index[hash % CONTENT_INDEX_BUCKETS]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && !osStrcmp(entry->path, path))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void content_index_fs_event(void *ctx, const char *dir, const char *name, bool_t isDir)
+{
+    if (name == NULL)
+    {
+        content_index_invalidate_dir(dir);
+        return;
+    }
+
+    char *path = custom_asprintf("%s/%s", dir, name);
+    if (isDir)
+    {
+        content_index_invalidate_dir(path);
+    }
+    else
+    {
+        content_index_invalidate(path);
+    }
+    osFreeMem(path);
+}
+
+/* watches the directory of the file, or its parent if the directory does not exist yet */
+static bool_t content_index_watch(const char *path)
+{
+    char *dir = strdup(path);
+    bool_t watched = FALSE;
+
+    for (int level = 0; level < 2 && !watched; level++)
+    {
+        char *sep = osStrrchr(dir, '/');
+        if (sep == NULL || sep == dir)
+        {
+            break;
+        }
+        *sep = '\0';
+
+        error_t error = fs_watch_add_dir(dir, &content_index_fs_event, NULL);
+        if (error == NO_ERROR)
+        {
+            watched = TRUE;
+        }
+        else if (error != ERROR_DIRECTORY_NOT_FOUND)
+        {
+            break;
+        }
+    }
+    osFreeMem(dir);
+
+    return watched;
+}
+
+static void content_index_probe_taf(content_index_entry_t *entry)
+{
+    FsFile *file = fsOpenFile(entry->path, FS_FILE_MODE_READ);
+    if (!file)
+    {
+        return;
+    }
+
+    uint8_t headerBuffer[TAF_HEADER_SIZE];
+    size_t read_length;
+    fsReadFile(file, headerBuffer, 4, &read_length);
+    if (read_length == 4)
+    {
+        uint32_t protobufSize = (uint32_t)((headerBuffer[0] << 24) | (headerBuffer[1] << 16) | (headerBuffer[2] << 8) | headerBuffer[3]);
+        if (protobufSize <= TAF_HEADER_SIZE)
+        {
+            fsReadFile(file, headerBuffer, protobufSize, &read_length);
+            if (read_length == protobufSize)
+            {
+                if (toniefile_header_decode(headerBuffer, protobufSize, &entry->header) == NO_ERROR)
+                {
+                    entry->valid = true;
+
+                    if (entry->header.num_bytes == TONIE_LENGTH_MAX)
+                    {
+                        entry->stream = true;
+                    }
+                }
+            }
+            else
+            {
+                TRACE_WARNING("Invalid TAF-header on %s, read_length=%" PRIuSIZE " != protobufSize=%" PRIu32 "\r\n", entry->path, read_length, protobufSize);
+            }
+        }
+        else
+        {
+            TRACE_WARNING("Invalid TAF-header on %s, protobufSize=%" PRIu32 " >= TAF_HEADER_SIZE=%u\r\n", entry->path, protobufSize, TAF_HEADER_SIZE);
+        }
+    }
+    else if (read_length == 0)
+    {
+        // TODO don't send invalid TAF files via API
+        TRACE_VERBOSE("Invalid TAF-header, file %s is empty!", entry->path);
+    }
+    else
+    {
+        TRACE_WARNING("Invalid TAF-header on %s, Could not read 4 bytes, read_length=%" PRIuSIZE "\r\n", entry->path, read_length);
+    }
+    fsCloseFile(file);
+}
+
+static void content_index_stat_config(const char *path, bool_t *exists, DateTime *modified)
+{
+    char *jsonPath = custom_asprintf("%s.json", path);
+    FsFileStat stat;
+
+    *exists = (fsGetFileStat(jsonPath, &stat) == NO_ERROR);
+    if (*exists)
+    {
+        *modified = stat.modified;
+    }
+    osFreeMem(jsonPath);
+}
+
+static content_index_entry_t *content_index_probe(const char *path, uint32_t hash, bool_t isContent)
+{
+    content_index_entry_t *entry = osAllocMem(sizeof(content_index_entry_t));
+    osMemset(entry, 0x00, sizeof(content_index_entry_t));
+    entry->path = strdup(path);
+    entry->hash = hash;
+    entry->isContent = isContent;
+
+    /* subscribe before reading, so a change while probing is not missed */
+    if (content_index_running)
+    {
+        entry->watched = content_index_watch(path);
+    }
+
+    if (isContent)
+    {
+        load_content_json(path, &entry->config);
+        if (!entry->watched)
+        {
+            content_index_stat_config(path, &entry->configExists, &entry->configModified);
+        }
+    }
+
+    FsFileStat stat;
+    entry->exists = (fsGetFileStat(path, &stat) == NO_ERROR);
+    if (entry->exists)
+    {
+        entry->size = stat.size;
+        entry->modified = stat.modified;
+        content_index_probe_taf(entry);
+    }
+
+    return entry;
+}
+
+/* fallback without change notifications, compares size and timestamps */
+static bool_t content_index_unchanged(content_index_entry_t *entry)
+{
+    FsFileStat stat;
+    bool_t exists = (fsGetFileStat(entry->path, &stat) == NO_ERROR);
+
+    if (exists != entry->exists)
+    {
+        return FALSE;
+    }
+    if (exists && (stat.size != entry->size || compareDateTime(&stat.modified, &entry->modified)))
+    {
+        return FALSE;
+    }
+    if (entry->isContent)
+    {
+        DateTime configModified;
+        content_index_stat_config(entry->path, &exists, &configModified);
+        if (exists != entry->configExists || (exists && compareDateTime(&configModified, &entry->configModified)))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void content_index_copy(const content_index_entry_t *entry, tonie_info_t *tonieInfo)
+{
+    tonieInfo->exists = entry->exists;
+    tonieInfo->valid = entry->valid;
+    tonieInfo->stream = entry->stream;
+    tonieInfo->tafHeader = entry->header;
+    tonieInfo->verify = entry->verify;
+
+    contentJson_t *config = &tonieInfo->contentConfig;
+    config->live = entry->config.live;
+    config->nocloud = entry->config.nocloud;
+    config->source = entry->config.source ? strdup(entry->config.source) : NULL;
+    config->skip_seconds = entry->config.skip_seconds;
+    config->cache = entry->config.cache;
+    config->_stream = entry->config._stream;
+    config->_version = entry->config._version;
+    config->_updated = entry->config._updated;
+}
+
+void content_index_get(const char *contentPath, bool_t isContent, tonie_info_t *tonieInfo)
+{
+    uint32_t hash = content_index_hash(contentPath);
+    uint32_t generation = 0;
+
+    if (content_index_running)
+    {
+        mutex_lock(MUTEX_CONTENT_INDEX);
+        content_index_entry_t *entry = content_index_find(contentPath, hash);
+        if (entry && entry->isContent == isContent && (entry->watched || content_index_unchanged(entry)))
+        {
+            content_index_copy(entry, tonieInfo);
+            mutex_unlock(MUTEX_CONTENT_INDEX);
+            stats_update("content_index_hit", 1);
+            return;
+        }
+        generation = content_index_generation;
+        mutex_unlock(MUTEX_CONTENT_INDEX);
+        stats_update("content_index_miss", 1);
+    }
+
+    content_index_entry_t *entry = content_index_probe(contentPath, hash, isContent);
+    content_index_copy(entry, tonieInfo);
+
+    if (content_index_running)
+    {
+        mutex_lock(MUTEX_CONTENT_INDEX);
+        if (generation == content_index_generation)
+        {
+            content_index_remove(contentPath, hash);
+            if (content_index_count >= CONTENT_INDEX_MAX_ENTRIES)
+            {
+                TRACE_INFO("Content index full, dropping %" PRIuSIZE " entries\r\n", content_index_count);
+                content_index_clear();
+            }
+            entry->next = content_index[hash % CONTENT_INDEX_BUCKETS];
+            content_index[hash % CONTENT_INDEX_BUCKETS] = entry;
+            content_index_count++;
+            entry = NULL;
+        }
+        mutex_unlock(MUTEX_CONTENT_INDEX);
+    }
+
+    if (entry)
+    {
+        content_index_free_entry(entry);
+    }
+}
+
+void content_index_set_verify(const char *path, const FsFileStat *stat, taf_verify_result_t result)
+{
+    if (!content_index_running)
+    {
+        return;
+    }
+
+    mutex_lock(MUTEX_CONTENT_INDEX);
+    content_index_entry_t *entry = content_index_find(path, content_index_hash(path));
+    if (entry && entry->exists && entry->size == stat->size && !compareDateTime(&entry->modified, &stat->modified))
+    {
+        entry->verify = result;
+    }
+    mutex_unlock(MUTEX_CONTENT_INDEX);
+}
+
+void content_index_invalidate(const char *path)
+{
+    if (!content_index_running)
+    {
+        return;
+    }
+
+    char *tafPath = strdup(path);
+    size_t len = osStrlen(tafPath);
+    if (len > 5 && !osStrcmp(&tafPath[len - 5], ".json"))
+    {
+        tafPath[len - 5] = '\0';
+    }
+
+    mutex_lock(MUTEX_CONTENT_INDEX);
+    content_index_remove(tafPath, content_index_hash(tafPath));
+    content_index_generation++;
+    mutex_unlock(MUTEX_CONTENT_INDEX);
+
+    osFreeMem(tafPath);
+}
+
+void content_index_invalidate_dir(const char *dir)
+{
+    if (!content_index_running)
+    {
+        return;
+    }
+
+    size_t len = osStrlen(dir);
+    while (len > 0 && dir[len - 1] == '/')
+    {
+        len--;
+    }
+
+    mutex_lock(MUTEX_CONTENT_INDEX);
+    for (size_t bucket = 0; bucket < CONTENT_INDEX_BUCKETS; bucket++)
+    {
+        content_index_entry_t **prev = &content_index[bucket];
+        while (*prev)
+        {
+            content_index_entry_t *entry = *prev;
+            if (!osStrncmp(entry->path, dir, len) && entry->path[len] == '/')
+            {
+                *prev = entry->next;
+                content_index_free_entry(entry);
+                content_index_count--;
+            }
+            else
+            {
+                prev = &entry->next;
+            }
+        }
+    }
+    content_index_generation++;
+    mutex_unlock(MUTEX_CONTENT_INDEX);
+}
+
+void content_index_init()
+{
+    osMemset(content_index, 0x00, sizeof(content_index));
+    content_index_count = 0;
+    content_index_running = TRUE;
+    if (!fs_watch_available())
+    {
+        TRACE_INFO("No file change notifications, content index validates entries on access\r\n");
+    }
+}
+
+void content_index_deinit()
+{
+    mutex_lock(MUTEX_CONTENT_INDEX);
+    content_index_running = FALSE;
+    content_index_clear();
+    mutex_unlock(MUTEX_CONTENT_INDEX);
+}
@@ -0,0 +1,419 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir_cache.h"
+#include "fs_watch.h"
+#include "handler.h"
+#include "mutex_manager.h"
+#include "server_helpers.h"
+#include "path_ext.h"
+#include "stats.h"
+#include "debug.h"
+#include "os_port.h"
+
+struct dir_cache_listing_s
+{
+    uint32_t refCount;
+    size_t count;
+    /* sorted by name */
+    dir_cache_entry_t *entries;
+};
+
+typedef struct dir_cache_dir_s
+{
+    struct dir_cache_dir_s *next;
+    char *path;
+    /* cleared by change notifications */
+    bool_t valid;
+    bool_t watched;
+    DateTime modified;
+    dir_cache_listing_t *listing;
+} dir_cache_dir_t;
+
+/* most recently used first */
+static dir_cache_dir_t *dir_cache_dirs = NULL;
+static bool_t dir_cache_running = FALSE;
+
+static void dir_cache_listing_free(dir_cache_listing_t *listing)
+{
+    for (size_t pos = 0; pos < listing->count; pos++)
+    {
+        osFreeMem(listing->entries[pos].name);
+    }
+    osFreeMem(listing->entries);
+    osFreeMem(listing);
+}
+
+/* has to be called locked */
+static void dir_cache_listing_unref(dir_cache_listing_t *listing)
+{
+    if (listing && --listing->refCount == 0)
+    {
+        dir_cache_listing_free(listing);
+    }
+}
+
+static void dir_cache_dir_free(dir_cache_dir_t *dir)
+{
+    dir_cache_listing_unref(dir->listing);
+    osFreeMem(dir->path);
+    osFreeMem(dir);
+}
+
+static void dir_cache_fs_event(void *ctx, const char *dir, const char *name, bool_t isDir)
+{
+    size_t len = osStrlen(dir);
+
+    mutex_lock(MUTEX_DIR_CACHE);
+    for (dir_cache_dir_t *cached = dir_cache_dirs; cached; cached = cached->next)
+    {
+        /* the directory itself or, if it vanished, anything below */
+        if (!osStrcmp(cached->path, dir) || (name == NULL && !osStrncmp(cached->path, dir, len) && cached->path[len] == '/'))
+        {
+            cached->valid = FALSE;
+        }
+    }
+    mutex_unlock(MUTEX_DIR_CACHE);
+}
+
+static int dir_cache_compare_name(const void *a, const void *b)
+{
+    return osStrcmp(((const dir_cache_entry_t *)a)->name, ((const dir_cache_entry_t *)b)->name);
+}
+
+/* listings are immutable, no locking needed */
+static const dir_cache_entry_t *dir_cache_find_entry(const dir_cache_listing_t *listing, const char *name)
+{
+    if (!listing)
+    {
+        return NULL;
+    }
+    dir_cache_entry_t key = {.name = (char *)name};
+    return bsearch(&key, listing->entries, listing->count, sizeof(dir_cache_entry_t), &dir_cache_compare_name);
+}
+
+static void dir_cache_describe(const char *path, dir_cache_entry_t *entry, settings_t *settings)
+{
+    entry->desc[0] = '\0';
+    if (entry->isDir)
+    {
+        return;
+    }
+
+    char *filePathAbsolute = custom_asprintf("%s/%s", path, entry->name);
+    pathSafeCanonicalize(filePathAbsolute);
+
+    tonie_info_t tafInfo = getTonieInfo(filePathAbsolute, settings);
+    if (tafInfo.valid)
+    {
+        osSnprintf(entry->desc, sizeof(entry->desc), "TAF:%08X:", tafInfo.tafHeader.audio_id);
+        for (size_t pos = 0; pos < tafInfo.tafHeader.sha1_hash_len; pos++)
+        {
+            char tmp[3];
+            osSprintf(tmp, "%02X", tafInfo.tafHeader.sha1_hash[pos]);
+            osStrcat(entry->desc, tmp);
+        }
+    }
+    freeTonieInfo(&tafInfo);
+    osFreeMem(filePathAbsolute);
+}
+
+/* reads the directory, reusing the descriptions of unchanged entries from the previous listing */
+static dir_cache_listing_t *dir_cache_read(const char *path, const dir_cache_listing_t *previous, settings_t *settings)
+{
+    FsDir *dir = fsOpenDir(path);
+    if (dir == NULL)
+    {
+        return NULL;
+    }
+
+    dir_cache_listing_t *listing = osAllocMem(sizeof(dir_cache_listing_t));
+    listing->refCount = 1;
+    listing->count = 0;
+    size_t size = 64;
+    listing->entries = osAllocMem(size * sizeof(dir_cache_entry_t));
+
+    FsDirEntry dirEntry;
+    while (fsReadDir(dir, &dirEntry) == NO_ERROR)
+    {
+        if (!osStrcmp(dirEntry.name, ".") || !osStrcmp(dirEntry.name, ".."))
+        {
+            continue;
+        }
+        if (listing->count == size)
+        {
+            size *= 2;
+            dir_cache_entry_t *entries = osAllocMem(size * sizeof(dir_cache_entry_t));
+            osMemcpy(entries, listing->entries, listing->count * sizeof(dir_cache_entry_t));
+            osFreeMem(listing->entries);
+            listing->entries = entries;
+        }
+
+        dir_cache_entry_t *entry = &listing->entries[listing->count++];
+        entry->name = strdup(dirEntry.name);
+        entry->size = dirEntry.size;
+        entry->modified = dirEntry.modified;
+        entry->isDir = (dirEntry.attributes & FS_FILE_ATTR_DIRECTORY) != 0;
+
+        const dir_cache_entry_t *old = dir_cache_find_entry(previous, entry->name);
+        if (old && old->isDir == entry->isDir && old->size == entry->size && !compareDateTime(&old->modified, &entry->modified))
+        {
+            osStrcpy(entry->desc, old->desc);
+        }
+        else
+        {
+            dir_cache_describe(path, entry, settings);
+        }
+    }
+    fsCloseDir(dir);
+
+    qsort(listing->entries, listing->count, sizeof(dir_cache_entry_t), &dir_cache_compare_name);
+
+    return listing;
+}
+
+dir_cache_listing_t *dir_cache_get(const char *path, settings_t *settings)
+{
+    char *dirPath = strdup(path);
+    size_t len = osStrlen(dirPath);
+    while (len > 1 && dirPath[len - 1] == '/')
+    {
+        dirPath[--len] = '\0';
+    }
+
+    FsFileStat stat;
+    if (fsGetFileStat(dirPath, &stat) != NO_ERROR)
+    {
+        osFreeMem(dirPath);
+        return NULL;
+    }
+
+    dir_cache_listing_t *previous = NULL;
+    bool_t watched = FALSE;
+
+    if (dir_cache_running)
+    {
+        mutex_lock(MUTEX_DIR_CACHE);
+        dir_cache_dir_t **prev = &dir_cache_dirs;
+        for (dir_cache_dir_t *cached = dir_cache_dirs; cached; prev = &cached->next, cached = cached->next)
+        {
+            if (osStrcmp(cached->path, dirPath))
+            {
+                continue;
+            }
+            /* move to front */
+            *prev = cached->next;
+            cached->next = dir_cache_dirs;
+            dir_cache_dirs = cached;
+
+            if (cached->valid && cached->watched && !compareDateTime(&cached->modified, &stat.modified))
+            {
+                dir_cache_listing_t *listing = cached->listing;
+                listing->refCount++;
+                mutex_unlock(MUTEX_DIR_CACHE);
+                osFreeMem(dirPath);
+                stats_update("dir_cache_hit", 1);
+                return listing;
+            }
+            previous = cached->listing;
+            previous->refCount++;
+            /* changes from now on have to invalidate the listing read below */
+            cached->valid = TRUE;
+            break;
+        }
+        mutex_unlock(MUTEX_DIR_CACHE);
+        stats_update("dir_cache_miss", 1);
+
+        watched = (fs_watch_add_dir(dirPath, &dir_cache_fs_event, NULL) == NO_ERROR);
+    }
+
+    dir_cache_listing_t *listing = dir_cache_read(dirPath, previous, settings);
+
+    if (!dir_cache_running)
+    {
+        osFreeMem(dirPath);
+        return listing;
+    }
+
+    mutex_lock(MUTEX_DIR_CACHE);
+    dir_cache_listing_unref(previous);
+
+    dir_cache_dir_t *cached = NULL;
+    size_t dirs = 0;
+    dir_cache_dir_t **prev = &dir_cache_dirs;
+    while (*prev)
+    {
+        dir_cache_dir_t *entry = *prev;
+        if (!osStrcmp(entry->path, dirPath))
+        {
+            cached = entry;
+        }
+        if (++dirs > DIR_CACHE_DIRS && entry != cached)
+        {
+            *prev = entry->next;
+            dir_cache_dir_free(entry);
+            continue;
+        }
+        prev = &entry->next;
+    }
+
+    if (listing)
+    {
+        if (!cached)
+        {
+            cached = osAllocMem(sizeof(dir_cache_dir_t));
+            osMemset(cached, 0x00, sizeof(dir_cache_dir_t));
+            cached->path = dirPath;
+            cached->valid = TRUE;
+            cached->next = dir_cache_dirs;
+            dir_cache_dirs = cached;
+            dirPath = NULL;
+        }
+        dir_cache_listing_unref(cached->listing);
+        cached->listing = listing;
+        cached->watched = watched;
+        cached->modified = stat.modified;
+        listing->refCount++;
+    }
+    mutex_unlock(MUTEX_DIR_CACHE);
+
+    if (dirPath)
+    {
+        osFreeMem(dirPath);
+    }
+
+    return listing;
+}
+
+void dir_cache_release(dir_cache_listing_t *listing)
+{
+    if (!listing)
+    {
+        return;
+    }
+    if (!dir_cache_running)
+    {
+        dir_cache_listing_free(listing);
+        return;
+    }
+    mutex_lock(MUTEX_DIR_CACHE);
+    dir_cache_listing_unref(listing);
+    mutex_unlock(MUTEX_DIR_CACHE);
+}
+
+size_t dir_cache_count(const dir_cache_listing_t *listing)
+{
+    return listing->count;
+}
+
+/* comparators for the pointer array, directories first, ties are ordered by name */
+#define DIR_CACHE_COMPARE_HEAD()                                      \
+    const dir_cache_entry_t *a = *(const dir_cache_entry_t **)pa; \
+    const dir_cache_entry_t *b = *(const dir_cache_entry_t **)pb; \
+    if (a->isDir != b->isDir)                                     \
+    {                                                             \
+        return a->isDir ? -1 : 1;                                 \
+    }
+
+static int dir_cache_compare_date(const void *pa, const void *pb)
+{
+    DIR_CACHE_COMPARE_HEAD()
+    int result = compareDateTime(&a->modified, &b->modified);
+    return result ? result : osStrcmp(a->name, b->name);
+}
+
+static int dir_cache_compare_size(const void *pa, const void *pb)
+{
+    DIR_CACHE_COMPARE_HEAD()
+    int result = (a->size > b->size) - (a->size < b->size);
+    return result ? result : osStrcmp(a->name, b->name);
+}
+
+static void dir_cache_reverse(const dir_cache_entry_t **sorted, size_t start, size_t end)
+{
+    while (start + 1 < end)
+    {
+        const dir_cache_entry_t *tmp = sorted[start];
+        sorted[start++] = sorted[--end];
+        sorted[end] = tmp;
+    }
+}
+
+const dir_cache_entry_t **dir_cache_sorted(const dir_cache_listing_t *listing, dir_cache_sort_t sort, bool_t descending)
+{
+    const dir_cache_entry_t **sorted = osAllocMem(MAX(listing->count, 1) * sizeof(dir_cache_entry_t *));
+    size_t dirs = 0;
+
+    /* the listing is sorted by name already, a stable partition puts the directories first */
+    for (size_t pos = 0; pos < listing->count; pos++)
+    {
+        if (listing->entries[pos].isDir)
+        {
+            sorted[dirs++] = &listing->entries[pos];
+        }
+    }
+    size_t files = dirs;
+    for (size_t pos = 0; pos < listing->count; pos++)
+    {
+        if (!listing->entries[pos].isDir)
+        {
+            sorted[files++] = &listing->entries[pos];
+        }
+    }
+
+    switch (sort)
+    {
+    case DIR_CACHE_SORT_DATE:
+        qsort(sorted, listing->count, sizeof(dir_cache_entry_t *), &dir_cache_compare_date);
+        break;
+    case DIR_CACHE_SORT_SIZE:
+        qsort(sorted, listing->count, sizeof(dir_cache_entry_t *), &dir_cache_compare_size);
+        break;
+    default:
+        break;
+    }
+
+    if (descending)
+    {
+        dir_cache_reverse(sorted, 0, dirs);
+        dir_cache_reverse(sorted, dirs, listing->count);
+    }
+
+    return sorted;
+}
+
+size_t dir_cache_after(const dir_cache_entry_t **sorted, size_t count, size_t hint, const char *name)
+{
+    if (hint < count && !osStrcmp(sorted[hint]->name, name))
+    {
+        return hint + 1;
+    }
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        if (!osStrcmp(sorted[pos]->name, name))
+        {
+            return pos + 1;
+        }
+    }
+    /* entry vanished, continue at the same position */
+    return MIN(hint + 1, count);
+}
+
+void dir_cache_init()
+{
+    dir_cache_dirs = NULL;
+    dir_cache_running = TRUE;
+}
+
+void dir_cache_deinit()
+{
+    mutex_lock(MUTEX_DIR_CACHE);
+    dir_cache_running = FALSE;
+    while (dir_cache_dirs)
+    {
+        dir_cache_dir_t *dir = dir_cache_dirs;
+        dir_cache_dirs = dir->next;
+        dir_cache_dir_free(dir);
+    }
+    mutex_unlock(MUTEX_DIR_CACHE);
+}
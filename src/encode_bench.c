@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "encode_bench.h"
+#include "toniefile.h"
+#include "audio_decoder.h"
+#include "platform.h"
+#include "version.h"
+#include "cJSON.h"
+#include "fs_port.h"
+#include "debug.h"
+
+typedef enum
+{
+    ENCODE_BENCH_SWEEP,
+    ENCODE_BENCH_CHORD,
+    ENCODE_BENCH_NOISE,
+    ENCODE_BENCH_SILENCE
+} encode_bench_signal_t;
+
+static const struct
+{
+    const char *name;
+    encode_bench_signal_t signal;
+} encode_bench_signals[] = {
+    {"sweep", ENCODE_BENCH_SWEEP},
+    {"chord", ENCODE_BENCH_CHORD},
+    {"noise", ENCODE_BENCH_NOISE},
+    {"silence", ENCODE_BENCH_SILENCE},
+};
+
+/* the same samples on every run, the noise comes from a fixed seed */
+static int16_t *encode_bench_synthesize(encode_bench_signal_t signal, size_t samples)
+{
+    int16_t *pcm = osAllocMem(samples * OPUS_CHANNELS * sizeof(int16_t));
+    uint32_t seed = 0x12345678;
+
+    for (size_t pos = 0; pos < samples; pos++)
+    {
+        float t = (float)pos / OPUS_SAMPLING_RATE;
+        float left = 0;
+        float right = 0;
+
+        switch (signal)
+        {
+        case ENCODE_BENCH_SWEEP:
+            /* the signal of ENCODE_TEST */
+            left = 8192 * sinf(pos / 10.0f * (1 + sinf(pos / 100000.0f)));
+            right = 8192 * sinf(pos / 20.0f * (1 + sinf(pos / 30000.0f)));
+            break;
+        case ENCODE_BENCH_CHORD:
+        {
+            float tremolo = 0.75f + 0.25f * sinf(2 * (float)M_PI * 4 * t);
+            float chord = sinf(2 * (float)M_PI * 220 * t) + sinf(2 * (float)M_PI * 277.18f * t) + sinf(2 * (float)M_PI * 329.63f * t);
+            left = 6000 * tremolo * chord;
+            right = 6000 * tremolo * (chord + 0.5f * sinf(2 * (float)M_PI * 440 * t + 1.0f)) / 1.5f;
+            break;
+        }
+        case ENCODE_BENCH_NOISE:
+            seed = seed * 1664525 + 1013904223;
+            left = (float)(int16_t)(seed >> 16) / 4;
+            seed = seed * 1664525 + 1013904223;
+            right = (float)(int16_t)(seed >> 16) / 4;
+            break;
+        case ENCODE_BENCH_SILENCE:
+            break;
+        }
+        pcm[OPUS_CHANNELS * pos + 0] = (int16_t)left;
+        pcm[OPUS_CHANNELS * pos + 1] = (int16_t)right;
+    }
+
+    return pcm;
+}
+
+static int16_t *encode_bench_decode(const char *source, size_t *samples)
+{
+    ffmpeg_decoder_t *decoder = ffmpeg_decode_audio_start(source);
+    if (!decoder)
+    {
+        return NULL;
+    }
+
+    size_t max_samples = (size_t)ENCODE_BENCH_MAX_SECONDS * OPUS_SAMPLING_RATE;
+    size_t size = (size_t)10 * OPUS_SAMPLING_RATE;
+    int16_t *pcm = osAllocMem(size * OPUS_CHANNELS * sizeof(int16_t));
+    size_t used = 0;
+    error_t error = NO_ERROR;
+
+    while (used < max_samples)
+    {
+        if (used + OPUS_FRAME_SIZE > size)
+        {
+            size_t grown = MIN(2 * size, max_samples + OPUS_FRAME_SIZE);
+            int16_t *buffer = osAllocMem(grown * OPUS_CHANNELS * sizeof(int16_t));
+            osMemcpy(buffer, pcm, used * OPUS_CHANNELS * sizeof(int16_t));
+            osFreeMem(pcm);
+            pcm = buffer;
+            size = grown;
+        }
+
+        size_t read = 0;
+        error = ffmpeg_decode_audio(decoder, &pcm[OPUS_CHANNELS * used], OPUS_FRAME_SIZE * OPUS_CHANNELS, &read);
+        if (error == ERROR_TIMEOUT)
+        {
+            continue;
+        }
+        if (error != NO_ERROR)
+        {
+            break;
+        }
+        used += read / OPUS_CHANNELS;
+    }
+    ffmpeg_decode_audio_end(decoder, error == ERROR_END_OF_STREAM ? NO_ERROR : error);
+
+    if (used == 0 || (error != NO_ERROR && error != ERROR_END_OF_STREAM))
+    {
+        TRACE_ERROR("Could not decode %s, error=%" PRIu16 "\r\n", source, error);
+        osFreeMem(pcm);
+        return NULL;
+    }
+    *samples = MIN(used, max_samples);
+
+    return pcm;
+}
+
+static void encode_bench_add_ms(cJSON *json, const char *name, uint64_t ns)
+{
+    cJSON_AddNumberToObject(json, name, ns / 1000000.0);
+}
+
+/* decodes up to ENCODE_BENCH_MAX_SECONDS without keeping the samples, 0 if the source could not be decoded */
+static uint64_t encode_bench_time_native(const char *source, size_t *samples)
+{
+    audio_decoder_t *decoder = audio_decoder_open(source, 0);
+    if (!decoder)
+    {
+        return 0;
+    }
+
+    size_t max_samples = (size_t)ENCODE_BENCH_MAX_SECONDS * OPUS_SAMPLING_RATE;
+    int16_t pcm[OPUS_FRAME_SIZE * OPUS_CHANNELS];
+    size_t used = 0;
+    error_t error = NO_ERROR;
+
+    uint64_t start = platform_time_ns();
+    while (error == NO_ERROR && used < max_samples)
+    {
+        size_t read = 0;
+        error = audio_decoder_read(decoder, pcm, OPUS_FRAME_SIZE, &read);
+        used += read;
+    }
+    uint64_t ns = platform_time_ns() - start;
+    audio_decoder_close(decoder);
+
+    *samples = MIN(used, max_samples);
+    return (error == NO_ERROR || error == ERROR_END_OF_STREAM) ? ns : 0;
+}
+
+static uint64_t encode_bench_time_ffmpeg(const char *source, size_t *samples)
+{
+    ffmpeg_decoder_t *decoder = ffmpeg_decode_audio_start_process(source, 0);
+    if (!decoder)
+    {
+        return 0;
+    }
+
+    size_t max_samples = (size_t)ENCODE_BENCH_MAX_SECONDS * OPUS_SAMPLING_RATE;
+    int16_t pcm[OPUS_FRAME_SIZE * OPUS_CHANNELS];
+    size_t used = 0;
+    error_t error = NO_ERROR;
+
+    uint64_t start = platform_time_ns();
+    while (used < max_samples)
+    {
+        size_t read = 0;
+        error = ffmpeg_decode_audio(decoder, pcm, OPUS_FRAME_SIZE * OPUS_CHANNELS, &read);
+        if (error == ERROR_TIMEOUT)
+        {
+            continue;
+        }
+        if (error != NO_ERROR)
+        {
+            break;
+        }
+        used += read / OPUS_CHANNELS;
+    }
+    ffmpeg_decode_audio_end(decoder, error == ERROR_END_OF_STREAM ? NO_ERROR : error);
+    uint64_t ns = platform_time_ns() - start;
+
+    *samples = MIN(used, max_samples);
+    return (error == NO_ERROR || error == ERROR_END_OF_STREAM) ? ns : 0;
+}
+
+/* the in process decoder against ffmpeg, for sources both can read */
+static void encode_bench_decoders(cJSON *jsonCase, const char *source)
+{
+    size_t nativeSamples = 0;
+    size_t ffmpegSamples = 0;
+    uint64_t native_ns = encode_bench_time_native(source, &nativeSamples);
+    uint64_t ffmpeg_ns = encode_bench_time_ffmpeg(source, &ffmpegSamples);
+
+    cJSON *jsonDecode = cJSON_AddObjectToObject(jsonCase, "decode");
+    cJSON_AddBoolToObject(jsonDecode, "native", native_ns != 0);
+    if (native_ns)
+    {
+        encode_bench_add_ms(jsonDecode, "native_ms", native_ns);
+        cJSON_AddNumberToObject(jsonDecode, "native_realtime_factor", (double)nativeSamples / OPUS_SAMPLING_RATE * 1e9 / native_ns);
+    }
+    if (ffmpeg_ns)
+    {
+        encode_bench_add_ms(jsonDecode, "ffmpeg_ms", ffmpeg_ns);
+        cJSON_AddNumberToObject(jsonDecode, "ffmpeg_realtime_factor", (double)ffmpegSamples / OPUS_SAMPLING_RATE * 1e9 / ffmpeg_ns);
+    }
+    if (native_ns && ffmpeg_ns)
+    {
+        cJSON_AddNumberToObject(jsonDecode, "speedup", (double)ffmpeg_ns / native_ns);
+    }
+}
+
+static error_t encode_bench_encode(toniefile_t *taf, int16_t *pcm, size_t samples)
+{
+    size_t chunk = FFMPEG_PCM_FRAMES * OPUS_FRAME_SIZE;
+    error_t error = NO_ERROR;
+
+    for (size_t pos = 0; pos < samples && error == NO_ERROR; pos += chunk)
+    {
+        error = toniefile_encode(taf, &pcm[OPUS_CHANNELS * pos], MIN(chunk, samples - pos));
+    }
+    if (toniefile_close(taf) != NO_ERROR && error == NO_ERROR)
+    {
+        error = ERROR_WRITE_FAILED;
+    }
+    return error;
+}
+
+static cJSON *encode_bench_case(const char *name, const char *source, const char *target, int16_t *pcm, size_t samples)
+{
+    double audio_s = (double)samples / OPUS_SAMPLING_RATE;
+    cJSON *jsonCase = cJSON_CreateObject();
+    cJSON_AddStringToObject(jsonCase, "name", name);
+    cJSON_AddStringToObject(jsonCase, "source", source);
+    cJSON_AddNumberToObject(jsonCase, "audio_s", audio_s);
+
+    /* serial with all stages measured */
+    toniefile_profile_t profile;
+    osMemset(&profile, 0x00, sizeof(profile));
+    toniefile_t *taf = toniefile_create_serial(target, 0x12345678);
+    if (!taf)
+    {
+        cJSON_AddStringToObject(jsonCase, "error", "could not create TAF");
+        return jsonCase;
+    }
+    toniefile_profile(taf, &profile);
+    uint64_t start = platform_time_ns();
+    error_t error = encode_bench_encode(taf, pcm, samples);
+    uint64_t wall_ns = platform_time_ns() - start;
+
+    uint32_t size = 0;
+    fsGetFileSize(target, &size);
+    fsDeleteFile(target);
+    if (error != NO_ERROR)
+    {
+        cJSON_AddStringToObject(jsonCase, "error", "encoding failed");
+        return jsonCase;
+    }
+
+    uint64_t stages_ns = profile.opus_ns + profile.ogg_ns + profile.sha1_ns + profile.io_ns;
+    uint32_t blocks = (size > TONIEFILE_FRAME_SIZE) ? size / TONIEFILE_FRAME_SIZE - 1 : 0;
+    cJSON *jsonSerial = cJSON_AddObjectToObject(jsonCase, "serial");
+    encode_bench_add_ms(jsonSerial, "wall_ms", wall_ns);
+    cJSON_AddNumberToObject(jsonSerial, "realtime_factor", wall_ns ? audio_s * 1e9 / wall_ns : 0);
+    encode_bench_add_ms(jsonSerial, "opus_ms", profile.opus_ns);
+    encode_bench_add_ms(jsonSerial, "ogg_ms", profile.ogg_ns);
+    encode_bench_add_ms(jsonSerial, "sha1_ms", profile.sha1_ns);
+    encode_bench_add_ms(jsonSerial, "io_ms", profile.io_ns);
+    encode_bench_add_ms(jsonSerial, "other_ms", wall_ns > stages_ns ? wall_ns - stages_ns : 0);
+    cJSON_AddNumberToObject(jsonSerial, "frames", (double)profile.frames);
+    cJSON_AddNumberToObject(jsonSerial, "padded_frames", (double)profile.padded_frames);
+    cJSON_AddNumberToObject(jsonSerial, "filled_frames", (double)profile.filled_frames);
+    cJSON_AddNumberToObject(jsonSerial, "pad_bytes", (double)profile.pad_bytes);
+    cJSON_AddNumberToObject(jsonSerial, "pad_bytes_per_block", blocks ? (double)profile.pad_bytes / blocks : 0);
+    cJSON_AddNumberToObject(jsonSerial, "blocks", blocks);
+    cJSON_AddNumberToObject(jsonSerial, "bytes", size);
+    cJSON_AddNumberToObject(jsonSerial, "bitrate_kbps", audio_s > 0 ? (double)blocks * TONIEFILE_FRAME_SIZE * 8 / audio_s / 1000 : 0);
+
+    /* the worker pool, only the wall clock time */
+    taf = toniefile_create(target, 0x12345678);
+    if (taf)
+    {
+        start = platform_time_ns();
+        error = encode_bench_encode(taf, pcm, samples);
+        wall_ns = platform_time_ns() - start;
+        fsDeleteFile(target);
+
+        if (error == NO_ERROR)
+        {
+            cJSON *jsonParallel = cJSON_AddObjectToObject(jsonCase, "parallel");
+            encode_bench_add_ms(jsonParallel, "wall_ms", wall_ns);
+            cJSON_AddNumberToObject(jsonParallel, "realtime_factor", wall_ns ? audio_s * 1e9 / wall_ns : 0);
+        }
+    }
+
+    TRACE_INFO("Benchmarked %s, %.1f s of audio in %.1f ms\r\n", name, audio_s, wall_ns / 1000000.0);
+    return jsonCase;
+}
+
+error_t encode_bench_run(const char *output, const char *target, const char *const *sources, size_t count)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "version", BUILD_GIT_SHORT_SHA BUILD_GIT_DIRTY);
+    cJSON_AddStringToObject(json, "quality", toniefile_quality_name(TONIEFILE_QUALITY_DEFAULT));
+    cJSON_AddNumberToObject(json, "frame_size", OPUS_FRAME_SIZE);
+    cJSON_AddNumberToObject(json, "cpus", platform_get_cpu_count());
+    cJSON *jsonCases = cJSON_AddArrayToObject(json, "cases");
+
+    size_t samples = (size_t)ENCODE_BENCH_SECONDS * OPUS_SAMPLING_RATE;
+    for (size_t pos = 0; pos < sizeof(encode_bench_signals) / sizeof(encode_bench_signals[0]); pos++)
+    {
+        int16_t *pcm = encode_bench_synthesize(encode_bench_signals[pos].signal, samples);
+        cJSON_AddItemToArray(jsonCases, encode_bench_case(encode_bench_signals[pos].name, "synthetic", target, pcm, samples));
+        osFreeMem(pcm);
+    }
+
+    error_t error = NO_ERROR;
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        size_t fileSamples = 0;
+        int16_t *pcm = encode_bench_decode(sources[pos], &fileSamples);
+        if (!pcm)
+        {
+            error = ERROR_FILE_NOT_FOUND;
+            continue;
+        }
+        const char *name = osStrrchr(sources[pos], '/');
+        cJSON *jsonCase = encode_bench_case(name ? name + 1 : sources[pos], sources[pos], target, pcm, fileSamples);
+        osFreeMem(pcm);
+        encode_bench_decoders(jsonCase, sources[pos]);
+        cJSON_AddItemToArray(jsonCases, jsonCase);
+    }
+
+    char *jsonString = cJSON_Print(json);
+    cJSON_Delete(json);
+
+    if (!osStrcmp(output, "-"))
+    {
+        printf("%s\n", jsonString);
+    }
+    else
+    {
+        FsFile *file = fsOpenFile(output, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+        if (!file || fsWriteFile(file, jsonString, osStrlen(jsonString)) != NO_ERROR)
+        {
+            TRACE_ERROR("Could not write %s\r\n", output);
+            error = ERROR_WRITE_FAILED;
+        }
+        if (file)
+        {
+            fsCloseFile(file);
+        }
+    }
+    osFreeMem(jsonString);
+
+    return error;
+}
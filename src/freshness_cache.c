@@ -0,0 +1,315 @@
+#include <time.h>
+#include <string.h>
+
+#include "freshness_cache.h"
+#include "cloud_request.h"
+#include "settings.h"
+#include "mutex_manager.h"
+#include "stats.h"
+#include "debug.h"
+#include "os_port.h"
+
+typedef struct
+{
+    bool_t valid;
+    bool_t revalidating;
+    uint64_t key;
+    time_t updated;
+    uint8_t *data;
+    size_t dataLen;
+} freshness_cache_entry_t;
+
+typedef struct
+{
+    /* has to be the first member, cloud_request() casts the context to cbr_ctx_t */
+    cbr_ctx_t cbr_ctx;
+    uint_t statusCode;
+    uint8_t *buffer;
+    size_t bufferLen;
+    size_t bufferSize;
+    bool_t complete;
+} freshness_cache_ctx_t;
+
+typedef struct
+{
+    uint8_t overlay;
+    uint64_t key;
+    uint8_t *data;
+    size_t dataLen;
+} freshness_cache_task_t;
+
+static freshness_cache_entry_t freshness_cache[MAX_OVERLAYS];
+/* revalidation tasks still running, no new ones are started once stopping is set */
+static size_t freshness_cache_tasks = 0;
+static bool_t freshness_cache_stopping = FALSE;
+static OsEvent freshness_cache_idle;
+
+static uint64_t freshness_cache_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t freshness_cache_key(const TonieFreshnessCheckRequest *freshReq)
+{
+    uint64_t key = freshness_cache_mix(freshReq->n_tonie_infos);
+
+    /* sum of the tonie hashes, so the order the box sends them in does not matter */
+    for (size_t pos = 0; pos < freshReq->n_tonie_infos; pos++)
+    {
+        const TonieFCInfo *info = freshReq->tonie_infos[pos];
+        key += freshness_cache_mix(info->uid ^ freshness_cache_mix(info->audio_id));
+    }
+    return key;
+}
+
+void freshness_cache_init()
+{
+    osMemset(freshness_cache, 0x00, sizeof(freshness_cache));
+    freshness_cache_tasks = 0;
+    freshness_cache_stopping = FALSE;
+    osCreateEvent(&freshness_cache_idle);
+}
+
+void freshness_cache_deinit()
+{
+    mutex_lock(MUTEX_FRESHNESS_CACHE);
+    freshness_cache_stopping = TRUE;
+    size_t tasks = freshness_cache_tasks;
+    mutex_unlock(MUTEX_FRESHNESS_CACHE);
+
+    /* the revalidations store their answer in the entries */
+    if (tasks > 0 && !osWaitForEvent(&freshness_cache_idle, FRESHNESS_CACHE_STOP_TIMEOUT_MS))
+    {
+        TRACE_WARNING("Freshness check revalidation did not stop in time\r\n");
+        return;
+    }
+    osDeleteEvent(&freshness_cache_idle);
+
+    mutex_lock(MUTEX_FRESHNESS_CACHE);
+    for (size_t pos = 0; pos < MAX_OVERLAYS; pos++)
+    {
+        freshness_cache_entry_t *entry = &freshness_cache[pos];
+        if (entry->data)
+        {
+            osFreeMem(entry->data);
+        }
+        entry->data = NULL;
+        entry->valid = FALSE;
+    }
+    mutex_unlock(MUTEX_FRESHNESS_CACHE);
+}
+
+static freshness_cache_entry_t *freshness_cache_entry(uint8_t overlay)
+{
+    if (overlay >= MAX_OVERLAYS)
+    {
+        return NULL;
+    }
+    return &freshness_cache[overlay];
+}
+
+TonieFreshnessCheckResponse *freshness_cache_get(client_ctx_t *client_ctx, uint64_t key)
+{
+    settings_t *settings = client_ctx->settings;
+    freshness_cache_entry_t *entry = freshness_cache_entry(settings->internal.overlayNumber);
+    TonieFreshnessCheckResponse *freshResp = NULL;
+
+    if (!entry || settings->cloud.freshnessCacheMaxAge == 0)
+    {
+        return NULL;
+    }
+
+    mutex_lock(MUTEX_FRESHNESS_CACHE);
+    if (entry->valid && entry->key == key && time(NULL) <= entry->updated + (time_t)settings->cloud.freshnessCacheMaxAge)
+    {
+        freshResp = tonie_freshness_check_response__unpack(NULL, entry->dataLen, entry->data);
+    }
+    mutex_unlock(MUTEX_FRESHNESS_CACHE);
+
+    stats_update(freshResp ? "freshness_cache_hit" : "freshness_cache_miss", 1);
+
+    return freshResp;
+}
+
+static void cbrFreshnessCacheResponse(void *src_ctx, HttpClientContext *cloud_ctx)
+{
+    freshness_cache_ctx_t *ctx = (freshness_cache_ctx_t *)src_ctx;
+
+    ctx->statusCode = cloud_ctx->statusCode;
+    ctx->cbr_ctx.status = PROX_STATUS_CONN;
+}
+
+static void cbrFreshnessCacheBody(void *src_ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error)
+{
+    freshness_cache_ctx_t *ctx = (freshness_cache_ctx_t *)src_ctx;
+
+    if (ctx->statusCode != 200)
+    {
+        return;
+    }
+
+    if (length > 0)
+    {
+        if (ctx->bufferLen + length > FRESHNESS_CACHE_BODY_MAX)
+        {
+            TRACE_ERROR("Freshness check response exceeds %u bytes\r\n", FRESHNESS_CACHE_BODY_MAX);
+            ctx->statusCode = 0;
+            return;
+        }
+        if (ctx->bufferLen + length > ctx->bufferSize)
+        {
+            size_t newSize = MAX(ctx->bufferSize * 2, ctx->bufferLen + length);
+            uint8_t *newBuffer = osAllocMem(newSize);
+            if (ctx->buffer)
+            {
+                osMemcpy(newBuffer, ctx->buffer, ctx->bufferLen);
+                osFreeMem(ctx->buffer);
+            }
+            ctx->buffer = newBuffer;
+            ctx->bufferSize = newSize;
+        }
+        osMemcpy(&ctx->buffer[ctx->bufferLen], payload, length);
+        ctx->bufferLen += length;
+    }
+    if (error == ERROR_END_OF_STREAM)
+    {
+        ctx->complete = TRUE;
+    }
+    ctx->cbr_ctx.status = PROX_STATUS_BODY;
+}
+
+TonieFreshnessCheckResponse *freshness_cache_fetch(client_ctx_t *client_ctx, uint64_t key, const uint8_t *data, size_t dataLen)
+{
+    freshness_cache_ctx_t ctx;
+    osMemset(&ctx, 0x00, sizeof(ctx));
+    ctx.cbr_ctx.uri = "/v1/freshness-check";
+    ctx.cbr_ctx.api = V1_FRESHNESS_CHECK;
+    ctx.cbr_ctx.status = PROX_STATUS_IDLE;
+    ctx.cbr_ctx.client_ctx = client_ctx;
+
+    req_cbr_t cbr = {
+        .ctx = &ctx,
+        .response = &cbrFreshnessCacheResponse,
+        .body = &cbrFreshnessCacheBody};
+
+    cloud_request_post(NULL, 0, "/v1/freshness-check", NULL, data, dataLen, NULL, &cbr);
+
+    TonieFreshnessCheckResponse *freshResp = NULL;
+    if (ctx.complete && ctx.statusCode == 200)
+    {
+        freshResp = tonie_freshness_check_response__unpack(NULL, ctx.bufferLen, ctx.buffer);
+    }
+
+    if (!freshResp)
+    {
+        TRACE_WARNING("No valid freshness check response from cloud (HTTP %u)\r\n", ctx.statusCode);
+        if (ctx.buffer)
+        {
+            osFreeMem(ctx.buffer);
+        }
+        return NULL;
+    }
+
+    freshness_cache_entry_t *entry = freshness_cache_entry(client_ctx->settings->internal.overlayNumber);
+    if (entry)
+    {
+        mutex_lock(MUTEX_FRESHNESS_CACHE);
+        if (entry->data)
+        {
+            osFreeMem(entry->data);
+        }
+        entry->data = ctx.buffer;
+        entry->dataLen = ctx.bufferLen;
+        entry->key = key;
+        entry->updated = time(NULL);
+        entry->valid = TRUE;
+        mutex_unlock(MUTEX_FRESHNESS_CACHE);
+    }
+    else
+    {
+        osFreeMem(ctx.buffer);
+    }
+
+    return freshResp;
+}
+
+/* called with the mutex held */
+static void freshness_cache_task_done(freshness_cache_entry_t *entry)
+{
+    entry->revalidating = FALSE;
+    if (--freshness_cache_tasks == 0)
+    {
+        osSetEvent(&freshness_cache_idle);
+    }
+}
+
+static void freshness_cache_task(void *param)
+{
+    freshness_cache_task_t *task = (freshness_cache_task_t *)param;
+
+    client_ctx_t client_ctx;
+    osMemset(&client_ctx, 0x00, sizeof(client_ctx));
+    client_ctx.settings = get_settings_id(task->overlay);
+
+    TonieFreshnessCheckResponse *freshResp = freshness_cache_fetch(&client_ctx, task->key, task->data, task->dataLen);
+    if (freshResp)
+    {
+        TRACE_INFO("Revalidated freshness check of overlay %" PRIu8 ", %" PRIuSIZE " tonies marked by cloud\r\n", task->overlay, freshResp->n_tonie_marked);
+        tonie_freshness_check_response__free_unpacked(freshResp, NULL);
+    }
+
+    mutex_lock(MUTEX_FRESHNESS_CACHE);
+    freshness_cache_task_done(&freshness_cache[task->overlay]);
+    mutex_unlock(MUTEX_FRESHNESS_CACHE);
+
+    osFreeMem(task->data);
+    osFreeMem(task);
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void freshness_cache_revalidate(client_ctx_t *client_ctx, uint64_t key, const uint8_t *data, size_t dataLen)
+{
+    uint8_t overlay = client_ctx->settings->internal.overlayNumber;
+    freshness_cache_entry_t *entry = freshness_cache_entry(overlay);
+
+    if (!entry)
+    {
+        return;
+    }
+
+    mutex_lock(MUTEX_FRESHNESS_CACHE);
+    if (freshness_cache_stopping || entry->revalidating || (entry->valid && entry->key == key && time(NULL) < entry->updated + FRESHNESS_CACHE_REVALIDATE_MIN_S))
+    {
+        mutex_unlock(MUTEX_FRESHNESS_CACHE);
+        return;
+    }
+    entry->revalidating = TRUE;
+    if (freshness_cache_tasks++ == 0)
+    {
+        /* a signal left from the last task that finished must not satisfy freshness_cache_deinit */
+        osResetEvent(&freshness_cache_idle);
+    }
+    mutex_unlock(MUTEX_FRESHNESS_CACHE);
+
+    freshness_cache_task_t *task = osAllocMem(sizeof(freshness_cache_task_t));
+    task->overlay = overlay;
+    task->key = key;
+    task->dataLen = dataLen;
+    task->data = osAllocMem(dataLen > 0 ? dataLen : 1);
+    osMemcpy(task->data, data, dataLen);
+
+    if (osCreateTask("FreshnessCheck", &freshness_cache_task, task, 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start freshness check revalidation\r\n");
+        mutex_lock(MUTEX_FRESHNESS_CACHE);
+        freshness_cache_task_done(entry);
+        mutex_unlock(MUTEX_FRESHNESS_CACHE);
+        osFreeMem(task->data);
+        osFreeMem(task);
+    }
+}
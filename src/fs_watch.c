@@ -0,0 +1,586 @@
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include "fs_watch.h"
+#include "mutex_manager.h"
+#include "settings.h"
+#include "debug.h"
+#include "os_port.h"
+
+#define FS_WATCH_STOP_TIMEOUT_MS 2000
+#define FS_WATCH_MAX_DISPATCH 16
+
+typedef struct fs_watch_entry_s
+{
+    struct fs_watch_entry_s *next;
+    int wd;
+    char *dir;
+    fs_watch_cbr_t cbr;
+    void *ctx;
+} fs_watch_entry_t;
+
+typedef struct
+{
+    bool_t exists;
+    uint32_t size;
+    DateTime modified;
+} fs_watch_state_t;
+
+typedef struct fs_watch_file_s
+{
+    struct fs_watch_file_s *next;
+    char *path;
+    char *dir;
+    char *name;
+    fs_watch_file_cbr_t cbr;
+    void *ctx;
+    /* the directory is watched, otherwise the file is checked every FS_WATCH_FALLBACK_MS */
+    bool_t watched;
+    bool_t pending;
+    systime_t due;
+    fs_watch_state_t state;
+} fs_watch_file_t;
+
+typedef struct
+{
+    fs_watch_cbr_t cbr;
+    void *ctx;
+    char *dir;
+} fs_watch_dispatch_t;
+
+typedef struct
+{
+    fs_watch_file_cbr_t cbr;
+    void *ctx;
+    char *path;
+} fs_watch_file_dispatch_t;
+
+static fs_watch_entry_t *fs_watch_entries = NULL;
+static fs_watch_file_t *fs_watch_files = NULL;
+static systime_t fs_watch_last_poll = 0;
+static bool_t fs_watch_running = FALSE;
+/* inotify is available, the thread only polls the files otherwise */
+static bool_t fs_watch_notify = FALSE;
+static OsEvent fs_watch_stopped;
+/* wakes the thread when it is not blocked on inotify */
+static OsEvent fs_watch_wakeup;
+
+#ifdef __linux__
+static int fs_watch_fd = -1;
+/* polled beside the inotify descriptor to wake the thread */
+static int fs_watch_wake_fd = -1;
+
+/* collects the callbacks of a watch descriptor (or of all watches if wd < 0), has to be called locked */
+static size_t fs_watch_collect(int wd, fs_watch_dispatch_t *dispatch)
+{
+    size_t count = 0;
+
+    for (fs_watch_entry_t *entry = fs_watch_entries; entry && count < FS_WATCH_MAX_DISPATCH; entry = entry->next)
+    {
+        if (wd < 0 || entry->wd == wd)
+        {
+            dispatch[count].cbr = entry->cbr;
+            dispatch[count].ctx = entry->ctx;
+            dispatch[count].dir = strdup(entry->dir);
+            count++;
+        }
+    }
+    return count;
+}
+
+static void fs_watch_remove_wd(int wd)
+{
+    fs_watch_entry_t **prev = &fs_watch_entries;
+
+    while (*prev)
+    {
+        fs_watch_entry_t *entry = *prev;
+        if (entry->wd == wd)
+        {
+            *prev = entry->next;
+            osFreeMem(entry->dir);
+            osFreeMem(entry);
+        }
+        else
+        {
+            prev = &entry->next;
+        }
+    }
+}
+
+static void fs_watch_handle_event(const struct inotify_event *event)
+{
+    fs_watch_dispatch_t dispatch[FS_WATCH_MAX_DISPATCH];
+    const char *name = (event->len > 0) ? event->name : NULL;
+    bool_t isDir = (event->mask & IN_ISDIR) != 0;
+
+    mutex_lock(MUTEX_FS_WATCH);
+    size_t count = fs_watch_collect((event->mask & IN_Q_OVERFLOW) ? -1 : event->wd, dispatch);
+    if (event->mask & IN_IGNORED)
+    {
+        fs_watch_remove_wd(event->wd);
+    }
+    mutex_unlock(MUTEX_FS_WATCH);
+
+    if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+    {
+        name = NULL;
+        isDir = TRUE;
+    }
+
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        dispatch[pos].cbr(dispatch[pos].ctx, dispatch[pos].dir, name, isDir);
+        osFreeMem(dispatch[pos].dir);
+    }
+}
+
+static void fs_watch_read_events()
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t length = read(fs_watch_fd, buffer, sizeof(buffer));
+    if (length <= 0)
+    {
+        return;
+    }
+
+    for (char *ptr = buffer; ptr < buffer + length;)
+    {
+        const struct inotify_event *event = (const struct inotify_event *)ptr;
+        fs_watch_handle_event(event);
+        ptr += sizeof(struct inotify_event) + event->len;
+    }
+}
+#endif
+
+/* has to be called locked */
+static error_t fs_watch_add_dir_locked(const char *dir, fs_watch_cbr_t cbr, void *ctx)
+{
+#ifdef __linux__
+    if (!fs_watch_running || !fs_watch_notify)
+    {
+        return ERROR_NOT_READY;
+    }
+
+    for (fs_watch_entry_t *entry = fs_watch_entries; entry; entry = entry->next)
+    {
+        if (entry->cbr == cbr && entry->ctx == ctx && !osStrcmp(entry->dir, dir))
+        {
+            return NO_ERROR;
+        }
+    }
+
+    int wd = inotify_add_watch(fs_watch_fd, dir, IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd < 0)
+    {
+        if (errno == ENOSPC)
+        {
+            TRACE_WARNING("inotify watch limit reached, not watching %s\r\n", dir);
+        }
+        return (errno == ENOENT || errno == ENOTDIR) ? ERROR_DIRECTORY_NOT_FOUND : ERROR_OUT_OF_RESOURCES;
+    }
+
+    fs_watch_entry_t *entry = osAllocMem(sizeof(fs_watch_entry_t));
+    entry->wd = wd;
+    entry->dir = strdup(dir);
+    entry->cbr = cbr;
+    entry->ctx = ctx;
+    entry->next = fs_watch_entries;
+    fs_watch_entries = entry;
+
+    return NO_ERROR;
+#else
+    return ERROR_NOT_IMPLEMENTED;
+#endif
+}
+
+static void fs_watch_get_state(const char *path, fs_watch_state_t *state)
+{
+    FsFileStat stat;
+
+    osMemset(state, 0x00, sizeof(fs_watch_state_t));
+    if (fsGetFileStat(path, &stat) == NO_ERROR)
+    {
+        state->exists = TRUE;
+        state->size = stat.size;
+        state->modified = stat.modified;
+    }
+}
+
+/* remaining time until a point in time, 0 if it passed already */
+static systime_t fs_watch_remaining(systime_t due, systime_t now)
+{
+    return ((int32_t)(due - now) > 0) ? due - now : 0;
+}
+
+/* called for the directories of the watched files */
+static void fs_watch_file_event(void *ctx, const char *dir, const char *name, bool_t isDir)
+{
+    systime_t due = osGetSystemTime() + FS_WATCH_DEBOUNCE_MS;
+
+    mutex_lock(MUTEX_FS_WATCH);
+    for (fs_watch_file_t *file = fs_watch_files; file; file = file->next)
+    {
+        if (osStrcmp(file->dir, dir))
+        {
+            continue;
+        }
+        if (name == NULL)
+        {
+            /* the directory is gone or events were lost, the poll takes over until it can be watched again */
+            file->watched = FALSE;
+        }
+        else if (osStrcmp(file->name, name))
+        {
+            continue;
+        }
+        file->pending = TRUE;
+        file->due = due;
+    }
+    mutex_unlock(MUTEX_FS_WATCH);
+}
+
+/* checks the files without notifications and retries watching their directories */
+static void fs_watch_poll_files()
+{
+    systime_t now = osGetSystemTime();
+
+    mutex_lock(MUTEX_FS_WATCH);
+    if (fs_watch_remaining(fs_watch_last_poll + FS_WATCH_FALLBACK_MS, now) > 0)
+    {
+        mutex_unlock(MUTEX_FS_WATCH);
+        return;
+    }
+    fs_watch_last_poll = now;
+
+    for (fs_watch_file_t *file = fs_watch_files; file; file = file->next)
+    {
+        if (file->watched)
+        {
+            continue;
+        }
+        file->watched = (fs_watch_add_dir_locked(file->dir, &fs_watch_file_event, NULL) == NO_ERROR);
+
+        fs_watch_state_t state;
+        fs_watch_get_state(file->path, &state);
+        if (osMemcmp(&state, &file->state, sizeof(fs_watch_state_t)))
+        {
+            file->state = state;
+            file->pending = TRUE;
+            file->due = now + FS_WATCH_DEBOUNCE_MS;
+        }
+    }
+    mutex_unlock(MUTEX_FS_WATCH);
+}
+
+static void fs_watch_dispatch_files()
+{
+    fs_watch_file_dispatch_t dispatch[FS_WATCH_MAX_DISPATCH];
+    size_t count = 0;
+    systime_t now = osGetSystemTime();
+
+    mutex_lock(MUTEX_FS_WATCH);
+    for (fs_watch_file_t *file = fs_watch_files; file && count < FS_WATCH_MAX_DISPATCH; file = file->next)
+    {
+        if (!file->pending || fs_watch_remaining(file->due, now) > 0)
+        {
+            continue;
+        }
+        file->pending = FALSE;
+        fs_watch_get_state(file->path, &file->state);
+        dispatch[count].cbr = file->cbr;
+        dispatch[count].ctx = file->ctx;
+        dispatch[count].path = strdup(file->path);
+        count++;
+    }
+    mutex_unlock(MUTEX_FS_WATCH);
+
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        dispatch[pos].cbr(dispatch[pos].ctx, dispatch[pos].path);
+        osFreeMem(dispatch[pos].path);
+    }
+}
+
+/* time until the next pending file is due or the next poll, INFINITE_DELAY if there is nothing to wait for */
+static systime_t fs_watch_timeout()
+{
+    systime_t now = osGetSystemTime();
+    systime_t timeout = INFINITE_DELAY;
+
+    mutex_lock(MUTEX_FS_WATCH);
+    for (fs_watch_file_t *file = fs_watch_files; file; file = file->next)
+    {
+        systime_t remaining = timeout;
+        if (file->pending)
+        {
+            remaining = fs_watch_remaining(file->due, now);
+        }
+        else if (!file->watched)
+        {
+            remaining = fs_watch_remaining(fs_watch_last_poll + FS_WATCH_FALLBACK_MS, now);
+        }
+        if (remaining < timeout)
+        {
+            timeout = remaining;
+        }
+    }
+    mutex_unlock(MUTEX_FS_WATCH);
+
+    return timeout;
+}
+
+static void fs_watch_thread(void *param)
+{
+    setting_handle_t exitSetting = settings_handle("internal.exit");
+
+    while (!settings_get_bool_handle(exitSetting) && fs_watch_running)
+    {
+        systime_t timeout = fs_watch_timeout();
+#ifdef __linux__
+        if (fs_watch_notify)
+        {
+            struct pollfd pfd[2] = {{.fd = fs_watch_fd, .events = POLLIN}, {.fd = fs_watch_wake_fd, .events = POLLIN}};
+            if (poll(pfd, 2, (timeout == INFINITE_DELAY) ? -1 : (int)timeout) > 0)
+            {
+                if (pfd[0].revents & POLLIN)
+                {
+                    fs_watch_read_events();
+                }
+                if (pfd[1].revents & POLLIN)
+                {
+                    uint64_t count;
+                    if (read(fs_watch_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    {
+                        TRACE_WARNING("Failed to read the wakeup event (errno %d)\r\n", errno);
+                    }
+                }
+            }
+        }
+        else
+        {
+            osWaitForEvent(&fs_watch_wakeup, timeout);
+        }
+#else
+        osWaitForEvent(&fs_watch_wakeup, timeout);
+#endif
+        fs_watch_poll_files();
+        fs_watch_dispatch_files();
+    }
+
+    osSetEvent(&fs_watch_stopped);
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+/* makes the thread recalculate its timeout or notice it has to stop */
+static void fs_watch_wake()
+{
+#ifdef __linux__
+    if (fs_watch_notify)
+    {
+        uint64_t count = 1;
+        if (write(fs_watch_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        {
+            TRACE_WARNING("Failed to wake the file system watcher (errno %d)\r\n", errno);
+        }
+        return;
+    }
+#endif
+    osSetEvent(&fs_watch_wakeup);
+}
+
+static void fs_watch_free_file(fs_watch_file_t *file)
+{
+    osFreeMem(file->path);
+    osFreeMem(file->dir);
+    osFreeMem(file->name);
+    osFreeMem(file);
+}
+
+void fs_watch_init()
+{
+#ifdef __linux__
+    fs_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fs_watch_fd < 0)
+    {
+        TRACE_WARNING("inotify not available (errno %d), falling back to polling file states\r\n", errno);
+    }
+    else
+    {
+        fs_watch_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fs_watch_wake_fd < 0)
+        {
+            TRACE_WARNING("eventfd not available (errno %d), falling back to polling file states\r\n", errno);
+            close(fs_watch_fd);
+            fs_watch_fd = -1;
+        }
+    }
+    fs_watch_notify = (fs_watch_fd >= 0);
+#endif
+
+    osCreateEvent(&fs_watch_stopped);
+    osCreateEvent(&fs_watch_wakeup);
+    fs_watch_running = TRUE;
+    if (osCreateTask("FsWatch", &fs_watch_thread, NULL, 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start file system watcher\r\n");
+        fs_watch_running = FALSE;
+        fs_watch_notify = FALSE;
+        osDeleteEvent(&fs_watch_stopped);
+        osDeleteEvent(&fs_watch_wakeup);
+#ifdef __linux__
+        if (fs_watch_fd >= 0)
+        {
+            close(fs_watch_fd);
+            close(fs_watch_wake_fd);
+            fs_watch_fd = -1;
+            fs_watch_wake_fd = -1;
+        }
+#endif
+    }
+}
+
+void fs_watch_deinit()
+{
+    if (!fs_watch_running)
+    {
+        return;
+    }
+
+    mutex_lock(MUTEX_FS_WATCH);
+    fs_watch_running = FALSE;
+    mutex_unlock(MUTEX_FS_WATCH);
+
+    fs_watch_wake();
+    if (!osWaitForEvent(&fs_watch_stopped, FS_WATCH_STOP_TIMEOUT_MS))
+    {
+        TRACE_WARNING("File system watcher did not stop in time\r\n");
+    }
+    osDeleteEvent(&fs_watch_stopped);
+    osDeleteEvent(&fs_watch_wakeup);
+
+    mutex_lock(MUTEX_FS_WATCH);
+    while (fs_watch_entries)
+    {
+        fs_watch_entry_t *entry = fs_watch_entries;
+        fs_watch_entries = entry->next;
+        osFreeMem(entry->dir);
+        osFreeMem(entry);
+    }
+    while (fs_watch_files)
+    {
+        fs_watch_file_t *file = fs_watch_files;
+        fs_watch_files = file->next;
+        fs_watch_free_file(file);
+    }
+#ifdef __linux__
+    if (fs_watch_fd >= 0)
+    {
+        close(fs_watch_fd);
+        close(fs_watch_wake_fd);
+        fs_watch_fd = -1;
+        fs_watch_wake_fd = -1;
+    }
+#endif
+    fs_watch_notify = FALSE;
+    mutex_unlock(MUTEX_FS_WATCH);
+}
+
+bool_t fs_watch_available()
+{
+    return fs_watch_running && fs_watch_notify;
+}
+
+error_t fs_watch_add_dir(const char *dir, fs_watch_cbr_t cbr, void *ctx)
+{
+    mutex_lock(MUTEX_FS_WATCH);
+    error_t error = fs_watch_add_dir_locked(dir, cbr, ctx);
+    mutex_unlock(MUTEX_FS_WATCH);
+
+    return error;
+}
+
+error_t fs_watch_add_file(const char *path, fs_watch_file_cbr_t cbr, void *ctx)
+{
+    mutex_lock(MUTEX_FS_WATCH);
+    if (!fs_watch_running)
+    {
+        mutex_unlock(MUTEX_FS_WATCH);
+        return ERROR_NOT_READY;
+    }
+
+    for (fs_watch_file_t *file = fs_watch_files; file; file = file->next)
+    {
+        if (file->cbr == cbr && file->ctx == ctx && !osStrcmp(file->path, path))
+        {
+            mutex_unlock(MUTEX_FS_WATCH);
+            return NO_ERROR;
+        }
+    }
+
+    fs_watch_file_t *file = osAllocMem(sizeof(fs_watch_file_t));
+    osMemset(file, 0x00, sizeof(fs_watch_file_t));
+    file->path = strdup(path);
+    file->cbr = cbr;
+    file->ctx = ctx;
+
+    /* the parent directory is watched, trailing slashes do not name another entry */
+    char *dir = strdup(path);
+    size_t length = osStrlen(dir);
+    while (length > 1 && dir[length - 1] == '/')
+    {
+        dir[--length] = '\0';
+    }
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+    {
+        file->name = strdup(dir);
+        file->dir = strdup(".");
+    }
+    else
+    {
+        file->name = strdup(slash + 1);
+        slash[(slash == dir) ? 1 : 0] = '\0';
+        file->dir = strdup(dir);
+    }
+    osFreeMem(dir);
+
+    fs_watch_get_state(file->path, &file->state);
+    file->watched = (fs_watch_add_dir_locked(file->dir, &fs_watch_file_event, NULL) == NO_ERROR);
+    file->next = fs_watch_files;
+    fs_watch_files = file;
+    mutex_unlock(MUTEX_FS_WATCH);
+
+    /* a file that has to be polled shortens the timeout of the thread */
+    fs_watch_wake();
+
+    return NO_ERROR;
+}
+
+void fs_watch_remove_files(fs_watch_file_cbr_t cbr, void *ctx)
+{
+    mutex_lock(MUTEX_FS_WATCH);
+    fs_watch_file_t **prev = &fs_watch_files;
+    while (*prev)
+    {
+        fs_watch_file_t *file = *prev;
+        if (file->cbr == cbr && file->ctx == ctx)
+        {
+            *prev = file->next;
+            fs_watch_free_file(file);
+        }
+        else
+        {
+            prev = &file->next;
+        }
+    }
+    mutex_unlock(MUTEX_FS_WATCH);
+}
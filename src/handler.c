@@ -1,5 +1,7 @@
 #include "handler.h"
 #include "server_helpers.h"
+#include "content_index.h"
+#include "stats.h"
 
 req_cbr_t getCloudCbr(HttpConnection *connection, const char_t *uri, const char_t *queryString, cloudapi_t api, cbr_ctx_t *ctx, client_ctx_t *client_ctx)
 {
@@ -54,18 +56,6 @@ void cbrCloudHeaderPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, cons
     ctx->status = PROX_STATUS_HEAD;
 }
 
-bool fillCbrBodyCache(cbr_ctx_t *ctx, HttpClientContext *httpClientContext, const char *payload, size_t length)
-{
-    if (ctx->bufferPos == 0)
-    {
-        ctx->bufferLen = httpClientContext->bodyLen; // ctx->connection->response.contentLength;
-        ctx->buffer = osAllocMem(ctx->bufferLen);
-    }
-    osMemcpy(&ctx->buffer[ctx->bufferPos], payload, length);
-    ctx->bufferPos += length;
-    return (ctx->bufferPos == ctx->bufferLen);
-}
-
 void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const char *payload, size_t length, error_t error)
 {
     cbr_ctx_t *ctx = (cbr_ctx_t *)src_ctx;
@@ -123,6 +113,7 @@ void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const
 
                 fsDeleteFile(ctx->tonieInfo.contentPath);
                 fsRenameFile(tmpPath, ctx->tonieInfo.contentPath);
+                content_index_invalidate(ctx->tonieInfo.contentPath);
                 if (fsFileExists(ctx->tonieInfo.contentPath))
                 {
                     TRACE_INFO(">> Successfully cached %s\r\n", ctx->tonieInfo.contentPath);
@@ -140,32 +131,6 @@ void cbrCloudBodyPassthrough(void *src_ctx, HttpClientContext *cloud_ctx, const
         }
         httpSend(ctx->connection, payload, length, HTTP_FLAG_DELAY);
         break;
-    case V1_FRESHNESS_CHECK:
-        if (ctx->client_ctx->settings->toniebox.overrideCloud && length > 0 && fillCbrBodyCache(ctx, httpClientContext, payload, length))
-        {
-            TonieFreshnessCheckResponse *freshResp = tonie_freshness_check_response__unpack(NULL, ctx->bufferLen, (const uint8_t *)ctx->buffer);
-            setTonieboxSettings(freshResp, ctx->client_ctx->settings);
-            size_t packSize = tonie_freshness_check_response__get_packed_size(freshResp);
-
-            // TODO: Check if size is stable and this is obsolete
-            // TODO Add live tonies here, too : freshResp.tonie_marked
-            if (ctx->bufferLen < packSize)
-            {
-                TRACE_WARNING(">> cbrCloudBodyPassthrough V1_FRESHNESS_CHECK: %zu / %zu\r\n", ctx->bufferLen, packSize);
-                osFreeMem(ctx->buffer);
-                ctx->bufferLen = packSize;
-                ctx->buffer = osAllocMem(ctx->bufferLen);
-            }
-            tonie_freshness_check_response__pack(freshResp, (uint8_t *)ctx->buffer);
-            tonie_freshness_check_response__free_unpacked(freshResp, NULL);
-            httpSend(ctx->connection, ctx->buffer, ctx->bufferLen, HTTP_FLAG_DELAY);
-            osFreeMem(ctx->buffer);
-        }
-        else
-        {
-            httpSend(ctx->connection, payload, length, HTTP_FLAG_DELAY);
-        }
-        break;
     default:
         httpSend(ctx->connection, payload, length, HTTP_FLAG_DELAY);
         break;
@@ -225,77 +190,17 @@ tonie_info_t getTonieInfo(const char *contentPath, settings_t *settings)
 {
     tonie_info_t tonieInfo;
 
-    tonieInfo.valid = false;
-    tonieInfo.updated = false;
-    tonieInfo.stream = false;
-    tonieInfo.tafHeader = NULL;
+    osMemset(&tonieInfo, 0x00, sizeof(tonie_info_t));
     tonieInfo.contentPath = strdup(contentPath);
-    tonieInfo.exists = fsFileExists(contentPath);
-
-    tonieInfo.contentConfig.live = false;
-    tonieInfo.contentConfig.nocloud = false;
-    tonieInfo.contentConfig.source = NULL;
-    tonieInfo.contentConfig.skip_seconds = 0;
-    tonieInfo.contentConfig.cache = false;
-    tonieInfo.contentConfig._updated = false;
-    tonieInfo.contentConfig._stream = false;
-    tonieInfo.contentConfig._streamFile = custom_asprintf("%s.stream", contentPath);
-
-    if (osStrstr(contentPath, ".json") == NULL &&
-        osStrstr(contentPath, settings->internal.contentdirfull) == contentPath &&
-        (contentPath[osStrlen(settings->internal.contentdirfull)] == '/' || contentPath[osStrlen(settings->internal.contentdirfull)] == '\\') &&
-        osStrlen(contentPath) - 18 == osStrlen(settings->internal.contentdirfull))
-    {
-        // TODO: Nice checking if valid tonie path
-        load_content_json(contentPath, &tonieInfo.contentConfig);
-    }
 
-    FsFile *file = fsOpenFile(contentPath, FS_FILE_MODE_READ);
-    if (file)
-    {
-        uint8_t headerBuffer[TAF_HEADER_SIZE];
-        size_t read_length;
-        fsReadFile(file, headerBuffer, 4, &read_length);
-        if (read_length == 4)
-        {
-            uint32_t protobufSize = (uint32_t)((headerBuffer[0] << 24) | (headerBuffer[1] << 16) | (headerBuffer[2] << 8) | headerBuffer[3]);
-            if (protobufSize <= TAF_HEADER_SIZE)
-            {
-                fsReadFile(file, headerBuffer, protobufSize, &read_length);
-                if (read_length == protobufSize)
-                {
-                    tonieInfo.tafHeader = toniebox_audio_file_header__unpack(NULL, protobufSize, (const uint8_t *)headerBuffer);
-                    if (tonieInfo.tafHeader)
-                    {
-                        tonieInfo.valid = true;
-
-                        if (tonieInfo.tafHeader->num_bytes == TONIE_LENGTH_MAX)
-                        {
-                            tonieInfo.stream = true;
-                        }
-                    }
-                }
-                else
-                {
-                    TRACE_WARNING("Invalid TAF-header on %s, read_length=%" PRIuSIZE " != protobufSize=%" PRIu32 "\r\n", contentPath, read_length, protobufSize);
-                }
-            }
-            else
-            {
-                TRACE_WARNING("Invalid TAF-header on %s, protobufSize=%" PRIu32 " >= TAF_HEADER_SIZE=%u\r\n", contentPath, protobufSize, TAF_HEADER_SIZE);
-            }
-        }
-        else if (read_length == 0)
-        {
-            // TODO don't send invalid TAF files via API
-            TRACE_VERBOSE("Invalid TAF-header, file %s is empty!", contentPath);
-        }
-        else
-        {
-            TRACE_WARNING("Invalid TAF-header on %s, Could not read 4 bytes, read_length=%" PRIuSIZE "\r\n", contentPath, read_length);
-        }
-        fsCloseFile(file);
-    }
+    // TODO: Nice checking if valid tonie path
+    bool_t isContent = osStrstr(contentPath, ".json") == NULL &&
+                       osStrstr(contentPath, settings->internal.contentdirfull) == contentPath &&
+                       (contentPath[osStrlen(settings->internal.contentdirfull)] == '/' || contentPath[osStrlen(settings->internal.contentdirfull)] == '\\') &&
+                       osStrlen(contentPath) - 18 == osStrlen(settings->internal.contentdirfull);
+
+    content_index_get(contentPath, isContent, &tonieInfo);
+
     return tonieInfo;
 }
 
@@ -306,15 +211,10 @@ void freeTonieInfo(tonie_info_t *tonieInfo)
         save_content_json(tonieInfo->contentPath, &tonieInfo->contentConfig);
     }
 
-    toniebox_audio_file_header__free_unpacked(tonieInfo->tafHeader, NULL);
     free(tonieInfo->contentPath);
     tonieInfo->contentPath = NULL;
-    tonieInfo->tafHeader = NULL;
 
-    if (tonieInfo->valid)
-    {
-        free_content_json(&tonieInfo->contentConfig);
-    }
+    free_content_json(&tonieInfo->contentConfig);
 }
 
 void httpPrepareHeader(HttpConnection *connection, const void *contentType, size_t contentLength)
@@ -370,4 +270,146 @@ error_t httpWriteString(HttpConnection *connection, const char_t *content)
 error_t httpFlushStream(HttpConnection *connection)
 {
     return httpCloseStream(connection);
-}
\ No newline at end of file
+}
+
+error_t httpSendStreamBuffer(HttpConnection *connection, stream_buffer_t *buffer, size_t backlog, systime_t requestTime)
+{
+    if (connection->request.Range.start > 0)
+    {
+        TRACE_WARNING("Seeking stream to %" PRIu32 " is not possible\r\n", connection->request.Range.start);
+        connection->response.statusCode = 404;
+        connection->response.contentLength = 0;
+        return httpWriteHeader(connection);
+    }
+
+    connection->response.statusCode = 200;
+    connection->response.contentLength = CONTENT_LENGTH_MAX;
+    connection->response.contentType = "application/octet-stream";
+    connection->response.chunkedEncoding = FALSE;
+    connection->response.noCache = TRUE;
+
+    error_t error = httpWriteHeader(connection);
+    if (error)
+    {
+        return error;
+    }
+
+    stream_reader_t *reader = stream_reader_create(buffer, backlog);
+    bool_t firstData = TRUE;
+    while (connection->running)
+    {
+        size_t length = 0;
+        error = stream_reader_read(reader, connection->buffer, HTTP_SERVER_BUFFER_SIZE, &length, 1000);
+        if (error == ERROR_TIMEOUT)
+        {
+            continue;
+        }
+        if (error)
+        {
+            break;
+        }
+        error = httpWriteStream(connection, connection->buffer, length);
+        if (error)
+        {
+            break;
+        }
+        if (firstData)
+        {
+            uint32_t ttfb = osGetSystemTime() - requestTime;
+            TRACE_INFO("Stream time to first byte: %" PRIu32 " ms\r\n", ttfb);
+            stats_update("stream_ttfb_count", 1);
+            stats_update("stream_ttfb_ms", ttfb);
+            stats_set("stream_ttfb_last_ms", ttfb);
+            firstData = FALSE;
+        }
+    }
+    stream_reader_free(reader);
+
+    if (error == ERROR_END_OF_STREAM)
+    {
+        error = httpFlushStream(connection);
+    }
+
+    return error;
+}
+
+error_t httpSendTafPlaylist(HttpConnection *connection, taf_playlist_t *playlist)
+{
+    uint32_t size = taf_playlist_size(playlist);
+    uint32_t start = 0;
+
+    if (connection->request.Range.start > 0)
+    {
+        if (connection->request.Range.start >= size)
+        {
+            connection->response.statusCode = 416;
+            connection->response.contentLength = 0;
+            return httpWriteHeader(connection);
+        }
+        start = connection->request.Range.start;
+        connection->request.Range.size = size;
+        if (connection->request.Range.end >= size || connection->request.Range.end == 0)
+        {
+            connection->request.Range.end = size - 1;
+        }
+        if (connection->response.contentRange == NULL)
+        {
+            connection->response.contentRange = osAllocMem(255);
+        }
+        osSprintf((char *)connection->response.contentRange, "bytes %" PRIu32 "-%" PRIu32 "/%" PRIu32, start, connection->request.Range.end, size);
+        connection->response.statusCode = 206;
+        connection->response.contentLength = connection->request.Range.end - start + 1;
+    }
+    else
+    {
+        connection->response.statusCode = 200;
+        connection->response.contentLength = size;
+    }
+    connection->response.contentType = "application/octet-stream";
+    connection->response.chunkedEncoding = FALSE;
+
+    taf_playlist_reader_t *reader = taf_playlist_reader_create(playlist);
+    if (!reader)
+    {
+        /* nothing was sent yet, the box still gets an answer instead of a dropped request */
+        TRACE_ERROR("Failed to open playlist for streaming\r\n");
+        char message[] = "Failed to open playlist";
+        httpPrepareHeader(connection, "text/plain; charset=utf-8", osStrlen(message));
+        connection->response.statusCode = 500;
+        return httpWriteResponseString(connection, message, false);
+    }
+
+    error_t error = httpWriteHeader(connection);
+    if (error)
+    {
+        taf_playlist_reader_free(reader);
+        return error;
+    }
+
+    uint32_t offset = start;
+    size_t remaining = connection->response.contentLength;
+    while (remaining > 0 && connection->running)
+    {
+        size_t length = 0;
+        error = taf_playlist_read(reader, offset, (uint8_t *)connection->buffer, MIN(remaining, HTTP_SERVER_BUFFER_SIZE), &length);
+        if (error)
+        {
+            break;
+        }
+        error = httpWriteStream(connection, connection->buffer, length);
+        if (error)
+        {
+            break;
+        }
+        offset += length;
+        remaining -= length;
+    }
+    taf_playlist_reader_free(reader);
+
+    if (error == NO_ERROR)
+    {
+        error = httpFlushStream(connection);
+    }
+
+    return error;
+}
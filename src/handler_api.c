@@ -1,6 +1,7 @@
 
 #include <sys/types.h>
 #include <time.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -8,6 +9,7 @@
 
 #include "path.h"
 #include "path_ext.h"
+#include "server.h"
 #include "server_helpers.h"
 #include "fs_port.h"
 #include "handler.h"
@@ -18,6 +20,13 @@
 #include "returncodes.h"
 #include "cJSON.h"
 #include "toniefile.h"
+#include "content_index.h"
+#include "dir_cache.h"
+#include "taf_index.h"
+#include "stream_session.h"
+#include "job_queue.h"
+#include "taf_edit.h"
+#include "pcm_encoder.h"
 
 void sanitizePath(char *path, bool isDir)
 {
@@ -277,6 +286,7 @@ error_t handleApiTrigger(HttpConnection *connection, const char_t *uri, const ch
         TRACE_INFO("Triggered Exit\r\n");
         settings_set_bool("internal.exit", TRUE);
         settings_set_signed("internal.returncode", RETURNCODE_USER_QUIT);
+        server_wake();
         osSprintf(response, "OK");
     }
     else if (!strcmp(item, "triggerRestart"))
@@ -284,6 +294,7 @@ error_t handleApiTrigger(HttpConnection *connection, const char_t *uri, const ch
         TRACE_INFO("Triggered Restart\r\n");
         settings_set_bool("internal.exit", TRUE);
         settings_set_signed("internal.returncode", RETURNCODE_USER_RESTART);
+        server_wake();
         osSprintf(response, "OK");
     }
     else if (!strcmp(item, "triggerReloadConfig"))
@@ -448,106 +459,515 @@ error_t handleApiSet(HttpConnection *connection, const char_t *uri, const char_t
     return httpWriteResponseString(connection, response, false);
 }
 
+static error_t fileIndexWrite(HttpConnection *connection, char *buffer, size_t *used, size_t size, const char *data)
+{
+    size_t length = osStrlen(data);
+    error_t error = NO_ERROR;
+
+    /* collect small pieces, every write is a chunk of its own */
+    if (*used + length > size)
+    {
+        error = httpWriteStream(connection, buffer, *used);
+        *used = 0;
+    }
+    if (error == NO_ERROR && length > size)
+    {
+        return httpWriteStream(connection, data, length);
+    }
+    osMemcpy(&buffer[*used], data, length);
+    *used += length;
+
+    return error;
+}
+
 error_t handleApiFileIndex(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
-    char *jsonString = strdup("{\"files\":[]}");
+    char overlay[16];
+    const char *rootPath = NULL;
 
-    do
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
     {
-        char overlay[16];
-        const char *rootPath = NULL;
+        return ERROR_FAILURE;
+    }
 
-        if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
-        {
-            return ERROR_FAILURE;
-        }
+    char path[128];
+    char sort[16];
+    char order[8];
+    char limitString[16];
+    char cursor[300];
 
-        char path[128];
+    if (!queryGet(queryString, "path", path, sizeof(path)))
+    {
+        osStrcpy(path, "/");
+    }
+    if (!queryGet(queryString, "sort", sort, sizeof(sort)))
+    {
+        osStrcpy(sort, "name");
+    }
+    if (!queryGet(queryString, "order", order, sizeof(order)))
+    {
+        osStrcpy(order, "asc");
+    }
+    if (!queryGet(queryString, "limit", limitString, sizeof(limitString)))
+    {
+        osStrcpy(limitString, "0");
+    }
+    if (!queryGet(queryString, "cursor", cursor, sizeof(cursor)))
+    {
+        osStrcpy(cursor, "");
+    }
+
+    dir_cache_sort_t sortMode = DIR_CACHE_SORT_NAME;
+    if (!osStrcmp(sort, "date"))
+    {
+        sortMode = DIR_CACHE_SORT_DATE;
+    }
+    else if (!osStrcmp(sort, "size"))
+    {
+        sortMode = DIR_CACHE_SORT_SIZE;
+    }
+    size_t limit = strtoul(limitString, NULL, 10);
+
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    pathSafeCanonicalize(path);
+    char *pathAbsolute = custom_asprintf("%s/%s", rootPath, path);
+    pathSafeCanonicalize(pathAbsolute);
 
-        if (!queryGet(queryString, "path", path, sizeof(path)))
+    dir_cache_listing_t *listing = dir_cache_get(pathAbsolute, client_ctx->settings);
+    if (listing == NULL)
+    {
+        TRACE_ERROR("Failed to open dir '%s'\r\n", pathAbsolute);
+        osFreeMem(pathAbsolute);
+
+        httpInitResponseHeader(connection);
+        connection->response.contentType = "text/json";
+        return httpWriteResponseString(connection, "{\"files\":[]}", false);
+    }
+    osFreeMem(pathAbsolute);
+
+    size_t count = dir_cache_count(listing);
+    const dir_cache_entry_t **sorted = dir_cache_sorted(listing, sortMode, !osStrcmp(order, "desc"));
+
+    /* cursor is "<position>:<name>" of the last entry of the previous page */
+    size_t start = 0;
+    char *cursorName = osStrchr(cursor, ':');
+    if (cursorName)
+    {
+        start = dir_cache_after(sorted, count, strtoul(cursor, NULL, 10), cursorName + 1);
+    }
+    size_t end = (limit > 0) ? MIN(start + limit, count) : count;
+
+    httpInitResponseHeader(connection);
+    connection->response.contentType = "text/json";
+    connection->response.chunkedEncoding = TRUE;
+
+    char buffer[4096];
+    size_t used = 0;
+    error_t error = httpWriteHeader(connection);
+
+    if (error == NO_ERROR)
+    {
+        error = fileIndexWrite(connection, buffer, &used, sizeof(buffer), "{\"files\":[");
+    }
+
+    for (size_t pos = start; pos < end && error == NO_ERROR; pos++)
+    {
+        const dir_cache_entry_t *entry = sorted[pos];
+        char dateString[64];
+
+        osSnprintf(dateString, sizeof(dateString), " %04" PRIu16 "-%02" PRIu8 "-%02" PRIu8 ",  %02" PRIu8 ":%02" PRIu8 ":%02" PRIu8,
+                   entry->modified.year, entry->modified.month, entry->modified.day,
+                   entry->modified.hours, entry->modified.minutes, entry->modified.seconds);
+
+        cJSON *jsonEntry = cJSON_CreateObject();
+        cJSON_AddStringToObject(jsonEntry, "name", entry->name);
+        cJSON_AddStringToObject(jsonEntry, "date", dateString);
+        cJSON_AddNumberToObject(jsonEntry, "size", entry->size);
+        cJSON_AddBoolToObject(jsonEntry, "isDirectory", entry->isDir);
+        cJSON_AddStringToObject(jsonEntry, "desc", entry->desc);
+
+        char *jsonString = cJSON_PrintUnformatted(jsonEntry);
+        cJSON_Delete(jsonEntry);
+
+        if (pos > start)
         {
-            osStrcpy(path, "/");
+            error = fileIndexWrite(connection, buffer, &used, sizeof(buffer), ",");
         }
+        if (error == NO_ERROR)
+        {
+            error = fileIndexWrite(connection, buffer, &used, sizeof(buffer), jsonString);
+        }
+        osFreeMem(jsonString);
+    }
 
-        /* first canonicalize path, then merge to prevent directory traversal bugs */
-        pathSafeCanonicalize(path);
-        char *pathAbsolute = custom_asprintf("%s/%s", rootPath, path);
-        pathSafeCanonicalize(pathAbsolute);
-
-        int pos = 0;
-        FsDir *dir = fsOpenDir(pathAbsolute);
-        if (dir == NULL)
+    if (error == NO_ERROR)
+    {
+        char *tail;
+        if (end < count)
         {
-            TRACE_ERROR("Failed to open dir '%s'\r\n", pathAbsolute);
-            osFreeMem(pathAbsolute);
-            break;
+            char *next = custom_asprintf("%" PRIuSIZE ":%s", end - 1, sorted[end - 1]->name);
+            cJSON *jsonNext = cJSON_CreateString(next);
+            char *nextString = cJSON_PrintUnformatted(jsonNext);
+            tail = custom_asprintf("],\"total\":%" PRIuSIZE ",\"next\":%s}", count, nextString);
+            osFreeMem(nextString);
+            cJSON_Delete(jsonNext);
+            osFreeMem(next);
         }
+        else
+        {
+            tail = custom_asprintf("],\"total\":%" PRIuSIZE "}", count);
+        }
+        error = fileIndexWrite(connection, buffer, &used, sizeof(buffer), tail);
+        osFreeMem(tail);
+    }
+    if (error == NO_ERROR && used > 0)
+    {
+        error = httpWriteStream(connection, buffer, used);
+    }
 
-        cJSON *json = cJSON_CreateObject();
-        cJSON *jsonArray = cJSON_AddArrayToObject(json, "files");
+    osFreeMem(sorted);
+    dir_cache_release(listing);
 
-        while (true)
-        {
-            FsDirEntry entry;
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Failed to send file index: %d\r\n", error);
+        return error;
+    }
 
-            if (fsReadDir(dir, &entry) != NO_ERROR)
-            {
-                fsCloseDir(dir);
-                break;
-            }
+    return httpFlushStream(connection);
+}
 
-            if (!osStrcmp(entry.name, ".") || !osStrcmp(entry.name, ".."))
-            {
-                continue;
-            }
+error_t handleApiTafInfo(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    const char *rootPath = NULL;
 
-            char dateString[64];
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
 
-            osSnprintf(dateString, sizeof(dateString), " %04" PRIu16 "-%02" PRIu8 "-%02" PRIu8 ",  %02" PRIu8 ":%02" PRIu8 ":%02" PRIu8,
-                       entry.modified.year, entry.modified.month, entry.modified.day,
-                       entry.modified.hours, entry.modified.minutes, entry.modified.seconds);
+    char path[128];
 
-            char *filePathAbsolute = custom_asprintf("%s/%s", pathAbsolute, entry.name);
-            pathSafeCanonicalize(filePathAbsolute);
+    if (!queryGet(queryString, "path", path, sizeof(path)))
+    {
+        return ERROR_INVALID_REQUEST;
+    }
 
-            char desc[64];
-            desc[0] = 0;
-            tonie_info_t tafInfo = getTonieInfo(filePathAbsolute, client_ctx->settings);
-            if (tafInfo.valid)
-            {
-                osSnprintf(desc, sizeof(desc), "TAF:%08X:", tafInfo.tafHeader->audio_id);
-                for (int pos = 0; pos < tafInfo.tafHeader->sha1_hash.len; pos++)
-                {
-                    char tmp[3];
-                    osSprintf(tmp, "%02X", tafInfo.tafHeader->sha1_hash.data[pos]);
-                    osStrcat(desc, tmp);
-                }
-            }
-            osFreeMem(filePathAbsolute);
-            freeTonieInfo(&tafInfo);
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    pathSafeCanonicalize(path);
+    char *pathAbsolute = custom_asprintf("%s/%s", rootPath, path);
+    pathSafeCanonicalize(pathAbsolute);
 
-            cJSON *jsonEntry = cJSON_CreateObject();
-            cJSON_AddStringToObject(jsonEntry, "name", entry.name);
-            cJSON_AddStringToObject(jsonEntry, "date", dateString);
-            cJSON_AddNumberToObject(jsonEntry, "size", entry.size);
-            cJSON_AddBoolToObject(jsonEntry, "isDirectory", (entry.attributes & FS_FILE_ATTR_DIRECTORY));
-            cJSON_AddStringToObject(jsonEntry, "desc", desc);
+    taf_index_t *index = taf_index_get(pathAbsolute);
+    osFreeMem(pathAbsolute);
 
-            cJSON_AddItemToArray(jsonArray, jsonEntry);
+    if (!index)
+    {
+        return ERROR_NOT_FOUND;
+    }
 
-            pos++;
-        }
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "audioId", index->audio_id);
+    cJSON_AddNumberToObject(json, "size", index->size);
+    cJSON_AddNumberToObject(json, "blocks", index->blocks);
+    cJSON_AddNumberToObject(json, "duration", taf_index_duration(index));
 
-        osFreeMem(pathAbsolute);
-        jsonString = cJSON_PrintUnformatted(json);
-        cJSON_Delete(json);
-    } while (0);
+    cJSON *jsonArray = cJSON_AddArrayToObject(json, "chapters");
+    for (size_t pos = 0; pos < index->chapters; pos++)
+    {
+        uint32_t block = index->chapter_blocks[pos];
+        uint32_t end = (pos + 1 < index->chapters) ? index->chapter_blocks[pos + 1] : index->blocks;
+
+        cJSON *jsonEntry = cJSON_CreateObject();
+        cJSON_AddNumberToObject(jsonEntry, "block", block);
+        cJSON_AddNumberToObject(jsonEntry, "offset", taf_index_offset(block));
+        cJSON_AddNumberToObject(jsonEntry, "start", taf_index_time(index, block));
+        cJSON_AddNumberToObject(jsonEntry, "duration", taf_index_time(index, end) - taf_index_time(index, block));
+        cJSON_AddItemToArray(jsonArray, jsonEntry);
+    }
+    taf_index_release(index);
+
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
 
     httpInitResponseHeader(connection);
     connection->response.contentType = "text/json";
-    connection->response.contentLength = osStrlen(jsonString);
+    return httpWriteResponseString(connection, jsonString, true);
+}
 
-    return httpWriteResponse(connection, jsonString, connection->response.contentLength, true);
+error_t handleApiStreams(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "streams", stream_session_list());
+
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    httpInitResponseHeader(connection);
+    connection->response.contentType = "text/json";
+    return httpWriteResponseString(connection, jsonString, true);
+}
+
+error_t handleApiJobs(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddItemToObject(json, "jobs", job_queue_list());
+
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+
+    httpInitResponseHeader(connection);
+    connection->response.contentType = "text/json";
+    return httpWriteResponseString(connection, jsonString, true);
+}
+
+error_t handleApiJobConvert(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    const char *rootPath = NULL;
+
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+
+    char recursive[8];
+    char overwrite[8];
+    char qualityName[16];
+    osStrcpy(recursive, "");
+    osStrcpy(overwrite, "");
+    osStrcpy(qualityName, "");
+    queryGet(queryString, "recursive", recursive, sizeof(recursive));
+    queryGet(queryString, "overwrite", overwrite, sizeof(overwrite));
+    queryGet(queryString, "quality", qualityName, sizeof(qualityName));
+
+    char path[256];
+    size_t size = 0;
+
+    error_t error = httpReceive(connection, &path, sizeof(path) - 1, &size, 0x00);
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("httpReceive failed!");
+        return error;
+    }
+    path[size] = 0;
+
+    /* first canonicalize path, then merge to prevent directory traversal bugs */
+    sanitizePath(path, false);
+    char *pathAbsolute = custom_asprintf("%s/%s", rootPath, path);
+    sanitizePath(pathAbsolute, false);
+
+    TRACE_INFO("Queueing conversion of '%s'\r\n", pathAbsolute);
+
+    uint_t statusCode = 200;
+    char message[256 + 64];
+    size_t added = 0;
+    toniefile_quality_t quality = TONIEFILE_QUALITY_DEFAULT;
+
+    error_t err = toniefile_quality_parse(qualityName, &quality);
+    if (err == NO_ERROR)
+    {
+        err = job_queue_add_path(pathAbsolute, !osStrcmp(recursive, "true") || !osStrcmp(recursive, "1"),
+                                 !osStrcmp(overwrite, "true") || !osStrcmp(overwrite, "1"), quality, &added);
+    }
+    else
+    {
+        statusCode = 400;
+        osSnprintf(message, sizeof(message), "Unknown quality '%s'", qualityName);
+    }
+
+    if (statusCode == 200 && err != NO_ERROR && added == 0)
+    {
+        statusCode = 500;
+        osSnprintf(message, sizeof(message), "Error queueing '%s', error %d", path, err);
+    }
+    else if (statusCode == 200)
+    {
+        osSnprintf(message, sizeof(message), "{\"queued\":%" PRIuSIZE "}", added);
+    }
+    httpPrepareHeader(connection, statusCode == 200 ? "text/json" : "text/plain; charset=utf-8", osStrlen(message));
+    connection->response.statusCode = statusCode;
+
+    osFreeMem(pathAbsolute);
+
+    return httpWriteResponseString(connection, message, false);
+}
+
+error_t handleApiJobCancel(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char id[16];
+    size_t size = 0;
+
+    error_t error = httpReceive(connection, &id, sizeof(id) - 1, &size, 0x00);
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("httpReceive failed!");
+        return error;
+    }
+    id[size] = 0;
+
+    uint_t statusCode = 200;
+    char message[64];
+
+    osSnprintf(message, sizeof(message), "OK");
+    if (job_queue_cancel((uint32_t)atol(id)) != NO_ERROR)
+    {
+        statusCode = 404;
+        osSnprintf(message, sizeof(message), "No unfinished job %s", id);
+    }
+    httpPrepareHeader(connection, "text/plain; charset=utf-8", osStrlen(message));
+    connection->response.statusCode = statusCode;
+
+    return httpWriteResponseString(connection, message, false);
+}
+
+/* resolves a path of the request below the content directory, NULL if it is missing */
+static char *handleApiTafEditPath(const char *rootPath, const cJSON *item)
+{
+    if (!cJSON_IsString(item) || osStrlen(item->valuestring) == 0)
+    {
+        return NULL;
+    }
+    char *path = strdup(item->valuestring);
+    sanitizePath(path, false);
+    char *pathAbsolute = custom_asprintf("%s/%s", rootPath, path);
+    sanitizePath(pathAbsolute, false);
+    osFreeMem(path);
+
+    return pathAbsolute;
+}
+
+/* JSON numbers are doubles, only hand over values that are finite and fit the target type */
+static bool_t handleApiTafEditNumber(const cJSON *item, double min, double max, double *value)
+{
+    if (!cJSON_IsNumber(item) || !isfinite(item->valuedouble) || item->valuedouble < min || item->valuedouble > max)
+    {
+        return false;
+    }
+    *value = item->valuedouble;
+    return true;
+}
+
+error_t handleApiTafEdit(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
+{
+    char overlay[16];
+    const char *rootPath = NULL;
+
+    if (queryPrepare(queryString, &rootPath, overlay, sizeof(overlay)) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+
+    char body[4096];
+    size_t size = 0;
+
+    error_t error = httpReceive(connection, &body, sizeof(body) - 1, &size, 0x00);
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("httpReceive failed!");
+        return error;
+    }
+    body[size] = 0;
+
+    cJSON *json = cJSON_ParseWithLengthOpts(body, size, 0, 0);
+    const cJSON *opItem = cJSON_GetObjectItem(json, "op");
+    const char *op = cJSON_IsString(opItem) ? opItem->valuestring : "";
+    const cJSON *audioIdItem = cJSON_GetObjectItem(json, "audioId");
+    double audioIdValue = 0;
+    bool_t paramsValid = !audioIdItem || handleApiTafEditNumber(audioIdItem, 0, UINT32_MAX, &audioIdValue);
+    uint32_t audioId = (uint32_t)audioIdValue;
+    char *source = handleApiTafEditPath(rootPath, cJSON_GetObjectItem(json, "source"));
+    char *target = handleApiTafEditPath(rootPath, cJSON_GetObjectItem(json, "target"));
+
+    error_t err = ERROR_INVALID_PARAMETER;
+    if (!paramsValid)
+    {
+        TRACE_WARNING("TAF edit '%s' with an invalid audio id\r\n", op);
+    }
+    else if (!osStrcmp(op, "concat") && target)
+    {
+        const cJSON *sources = cJSON_GetObjectItem(json, "sources");
+        size_t count = cJSON_GetArraySize(sources);
+        char **paths = osAllocMem(MAX(count, 1) * sizeof(char *));
+        size_t valid = 0;
+        for (; valid < count; valid++)
+        {
+            paths[valid] = handleApiTafEditPath(rootPath, cJSON_GetArrayItem(sources, valid));
+            if (!paths[valid])
+            {
+                break;
+            }
+        }
+        if (valid == count && count > 0)
+        {
+            err = taf_edit_concat(target, (const char *const *)paths, count, audioId);
+        }
+        for (size_t pos = 0; pos < valid; pos++)
+        {
+            osFreeMem(paths[pos]);
+        }
+        osFreeMem(paths);
+    }
+    else if (!osStrcmp(op, "split") && source)
+    {
+        const cJSON *targets = cJSON_GetObjectItem(json, "targets");
+        const cJSON *chapter = cJSON_GetObjectItem(json, "chapter");
+        char *first = handleApiTafEditPath(rootPath, cJSON_GetArrayItem(targets, 0));
+        char *second = handleApiTafEditPath(rootPath, cJSON_GetArrayItem(targets, 1));
+        double chapterNum = 0;
+        if (first && second && handleApiTafEditNumber(chapter, 0, TONIEFILE_MAX_CHAPTERS - 1, &chapterNum))
+        {
+            err = taf_edit_split(source, (size_t)chapterNum, first, second, audioId);
+        }
+        osFreeMem(first);
+        osFreeMem(second);
+    }
+    else if (!osStrcmp(op, "chapters") && source && target)
+    {
+        const cJSON *chapters = cJSON_GetObjectItem(json, "chapters");
+        double starts[TONIEFILE_MAX_CHAPTERS];
+        size_t count = 0;
+        bool_t startsValid = true;
+        const cJSON *start;
+        cJSON_ArrayForEach(start, chapters)
+        {
+            /* beyond the end is fine, the index clamps it to the last block */
+            if (count >= TONIEFILE_MAX_CHAPTERS || !handleApiTafEditNumber(start, 0, HUGE_VAL, &starts[count]))
+            {
+                startsValid = false;
+                break;
+            }
+            count++;
+        }
+        if (startsValid)
+        {
+            err = taf_edit_chapters(source, target, starts, count, audioId);
+        }
+    }
+    else if (!osStrcmp(op, "audioId") && source && target)
+    {
+        err = taf_edit_audio_id(source, target, audioId);
+    }
+
+    uint_t statusCode = 200;
+    char message[128];
+
+    osSnprintf(message, sizeof(message), "OK");
+    if (err != NO_ERROR)
+    {
+        statusCode = (err == ERROR_INVALID_PARAMETER) ? 400 : 500;
+        osSnprintf(message, sizeof(message), "TAF edit '%s' failed, error %d", op, err);
+    }
+    TRACE_INFO("TAF edit '%s': %s\r\n", op, message);
+    httpPrepareHeader(connection, "text/plain; charset=utf-8", osStrlen(message));
+    connection->response.statusCode = statusCode;
+
+    osFreeMem(source);
+    osFreeMem(target);
+    cJSON_Delete(json);
+
+    return httpWriteResponseString(connection, message, false);
 }
 
 error_t handleApiStats(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
@@ -615,6 +1035,7 @@ error_t file_save_start(void *in_ctx, const char *name, const char *filename)
     }
 
     ctx->file = fsOpenFile(fullPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    content_index_invalidate(fullPath);
 
     osFreeMem(fullPath);
 
@@ -825,10 +1246,14 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
     char ogg[16];
     char overlay[16];
     char special[16];
+    char chapter[16];
+    char seconds[16];
 
     osStrcpy(ogg, "");
     osStrcpy(overlay, "");
     osStrcpy(special, "");
+    osStrcpy(chapter, "");
+    osStrcpy(seconds, "");
 
     if (!queryGet(queryString, "ogg", ogg, sizeof(ogg)))
     {
@@ -852,9 +1277,27 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
             }
         }
     }
+    queryGet(queryString, "chapter", chapter, sizeof(chapter));
+    queryGet(queryString, "t", seconds, sizeof(seconds));
+
+    double seekSeconds = 0;
+    if (osStrlen(seconds) > 0)
+    {
+        char *end = NULL;
+        seekSeconds = strtod(seconds, &end);
+        if (end == seconds || !isfinite(seekSeconds))
+        {
+            char message[] = "Invalid seek time";
+            httpPrepareHeader(connection, "text/plain; charset=utf-8", osStrlen(message));
+            connection->response.statusCode = 400;
+            return httpWriteResponseString(connection, message, false);
+        }
+    }
 
-    bool skipFileHeader = !strcmp(ogg, "true");
-    size_t startOffset = skipFileHeader ? 4096 : 0;
+    /* seeking to a chapter or time always delivers plain ogg */
+    bool_t seek = osStrlen(chapter) > 0 || osStrlen(seconds) > 0;
+    bool skipFileHeader = seek || !strcmp(ogg, "true");
+    size_t startOffset = skipFileHeader ? TONIEFILE_FRAME_SIZE : 0;
 
     char *file_path = custom_asprintf("%s%s", rootPath, &uri[8]);
 
@@ -883,11 +1326,42 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
     if (error || length < startOffset)
     {
         TRACE_ERROR("File does not exist '%s'\r\n", file_path);
+        osFreeMem(file_path);
         return ERROR_NOT_FOUND;
     }
 
-    /* in case of skipped headers, also reduce the file length */
-    length -= startOffset;
+    /* the body consists of up to two parts of the file, the ogg headers and the audio starting at the seek position */
+    uint32_t partOffset[2] = {startOffset, 0};
+    uint32_t partLength[2] = {length - startOffset, 0};
+
+    if (seek && !isStream)
+    {
+        taf_index_t *index = taf_index_get(file_path);
+        if (index)
+        {
+            uint32_t block = 0;
+            if (osStrlen(chapter) > 0)
+            {
+                size_t chapterNum = strtoul(chapter, NULL, 10);
+                block = index->chapter_blocks[MIN(chapterNum, index->chapters - 1)];
+            }
+            else
+            {
+                block = taf_index_block_at(index, seekSeconds);
+            }
+            TRACE_DEBUG("Seeking to block %" PRIu32 " (%.1f s)\r\n", block, taf_index_time(index, block));
+
+            if (block > 0)
+            {
+                partLength[0] = index->header_length;
+                partOffset[1] = taf_index_offset(block);
+                partLength[1] = length - partOffset[1];
+            }
+            taf_index_release(index);
+        }
+    }
+    /* in case of skipped headers or seeking, also reduce the file length */
+    length = partLength[0] + partLength[1];
 
     // Open the file for reading
     file = fsOpenFile(file_path, FS_FILE_MODE_READ);
@@ -900,6 +1374,7 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
     }
 
     char *range_hdr = NULL;
+    uint32_t skip = 0;
 
     // Format HTTP response header
     // TODO add status 416 on invalid ranges
@@ -916,6 +1391,12 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
         connection->response.statusCode = 206;
         connection->response.contentLength = connection->request.Range.end - connection->request.Range.start + 1;
         TRACE_DEBUG("Added response range %s\r\n", connection->response.contentRange);
+
+        if (connection->request.Range.start < connection->request.Range.size)
+        {
+            skip = connection->request.Range.start;
+            length = connection->response.contentLength;
+        }
     }
     else
     {
@@ -938,42 +1419,46 @@ error_t handleApiContent(HttpConnection *connection, const char_t *uri, const ch
         return error;
     }
 
-    if (!isStream && connection->request.Range.start > 0 && connection->request.Range.start < connection->request.Range.size)
+    for (int part = 0; part < 2 && length > 0 && !error; part++)
     {
-        TRACE_DEBUG("Seeking file to %" PRIu32 "\r\n", connection->request.Range.start);
-        fsSeekFile(file, startOffset + connection->request.Range.start, FS_SEEK_SET);
-    }
-    else
-    {
-        TRACE_DEBUG("No seeking, sending from beginning\r\n");
-        fsSeekFile(file, startOffset, FS_SEEK_SET);
-    }
-
-    // Send response body
-    while (length > 0)
-    {
-        // Limit the number of bytes to read at a time
-        n = MIN(length, HTTP_SERVER_BUFFER_SIZE);
-
-        // Read data from the specified file
-        error = fsReadFile(file, connection->buffer, n, &n);
-        // End of input stream?
-        if (isStream && error == ERROR_END_OF_FILE && connection->running)
+        if (skip >= partLength[part])
         {
-            osDelayTask(500);
+            skip -= partLength[part];
             continue;
         }
-        if (error)
-            break;
+        uint32_t remaining = partLength[part] - skip;
 
-        // Send data to the client
-        error = httpWriteStream(connection, connection->buffer, n);
-        // Any error to report?
-        if (error)
-            break;
+        TRACE_DEBUG("Seeking file to %" PRIu32 "\r\n", partOffset[part] + skip);
+        fsSeekFile(file, partOffset[part] + skip, FS_SEEK_SET);
+        skip = 0;
+
+        // Send response body
+        while (remaining > 0 && length > 0)
+        {
+            // Limit the number of bytes to read at a time
+            n = MIN(MIN(length, remaining), HTTP_SERVER_BUFFER_SIZE);
+
+            // Read data from the specified file
+            error = fsReadFile(file, connection->buffer, n, &n);
+            // End of input stream?
+            if (isStream && error == ERROR_END_OF_FILE && connection->running)
+            {
+                osDelayTask(500);
+                continue;
+            }
+            if (error)
+                break;
+
+            // Send data to the client
+            error = httpWriteStream(connection, connection->buffer, n);
+            // Any error to report?
+            if (error)
+                break;
 
-        // Decrement the count of remaining bytes to be transferred
-        length -= n;
+            // Decrement the count of remaining bytes to be transferred
+            length -= n;
+            remaining -= n;
+        }
     }
 
     // Close the file
@@ -996,24 +1481,24 @@ typedef struct
 {
     const char *overlay;
     const char *file_path;
-    toniefile_t *taf;
-    uint8_t remainder[4];
-    int remainder_avail;
+    /* the encoder runs on a task of its own, so receiving goes on while it encodes */
+    pcm_encoder_t *encoder;
     uint32_t audio_id;
+    toniefile_quality_t quality;
 } taf_encode_ctx;
 
 error_t taf_encode_start(void *in_ctx, const char *name, const char *filename)
 {
     taf_encode_ctx *ctx = (taf_encode_ctx *)in_ctx;
 
-    if (!ctx->taf)
+    if (!ctx->encoder)
     {
         TRACE_INFO("[TAF] Start encoding to %s\r\n", ctx->file_path);
         TRACE_INFO("[TAF]   first file: %s\r\n", name);
 
-        ctx->taf = toniefile_create(ctx->file_path, ctx->audio_id);
+        ctx->encoder = pcm_encoder_start(ctx->file_path, ctx->audio_id, ctx->quality);
 
-        if (ctx->taf == NULL)
+        if (ctx->encoder == NULL)
         {
             TRACE_INFO("[TAF]   Creating TAF failed\r\n");
             return ERROR_FILE_OPENING_FAILED;
@@ -1022,7 +1507,7 @@ error_t taf_encode_start(void *in_ctx, const char *name, const char *filename)
     else
     {
         TRACE_INFO("[TAF]   new chapter for %s\r\n", name);
-        toniefile_new_chapter(ctx->taf);
+        return pcm_encoder_chapter(ctx->encoder);
     }
 
     return NO_ERROR;
@@ -1031,48 +1516,9 @@ error_t taf_encode_start(void *in_ctx, const char *name, const char *filename)
 error_t taf_encode_add(void *in_ctx, void *data, size_t length)
 {
     taf_encode_ctx *ctx = (taf_encode_ctx *)in_ctx;
-    uint8_t *byte_data = (uint8_t *)data;
-    size_t byte_data_start = 0;
-    size_t byte_data_length = length;
-
-    /* we have to take into account that the packets are not 4 byte aligned */
-    if (ctx->remainder_avail)
-    {
-        /* there a a few bytes, so first fill the buffer */
-        int size = 4 - ctx->remainder_avail;
-        if (size > length)
-        {
-            size = length;
-        }
-        osMemcpy(&ctx->remainder[ctx->remainder_avail], byte_data, size);
-
-        byte_data_start += size;
-        byte_data_length -= size;
-        ctx->remainder_avail += size;
-    }
-
-    /* either we have a full buffer now or no more data */
-    if (ctx->remainder_avail == 4)
-    {
-        toniefile_encode(ctx->taf, (int16_t *)ctx->remainder, 1);
-        ctx->remainder_avail = 0;
-    }
-
-    int samples = byte_data_length / 4;
-    int remain = byte_data_length % 4;
 
-    if (samples)
-    {
-        toniefile_encode(ctx->taf, (int16_t *)&byte_data[byte_data_start], samples);
-    }
-
-    if (remain)
-    {
-        osMemcpy(ctx->remainder, &byte_data[byte_data_start + samples * 4], remain);
-        ctx->remainder_avail = remain;
-    }
-
-    return NO_ERROR;
+    /* blocks while the encoder is behind, which throttles the upload */
+    return pcm_encoder_write(ctx->encoder, data, length);
 }
 
 error_t taf_encode_end(void *in_ctx)
@@ -1088,7 +1534,9 @@ error_t handleApiPcmUpload(HttpConnection *connection, const char_t *uri, const
     char uid[32];
     char path[128];
     char audio_id_str[128];
+    char qualityName[16];
     uint32_t audio_id = 0;
+    toniefile_quality_t quality = TONIEFILE_QUALITY_DEFAULT;
 
     osStrcpy(name, "unnamed");
     osStrcpy(uid, "");
@@ -1119,6 +1567,7 @@ error_t handleApiPcmUpload(HttpConnection *connection, const char_t *uri, const
     {
         osStrcpy(path, "/");
     }
+    bool_t qualityValid = !queryGet(queryString, "quality", qualityName, sizeof(qualityName)) || toniefile_quality_parse(qualityName, &quality) == NO_ERROR;
 
     sanitizePath(name, false);
 
@@ -1131,7 +1580,12 @@ error_t handleApiPcmUpload(HttpConnection *connection, const char_t *uri, const
     char message[256];
     osSnprintf(message, sizeof(message), "OK");
 
-    if (!fsDirExists(pathAbsolute))
+    if (!qualityValid)
+    {
+        statusCode = 400;
+        osSnprintf(message, sizeof(message), "Unknown quality '%s'", qualityName);
+    }
+    else if (!fsDirExists(pathAbsolute))
     {
         statusCode = 500;
         osSnprintf(message, sizeof(message), "invalid path: '%s'", path);
@@ -1166,8 +1620,22 @@ error_t handleApiPcmUpload(HttpConnection *connection, const char_t *uri, const
         ctx.file_path = filename;
         ctx.overlay = overlay;
         ctx.audio_id = audio_id;
+        ctx.quality = quality;
 
-        switch (multipart_handle(connection, &cbr, &ctx))
+        error_t error = multipart_handle(connection, &cbr, &ctx);
+
+        if (ctx.encoder)
+        {
+            /* waits for the audio still queued */
+            error_t encodeError = pcm_encoder_finish(ctx.encoder);
+            TRACE_INFO("[TAF] Ended encoding\r\n");
+            if (error == NO_ERROR)
+            {
+                error = encodeError;
+            }
+        }
+
+        switch (error)
         {
         case NO_ERROR:
             statusCode = 200;
@@ -1177,12 +1645,6 @@ error_t handleApiPcmUpload(HttpConnection *connection, const char_t *uri, const
             statusCode = 500;
             break;
         }
-
-        if (ctx.taf)
-        {
-            TRACE_INFO("[TAF] Ended encoding\r\n");
-            toniefile_close(ctx.taf);
-        }
         osFreeMem(filename);
     }
 
@@ -1276,6 +1738,7 @@ error_t handleApiDirectoryDelete(HttpConnection *connection, const char_t *uri,
     osSnprintf(message, sizeof(message), "OK");
 
     error_t err = fsRemoveDir(pathAbsolute);
+    content_index_invalidate_dir(pathAbsolute);
 
     if (err != NO_ERROR)
     {
@@ -1325,6 +1788,7 @@ error_t handleApiFileDelete(HttpConnection *connection, const char_t *uri, const
     osSnprintf(message, sizeof(message), "OK");
 
     error_t err = fsDeleteFile(pathAbsolute);
+    content_index_invalidate(pathAbsolute);
 
     if (err != NO_ERROR)
     {
@@ -8,12 +8,18 @@
 #include "handler.h"
 #include "handler_api.h"
 #include "handler_cloud.h"
+#include "cloud_queue.h"
+#include "freshness_cache.h"
+#include "content_index.h"
 #include "http/http_client.h"
 
 #include "mqtt.h"
 #include "server_helpers.h"
 
 #include "toniefile.h"
+#include "stream_session.h"
+#include "taf_playlist.h"
+#include "transcode_cache.h"
 
 error_t handleCloudTime(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
 {
@@ -158,11 +164,32 @@ error_t handleCloudLog(HttpConnection *connection, const char_t *uri, const char
 {
     if (client_ctx->settings->cloud.enabled && client_ctx->settings->cloud.enableV1Log)
     {
-        cbr_ctx_t ctx;
-        req_cbr_t cbr = getCloudCbr(connection, uri, queryString, V1_LOG, &ctx, client_ctx);
-        cloud_request_get(NULL, 0, uri, queryString, NULL, &cbr);
+        uint8_t data[CLOUD_QUEUE_BODY_LENGTH];
+        size_t size = 0;
+
+        if (connection->request.byteCount > sizeof(data))
+        {
+            TRACE_ERROR("Body size %zu bigger than buffer size %zu bytes, not forwarded\r\n", connection->request.byteCount, sizeof(data));
+        }
+        else
+        {
+            if (connection->request.byteCount > 0)
+            {
+                error_t error = httpReceive(connection, &data, sizeof(data), &size, 0x00);
+                if (error != NO_ERROR)
+                {
+                    TRACE_ERROR("httpReceive failed!\r\n");
+                    return error;
+                }
+            }
+            /* the box does not care about the answer, so don't let it wait for the cloud */
+            cloud_queue_add(V1_LOG, "POST", uri, queryString, data, size, NULL, client_ctx);
+        }
     }
-    return NO_ERROR;
+
+    httpPrepareHeader(connection, NULL, 0);
+    connection->response.statusCode = 200;
+    return httpWriteResponse(connection, NULL, 0, false);
 }
 
 error_t handleCloudClaim(HttpConnection *connection, const char_t *uri, const char_t *queryString, client_ctx_t *client_ctx)
@@ -201,8 +228,6 @@ error_t handleCloudClaim(HttpConnection *connection, const char_t *uri, const ch
     getContentPathFromCharRUID(ruid, &tonieInfo.contentPath, client_ctx->settings);
     tonieInfo = getTonieInfo(tonieInfo.contentPath, client_ctx->settings);
 
-    /* allow to override HTTP status code if needed */
-    bool served = false;
     httpPrepareHeader(connection, NULL, 0);
     connection->response.statusCode = 200;
 
@@ -215,10 +240,8 @@ error_t handleCloudClaim(HttpConnection *connection, const char_t *uri, const ch
         }
         else if (client_ctx->settings->cloud.enabled && client_ctx->settings->cloud.enableV1Claim)
         {
-            cbr_ctx_t ctx;
-            req_cbr_t cbr = getCloudCbr(connection, uri, queryString, V1_CLAIM, &ctx, client_ctx);
-            cloud_request_get(NULL, 0, uri, queryString, token, &cbr);
-            served = true;
+            /* the claim is answered right away and delivered in background */
+            cloud_queue_add(V1_CLAIM, "GET", uri, queryString, NULL, 0, token, client_ctx);
         }
         else
         {
@@ -232,10 +255,7 @@ error_t handleCloudClaim(HttpConnection *connection, const char_t *uri, const ch
 
     freeTonieInfo(&tonieInfo);
 
-    if (!served)
-    {
-        ret = httpWriteResponse(connection, NULL, 0, false);
-    }
+    ret = httpWriteResponse(connection, NULL, 0, false);
 
     return ret;
 }
@@ -341,6 +361,7 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
             osFreeMem(dir);
 
             error = fsCopyFile(assignFile, tonieInfo.contentPath, true);
+            content_index_invalidate(tonieInfo.contentPath);
             if (error != NO_ERROR)
             {
                 freeTonieInfo(&tonieInfoAssign);
@@ -357,6 +378,7 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
             {
                 TRACE_ERROR("TAF headerinvalid, delete it again: %s\r\n", tonieInfo.contentPath);
                 fsDeleteFile(tonieInfo.contentPath);
+                content_index_invalidate(tonieInfo.contentPath);
                 break;
             }
 
@@ -373,40 +395,81 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
         error = NO_ERROR;
     }
 
-    if (tonieInfo.contentConfig._stream)
+    /* streams marked to be cached are served like local content once they were encoded completely */
+    char *cachedPath = NULL;
+    if (tonieInfo.contentConfig._stream && tonieInfo.contentConfig.cache && !taf_playlist_is_playlist(tonieInfo.contentConfig.source))
     {
-        char *streamFileRel = &tonieInfo.contentConfig._streamFile[osStrlen(client_ctx->settings->internal.datadirfull)];
-        TRACE_INFO("Serve streaming content from %s\r\n", tonieInfo.contentConfig.source);
+        cachedPath = transcode_cache_lookup(tonieInfo.contentConfig.source, tonieInfo.contentConfig.skip_seconds);
+    }
+
+    /* a local file the scrubber found broken is fetched from the cloud again, if it may be */
+    bool_t refetch = taf_verify_failed(tonieInfo.verify) && client_ctx->settings->cloud.enabled &&
+                     client_ctx->settings->cloud.enableV2Content && !tonieInfo.contentConfig.nocloud;
+    if (refetch)
+    {
+        TRACE_WARNING("Local content %s is broken (%s)\r\n", tonieInfo.contentPath, taf_verify_result_name(tonieInfo.verify));
+    }
+
+    if (tonieInfo.contentConfig._stream && taf_playlist_is_playlist(tonieInfo.contentConfig.source))
+    {
+        TRACE_INFO("Serve playlist content from %s\r\n", tonieInfo.contentConfig.source);
         connection->response.keepAlive = true;
 
-        ffmpeg_stream_ctx_t ffmpeg_ctx;
-        ffmpeg_ctx.active = false;
-        ffmpeg_ctx.quit = false;
-        ffmpeg_ctx.source = tonieInfo.contentConfig.source;
-        ffmpeg_ctx.skip_seconds = tonieInfo.contentConfig.skip_seconds;
-        ffmpeg_ctx.targetFile = tonieInfo.contentConfig._streamFile;
-        ffmpeg_ctx.error = NO_ERROR;
-        ffmpeg_ctx.taskId = osCreateTask(streamFileRel, &ffmpeg_stream_task, &ffmpeg_ctx, 10 * 1024, 0);
+        /* playlists not found as they are are looked up in the library */
+        char *playlistPath = fsFileExists(tonieInfo.contentConfig.source)
+                                 ? strdup(tonieInfo.contentConfig.source)
+                                 : custom_asprintf("%s/%s", client_ctx->settings->internal.librarydirfull, tonieInfo.contentConfig.source);
+        taf_playlist_t *playlist = taf_playlist_get(playlistPath);
+        osFreeMem(playlistPath);
+        if (playlist)
+        {
+            error_t error = httpSendTafPlaylist(connection, playlist);
+            if (error)
+            {
+                TRACE_ERROR(" >> playlist %s not send, error=%u...\r\n", tonieInfo.contentConfig.source, error);
+            }
+            taf_playlist_release(playlist);
+        }
+        else
+        {
+            httpPrepareHeader(connection, NULL, 0);
+            connection->response.statusCode = 404;
+            error = httpWriteResponse(connection, NULL, 0, false);
+        }
+    }
+    else if (cachedPath)
+    {
+        TRACE_INFO("Serve cached transcode of %s from %s\r\n", tonieInfo.contentConfig.source, cachedPath);
+        connection->response.keepAlive = true;
 
-        while (!ffmpeg_ctx.active && ffmpeg_ctx.error == NO_ERROR)
+        error_t error = httpSendResponseStream(connection, &cachedPath[osStrlen(client_ctx->settings->internal.datadirfull)], false);
+        if (error)
         {
-            osDelayTask(100);
+            TRACE_ERROR(" >> file %s not available or not send, error=%u...\r\n", cachedPath, error);
         }
-        if (ffmpeg_ctx.error == NO_ERROR)
+    }
+    else if (tonieInfo.contentConfig._stream)
+    {
+        TRACE_INFO("Serve streaming content from %s\r\n", tonieInfo.contentConfig.source);
+        connection->response.keepAlive = true;
+
+        systime_t requestTime = osGetSystemTime();
+        stream_session_t *session = stream_session_join(tonieInfo.contentConfig.source, tonieInfo.contentConfig.skip_seconds, tonieInfo.contentConfig.cache);
+        if (session)
         {
-            error_t error = httpSendResponseStream(connection, streamFileRel, tonieInfo.contentConfig._stream);
+            error_t error = stream_session_wait(session);
+            if (error == NO_ERROR)
+            {
+                error = httpSendStreamBuffer(connection, stream_session_buffer(session), stream_session_backlog(session), requestTime);
+            }
             if (error)
             {
-                TRACE_ERROR(" >> file %s not available or not send, error=%u...\r\n", tonieInfo.contentPath, error);
+                TRACE_ERROR(" >> stream %s not available or not send, error=%u...\r\n", tonieInfo.contentConfig.source, error);
             }
-        }
-        ffmpeg_ctx.active = false;
-        while (!ffmpeg_ctx.quit)
-        {
-            osDelayTask(100);
+            stream_session_leave(session);
         }
     }
-    else if (tonieInfo.exists && tonieInfo.valid)
+    else if (tonieInfo.exists && tonieInfo.valid && !refetch)
     {
         TRACE_INFO("Serve local content from %s\r\n", tonieInfo.contentPath);
         connection->response.keepAlive = true;
@@ -448,6 +511,7 @@ error_t handleCloudContent(HttpConnection *connection, const char_t *uri, const
             error = NO_ERROR;
         }
     }
+    osFreeMem(cachedPath);
     freeTonieInfo(&tonieInfo);
     return error;
 }
@@ -560,7 +624,7 @@ error_t handleCloudFreshnessCheck(HttpConnection *connection, const char_t *uri,
 
                 if (tonieInfo.valid)
                 {
-                    uint32_t serverAudioId = tonieInfo.tafHeader->audio_id;
+                    uint32_t serverAudioId = tonieInfo.tafHeader.audio_id;
                     checkAudioIdForCustom(&custom_server, date_buffer_server, serverAudioId);
 
                     if (custom_server)
@@ -605,7 +669,7 @@ error_t handleCloudFreshnessCheck(HttpConnection *connection, const char_t *uri,
                 if (tonieInfo.valid)
                 {
                     TRACE_INFO_RESUME(", audioid-server: %08X (%s%s)",
-                                      tonieInfo.tafHeader->audio_id,
+                                      tonieInfo.tafHeader.audio_id,
                                       date_buffer_server,
                                       custom_server ? ", custom" : "");
                 }
@@ -619,31 +683,75 @@ error_t handleCloudFreshnessCheck(HttpConnection *connection, const char_t *uri,
                 freeTonieInfo(&tonieInfo);
             }
 
+            TonieFreshnessCheckResponse *freshRespCloud = NULL;
             if (client_ctx->settings->cloud.enabled && client_ctx->settings->cloud.enableV1FreshnessCheck)
             {
                 size_t dataLen = tonie_freshness_check_request__get_packed_size(&freshReqCloud);
                 tonie_freshness_check_request__pack(&freshReqCloud, (uint8_t *)data);
-                tonie_freshness_check_request__free_unpacked(freshReq, NULL);
+                uint64_t key = freshness_cache_key(&freshReqCloud);
 
-                osFreeMem(freshReqCloud.tonie_infos);
-                osFreeMem(freshResp.tonie_marked);
+                /* answer from the last cloud response of this box if possible and refresh it in background */
+                freshRespCloud = freshness_cache_get(client_ctx, key);
+                if (freshRespCloud)
+                {
+                    freshness_cache_revalidate(client_ctx, key, data, dataLen);
+                }
+                else
+                {
+                    freshRespCloud = freshness_cache_fetch(client_ctx, key, data, dataLen);
+                }
+            }
+            tonie_freshness_check_request__free_unpacked(freshReq, NULL);
+            osFreeMem(freshReqCloud.tonie_infos);
+
+            if (freshRespCloud)
+            {
+                /* merge the tonies marked by the cloud with the local ones */
+                uint64_t *marked = osAllocMem(sizeof(uint64_t) * (freshResp.n_tonie_marked + freshRespCloud->n_tonie_marked + 1));
+                osMemcpy(marked, freshResp.tonie_marked, sizeof(uint64_t) * freshResp.n_tonie_marked);
+                size_t markedCount = freshResp.n_tonie_marked;
 
-                cbr_ctx_t ctx;
-                req_cbr_t cbr = getCloudCbr(connection, uri, queryString, V1_FRESHNESS_CHECK, &ctx, client_ctx);
-                if (!cloud_request_post(NULL, 0, "/v1/freshness-check", queryString, data, dataLen, NULL, &cbr))
+                for (size_t i = 0; i < freshRespCloud->n_tonie_marked; i++)
                 {
-                    return NO_ERROR;
+                    bool_t found = FALSE;
+                    for (size_t j = 0; j < freshResp.n_tonie_marked; j++)
+                    {
+                        if (marked[j] == freshRespCloud->tonie_marked[i])
+                        {
+                            found = TRUE;
+                            break;
+                        }
+                    }
+                    if (!found)
+                    {
+                        marked[markedCount++] = freshRespCloud->tonie_marked[i];
+                    }
+                }
+                osFreeMem(freshResp.tonie_marked);
+                freshResp.tonie_marked = marked;
+                freshResp.n_tonie_marked = markedCount;
+
+                freshResp.field2 = freshRespCloud->field2;
+                freshResp.max_vol_spk = freshRespCloud->max_vol_spk;
+                freshResp.slap_en = freshRespCloud->slap_en;
+                freshResp.slap_dir = freshRespCloud->slap_dir;
+                freshResp.field6 = freshRespCloud->field6;
+                freshResp.max_vol_hdp = freshRespCloud->max_vol_hdp;
+                freshResp.led = freshRespCloud->led;
+                tonie_freshness_check_response__free_unpacked(freshRespCloud, NULL);
+
+                if (client_ctx->settings->toniebox.overrideCloud)
+                {
+                    setTonieboxSettings(&freshResp, client_ctx->settings);
                 }
             }
             else
             {
-                tonie_freshness_check_request__free_unpacked(freshReq, NULL);
+                setTonieboxSettings(&freshResp, client_ctx->settings);
             }
-            setTonieboxSettings(&freshResp, client_ctx->settings);
 
             size_t dataLen = tonie_freshness_check_response__get_packed_size(&freshResp);
             tonie_freshness_check_response__pack(&freshResp, (uint8_t *)data);
-            osFreeMem(freshReqCloud.tonie_infos);
             osFreeMem(freshResp.tonie_marked);
             TRACE_INFO("Freshness check response: size=%zu, content=%s\n", dataLen, data);
 
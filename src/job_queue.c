@@ -0,0 +1,1036 @@
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "job_queue.h"
+#include "toniefile.h"
+#include "opus_reader.h"
+#include "handler_sse.h"
+#include "server_helpers.h"
+#include "content_index.h"
+#include "platform.h"
+#include "settings.h"
+#include "mutex_manager.h"
+#include "stats.h"
+#include "fs_port.h"
+#include "debug.h"
+#include "os_port.h"
+
+#define JOB_QUEUE_MAGIC 0x514A5454 /* "TTJQ" */
+#define JOB_QUEUE_VERSION 1
+#define JOB_QUEUE_IDLE_MS 1000
+/* workers still converting after this time are left behind on shutdown */
+#define JOB_QUEUE_STOP_TIMEOUT_MS 10000
+/* subfolders followed when queueing a folder, also stops symlink loops */
+#define JOB_QUEUE_MAX_DEPTH 16
+
+/*
+ * The queue file is a header followed by one record per job, each followed by
+ * the target and the sources, every string with a uint16_t length in front.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+} job_queue_file_header_t;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t audio_id;
+    uint8_t state;
+    uint8_t quality;
+    uint8_t reserved[2];
+    uint32_t error;
+    uint64_t created;
+    uint64_t finished;
+    uint64_t samples;
+    uint32_t sourceCount;
+} job_queue_record_t;
+
+typedef struct job_s
+{
+    struct job_s *next;
+    uint32_t id;
+    uint32_t audio_id;
+    toniefile_quality_t quality;
+    job_state_t state;
+    error_t error;
+    uint64_t created;
+    uint64_t finished;
+    char *target;
+    char **sources;
+    size_t sourceCount;
+
+    /* progress of a running job */
+    bool_t cancel;
+    size_t source;
+    uint64_t samples;
+    uint32_t speed_pct;
+} job_t;
+
+/* ordered by id, which is the order the jobs are started in */
+static job_t *job_queue = NULL;
+static uint32_t job_queue_next_id = 1;
+static bool_t job_queue_running = FALSE;
+static uint32_t job_queue_workers = 0;
+static OsEvent job_queue_event;
+static OsEvent job_queue_stopped;
+
+static const char *job_queue_state_names[] = {"queued", "running", "done", "failed", "canceled"};
+
+static void job_free(job_t *job)
+{
+    for (size_t pos = 0; pos < job->sourceCount; pos++)
+    {
+        osFreeMem(job->sources[pos]);
+    }
+    osFreeMem(job->sources);
+    osFreeMem(job->target);
+    osFreeMem(job);
+}
+
+static bool_t job_finished(const job_t *job)
+{
+    return job->state == JOB_DONE || job->state == JOB_FAILED || job->state == JOB_CANCELED;
+}
+
+/* called with MUTEX_JOB_QUEUE held */
+static void job_queue_append(job_t *job)
+{
+    job_t **tail = &job_queue;
+    while (*tail)
+    {
+        tail = &(*tail)->next;
+    }
+    job->next = NULL;
+    *tail = job;
+    if (job->id >= job_queue_next_id)
+    {
+        job_queue_next_id = job->id + 1;
+    }
+}
+
+/* drops the oldest finished jobs beyond JOB_QUEUE_HISTORY, called with MUTEX_JOB_QUEUE held */
+static void job_queue_trim()
+{
+    size_t finished = 0;
+    for (job_t *job = job_queue; job; job = job->next)
+    {
+        if (job_finished(job))
+        {
+            finished++;
+        }
+    }
+
+    job_t **prev = &job_queue;
+    while (*prev && finished > JOB_QUEUE_HISTORY)
+    {
+        job_t *job = *prev;
+        if (!job_finished(job))
+        {
+            prev = &job->next;
+            continue;
+        }
+        *prev = job->next;
+        job_free(job);
+        finished--;
+    }
+}
+
+/* called with MUTEX_JOB_QUEUE held */
+static job_t *job_queue_find(uint32_t id)
+{
+    for (job_t *job = job_queue; job; job = job->next)
+    {
+        if (job->id == id)
+        {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static error_t job_queue_write_string(FsFile *file, const char *string)
+{
+    uint16_t length = (uint16_t)osStrlen(string);
+    error_t error = fsWriteFile(file, &length, sizeof(length));
+    if (error == NO_ERROR)
+    {
+        error = fsWriteFile(file, (void *)string, length);
+    }
+    return error;
+}
+
+static char *job_queue_read_string(FsFile *file)
+{
+    uint16_t length = 0;
+    size_t read = 0;
+    if (fsReadFile(file, &length, sizeof(length), &read) != NO_ERROR || read != sizeof(length))
+    {
+        return NULL;
+    }
+    char *string = osAllocMem(length + 1);
+    if (length > 0 && (fsReadFile(file, string, length, &read) != NO_ERROR || read != length))
+    {
+        osFreeMem(string);
+        return NULL;
+    }
+    string[length] = '\0';
+    return string;
+}
+
+static job_t *job_queue_read_job(FsFile *file)
+{
+    job_queue_record_t record;
+    size_t read = 0;
+    if (fsReadFile(file, &record, sizeof(record), &read) != NO_ERROR || read != sizeof(record) ||
+        record.sourceCount == 0 || record.sourceCount > JOB_QUEUE_MAX_SOURCES || record.state > JOB_CANCELED || record.quality >= TONIEFILE_QUALITY_COUNT)
+    {
+        return NULL;
+    }
+
+    job_t *job = osAllocMem(sizeof(job_t));
+    osMemset(job, 0x00, sizeof(job_t));
+    job->id = record.id;
+    job->audio_id = record.audio_id;
+    job->quality = (toniefile_quality_t)record.quality;
+    job->state = (job_state_t)record.state;
+    job->error = (error_t)record.error;
+    job->created = record.created;
+    job->finished = record.finished;
+    job->samples = record.samples;
+    job->sources = osAllocMem(record.sourceCount * sizeof(char *));
+    job->target = job_queue_read_string(file);
+    if (!job->target)
+    {
+        job_free(job);
+        return NULL;
+    }
+    for (uint32_t pos = 0; pos < record.sourceCount; pos++)
+    {
+        job->sources[pos] = job_queue_read_string(file);
+        if (!job->sources[pos])
+        {
+            job_free(job);
+            return NULL;
+        }
+        job->sourceCount++;
+    }
+
+    /* interrupted by a restart, start over */
+    if (job->state == JOB_RUNNING)
+    {
+        job->state = JOB_QUEUED;
+        job->samples = 0;
+    }
+    return job;
+}
+
+static void job_queue_load()
+{
+    FsFile *file = fsOpenFile(JOB_QUEUE_PATH, FS_FILE_MODE_READ);
+    if (file == NULL)
+    {
+        return;
+    }
+
+    job_queue_file_header_t header;
+    size_t read = 0;
+    if (fsReadFile(file, &header, sizeof(header), &read) != NO_ERROR || read != sizeof(header) ||
+        header.magic != JOB_QUEUE_MAGIC || header.version != JOB_QUEUE_VERSION)
+    {
+        TRACE_WARNING("Ignoring incompatible job queue file %s\r\n", JOB_QUEUE_PATH);
+        fsCloseFile(file);
+        return;
+    }
+
+    size_t pending = 0;
+    for (uint32_t pos = 0; pos < header.count; pos++)
+    {
+        job_t *job = job_queue_read_job(file);
+        if (!job)
+        {
+            TRACE_WARNING("Job queue file %s is truncated\r\n", JOB_QUEUE_PATH);
+            break;
+        }
+        if (!job_finished(job))
+        {
+            pending++;
+        }
+        job_queue_append(job);
+    }
+    fsCloseFile(file);
+
+    if (pending > 0)
+    {
+        TRACE_INFO("Restored %" PRIuSIZE " pending conversion jobs\r\n", pending);
+    }
+}
+
+static void job_queue_save()
+{
+    const char *tmpPath = JOB_QUEUE_PATH ".tmp";
+
+    mutex_lock(MUTEX_JOB_QUEUE);
+    job_queue_file_header_t header = {
+        .magic = JOB_QUEUE_MAGIC,
+        .version = JOB_QUEUE_VERSION,
+        .count = 0};
+
+    for (job_t *job = job_queue; job; job = job->next)
+    {
+        header.count++;
+    }
+
+    if (header.count == 0)
+    {
+        fsDeleteFile(JOB_QUEUE_PATH);
+        mutex_unlock(MUTEX_JOB_QUEUE);
+        return;
+    }
+
+    FsFile *file = fsOpenFile(tmpPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file == NULL)
+    {
+        mutex_unlock(MUTEX_JOB_QUEUE);
+        TRACE_ERROR("Could not open %s for writing\r\n", tmpPath);
+        return;
+    }
+
+    error_t error = fsWriteFile(file, &header, sizeof(header));
+    for (job_t *job = job_queue; job && error == NO_ERROR; job = job->next)
+    {
+        job_queue_record_t record;
+        osMemset(&record, 0x00, sizeof(record));
+        record.id = job->id;
+        record.audio_id = job->audio_id;
+        record.quality = (uint8_t)job->quality;
+        record.state = (uint8_t)job->state;
+        record.error = (uint32_t)job->error;
+        record.created = job->created;
+        record.finished = job->finished;
+        record.samples = job->samples;
+        record.sourceCount = (uint32_t)job->sourceCount;
+
+        error = fsWriteFile(file, &record, sizeof(record));
+        if (error == NO_ERROR)
+        {
+            error = job_queue_write_string(file, job->target);
+        }
+        for (size_t pos = 0; pos < job->sourceCount && error == NO_ERROR; pos++)
+        {
+            error = job_queue_write_string(file, job->sources[pos]);
+        }
+    }
+    fsCloseFile(file);
+
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Could not write %s, error=%" PRIu32 "\r\n", tmpPath, (uint32_t)error);
+        fsDeleteFile(tmpPath);
+    }
+    else
+    {
+        fsDeleteFile(JOB_QUEUE_PATH);
+        fsRenameFile(tmpPath, JOB_QUEUE_PATH);
+    }
+    mutex_unlock(MUTEX_JOB_QUEUE);
+}
+
+/* called with MUTEX_JOB_QUEUE held */
+static cJSON *job_to_json(const job_t *job)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "id", job->id);
+    cJSON_AddStringToObject(json, "state", job_queue_state_names[job->state]);
+    cJSON_AddStringToObject(json, "target", job->target);
+    cJSON_AddNumberToObject(json, "sources", job->sourceCount);
+    cJSON_AddStringToObject(json, "quality", toniefile_quality_name(job->quality));
+    cJSON_AddNumberToObject(json, "created", job->created);
+
+    if (job->state == JOB_RUNNING)
+    {
+        cJSON_AddStringToObject(json, "current", job->sources[job->source]);
+        cJSON_AddNumberToObject(json, "progress", job->source * 100 / job->sourceCount);
+        cJSON_AddNumberToObject(json, "speed", job->speed_pct / 100.0);
+    }
+    else if (job_finished(job))
+    {
+        cJSON_AddNumberToObject(json, "finished", job->finished);
+        cJSON_AddNumberToObject(json, "progress", job->state == JOB_DONE ? 100 : 0);
+    }
+    else
+    {
+        cJSON_AddNumberToObject(json, "progress", 0);
+    }
+    if (job->state == JOB_FAILED)
+    {
+        cJSON_AddNumberToObject(json, "error", job->error);
+    }
+    cJSON_AddNumberToObject(json, "audio_s", (double)(job->samples / OPUS_SAMPLING_RATE));
+
+    return json;
+}
+
+/* sends the state of a job as SSE event, the JSON is created while it can not be trimmed */
+static void job_queue_send(cJSON *json)
+{
+    char *jsonString = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    sse_sendEvent("job", jsonString, false);
+    osFreeMem(jsonString);
+}
+
+/* only for running jobs, finished ones might get trimmed any time */
+static void job_queue_notify(job_t *job)
+{
+    mutex_lock(MUTEX_JOB_QUEUE);
+    cJSON *json = job_to_json(job);
+    mutex_unlock(MUTEX_JOB_QUEUE);
+
+    job_queue_send(json);
+}
+
+static bool_t job_queue_canceled(job_t *job)
+{
+    mutex_lock(MUTEX_JOB_QUEUE);
+    bool_t cancel = job->cancel || !job_queue_running;
+    mutex_unlock(MUTEX_JOB_QUEUE);
+
+    return cancel;
+}
+
+static void job_queue_progress(job_t *job, size_t samples, systime_t start, systime_t *lastEvent)
+{
+    systime_t now = osGetSystemTime();
+    mutex_lock(MUTEX_JOB_QUEUE);
+    job->samples += samples;
+    job->speed_pct = (uint32_t)(job->samples * 100 * 1000 / OPUS_SAMPLING_RATE / MAX(now - start, 1));
+    mutex_unlock(MUTEX_JOB_QUEUE);
+
+    if (now - *lastEvent >= JOB_QUEUE_PROGRESS_MS)
+    {
+        *lastEvent = now;
+        job_queue_notify(job);
+    }
+}
+
+/* copies the packets of an Opus source into the TAF without encoding them again */
+static error_t job_queue_remux_source(job_t *job, toniefile_t *taf, opus_reader_t *reader, systime_t start)
+{
+    const char *source = job->sources[job->source];
+    error_t error = NO_ERROR;
+    uint64_t samples_source = 0;
+    systime_t lastEvent = osGetSystemTime();
+
+    stats_update("decode_remux", 1);
+
+    while (TRUE)
+    {
+        if (job_queue_canceled(job))
+        {
+            error = ERROR_ABORTED;
+            break;
+        }
+
+        const uint8_t *packet;
+        size_t length;
+        uint32_t samples;
+        error = opus_reader_read(reader, &packet, &length, &samples);
+        if (error == ERROR_END_OF_STREAM)
+        {
+            error = NO_ERROR;
+            break;
+        }
+        else if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Could not read %s, error=%" PRIu16 "\r\n", source, error);
+            break;
+        }
+
+        error = toniefile_remux_packet(taf, packet, length);
+        if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Could not remux %s, error=%" PRIu16 "\r\n", source, error);
+            break;
+        }
+        samples_source += samples;
+        job_queue_progress(job, samples, start, &lastEvent);
+    }
+    opus_reader_close(reader);
+
+    if (error == NO_ERROR && samples_source == 0)
+    {
+        TRACE_ERROR("No audio in %s\r\n", source);
+        error = ERROR_INVALID_FILE;
+    }
+    return error;
+}
+
+/* decodes one source into the TAF, with the job progress updated on the way */
+static error_t job_queue_convert_source(job_t *job, toniefile_t *taf, int16_t *sample_buffer, size_t samples, systime_t start)
+{
+    const char *source = job->sources[job->source];
+
+    /* Opus sources keep their packets, everything else is decoded and encoded */
+    opus_reader_t *reader = opus_reader_open(source);
+    if (reader)
+    {
+        return job_queue_remux_source(job, taf, reader, start);
+    }
+
+    ffmpeg_decoder_t *decoder = ffmpeg_decode_audio_start(source);
+    if (decoder == NULL)
+    {
+        return ERROR_FAILURE;
+    }
+
+    error_t error = NO_ERROR;
+    uint64_t samples_source = 0;
+    systime_t lastEvent = osGetSystemTime();
+
+    while (TRUE)
+    {
+        if (job_queue_canceled(job))
+        {
+            error = ERROR_ABORTED;
+            break;
+        }
+
+        size_t samples_read = 0;
+        error = ffmpeg_decode_audio(decoder, sample_buffer, samples, &samples_read);
+        if (error == ERROR_TIMEOUT)
+        {
+            error = NO_ERROR;
+            continue;
+        }
+        else if (error == ERROR_END_OF_STREAM)
+        {
+            error = NO_ERROR;
+            break;
+        }
+        else if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Could not decode %s, error=%" PRIu16 "\r\n", source, error);
+            break;
+        }
+
+        error = toniefile_encode(taf, sample_buffer, samples_read / OPUS_CHANNELS);
+        if (error != NO_ERROR && error != ERROR_END_OF_STREAM)
+        {
+            TRACE_ERROR("Could not encode %s, error=%" PRIu16 "\r\n", source, error);
+            break;
+        }
+        error = NO_ERROR;
+        samples_source += samples_read / OPUS_CHANNELS;
+        job_queue_progress(job, samples_read / OPUS_CHANNELS, start, &lastEvent);
+    }
+    ffmpeg_decode_audio_end(decoder, error);
+
+    /* ffmpeg closes its output right away when it cannot read the source */
+    if (error == NO_ERROR && samples_source == 0)
+    {
+        TRACE_ERROR("No audio decoded from %s\r\n", source);
+        error = ERROR_INVALID_FILE;
+    }
+    return error;
+}
+
+static error_t job_queue_convert(job_t *job)
+{
+    TRACE_INFO("Converting %" PRIuSIZE " files to %s\r\n", job->sourceCount, job->target);
+
+    /* only replace an existing TAF once the new one is complete */
+    char *tmpPath = custom_asprintf("%s.tmp", job->target);
+    uint32_t audio_id = job->audio_id ? job->audio_id : (uint32_t)time(NULL);
+    toniefile_t *taf = toniefile_create_serial(tmpPath, audio_id);
+    if (!taf)
+    {
+        osFreeMem(tmpPath);
+        return ERROR_FILE_OPENING_FAILED;
+    }
+    toniefile_set_quality(taf, job->quality);
+
+    size_t samples = FFMPEG_PCM_FRAMES * FFMPEG_PCM_FRAME_BYTES / sizeof(int16_t);
+    int16_t *sample_buffer = osAllocMem(samples * sizeof(int16_t));
+    systime_t start = osGetSystemTime();
+    error_t error = NO_ERROR;
+
+    for (size_t pos = 0; pos < job->sourceCount && error == NO_ERROR; pos++)
+    {
+        mutex_lock(MUTEX_JOB_QUEUE);
+        job->source = pos;
+        mutex_unlock(MUTEX_JOB_QUEUE);
+
+        if (pos > 0)
+        {
+            error = toniefile_new_chapter(taf);
+        }
+        if (error == NO_ERROR)
+        {
+            error = job_queue_convert_source(job, taf, sample_buffer, samples, start);
+        }
+    }
+    toniefile_close(taf);
+    osFreeMem(sample_buffer);
+
+    if (error == NO_ERROR)
+    {
+        fsDeleteFile(job->target);
+        error = fsRenameFile(tmpPath, job->target);
+        content_index_invalidate(job->target);
+    }
+    if (error != NO_ERROR)
+    {
+        fsDeleteFile(tmpPath);
+    }
+    osFreeMem(tmpPath);
+
+    return error;
+}
+
+static void job_queue_worker(void *arg)
+{
+    platform_set_task_background();
+
+    while (TRUE)
+    {
+        mutex_lock(MUTEX_JOB_QUEUE);
+        bool_t running = job_queue_running;
+        job_t *job = NULL;
+        bool_t queued = FALSE;
+        for (job_t *current = job_queue; current && running; current = current->next)
+        {
+            if (current->state != JOB_QUEUED)
+            {
+                continue;
+            }
+            if (job)
+            {
+                queued = TRUE;
+                break;
+            }
+            job = current;
+        }
+        if (job)
+        {
+            job->state = JOB_RUNNING;
+            job->source = 0;
+            job->samples = 0;
+            job->speed_pct = 0;
+        }
+        mutex_unlock(MUTEX_JOB_QUEUE);
+
+        if (!running)
+        {
+            break;
+        }
+        if (!job)
+        {
+            osWaitForEvent(&job_queue_event, JOB_QUEUE_IDLE_MS);
+            continue;
+        }
+        /* the event only wakes one worker, pass it on */
+        if (queued)
+        {
+            osSetEvent(&job_queue_event);
+        }
+
+        job_queue_save();
+        job_queue_notify(job);
+
+        error_t error = job_queue_convert(job);
+
+        mutex_lock(MUTEX_JOB_QUEUE);
+        if (error == ERROR_ABORTED && !job->cancel)
+        {
+            /* shutting down, the job is started again after the restart */
+            job->state = JOB_QUEUED;
+            job->samples = 0;
+        }
+        else
+        {
+            job->state = (error == NO_ERROR) ? JOB_DONE : (job->cancel ? JOB_CANCELED : JOB_FAILED);
+            job->error = error;
+            job->finished = (uint64_t)time(NULL);
+        }
+        uint32_t id = job->id;
+        job_state_t state = job->state;
+        cJSON *json = job_to_json(job);
+        job_queue_trim();
+        mutex_unlock(MUTEX_JOB_QUEUE);
+
+        switch (state)
+        {
+        case JOB_DONE:
+            TRACE_INFO("Job %" PRIu32 " finished\r\n", id);
+            stats_update("jobs_done", 1);
+            break;
+        case JOB_CANCELED:
+            TRACE_INFO("Job %" PRIu32 " canceled\r\n", id);
+            stats_update("jobs_canceled", 1);
+            break;
+        case JOB_FAILED:
+            TRACE_ERROR("Job %" PRIu32 " failed with error %" PRIu32 "\r\n", id, (uint32_t)error);
+            stats_update("jobs_failed", 1);
+            break;
+        default:
+            break;
+        }
+        job_queue_send(json);
+        job_queue_save();
+    }
+
+    mutex_lock(MUTEX_JOB_QUEUE);
+    job_queue_workers--;
+    mutex_unlock(MUTEX_JOB_QUEUE);
+    osSetEvent(&job_queue_stopped);
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void job_queue_init()
+{
+    job_queue = NULL;
+    job_queue_next_id = 1;
+    job_queue_load();
+
+    osCreateEvent(&job_queue_event);
+    osCreateEvent(&job_queue_stopped);
+    job_queue_running = TRUE;
+
+    uint32_t workers = settings_get_unsigned("core.job_threads");
+    if (workers == 0)
+    {
+        workers = platform_get_cpu_count();
+    }
+    for (uint32_t worker = 0; worker < workers; worker++)
+    {
+        mutex_lock(MUTEX_JOB_QUEUE);
+        job_queue_workers++;
+        mutex_unlock(MUTEX_JOB_QUEUE);
+
+        if (osCreateTask("JobWorker", &job_queue_worker, NULL, 10 * 1024, 0) == OS_INVALID_TASK_ID)
+        {
+            TRACE_ERROR("Failed to start job worker %" PRIu32 "\r\n", worker);
+            mutex_lock(MUTEX_JOB_QUEUE);
+            job_queue_workers--;
+            mutex_unlock(MUTEX_JOB_QUEUE);
+            break;
+        }
+    }
+}
+
+void job_queue_deinit()
+{
+    if (!job_queue_running)
+    {
+        return;
+    }
+    mutex_lock(MUTEX_JOB_QUEUE);
+    job_queue_running = FALSE;
+    mutex_unlock(MUTEX_JOB_QUEUE);
+
+    /* running conversions notice the flag with the next block of audio and stop ffmpeg */
+    systime_t start = osGetSystemTime();
+    uint32_t workers = 0;
+    while (TRUE)
+    {
+        osSetEvent(&job_queue_event);
+        mutex_lock(MUTEX_JOB_QUEUE);
+        workers = job_queue_workers;
+        mutex_unlock(MUTEX_JOB_QUEUE);
+        if (workers == 0 || osGetSystemTime() - start >= JOB_QUEUE_STOP_TIMEOUT_MS)
+        {
+            break;
+        }
+        osWaitForEvent(&job_queue_stopped, 100);
+    }
+    job_queue_save();
+    if (workers > 0)
+    {
+        TRACE_WARNING("%" PRIu32 " job workers did not stop in time\r\n", workers);
+        return;
+    }
+
+    while (job_queue)
+    {
+        job_t *job = job_queue;
+        job_queue = job->next;
+        job_free(job);
+    }
+    osDeleteEvent(&job_queue_event);
+    osDeleteEvent(&job_queue_stopped);
+}
+
+error_t job_queue_add(const char *target, const char *const *sources, size_t count, uint32_t audio_id, toniefile_quality_t quality, uint32_t *id)
+{
+    if (count == 0 || count > JOB_QUEUE_MAX_SOURCES)
+    {
+        TRACE_ERROR("Job for %s has %" PRIuSIZE " sources, allowed are 1 to %d\r\n", target, count, JOB_QUEUE_MAX_SOURCES);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (quality >= TONIEFILE_QUALITY_COUNT)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    job_t *job = osAllocMem(sizeof(job_t));
+    osMemset(job, 0x00, sizeof(job_t));
+    job->audio_id = audio_id;
+    job->quality = quality;
+    job->state = JOB_QUEUED;
+    job->created = (uint64_t)time(NULL);
+    job->target = strdup(target);
+    job->sources = osAllocMem(count * sizeof(char *));
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        job->sources[pos] = strdup(sources[pos]);
+    }
+    job->sourceCount = count;
+
+    mutex_lock(MUTEX_JOB_QUEUE);
+    job->id = job_queue_next_id;
+    job_queue_append(job);
+    if (id)
+    {
+        *id = job->id;
+    }
+    TRACE_INFO("Queued job %" PRIu32 " converting %" PRIuSIZE " files to %s\r\n", job->id, count, target);
+    cJSON *json = job_to_json(job);
+    mutex_unlock(MUTEX_JOB_QUEUE);
+
+    stats_update("jobs_queued", 1);
+    job_queue_save();
+    job_queue_send(json);
+    osSetEvent(&job_queue_event);
+
+    return NO_ERROR;
+}
+
+static bool_t job_queue_is_audio(const char *name)
+{
+    static const char *extensions[] = {".mp3", ".m4a", ".m4b", ".aac", ".ogg", ".oga", ".opus", ".flac", ".wav", ".wma", ".aif", ".aiff"};
+
+    const char *ext = strrchr(name, '.');
+    if (!ext)
+    {
+        return FALSE;
+    }
+    for (size_t pos = 0; pos < sizeof(extensions) / sizeof(extensions[0]); pos++)
+    {
+        if (!osStrcasecmp(ext, extensions[pos]))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static int job_queue_compare_name(const void *a, const void *b)
+{
+    return osStrcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void job_queue_add_name(char ***names, size_t *count, size_t *size, const char *name)
+{
+    if (*count == *size)
+    {
+        *size = *size ? *size * 2 : 16;
+        char **grown = osAllocMem(*size * sizeof(char *));
+        if (*count > 0)
+        {
+            osMemcpy(grown, *names, *count * sizeof(char *));
+        }
+        osFreeMem(*names);
+        *names = grown;
+    }
+    (*names)[(*count)++] = strdup(name);
+}
+
+static void job_queue_free_names(char **names, size_t count)
+{
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        osFreeMem(names[pos]);
+    }
+    osFreeMem(names);
+}
+
+static error_t job_queue_add_dir(const char *path, bool_t recursive, bool_t overwrite, toniefile_quality_t quality, size_t depth, size_t *added)
+{
+    FsDir *dir = fsOpenDir(path);
+    if (dir == NULL)
+    {
+        return ERROR_DIRECTORY_NOT_FOUND;
+    }
+
+    char **files = NULL;
+    size_t fileCount = 0;
+    size_t fileSize = 0;
+    char **dirs = NULL;
+    size_t dirCount = 0;
+    size_t dirSize = 0;
+
+    FsDirEntry dirEntry;
+    while (fsReadDir(dir, &dirEntry) == NO_ERROR)
+    {
+        if (!osStrcmp(dirEntry.name, ".") || !osStrcmp(dirEntry.name, ".."))
+        {
+            continue;
+        }
+        if (dirEntry.attributes & FS_FILE_ATTR_DIRECTORY)
+        {
+            job_queue_add_name(&dirs, &dirCount, &dirSize, dirEntry.name);
+        }
+        else if (job_queue_is_audio(dirEntry.name))
+        {
+            job_queue_add_name(&files, &fileCount, &fileSize, dirEntry.name);
+        }
+    }
+    fsCloseDir(dir);
+
+    error_t error = NO_ERROR;
+    if (fileCount > 0)
+    {
+        qsort(files, fileCount, sizeof(char *), &job_queue_compare_name);
+
+        /* the TAF is named after the folder it is stored in */
+        size_t length = osStrlen(path);
+        while (length > 1 && path[length - 1] == '/')
+        {
+            length--;
+        }
+        size_t nameStart = length;
+        while (nameStart > 0 && path[nameStart - 1] != '/')
+        {
+            nameStart--;
+        }
+        char *folder = custom_asprintf("%.*s", (int)(length - nameStart), &path[nameStart]);
+        char *target = custom_asprintf("%.*s%c%s.taf", (int)length, path, '/', osStrlen(folder) ? folder : "library");
+        osFreeMem(folder);
+
+        if (fileCount > JOB_QUEUE_MAX_SOURCES)
+        {
+            TRACE_WARNING("Skipping %s, %" PRIuSIZE " files are more than the %d chapters a TAF can have\r\n", path, fileCount, JOB_QUEUE_MAX_SOURCES);
+        }
+        else if (!overwrite && fsFileExists(target))
+        {
+            TRACE_INFO("Skipping %s, %s already exists\r\n", path, target);
+        }
+        else
+        {
+            for (size_t pos = 0; pos < fileCount; pos++)
+            {
+                char *source = custom_asprintf("%.*s%c%s", (int)length, path, '/', files[pos]);
+                osFreeMem(files[pos]);
+                files[pos] = source;
+            }
+            error = job_queue_add(target, (const char *const *)files, fileCount, 0, quality, NULL);
+            if (error == NO_ERROR)
+            {
+                (*added)++;
+            }
+        }
+        osFreeMem(target);
+    }
+    job_queue_free_names(files, fileCount);
+
+    if (recursive && depth < JOB_QUEUE_MAX_DEPTH)
+    {
+        qsort(dirs, dirCount, sizeof(char *), &job_queue_compare_name);
+        for (size_t pos = 0; pos < dirCount && error == NO_ERROR; pos++)
+        {
+            char *subdir = custom_asprintf("%s%c%s", path, '/', dirs[pos]);
+            error = job_queue_add_dir(subdir, recursive, overwrite, quality, depth + 1, added);
+            osFreeMem(subdir);
+        }
+    }
+    job_queue_free_names(dirs, dirCount);
+
+    return error;
+}
+
+error_t job_queue_add_path(const char *path, bool_t recursive, bool_t overwrite, toniefile_quality_t quality, size_t *added)
+{
+    *added = 0;
+
+    if (fsDirExists(path))
+    {
+        return job_queue_add_dir(path, recursive, overwrite, quality, 0, added);
+    }
+    if (!fsFileExists(path) || !job_queue_is_audio(path))
+    {
+        TRACE_ERROR("%s is no audio file or folder\r\n", path);
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    const char *ext = strrchr(path, '.');
+    char *target = custom_asprintf("%.*s.taf", (int)(ext - path), path);
+    error_t error = NO_ERROR;
+
+    if (!overwrite && fsFileExists(target))
+    {
+        TRACE_INFO("Skipping %s, %s already exists\r\n", path, target);
+    }
+    else
+    {
+        error = job_queue_add(target, &path, 1, 0, quality, NULL);
+        if (error == NO_ERROR)
+        {
+            *added = 1;
+        }
+    }
+    osFreeMem(target);
+
+    return error;
+}
+
+error_t job_queue_cancel(uint32_t id)
+{
+    mutex_lock(MUTEX_JOB_QUEUE);
+    job_t *job = job_queue_find(id);
+    if (!job || job_finished(job))
+    {
+        mutex_unlock(MUTEX_JOB_QUEUE);
+        return ERROR_NOT_FOUND;
+    }
+
+    /* a running job is finished by its worker */
+    job->cancel = TRUE;
+    cJSON *json = NULL;
+    if (job->state == JOB_QUEUED)
+    {
+        job->state = JOB_CANCELED;
+        job->finished = (uint64_t)time(NULL);
+        json = job_to_json(job);
+        job_queue_trim();
+    }
+    mutex_unlock(MUTEX_JOB_QUEUE);
+
+    TRACE_INFO("Canceling job %" PRIu32 "\r\n", id);
+    if (json)
+    {
+        stats_update("jobs_canceled", 1);
+        job_queue_save();
+        job_queue_send(json);
+    }
+
+    return NO_ERROR;
+}
+
+cJSON *job_queue_list()
+{
+    cJSON *jsonArray = cJSON_CreateArray();
+
+    mutex_lock(MUTEX_JOB_QUEUE);
+    for (job_t *job = job_queue; job; job = job->next)
+    {
+        cJSON_AddItemToArray(jsonArray, job_to_json(job));
+    }
+    mutex_unlock(MUTEX_JOB_QUEUE);
+
+    return jsonArray;
+}
@@ -27,6 +27,15 @@
 #include "mqtt.h"
 #include "cert.h"
 #include "toniefile.h"
+#include "taf_edit.h"
+#include "encode_bench.h"
+#include "taf_verify.h"
+#include "opus_reader.h"
+#include "opus.h"
+#include "ogg/ogg.h"
+#include "platform.h"
+#include "server_helpers.h"
+#include "proto/toniebox.pb.taf-header.pb-c.h"
 
 void platform_init(void);
 void platform_deinit(void);
@@ -116,6 +125,221 @@ bool parse_url(const char *url, char **hostname, uint16_t *port, char **uri, Pro
     return true;
 }
 
+typedef void (*taf_test_file_cbr_t)(const char *path, void *ctx);
+
+/* calls cbr for a file or recursively for the files of a directory whose name passes the filter, all if it is NULL */
+static void taf_test_walk(const char *path, bool_t (*filter)(const char *name), taf_test_file_cbr_t cbr, void *ctx)
+{
+    FsDir *dir = fsOpenDir(path);
+    if (!dir)
+    {
+        cbr(path, ctx);
+        return;
+    }
+
+    FsDirEntry entry;
+    while (fsReadDir(dir, &entry) == NO_ERROR)
+    {
+        if (!osStrcmp(entry.name, ".") || !osStrcmp(entry.name, ".."))
+        {
+            continue;
+        }
+        char *entryPath = custom_asprintf("%s/%s", path, entry.name);
+        if (entry.attributes & FS_FILE_ATTR_DIRECTORY)
+        {
+            taf_test_walk(entryPath, filter, cbr, ctx);
+        }
+        else if (!filter || filter(entry.name))
+        {
+            cbr(entryPath, ctx);
+        }
+        osFreeMem(entryPath);
+    }
+    fsCloseDir(dir);
+}
+
+typedef struct
+{
+    size_t files;
+    size_t valid;
+    size_t mismatches;
+} taf_header_test_t;
+
+/* compares toniefile_header_decode() with the protobuf-c decoder for one file */
+static void taf_header_test_file(const char *path, void *ctx)
+{
+    taf_header_test_t *result = (taf_header_test_t *)ctx;
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    if (!file)
+    {
+        return;
+    }
+
+    uint8_t buffer[TAF_HEADER_SIZE];
+    size_t read_length = 0;
+    fsReadFile(file, buffer, 4, &read_length);
+    uint32_t protobufSize = (read_length == 4) ? (uint32_t)((buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3]) : 0;
+    if (read_length != 4 || protobufSize > sizeof(buffer) || fsReadFile(file, buffer, protobufSize, &read_length) != NO_ERROR || read_length != protobufSize)
+    {
+        fsCloseFile(file);
+        return;
+    }
+    fsCloseFile(file);
+    result->files++;
+
+    toniefile_header_t header;
+    bool_t decoded = (toniefile_header_decode(buffer, protobufSize, &header) == NO_ERROR);
+    TonieboxAudioFileHeader *tafHeader = toniebox_audio_file_header__unpack(NULL, protobufSize, buffer);
+
+    bool_t equal = (decoded == (tafHeader != NULL));
+    if (equal && tafHeader)
+    {
+        size_t chapters = MIN(tafHeader->n_track_page_nums, TONIEFILE_MAX_CHAPTERS);
+        size_t sha1Len = MIN(tafHeader->sha1_hash.len, sizeof(header.sha1_hash));
+
+        equal = header.audio_id == tafHeader->audio_id &&
+                header.num_bytes == tafHeader->num_bytes &&
+                header.sha1_hash_len == sha1Len &&
+                !osMemcmp(header.sha1_hash, tafHeader->sha1_hash.data, sha1Len) &&
+                header.n_track_page_nums == chapters &&
+                !osMemcmp(header.track_page_nums, tafHeader->track_page_nums, chapters * sizeof(uint32_t));
+        result->valid++;
+    }
+    toniebox_audio_file_header__free_unpacked(tafHeader, NULL);
+
+    if (!equal)
+    {
+        TRACE_ERROR("Header decoders disagree on %s\r\n", path);
+        result->mismatches++;
+    }
+}
+
+typedef struct
+{
+    size_t files;
+    size_t broken;
+    uint64_t bytes;
+} taf_verify_test_t;
+
+static void taf_verify_test_file(const char *path, void *ctx)
+{
+    taf_verify_test_t *result = (taf_verify_test_t *)ctx;
+    taf_verify_info_t info;
+    taf_verify_result_t verify = taf_verify_file(path, 0, NULL, &info);
+
+    result->files++;
+    result->bytes += info.bytes;
+    if (verify != TAF_VERIFY_OK)
+    {
+        TRACE_ERROR("%s: %s in block %" PRIu32 "\r\n", path, taf_verify_result_name(verify), info.block);
+        result->broken++;
+    }
+}
+
+/* in directories only .taf files and the ones of the content dir, which are named by 8 hex digits */
+static bool_t taf_verify_test_name(const char *name)
+{
+    size_t length = osStrlen(name);
+    if (length > 4 && !osStrcasecmp(&name[length - 4], ".taf"))
+    {
+        return TRUE;
+    }
+    return length == 8 && strspn(name, "0123456789ABCDEFabcdef") == 8;
+}
+
+/* writes an Ogg Opus file with one second of silence and the given pre-skip */
+static bool_t opus_remux_test_write(const char *path, uint16_t preSkip)
+{
+    int opusError = OPUS_OK;
+    OpusEncoder *encoder = opus_encoder_create(OPUS_SAMPLING_RATE, OPUS_CHANNELS, OPUS_APPLICATION_AUDIO, &opusError);
+    if (!encoder)
+    {
+        return FALSE;
+    }
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (!file)
+    {
+        opus_encoder_destroy(encoder);
+        return FALSE;
+    }
+
+    uint8_t head[] = {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, OPUS_CHANNELS, preSkip & 0xFF, preSkip >> 8,
+                      OPUS_SAMPLING_RATE & 0xFF, (OPUS_SAMPLING_RATE >> 8) & 0xFF, 0, 0, 0, 0, 0};
+    uint8_t tags[] = {'O', 'p', 'u', 's', 'T', 'a', 'g', 's', 0, 0, 0, 0, 0, 0, 0, 0};
+    int16_t silence[960 * OPUS_CHANNELS] = {0};
+    uint8_t packet[1500];
+    size_t packets = 2 + OPUS_SAMPLING_RATE / 960;
+    uint64_t granule = preSkip;
+    bool_t written = TRUE;
+
+    ogg_stream_state os;
+    ogg_stream_init(&os, 0x7E57);
+    for (size_t pos = 0; pos < packets && written; pos++)
+    {
+        ogg_packet op;
+        osMemset(&op, 0x00, sizeof(op));
+        op.packetno = pos;
+        if (pos == 0)
+        {
+            op.packet = head;
+            op.bytes = sizeof(head);
+            op.b_o_s = 1;
+        }
+        else if (pos == 1)
+        {
+            op.packet = tags;
+            op.bytes = sizeof(tags);
+        }
+        else
+        {
+            int length = opus_encode(encoder, silence, 960, packet, sizeof(packet));
+            granule += 960;
+            op.packet = packet;
+            op.bytes = (length > 0) ? length : 0;
+            op.granulepos = granule;
+            op.e_o_s = (pos == packets - 1);
+            written = (length > 0);
+        }
+        ogg_stream_packetin(&os, &op);
+
+        /* the header packets have to be on pages of their own */
+        ogg_page og;
+        while (written && ogg_stream_flush(&os, &og))
+        {
+            written = fsWriteFile(file, og.header, og.header_len) == NO_ERROR && fsWriteFile(file, og.body, og.body_len) == NO_ERROR;
+        }
+    }
+    ogg_stream_clear(&os);
+    fsCloseFile(file);
+    opus_encoder_destroy(encoder);
+
+    return written;
+}
+
+/* Opus sources are only remuxed if their pre-skip matches the one of the TAF */
+static bool_t opus_remux_test(uint16_t preSkip)
+{
+    const char *path = "opus_remux_test.opus";
+    if (!opus_remux_test_write(path, preSkip))
+    {
+        TRACE_ERROR("Could not write %s\r\n", path);
+        return FALSE;
+    }
+
+    bool_t expected = (preSkip == OPUS_PRE_SKIP);
+    opus_reader_t *reader = opus_reader_open(path);
+    bool_t passed = ((reader != NULL) == expected);
+    if (reader)
+    {
+        passed &= (opus_reader_duration(reader) == OPUS_SAMPLING_RATE);
+        opus_reader_close(reader);
+    }
+    fsDeleteFile(path);
+
+    TRACE_INFO("Pre-skip %" PRIu16 ": %s, expected %s\r\n", preSkip, (reader != NULL) ? "remuxed" : "decoded", expected ? "remuxed" : "decoded");
+    return passed;
+}
+
 int_t main(int argc, char *argv[])
 {
     TRACE_PRINTF(BUILD_FULL_NAME_LONG "\r\n\r\n");
@@ -307,6 +531,102 @@ int_t main(int argc, char *argv[])
 
             return 1;
         }
+        else if (!strcasecmp(type, "BENCH_ENCODE"))
+        {
+            if (argc < 3)
+            {
+                TRACE_ERROR("Usage: %s BENCH_ENCODE <result.json|-> [audio files...]\r\n", argv[0]);
+                return -1;
+            }
+            error_t benchError = encode_bench_run(argv[2], "bench_encode.taf", (const char *const *)&argv[3], argc - 3);
+
+            return (benchError == NO_ERROR) ? 1 : -1;
+        }
+        else if (!strcasecmp(type, "TAFHEADER_TEST"))
+        {
+            if (argc != 3)
+            {
+                TRACE_ERROR("Usage: %s TAFHEADER_TEST <taf_file/directory>\r\n", argv[0]);
+                return -1;
+            }
+            taf_header_test_t result = {0};
+            taf_test_walk(argv[2], NULL, &taf_header_test_file, &result);
+
+            TRACE_INFO("Checked %" PRIuSIZE " files, %" PRIuSIZE " valid TAF headers, %" PRIuSIZE " mismatches\r\n", result.files, result.valid, result.mismatches);
+
+            return result.mismatches ? -1 : 1;
+        }
+        else if (!strcasecmp(type, "OPUS_REMUX_TEST"))
+        {
+            bool_t passed = opus_remux_test(OPUS_PRE_SKIP);
+            passed &= opus_remux_test(3840);
+
+            return passed ? 1 : -1;
+        }
+        else if (!strcasecmp(type, "VERIFY"))
+        {
+            if (argc < 3)
+            {
+                TRACE_ERROR("Usage: %s VERIFY <taf_file/directory...>\r\n", argv[0]);
+                return -1;
+            }
+            taf_verify_init();
+            taf_verify_test_t result = {0};
+            uint64_t start = platform_time_ns();
+            for (int pos = 2; pos < argc; pos++)
+            {
+                taf_test_walk(argv[pos], &taf_verify_test_name, &taf_verify_test_file, &result);
+            }
+            double seconds = (platform_time_ns() - start) / 1e9;
+
+            TRACE_INFO("Checked %" PRIuSIZE " files with %.1f MB in %.1f s (%.0f MB/s), %" PRIuSIZE " broken\r\n",
+                       result.files, result.bytes / 1048576.0, seconds, seconds > 0 ? result.bytes / 1048576.0 / seconds : 0, result.broken);
+
+            return result.broken ? -1 : 1;
+        }
+        else if (!strcasecmp(type, "TAFEDIT"))
+        {
+            const char *cmd = (argc >= 3) ? argv[2] : "";
+            error_t editError = ERROR_INVALID_PARAMETER;
+
+            if (!strcasecmp(cmd, "concat") && argc >= 5)
+            {
+                editError = taf_edit_concat(argv[3], (const char *const *)&argv[4], argc - 4, 0);
+            }
+            else if (!strcasecmp(cmd, "split") && argc == 7)
+            {
+                editError = taf_edit_split(argv[3], atoi(argv[4]), argv[5], argv[6], 0);
+            }
+            else if (!strcasecmp(cmd, "chapters") && argc == 6)
+            {
+                double starts[TONIEFILE_MAX_CHAPTERS];
+                size_t count = 0;
+                for (char *start = strtok(argv[5], ","); start && count < TONIEFILE_MAX_CHAPTERS; start = strtok(NULL, ","))
+                {
+                    starts[count++] = atof(start);
+                }
+                editError = taf_edit_chapters(argv[3], argv[4], starts, count, 0);
+            }
+            else if (!strcasecmp(cmd, "audioid") && argc == 6)
+            {
+                editError = taf_edit_audio_id(argv[3], argv[4], (uint32_t)strtoul(argv[5], NULL, 0));
+            }
+            else
+            {
+                TRACE_ERROR("Usage: %s TAFEDIT concat <target> <source...>\r\n", argv[0]);
+                TRACE_ERROR("       %s TAFEDIT split <source> <chapter> <first_target> <second_target>\r\n", argv[0]);
+                TRACE_ERROR("       %s TAFEDIT chapters <source> <target> <seconds,seconds,...>\r\n", argv[0]);
+                TRACE_ERROR("       %s TAFEDIT audioid <source> <target> <audio_id>\r\n", argv[0]);
+                return -1;
+            }
+
+            if (editError != NO_ERROR)
+            {
+                TRACE_ERROR("TAFEDIT %s failed, error=%" PRIu16 "\r\n", cmd, editError);
+                return -1;
+            }
+            return 1;
+        }
 #ifdef FFMPEG_DECODING
         else if (!strcasecmp(type, "DENCODE"))
         {
@@ -402,8 +402,10 @@ void mqtt_thread()
     osMemset(&mqtt_ctx, 0x00, sizeof(mqtt_ctx));
 
     mqtt_context.mqtt_ctx = &mqtt_ctx;
+    setting_handle_t exitSetting = settings_handle("internal.exit");
+    setting_handle_t qosSetting = settings_handle("mqtt.qosLevel");
 
-    while (!settings_get_bool("internal.exit"))
+    while (!settings_get_bool_handle(exitSetting))
     {
         if (!settings_get_bool("mqtt.enabled"))
         {
@@ -465,7 +467,7 @@ void mqtt_thread()
         {
             if (mqtt_tx_buffers[pos].used)
             {
-                mqttClientPublish(&mqtt_context, mqtt_tx_buffers[pos].topic, mqtt_tx_buffers[pos].payload, osStrlen(mqtt_tx_buffers[pos].payload), settings_get_unsigned("mqtt.qosLevel"), false, NULL);
+                mqttClientPublish(&mqtt_context, mqtt_tx_buffers[pos].topic, mqtt_tx_buffers[pos].payload, osStrlen(mqtt_tx_buffers[pos].payload), settings_get_unsigned_handle(qosSetting), false, NULL);
                 osFreeMem(mqtt_tx_buffers[pos].topic);
                 osFreeMem(mqtt_tx_buffers[pos].payload);
                 mqtt_tx_buffers[pos].used = false;
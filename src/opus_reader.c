@@ -0,0 +1,313 @@
+#include <string.h>
+
+#include "opus_reader.h"
+#include "toniefile.h"
+#include "fs_port.h"
+#include "debug.h"
+#include "opus.h"
+#include "ogg/ogg.h"
+
+#define OPUS_READER_HEADER_SIZE 27
+#define OPUS_READER_FLAG_CONTINUED 0x01
+#define OPUS_READER_FLAG_BOS 0x02
+#define OPUS_READER_FLAG_EOS 0x04
+
+struct opus_reader_s
+{
+    FsFile *file;
+    uint32_t serial;
+    uint64_t duration;
+
+    /* page being read */
+    uint8_t header[OPUS_READER_HEADER_SIZE + 255];
+    uint8_t *body;
+    uint8_t segments;
+    uint8_t segment;
+    size_t bodyPos;
+    bool_t last;
+
+    /* packet assembled from the segments */
+    uint8_t *packet;
+    size_t packetLength;
+    uint64_t packetCount;
+};
+
+static uint32_t opus_reader_le32(const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint64_t opus_reader_le64(const uint8_t *data)
+{
+    return (uint64_t)opus_reader_le32(data) | ((uint64_t)opus_reader_le32(&data[4]) << 32);
+}
+
+static bool_t opus_reader_read_exact(FsFile *file, void *data, size_t size)
+{
+    size_t read = 0;
+    return size == 0 || (fsReadFile(file, data, size, &read) == NO_ERROR && read == size);
+}
+
+static bool_t opus_reader_is_ogg(const char *source)
+{
+    size_t length = osStrlen(source);
+    return (length > 5 && !osStrcasecmp(&source[length - 5], ".opus")) ||
+           (length > 4 && (!osStrcasecmp(&source[length - 4], ".ogg") || !osStrcasecmp(&source[length - 4], ".oga")));
+}
+
+/**
+ * @brief Walks the page headers of the whole file without reading the bodies
+ *
+ * Accepts a single logical stream with consecutive sequence numbers that ends with its EOS page
+ * right at the end of the file.
+ */
+static bool_t opus_reader_scan(opus_reader_t *reader, uint32_t size)
+{
+    size_t pos = 0;
+    uint32_t sequence = 0;
+    bool_t ended = FALSE;
+
+    while (pos < size)
+    {
+        uint8_t *header = reader->header;
+        size_t read = 0;
+
+        if (fsSeekFile(reader->file, (int_t)pos, FS_SEEK_SET) != NO_ERROR)
+        {
+            return FALSE;
+        }
+        if (fsReadFile(reader->file, header, OPUS_READER_HEADER_SIZE, &read) != NO_ERROR || read != OPUS_READER_HEADER_SIZE)
+        {
+            return FALSE;
+        }
+        if (osMemcmp(header, "OggS", 4) || header[4] != 0 || ended)
+        {
+            return FALSE;
+        }
+        if (sequence == 0)
+        {
+            if (!(header[5] & OPUS_READER_FLAG_BOS))
+            {
+                return FALSE;
+            }
+            reader->serial = opus_reader_le32(&header[14]);
+        }
+        else if ((header[5] & OPUS_READER_FLAG_BOS) || opus_reader_le32(&header[14]) != reader->serial)
+        {
+            return FALSE;
+        }
+        if (opus_reader_le32(&header[18]) != sequence++)
+        {
+            return FALSE;
+        }
+
+        uint64_t granule = opus_reader_le64(&header[6]);
+        if (granule != UINT64_MAX)
+        {
+            reader->duration = granule;
+        }
+        ended = (header[5] & OPUS_READER_FLAG_EOS) != 0;
+
+        uint8_t segments = header[26];
+        if (!opus_reader_read_exact(reader->file, &header[OPUS_READER_HEADER_SIZE], segments))
+        {
+            return FALSE;
+        }
+        size_t bodyLength = 0;
+        for (uint8_t segment = 0; segment < segments; segment++)
+        {
+            bodyLength += header[OPUS_READER_HEADER_SIZE + segment];
+        }
+        pos += OPUS_READER_HEADER_SIZE + segments + bodyLength;
+    }
+
+    return pos == size && ended && fsSeekFile(reader->file, 0, FS_SEEK_SET) == NO_ERROR;
+}
+
+static error_t opus_reader_page(opus_reader_t *reader)
+{
+    uint8_t *header = reader->header;
+
+    if (!opus_reader_read_exact(reader->file, header, OPUS_READER_HEADER_SIZE))
+    {
+        return ERROR_END_OF_STREAM;
+    }
+    if (osMemcmp(header, "OggS", 4) || opus_reader_le32(&header[14]) != reader->serial)
+    {
+        return ERROR_INVALID_FILE;
+    }
+    uint8_t segments = header[26];
+    if (!opus_reader_read_exact(reader->file, &header[OPUS_READER_HEADER_SIZE], segments))
+    {
+        return ERROR_INVALID_FILE;
+    }
+    size_t bodyLength = 0;
+    for (uint8_t segment = 0; segment < segments; segment++)
+    {
+        bodyLength += header[OPUS_READER_HEADER_SIZE + segment];
+    }
+    if (!opus_reader_read_exact(reader->file, reader->body, bodyLength))
+    {
+        return ERROR_INVALID_FILE;
+    }
+
+    /* the packets are copied as they are, so damaged pages must not get through */
+    uint8_t crc[4];
+    osMemcpy(crc, &header[22], sizeof(crc));
+    ogg_page og;
+    og.header = header;
+    og.header_len = OPUS_READER_HEADER_SIZE + segments;
+    og.body = reader->body;
+    og.body_len = bodyLength;
+    ogg_page_checksum_set(&og);
+    if (osMemcmp(crc, &header[22], sizeof(crc)))
+    {
+        TRACE_ERROR("Checksum mismatch in Ogg page %" PRIu32 "\r\n", opus_reader_le32(&header[18]));
+        return ERROR_INVALID_FILE;
+    }
+
+    /* a packet continues exactly if the previous page left one open */
+    if (((header[5] & OPUS_READER_FLAG_CONTINUED) != 0) != (reader->packetLength > 0))
+    {
+        return ERROR_INVALID_FILE;
+    }
+
+    reader->segments = segments;
+    reader->segment = 0;
+    reader->bodyPos = 0;
+    reader->last = (header[5] & OPUS_READER_FLAG_EOS) != 0;
+
+    return NO_ERROR;
+}
+
+static error_t opus_reader_packet(opus_reader_t *reader, const uint8_t **packet, size_t *length)
+{
+    reader->packetLength = 0;
+
+    while (TRUE)
+    {
+        while (reader->segment < reader->segments)
+        {
+            uint8_t size = reader->header[OPUS_READER_HEADER_SIZE + reader->segment++];
+            if (reader->packetLength + size > OPUS_READER_PACKET_MAX)
+            {
+                return ERROR_INVALID_FILE;
+            }
+            osMemcpy(&reader->packet[reader->packetLength], &reader->body[reader->bodyPos], size);
+            reader->packetLength += size;
+            reader->bodyPos += size;
+
+            if (size < 255)
+            {
+                *packet = reader->packet;
+                *length = reader->packetLength;
+                reader->packetCount++;
+                return NO_ERROR;
+            }
+        }
+        if (reader->last)
+        {
+            return ERROR_END_OF_STREAM;
+        }
+        error_t error = opus_reader_page(reader);
+        if (error != NO_ERROR)
+        {
+            return (error == ERROR_END_OF_STREAM && reader->packetLength > 0) ? ERROR_INVALID_FILE : error;
+        }
+    }
+}
+
+/* OpusHead, RFC 7845 section 5.1 */
+static bool_t opus_reader_head(opus_reader_t *reader)
+{
+    const uint8_t *packet;
+    size_t length;
+
+    if (opus_reader_packet(reader, &packet, &length) != NO_ERROR || length < 19 || osMemcmp(packet, "OpusHead", 8))
+    {
+        return FALSE;
+    }
+    uint8_t version = packet[8];
+    uint8_t channels = packet[9];
+    uint16_t preSkip = (uint16_t)(packet[10] | (packet[11] << 8));
+    int16_t gain = (int16_t)(packet[16] | (packet[17] << 8));
+    uint8_t family = packet[18];
+
+    if ((version >> 4) != 0 || channels == 0 || channels > OPUS_CHANNELS || family != 0 || gain != 0)
+    {
+        TRACE_INFO("Opus stream with %" PRIu8 " channels, mapping family %" PRIu8 " and gain %" PRId16 " can not be remuxed\r\n", channels, family, gain);
+        return FALSE;
+    }
+    /* the TAF has its own OpusHead, a different pre-skip would cut the start at the wrong sample */
+    if (preSkip != OPUS_PRE_SKIP)
+    {
+        TRACE_INFO("Opus stream with a pre-skip of %" PRIu16 " samples can not be remuxed\r\n", preSkip);
+        return FALSE;
+    }
+    reader->duration = (reader->duration > preSkip) ? reader->duration - preSkip : 0;
+
+    /* the tags are not carried over, the TAF has its own */
+    return opus_reader_packet(reader, &packet, &length) == NO_ERROR && length >= 8 && !osMemcmp(packet, "OpusTags", 8);
+}
+
+opus_reader_t *opus_reader_open(const char *source)
+{
+    uint32_t size = 0;
+    if (!opus_reader_is_ogg(source) || fsGetFileSize(source, &size) != NO_ERROR)
+    {
+        return NULL;
+    }
+
+    opus_reader_t *reader = osAllocMem(sizeof(opus_reader_t));
+    osMemset(reader, 0x00, sizeof(opus_reader_t));
+    reader->file = fsOpenFile(source, FS_FILE_MODE_READ);
+    if (reader->file == NULL)
+    {
+        osFreeMem(reader);
+        return NULL;
+    }
+    reader->body = osAllocMem(255 * 255);
+    reader->packet = osAllocMem(OPUS_READER_PACKET_MAX);
+
+    if (!reader->body || !reader->packet || !opus_reader_scan(reader, size) || !opus_reader_head(reader))
+    {
+        TRACE_INFO("%s can not be remuxed, decoding it\r\n", source);
+        opus_reader_close(reader);
+        return NULL;
+    }
+    TRACE_INFO("Remuxing %s, %" PRIu64 " s of Opus audio\r\n", source, reader->duration / OPUS_SAMPLING_RATE);
+
+    return reader;
+}
+
+void opus_reader_close(opus_reader_t *reader)
+{
+    fsCloseFile(reader->file);
+    osFreeMem(reader->body);
+    osFreeMem(reader->packet);
+    osFreeMem(reader);
+}
+
+error_t opus_reader_read(opus_reader_t *reader, const uint8_t **packet, size_t *length, uint32_t *samples)
+{
+    error_t error = opus_reader_packet(reader, packet, length);
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+
+    int count = opus_packet_get_nb_samples(*packet, (opus_int32)*length, OPUS_SAMPLING_RATE);
+    if (count <= 0)
+    {
+        TRACE_ERROR("Invalid Opus packet %" PRIu64 "\r\n", reader->packetCount);
+        return ERROR_INVALID_FILE;
+    }
+    *samples = (uint32_t)count;
+
+    return NO_ERROR;
+}
+
+uint64_t opus_reader_duration(opus_reader_t *reader)
+{
+    return reader->duration;
+}
@@ -0,0 +1,217 @@
+#include <string.h>
+
+#include "pcm_encoder.h"
+#include "pcm_ring.h"
+#include "toniefile.h"
+#include "debug.h"
+
+/* bytes of a stereo sample */
+#define PCM_ENCODER_ALIGN (OPUS_CHANNELS * sizeof(int16_t))
+
+struct pcm_encoder_s
+{
+    toniefile_t *taf;
+    pcm_ring_t *ring;
+    /* only touched by the producer */
+    uint64_t written;
+    /* byte offsets starting a chapter, appended by the producer before the data behind them is written */
+    OsMutex lock;
+    uint64_t chapters[TONIEFILE_MAX_CHAPTERS];
+    size_t chapter_count;
+    /* set by the encoder task before it aborts the ring */
+    error_t error;
+    OsEvent stopped;
+};
+
+/* encodes a read buffer, starting the chapters that fall into it */
+static error_t pcm_encoder_encode(pcm_encoder_t *encoder, uint8_t *data, size_t length, uint64_t offset, size_t *next_chapter)
+{
+    error_t error = NO_ERROR;
+
+    while (length > 0 && error == NO_ERROR)
+    {
+        osAcquireMutex(&encoder->lock);
+        bool_t chapter = *next_chapter < encoder->chapter_count;
+        uint64_t chapter_offset = chapter ? encoder->chapters[*next_chapter] : 0;
+        osReleaseMutex(&encoder->lock);
+
+        if (chapter && chapter_offset <= offset)
+        {
+            toniefile_new_chapter(encoder->taf);
+            (*next_chapter)++;
+            continue;
+        }
+
+        size_t part = (chapter && chapter_offset < offset + length) ? (size_t)(chapter_offset - offset) : length;
+        size_t samples = part / PCM_ENCODER_ALIGN;
+        if (samples > 0)
+        {
+            error = toniefile_encode(encoder->taf, (int16_t *)data, samples);
+            error = (error == ERROR_END_OF_STREAM) ? NO_ERROR : error;
+        }
+        data += part;
+        offset += part;
+        length -= part;
+    }
+
+    return error;
+}
+
+static void pcm_encoder_task(void *param)
+{
+    pcm_encoder_t *encoder = (pcm_encoder_t *)param;
+    size_t size = FFMPEG_PCM_FRAMES * FFMPEG_PCM_FRAME_BYTES;
+    uint8_t *buffer = osAllocMem(size);
+    uint64_t consumed = 0;
+    size_t next_chapter = 0;
+    error_t error = NO_ERROR;
+
+    if (!buffer)
+    {
+        TRACE_ERROR("[TAF] Failed to allocate the encode buffer\r\n");
+        error = ERROR_OUT_OF_MEMORY;
+    }
+    while (buffer)
+    {
+        size_t length = 0;
+        error = pcm_ring_read(encoder->ring, buffer, size, PCM_ENCODER_ALIGN, &length, PCM_ENCODER_TIMEOUT_MS);
+        if (error == ERROR_TIMEOUT)
+        {
+            /* the connection is still receiving, it times out on its own */
+            continue;
+        }
+        if (error == ERROR_END_OF_STREAM)
+        {
+            error = NO_ERROR;
+            break;
+        }
+        if (error == NO_ERROR)
+        {
+            error = pcm_encoder_encode(encoder, buffer, length, consumed, &next_chapter);
+        }
+        if (error != NO_ERROR)
+        {
+            TRACE_ERROR("[TAF] Encoding failed, error=%" PRIu16 "\r\n", error);
+            break;
+        }
+        consumed += length;
+    }
+    osFreeMem(buffer);
+
+    if (error != NO_ERROR)
+    {
+        encoder->error = error;
+        pcm_ring_abort(encoder->ring);
+    }
+    osSetEvent(&encoder->stopped);
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+pcm_encoder_t *pcm_encoder_start(const char *path, uint32_t audio_id, toniefile_quality_t quality)
+{
+    toniefile_t *taf = toniefile_create(path, audio_id);
+    if (!taf)
+    {
+        return NULL;
+    }
+    toniefile_set_quality(taf, quality);
+
+    pcm_encoder_t *encoder = osAllocMem(sizeof(pcm_encoder_t));
+    pcm_ring_t *ring = pcm_ring_create(PCM_ENCODER_RING_SIZE);
+    if (!encoder || !ring)
+    {
+        TRACE_ERROR("[TAF] Failed to allocate encoder\r\n");
+        toniefile_close(taf);
+        if (ring)
+        {
+            pcm_ring_free(ring);
+        }
+        osFreeMem(encoder);
+        return NULL;
+    }
+    osMemset(encoder, 0x00, sizeof(pcm_encoder_t));
+    encoder->taf = taf;
+    encoder->ring = ring;
+    osCreateMutex(&encoder->lock);
+    osCreateEvent(&encoder->stopped);
+
+    if (osCreateTask("PcmEncoder", &pcm_encoder_task, encoder, 10 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("[TAF] Failed to start encoder task\r\n");
+        toniefile_close(taf);
+        osDeleteEvent(&encoder->stopped);
+        osDeleteMutex(&encoder->lock);
+        pcm_ring_free(encoder->ring);
+        osFreeMem(encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+error_t pcm_encoder_write(pcm_encoder_t *encoder, const void *data, size_t length)
+{
+    const uint8_t *src = data;
+
+    while (length > 0)
+    {
+        uint8_t *dst;
+        size_t size;
+        error_t error = pcm_ring_write_begin(encoder->ring, &dst, &size, PCM_ENCODER_TIMEOUT_MS);
+        if (error == ERROR_ABORTED)
+        {
+            return encoder->error;
+        }
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+        size_t part = MIN(size, length);
+        osMemcpy(dst, src, part);
+        pcm_ring_write_commit(encoder->ring, part);
+        encoder->written += part;
+        src += part;
+        length -= part;
+    }
+
+    return NO_ERROR;
+}
+
+error_t pcm_encoder_chapter(pcm_encoder_t *encoder)
+{
+    error_t error = NO_ERROR;
+
+    osAcquireMutex(&encoder->lock);
+    if (encoder->chapter_count + 1 < TONIEFILE_MAX_CHAPTERS)
+    {
+        /* a sample split between the files ends up in the new chapter */
+        encoder->chapters[encoder->chapter_count++] = encoder->written - encoder->written % PCM_ENCODER_ALIGN;
+    }
+    else
+    {
+        error = ERROR_INVALID_PARAMETER;
+    }
+    osReleaseMutex(&encoder->lock);
+
+    return error;
+}
+
+error_t pcm_encoder_finish(pcm_encoder_t *encoder)
+{
+    pcm_ring_close(encoder->ring);
+    osWaitForEvent(&encoder->stopped, INFINITE_DELAY);
+
+    error_t error = encoder->error;
+    if (toniefile_close(encoder->taf) != NO_ERROR && error == NO_ERROR)
+    {
+        error = ERROR_WRITE_FAILED;
+    }
+
+    osDeleteEvent(&encoder->stopped);
+    osDeleteMutex(&encoder->lock);
+    pcm_ring_free(encoder->ring);
+    osFreeMem(encoder);
+
+    return error;
+}
@@ -0,0 +1,138 @@
+#include <string.h>
+
+#include "pcm_ring.h"
+#include "debug.h"
+
+/* the producer only writes written and closed, the consumer only read and aborted */
+#if defined(_MSC_VER)
+#include <windows.h>
+#define PCM_RING_LOAD(var) ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)&(var), 0, 0))
+#define PCM_RING_STORE(var, value) InterlockedExchange64((volatile LONG64 *)&(var), (LONG64)(value))
+#else
+#define PCM_RING_LOAD(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define PCM_RING_STORE(var, value) __atomic_store_n(&(var), (value), __ATOMIC_RELEASE)
+#endif
+
+struct pcm_ring_s
+{
+    uint8_t *data;
+    size_t size;
+    uint64_t written;
+    uint64_t read;
+    uint64_t closed;
+    uint64_t aborted;
+    /* set by the producer after publishing, by the consumer after consuming */
+    OsEvent dataEvent;
+    OsEvent spaceEvent;
+};
+
+pcm_ring_t *pcm_ring_create(size_t size)
+{
+    pcm_ring_t *ring = osAllocMem(sizeof(pcm_ring_t));
+    if (!ring)
+    {
+        return NULL;
+    }
+    osMemset(ring, 0x00, sizeof(pcm_ring_t));
+    ring->data = osAllocMem(size);
+    if (!ring->data)
+    {
+        osFreeMem(ring);
+        return NULL;
+    }
+    ring->size = size;
+    osCreateEvent(&ring->dataEvent);
+    osCreateEvent(&ring->spaceEvent);
+
+    return ring;
+}
+
+void pcm_ring_free(pcm_ring_t *ring)
+{
+    osDeleteEvent(&ring->dataEvent);
+    osDeleteEvent(&ring->spaceEvent);
+    osFreeMem(ring->data);
+    osFreeMem(ring);
+}
+
+error_t pcm_ring_write_begin(pcm_ring_t *ring, uint8_t **data, size_t *size, systime_t timeout)
+{
+    while (!PCM_RING_LOAD(ring->aborted))
+    {
+        uint64_t used = ring->written - PCM_RING_LOAD(ring->read);
+        if (used < ring->size)
+        {
+            size_t offset = (size_t)(ring->written % ring->size);
+            *data = &ring->data[offset];
+            *size = MIN((size_t)(ring->size - used), ring->size - offset);
+            return NO_ERROR;
+        }
+        if (!osWaitForEvent(&ring->spaceEvent, timeout))
+        {
+            return ERROR_TIMEOUT;
+        }
+    }
+
+    return ERROR_ABORTED;
+}
+
+void pcm_ring_write_commit(pcm_ring_t *ring, size_t length)
+{
+    PCM_RING_STORE(ring->written, ring->written + length);
+    osSetEvent(&ring->dataEvent);
+}
+
+void pcm_ring_close(pcm_ring_t *ring)
+{
+    PCM_RING_STORE(ring->closed, 1);
+    osSetEvent(&ring->dataEvent);
+}
+
+void pcm_ring_abort(pcm_ring_t *ring)
+{
+    PCM_RING_STORE(ring->aborted, 1);
+    osSetEvent(&ring->spaceEvent);
+}
+
+error_t pcm_ring_read(pcm_ring_t *ring, void *data, size_t size, size_t align, size_t *length, systime_t timeout)
+{
+    uint8_t *dst = data;
+    uint64_t available;
+    bool_t closed;
+
+    *length = 0;
+    while (TRUE)
+    {
+        /* checked first, everything written before closing is visible then */
+        closed = PCM_RING_LOAD(ring->closed) != 0;
+        available = PCM_RING_LOAD(ring->written) - ring->read;
+        if (available >= align || (closed && available > 0))
+        {
+            break;
+        }
+        if (closed)
+        {
+            return ERROR_END_OF_STREAM;
+        }
+        if (!osWaitForEvent(&ring->dataEvent, timeout))
+        {
+            return ERROR_TIMEOUT;
+        }
+    }
+
+    size_t count = (size_t)MIN(available, (uint64_t)size);
+    if (count >= align)
+    {
+        count -= count % align;
+    }
+    size_t offset = (size_t)(ring->read % ring->size);
+    size_t part = MIN(count, ring->size - offset);
+    osMemcpy(dst, &ring->data[offset], part);
+    osMemcpy(&dst[part], ring->data, count - part);
+
+    PCM_RING_STORE(ring->read, ring->read + count);
+    osSetEvent(&ring->spaceEvent);
+    *length = count;
+
+    return NO_ERROR;
+}
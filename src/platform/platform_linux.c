@@ -9,6 +9,14 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include "platform.h"
 #include "tls.h"
@@ -18,10 +26,18 @@
 #include "core/tcp.h"
 #include "debug.h"
 
+extern char **environ;
+
 // Special IP addresses
 const IpAddr IP_ADDR_ANY = {0};
 const IpAddr IP_ADDR_UNSPECIFIED = {0};
 
+struct platform_process_s
+{
+    pid_t pid;
+    int fd;
+};
+
 typedef struct
 {
     size_t buffer_used;
@@ -461,4 +477,115 @@ uint_t tcpWaitForEvents(Socket *socket, uint_t eventMask, systime_t timeout)
 time_t getCurrentUnixTime(void)
 {
     return time(NULL);
-}
\ No newline at end of file
+}
+
+uint32_t platform_get_cpu_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (count > 0) ? (uint32_t)count : 1;
+}
+
+uint64_t platform_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void platform_set_task_background()
+{
+    /* the nice value is per thread on linux and inherited by the programs it starts */
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    if (setpriority(PRIO_PROCESS, tid, PLATFORM_BACKGROUND_NICE) != 0)
+    {
+        TRACE_WARNING("Could not lower the priority of thread %d: %s\r\n", (int)tid, strerror(errno));
+    }
+}
+
+platform_process_t *platform_process_spawn(const char *const argv[])
+{
+    int fds[2];
+
+    if (pipe(fds) != 0)
+    {
+        TRACE_ERROR("Could not create pipe for %s: %s\r\n", argv[0], strerror(errno));
+        return NULL;
+    }
+    /* only the duplicate on stdout is inherited */
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+    pid_t pid;
+    int ret = posix_spawnp(&pid, argv[0], &actions, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+
+    if (ret != 0)
+    {
+        TRACE_ERROR("Could not start %s: %s\r\n", argv[0], strerror(ret));
+        close(fds[0]);
+        return NULL;
+    }
+
+    platform_process_t *process = osAllocMem(sizeof(platform_process_t));
+    process->pid = pid;
+    process->fd = fds[0];
+
+    return process;
+}
+
+error_t platform_process_read(platform_process_t *process, void *data, size_t size, size_t *length)
+{
+    ssize_t ret;
+
+    *length = 0;
+    do
+    {
+        ret = read(process->fd, data, size);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+    {
+        return ERROR_READ_FAILED;
+    }
+    if (ret == 0)
+    {
+        return ERROR_END_OF_STREAM;
+    }
+    *length = (size_t)ret;
+
+    return NO_ERROR;
+}
+
+void platform_process_terminate(platform_process_t *process)
+{
+    /* the pid stays valid until the process was waited for */
+    kill(process->pid, SIGTERM);
+}
+
+int platform_process_wait(platform_process_t *process)
+{
+    int status = 0;
+    pid_t ret;
+
+    close(process->fd);
+    do
+    {
+        ret = waitpid(process->pid, &status, 0);
+    } while (ret < 0 && errno == EINTR);
+    osFreeMem(process);
+
+    if (ret < 0 || !WIFEXITED(status))
+    {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
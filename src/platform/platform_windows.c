@@ -509,4 +509,51 @@ uint_t tcpWaitForEvents(Socket *socket, uint_t eventMask, systime_t timeout)
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+uint32_t platform_get_cpu_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return (info.dwNumberOfProcessors > 0) ? (uint32_t)info.dwNumberOfProcessors : 1;
+}
+
+uint64_t platform_time_ns()
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    /* split to not overflow with high counter frequencies */
+    uint64_t seconds = (uint64_t)counter.QuadPart / (uint64_t)frequency.QuadPart;
+    uint64_t rest = (uint64_t)counter.QuadPart % (uint64_t)frequency.QuadPart;
+    return seconds * 1000000000ULL + rest * 1000000000ULL / (uint64_t)frequency.QuadPart;
+}
+
+void platform_set_task_background()
+{
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+}
+
+platform_process_t *platform_process_spawn(const char *const argv[])
+{
+    TRACE_ERROR("Starting %s is not supported on this platform\r\n", argv[0]);
+    return NULL;
+}
+
+error_t platform_process_read(platform_process_t *process, void *data, size_t size, size_t *length)
+{
+    *length = 0;
+    return ERROR_NOT_IMPLEMENTED;
+}
+
+void platform_process_terminate(platform_process_t *process)
+{
+}
+
+int platform_process_wait(platform_process_t *process)
+{
+    return -1;
+}
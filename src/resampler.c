@@ -0,0 +1,233 @@
+#include <math.h>
+#include <string.h>
+
+#include "resampler.h"
+#include "debug.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define RESAMPLER_SSE
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RESAMPLER_NEON
+#endif
+
+#define RESAMPLER_CAPACITY (RESAMPLER_BUFFER_FRAMES + RESAMPLER_TAPS)
+/* cutoff relative to the lower Nyquist frequency, leaves room for the transition band */
+#define RESAMPLER_CUTOFF 0.95
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct resampler_s
+{
+    /* output rate is in_rate * up / down */
+    uint32_t up;
+    uint32_t down;
+    /* RESAMPLER_TAPS coefficients for each of the up phases */
+    float *coeffs;
+
+    /* the frame at index n is input frame n - (RESAMPLER_TAPS / 2 - 1) since the last compaction */
+    float left[RESAMPLER_CAPACITY];
+    float right[RESAMPLER_CAPACITY];
+    size_t filled;
+    /* first tap of the next output and its phase */
+    size_t pos;
+    uint32_t phase;
+
+    uint64_t in_total;
+    uint64_t out_total;
+    bool_t flushed;
+};
+
+static uint32_t resampler_gcd(uint32_t a, uint32_t b)
+{
+    while (b != 0)
+    {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static float resampler_dot(const float *coeffs, const float *samples)
+{
+#if defined(RESAMPLER_SSE)
+    __m128 sum = _mm_setzero_ps();
+    for (size_t tap = 0; tap < RESAMPLER_TAPS; tap += 4)
+    {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&coeffs[tap]), _mm_loadu_ps(&samples[tap])));
+    }
+    __m128 shuffled = _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(2, 3, 0, 1));
+    sum = _mm_add_ps(sum, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sum);
+    sum = _mm_add_ss(sum, shuffled);
+    return _mm_cvtss_f32(sum);
+#elif defined(RESAMPLER_NEON)
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (size_t tap = 0; tap < RESAMPLER_TAPS; tap += 4)
+    {
+        sum = vmlaq_f32(sum, vld1q_f32(&coeffs[tap]), vld1q_f32(&samples[tap]));
+    }
+    float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+    return vget_lane_f32(vpadd_f32(half, half), 0);
+#else
+    float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (size_t tap = 0; tap < RESAMPLER_TAPS; tap += 4)
+    {
+        sum[0] += coeffs[tap] * samples[tap];
+        sum[1] += coeffs[tap + 1] * samples[tap + 1];
+        sum[2] += coeffs[tap + 2] * samples[tap + 2];
+        sum[3] += coeffs[tap + 3] * samples[tap + 3];
+    }
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+#endif
+}
+
+int16_t resampler_clip(float sample)
+{
+    float scaled = sample * 32768.0f;
+    if (scaled >= 32767.0f)
+    {
+        return 32767;
+    }
+    if (scaled <= -32768.0f)
+    {
+        return -32768;
+    }
+    return (int16_t)lrintf(scaled);
+}
+
+static void resampler_init_coeffs(resampler_t *rs)
+{
+    double cutoff = RESAMPLER_CUTOFF * MIN(1.0, (double)rs->up / rs->down);
+    double half = RESAMPLER_TAPS / 2;
+
+    for (uint32_t phase = 0; phase < rs->up; phase++)
+    {
+        float *coeffs = &rs->coeffs[phase * RESAMPLER_TAPS];
+        double sum = 0.0;
+
+        for (size_t tap = 0; tap < RESAMPLER_TAPS; tap++)
+        {
+            /* distance of the tap from the position of the output sample, in input samples */
+            double distance = (double)tap - half + 1.0 - (double)phase / rs->up;
+            double x = M_PI * cutoff * distance;
+            double sinc = (x == 0.0) ? 1.0 : sin(x) / x;
+            /* Blackman window over the filter length */
+            double w = M_PI * distance / half;
+            double window = (fabs(distance) >= half) ? 0.0 : 0.42 + 0.5 * cos(w) + 0.08 * cos(2.0 * w);
+
+            coeffs[tap] = (float)(sinc * window);
+            sum += coeffs[tap];
+        }
+        /* unity gain for every phase */
+        for (size_t tap = 0; tap < RESAMPLER_TAPS; tap++)
+        {
+            coeffs[tap] = (float)(coeffs[tap] / sum);
+        }
+    }
+}
+
+resampler_t *resampler_create(uint32_t in_rate, uint32_t out_rate)
+{
+    if (in_rate == 0 || out_rate == 0)
+    {
+        return NULL;
+    }
+    uint32_t gcd = resampler_gcd(in_rate, out_rate);
+    uint32_t up = out_rate / gcd;
+    uint32_t down = in_rate / gcd;
+
+    /* the filter has to move less than its length per output */
+    if (up > RESAMPLER_MAX_PHASES || down > up * (RESAMPLER_TAPS / 4))
+    {
+        TRACE_WARNING("Resampling %" PRIu32 " Hz to %" PRIu32 " Hz is not supported\r\n", in_rate, out_rate);
+        return NULL;
+    }
+
+    resampler_t *rs = osAllocMem(sizeof(resampler_t));
+    osMemset(rs, 0x00, sizeof(resampler_t));
+    rs->up = up;
+    rs->down = down;
+    rs->coeffs = osAllocMem(up * RESAMPLER_TAPS * sizeof(float));
+    resampler_init_coeffs(rs);
+
+    /* silence in front of the first input frame, so the first output is centered on it */
+    rs->filled = RESAMPLER_TAPS / 2 - 1;
+
+    return rs;
+}
+
+void resampler_free(resampler_t *rs)
+{
+    osFreeMem(rs->coeffs);
+    osFreeMem(rs);
+}
+
+/* drops the frames no output needs anymore */
+static void resampler_compact(resampler_t *rs)
+{
+    if (rs->pos == 0)
+    {
+        return;
+    }
+    size_t keep = rs->filled - rs->pos;
+    memmove(rs->left, &rs->left[rs->pos], keep * sizeof(float));
+    memmove(rs->right, &rs->right[rs->pos], keep * sizeof(float));
+    rs->filled = keep;
+    rs->pos = 0;
+}
+
+size_t resampler_space(resampler_t *rs)
+{
+    resampler_compact(rs);
+
+    return (rs->filled < RESAMPLER_BUFFER_FRAMES && !rs->flushed) ? RESAMPLER_BUFFER_FRAMES - rs->filled : 0;
+}
+
+size_t resampler_process(resampler_t *rs, const float *left, const float *right, size_t in_frames, int16_t *out, size_t out_frames)
+{
+    resampler_compact(rs);
+
+    if (left)
+    {
+        in_frames = MIN(in_frames, resampler_space(rs));
+        osMemcpy(&rs->left[rs->filled], left, in_frames * sizeof(float));
+        osMemcpy(&rs->right[rs->filled], right, in_frames * sizeof(float));
+        rs->filled += in_frames;
+        rs->in_total += in_frames;
+    }
+    else if (!rs->flushed)
+    {
+        /* the last outputs need the taps behind the end of the input */
+        osMemset(&rs->left[rs->filled], 0x00, RESAMPLER_TAPS / 2 * sizeof(float));
+        osMemset(&rs->right[rs->filled], 0x00, RESAMPLER_TAPS / 2 * sizeof(float));
+        rs->filled += RESAMPLER_TAPS / 2;
+        rs->flushed = TRUE;
+    }
+
+    /* outputs are placed at in_total * up / down, rounded up */
+    uint64_t out_limit = (rs->in_total * rs->up + rs->down - 1) / rs->down;
+    size_t produced = 0;
+
+    while (produced < out_frames && rs->pos + RESAMPLER_TAPS <= rs->filled && (!rs->flushed || rs->out_total < out_limit))
+    {
+        const float *coeffs = &rs->coeffs[rs->phase * RESAMPLER_TAPS];
+        out[produced * 2] = resampler_clip(resampler_dot(coeffs, &rs->left[rs->pos]));
+        out[produced * 2 + 1] = resampler_clip(resampler_dot(coeffs, &rs->right[rs->pos]));
+        produced++;
+        rs->out_total++;
+
+        rs->phase += rs->down;
+        while (rs->phase >= rs->up)
+        {
+            rs->phase -= rs->up;
+            rs->pos++;
+        }
+    }
+
+    return produced;
+}
@@ -21,6 +21,7 @@
 #include "settings.h"
 #include "returncodes.h"
 
+#include "server.h"
 #include "server_helpers.h"
 #include "toniesJson.h"
 
@@ -30,6 +31,17 @@
 
 #include "mutex_manager.h"
 #include "cloud_request.h"
+#include "cloud_queue.h"
+#include "job_queue.h"
+#include "taf_scrub.h"
+#include "freshness_cache.h"
+#include "content_index.h"
+#include "content_db.h"
+#include "dir_cache.h"
+#include "taf_index.h"
+#include "taf_playlist.h"
+#include "stream_session.h"
+#include "fs_watch.h"
 #include "handler_cloud.h"
 #include "handler_reverse.h"
 #include "handler_rtnl.h"
@@ -41,6 +53,41 @@
 HttpConnection httpConnections[APP_HTTP_MAX_CONNECTIONS];
 HttpConnection httpsConnections[APP_HTTP_MAX_CONNECTIONS];
 
+/* interval of the main loop while connections are open, the online state of boxes expires after a second */
+#define SERVER_LOOP_MS 250
+/* otherwise the main loop waits for requests and file changes */
+#define SERVER_IDLE_MS 5000
+
+static OsEvent server_event;
+/* cleared before the event is deleted, HTTP connections may still try to wake the loop */
+static bool_t server_event_valid = FALSE;
+/* set by the file watcher, handled by the main loop */
+static bool_t server_reload_settings = FALSE;
+static bool_t server_reload_certs = FALSE;
+static bool_t server_reload_tonies = FALSE;
+static bool_t server_check_dirs = FALSE;
+
+/* resolved in server_init, used for every request and TLS connection */
+static setting_handle_t server_handle_crt;
+static setting_handle_t server_handle_key;
+static setting_handle_t server_handle_ua_esp32;
+
+static const char *server_sanity_dirs[] = {
+    "core.datadir",
+    "internal.datadirfull",
+    "internal.wwwdirfull",
+    "internal.contentdirfull",
+    "core.certdir"};
+
+static const char *server_cert_files[] = {
+    "core.server_cert.file.ca",
+    "core.server_cert.file.ca_key",
+    "core.server_cert.file.crt",
+    "core.server_cert.file.key",
+    "core.client_cert.file.ca",
+    "core.client_cert.file.crt",
+    "core.client_cert.file.key"};
+
 enum eRequestMethod
 {
     REQ_ANY,
@@ -71,7 +118,13 @@ request_type_t request_paths[] = {
     {REQ_POST, "/api/fileUpload", &handleApiFileUpload},
     {REQ_POST, "/api/pcmUpload", &handleApiPcmUpload},
     {REQ_GET, "/api/fileIndex", &handleApiFileIndex},
+    {REQ_GET, "/api/tafInfo", &handleApiTafInfo},
     {REQ_GET, "/api/stats", &handleApiStats},
+    {REQ_GET, "/api/streams", &handleApiStreams},
+    {REQ_GET, "/api/jobs", &handleApiJobs},
+    {REQ_POST, "/api/jobConvert", &handleApiJobConvert},
+    {REQ_POST, "/api/jobCancel", &handleApiJobCancel},
+    {REQ_POST, "/api/tafEdit", &handleApiTafEdit},
 
     {REQ_GET, "/api/trigger", &handleApiTrigger},
     {REQ_GET, "/api/getIndex", &handleApiGetIndex},
@@ -105,6 +158,8 @@ error_t httpServerRequestCallback(HttpConnection *connection, const char_t *uri)
     error_t error = NO_ERROR;
 
     stats_update("connections", 1);
+    /* the main loop keeps track of the connections again */
+    server_wake();
 
     if (connection->tlsContext != NULL && osStrlen(connection->tlsContext->client_cert_issuer))
     {
@@ -229,7 +284,7 @@ error_t httpServerRequestCallback(HttpConnection *connection, const char_t *uri)
                     client_ctx->settings->internal.toniebox_firmware.boxIC = BOX_ESP32;
                     if (osStrcmp(firmware_info->uaEsp32Firmware, fwEsp) != 0)
                     {
-                        settings_set_string_id("internal.toniebox_firmware.uaEsp32Firmware", fwEsp, client_ctx->settings->internal.overlayNumber);
+                        settings_set_string_handle_id(server_handle_ua_esp32, fwEsp, client_ctx->settings->internal.overlayNumber);
                     }
                 }
                 else
@@ -380,8 +435,8 @@ error_t httpServerTlsInitCallback(HttpConnection *connection, TlsContext *tlsCon
         return error;
 
     // Import server's certificate
-    const char *server_crt = settings_get_string("internal.server.crt");
-    const char *server_key = settings_get_string("internal.server.key");
+    const char *server_crt = settings_get_string_handle_id(server_handle_crt, 0);
+    const char *server_key = settings_get_string_handle_id(server_handle_key, 0);
 
     if (!server_crt || !server_key)
     {
@@ -422,22 +477,105 @@ bool sanityChecks()
 {
     bool ret = true;
 
-    ret &= sanityCheckDir("core.datadir");
-    ret &= sanityCheckDir("internal.datadirfull");
-    ret &= sanityCheckDir("internal.wwwdirfull");
-    ret &= sanityCheckDir("internal.contentdirfull");
-    ret &= sanityCheckDir("core.certdir");
+    for (size_t i = 0; i < sizeof(server_sanity_dirs) / sizeof(server_sanity_dirs[0]); i++)
+    {
+        ret &= sanityCheckDir(server_sanity_dirs[i]);
+    }
 
     if (!ret)
     {
         TRACE_ERROR("Sanity checks failed, exiting\r\n");
         settings_set_signed("internal.returncode", RETURNCODE_INVALID_CONFIG);
         settings_set_bool("internal.exit", true);
+        server_wake();
     }
 
     return ret;
 }
 
+void server_wake()
+{
+    mutex_lock(MUTEX_SERVER_EVENT);
+    if (server_event_valid)
+    {
+        osSetEvent(&server_event);
+    }
+    mutex_unlock(MUTEX_SERVER_EVENT);
+}
+
+static void server_file_changed(void *ctx, const char *path)
+{
+    TRACE_DEBUG("%s changed\r\n", path);
+    *(bool_t *)ctx = TRUE;
+    server_wake();
+}
+
+static void server_unwatch_files()
+{
+    fs_watch_remove_files(&server_file_changed, &server_reload_settings);
+    fs_watch_remove_files(&server_file_changed, &server_reload_certs);
+    fs_watch_remove_files(&server_file_changed, &server_reload_tonies);
+    fs_watch_remove_files(&server_file_changed, &server_check_dirs);
+}
+
+/* (re)subscribes the files the main loop reloads, their paths change with the settings */
+static void server_watch_files()
+{
+    server_unwatch_files();
+
+    fs_watch_add_file(CONFIG_PATH, &server_file_changed, &server_reload_settings);
+    fs_watch_add_file(CONFIG_OVERLAY_PATH, &server_file_changed, &server_reload_settings);
+
+    for (size_t id = 0; id < MAX_OVERLAYS; id++)
+    {
+        if (!get_settings_id(id)->internal.config_used)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(server_cert_files) / sizeof(server_cert_files[0]); i++)
+        {
+            const char *path = settings_get_string_id(server_cert_files[i], id);
+            if (path && osStrlen(path))
+            {
+                fs_watch_add_file(path, &server_file_changed, &server_reload_certs);
+            }
+        }
+    }
+
+    char *toniesPath = tonies_jsonPath();
+    fs_watch_add_file(toniesPath, &server_file_changed, &server_reload_tonies);
+    osFreeMem(toniesPath);
+
+    for (size_t i = 0; i < sizeof(server_sanity_dirs) / sizeof(server_sanity_dirs[0]); i++)
+    {
+        const char *path = settings_get_string(server_sanity_dirs[i]);
+        if (path && osStrlen(path))
+        {
+            fs_watch_add_file(path, &server_file_changed, &server_check_dirs);
+        }
+    }
+}
+
+/* the online state of boxes only has to be kept up to date while there are connections or online boxes */
+static bool_t server_busy()
+{
+    for (size_t i = 0; i < APP_HTTP_MAX_CONNECTIONS; i++)
+    {
+        if (httpConnections[i].running || httpsConnections[i].running)
+        {
+            return TRUE;
+        }
+    }
+    for (size_t i = 0; i < MAX_OVERLAYS; i++)
+    {
+        if (get_settings_id(i)->internal.online)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 void server_init()
 {
     mutex_manager_init();
@@ -446,8 +584,27 @@ void server_init()
         return;
     }
     settings_set_bool("internal.exit", FALSE);
+    server_handle_crt = settings_handle("internal.server.crt");
+    server_handle_key = settings_handle("internal.server.key");
+    server_handle_ua_esp32 = settings_handle("internal.toniebox_firmware.uaEsp32Firmware");
+    rtnl_init();
     sse_init();
     tonies_init();
+    fs_watch_init();
+    content_db_init();
+    content_index_init();
+    dir_cache_init();
+    taf_index_init();
+    taf_playlist_init();
+    stream_session_init();
+    cloud_queue_init();
+    job_queue_init();
+    freshness_cache_init();
+    taf_scrub_init();
+
+    osCreateEvent(&server_event);
+    server_event_valid = TRUE;
+    server_watch_files();
 
     HttpServerSettings http_settings;
     HttpServerSettings https_settings;
@@ -497,16 +654,32 @@ void server_init()
         return;
     }
 
-    systime_t last = osGetSystemTime();
     size_t openConnectionsLast = 0;
-    while (!settings_get_bool("internal.exit"))
+    setting_handle_t exitSetting = settings_handle("internal.exit");
+    while (!settings_get_bool_handle(exitSetting))
     {
-        osDelayTask(250);
-        settings_loop();
-        systime_t now = osGetSystemTime();
-        if ((now - last) / 1000 > 5)
+        osWaitForEvent(&server_event, server_busy() ? SERVER_LOOP_MS : SERVER_IDLE_MS);
+        if (server_reload_settings)
+        {
+            server_reload_settings = FALSE;
+            settings_loop();
+            server_watch_files();
+            server_check_dirs = TRUE;
+        }
+        if (server_reload_certs)
+        {
+            server_reload_certs = FALSE;
+            TRACE_INFO("Certificates changed. Reloading.\r\n");
+            settings_load_all_certs();
+        }
+        if (server_reload_tonies)
+        {
+            server_reload_tonies = FALSE;
+            tonies_readJson();
+        }
+        if (server_check_dirs)
         {
-            last = now;
+            server_check_dirs = FALSE;
             sanityChecks();
         }
         mutex_manager_loop();
@@ -554,6 +727,23 @@ void server_init()
             }
         }
     }
+    server_unwatch_files();
+    mutex_lock(MUTEX_SERVER_EVENT);
+    server_event_valid = FALSE;
+    mutex_unlock(MUTEX_SERVER_EVENT);
+    osDeleteEvent(&server_event);
+
+    taf_scrub_deinit();
+    job_queue_deinit();
+    cloud_queue_deinit();
+    freshness_cache_deinit();
+    stream_session_deinit();
+    taf_playlist_deinit();
+    taf_index_deinit();
+    dir_cache_deinit();
+    content_index_deinit();
+    content_db_deinit();
+    fs_watch_deinit();
     tonies_deinit();
     mutex_manager_deinit();
 
@@ -17,9 +17,65 @@
 static settings_t Settings_Overlay[MAX_OVERLAYS];
 static setting_item_t *Option_Map_Overlay[MAX_OVERLAYS];
 static uint16_t settings_size = 0;
+/* open addressing table of option map positions + 1 by name, the map has the same layout in every overlay */
+static uint16_t *settings_index = NULL;
+static uint32_t settings_index_mask = 0;
 DateTime settings_last_load;
 DateTime settings_last_load_ovl;
 
+static bool settings_set_string_item(setting_item_t *opt, const char *value, uint8_t settingsId);
+
+static uint32_t settings_index_hash(const char *item)
+{
+    uint32_t hash = 0x811C9DC5;
+    for (const char *pos = item; *pos; pos++)
+    {
+        hash ^= (uint8_t)*pos;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static void settings_index_build(const setting_item_t *option_map)
+{
+    uint32_t size = 64;
+    while (size < 2 * (uint32_t)settings_size)
+    {
+        size *= 2;
+    }
+    settings_index = osAllocMem(size * sizeof(uint16_t));
+    osMemset(settings_index, 0x00, size * sizeof(uint16_t));
+    settings_index_mask = size - 1;
+
+    for (uint16_t pos = 0; pos < settings_size; pos++)
+    {
+        uint32_t slot = settings_index_hash(option_map[pos].option_name) & settings_index_mask;
+        while (settings_index[slot])
+        {
+            slot = (slot + 1) & settings_index_mask;
+        }
+        settings_index[slot] = pos + 1;
+    }
+}
+
+/* position of the item in the option map or -1 */
+static int32_t settings_index_find(const char *item)
+{
+    const setting_item_t *option_map = Option_Map_Overlay[0];
+    uint32_t slot = settings_index_hash(item) & settings_index_mask;
+
+    while (settings_index[slot])
+    {
+        uint16_t pos = settings_index[slot] - 1;
+        if (!strcmp(item, option_map[pos].option_name))
+        {
+            return pos;
+        }
+        slot = (slot + 1) & settings_index_mask;
+    }
+    return -1;
+}
+
 static void option_map_init(uint8_t settingsId)
 {
     settings_t *settings = &Settings_Overlay[settingsId];
@@ -76,6 +132,14 @@ static void option_map_init(uint8_t settingsId)
 
     OPTION_BOOL("core.flex_enabled", &settings->core.flex_enabled, TRUE, "Enable Flex-Tonie", "When enabled this UID always gets assigned the audio selected from web interface")
     OPTION_STRING("core.flex_uid", &settings->core.flex_uid, "", "Flex-Tonie UID", "UID which shall get selected audio files assigned")
+    OPTION_UNSIGNED("core.stream_grace", &settings->core.stream_grace, 30, 0, 3600, "Stream grace time", "Seconds a live stream keeps running after its last listener left, so other boxes can join it")
+    OPTION_UNSIGNED("core.transcode_cache_max_age", &settings->core.transcode_cache_max_age, 86400, 0, 31536000, "Transcode cache age", "Seconds a cached encode of a URL is used before it is encoded again, 0 caches no URLs. Files are encoded again when they change")
+    OPTION_STRING("core.encode_quality", &settings->core.encode_quality, "standard", "Encoder quality", "Quality of newly encoded TAF files: standard, fast (about 1.4 times as fast, slightly worse) or small (64 kbit/s instead of 96 kbit/s)")
+    OPTION_UNSIGNED("core.encode_threads", &settings->core.encode_threads, 2, 0, 64, "Encoder threads", "Threads encoding a TAF file in parallel, 0 uses all CPU cores, 1 encodes serially. Each one holds about 6 MB of audio")
+    OPTION_UNSIGNED("core.job_threads", &settings->core.job_threads, 0, 0, 64, "Conversion jobs", "Conversion jobs running side by side in the background, 0 runs one per CPU core. Needs a restart")
+    OPTION_UNSIGNED("core.scrub_interval", &settings->core.scrub_interval, 168, 0, 8760, "TAF check interval", "Hours between background checks of the length, Ogg CRCs and SHA-1 of all TAF files, 0 disables the checks")
+    OPTION_UNSIGNED("core.scrub_rate", &settings->core.scrub_rate, 4, 0, 1000, "TAF check speed", "MB per second the background check reads at most, 0 reads as fast as the disk allows")
+    OPTION_BOOL("core.scrub_quarantine", &settings->core.scrub_quarantine, TRUE, "Move broken TAFs aside", "Renames broken cloud content to <file>.bad, so it is downloaded again. Only done when cloud.enabled and cloud.enableV2Content are set, custom tonies are never moved")
 
     OPTION_TREE_DESC("internal", "Internal")
     OPTION_INTERNAL_STRING("internal.server.ca", &settings->internal.server.ca, "", "CA certificate data")
@@ -144,6 +208,7 @@ static void option_map_init(uint8_t settingsId)
     OPTION_BOOL("cloud.enableV1Claim", &settings->cloud.enableV1Claim, TRUE, "Forward 'claim'", "Forward 'claim' queries to tonies cloud")
     OPTION_BOOL("cloud.enableV1CloudReset", &settings->cloud.enableV1CloudReset, FALSE, "Forward 'cloudReset'", "Forward 'cloudReset' queries to tonies cloud")
     OPTION_BOOL("cloud.enableV1FreshnessCheck", &settings->cloud.enableV1FreshnessCheck, TRUE, "Forward 'freshnessCheck'", "Forward 'freshnessCheck' queries to tonies cloud")
+    OPTION_UNSIGNED("cloud.freshnessCacheMaxAge", &settings->cloud.freshnessCacheMaxAge, 86400, 0, 604800, "'freshnessCheck' cache age", "Max age in seconds of a cached 'freshnessCheck' answer the box gets while it is refreshed in background, 0 to always wait for the cloud")
     OPTION_BOOL("cloud.enableV1Log", &settings->cloud.enableV1Log, FALSE, "Forward 'log'", "Forward 'log' queries to tonies cloud")
     OPTION_BOOL("cloud.enableV1Time", &settings->cloud.enableV1Time, FALSE, "Forward 'time'", "Forward 'time' queries to tonies cloud")
     OPTION_BOOL("cloud.enableV1Ota", &settings->cloud.enableV1Ota, FALSE, "Forward 'ota'", "Forward 'ota' queries to tonies cloud")
@@ -190,6 +255,11 @@ static void option_map_init(uint8_t settingsId)
     }
 
     osMemcpy(Option_Map_Overlay[settingsId], option_map_array, sizeof(option_map_array));
+
+    if (settings_index == NULL)
+    {
+        settings_index_build(option_map_array);
+    }
 }
 
 static setting_item_t *get_option_map(const char *overlay)
@@ -405,6 +475,8 @@ void settings_deinit_all()
     {
         settings_deinit(i);
     }
+    osFreeMem(settings_index);
+    settings_index = NULL;
 }
 
 void settings_init(char *cwd)
@@ -787,18 +859,64 @@ setting_item_t *settings_get_by_name_ovl(const char *item, const char *overlay_n
 
 setting_item_t *settings_get_by_name_id(const char *item, uint8_t settingsId)
 {
-    int pos = 0;
-    setting_item_t *option_map = Option_Map_Overlay[settingsId];
-    while (option_map[pos].type != TYPE_END)
+    int32_t pos = settings_index_find(item);
+    if (pos < 0)
     {
-        if (!strcmp(item, option_map[pos].option_name))
-        {
-            return &option_map[pos];
-        }
-        pos++;
+        TRACE_WARNING("Setting item '%s' not found\r\n", item);
+        return NULL;
     }
-    TRACE_WARNING("Setting item '%s' not found\r\n", item);
-    return NULL;
+    return &Option_Map_Overlay[settingsId][pos];
+}
+
+setting_handle_t settings_handle(const char *item)
+{
+    setting_handle_t handle = {.index = SETTING_HANDLE_INVALID, .type = TYPE_END};
+
+    int32_t pos = item ? settings_index_find(item) : -1;
+    if (pos < 0)
+    {
+        TRACE_WARNING("Setting item '%s' not found\r\n", item ? item : "(null)");
+        return handle;
+    }
+    handle.index = (uint16_t)pos;
+    handle.type = Option_Map_Overlay[0][pos].type;
+    return handle;
+}
+
+static setting_item_t *settings_get_by_handle_id(setting_handle_t handle, uint8_t settingsId)
+{
+    if (handle.index == SETTING_HANDLE_INVALID)
+    {
+        return NULL;
+    }
+    return &Option_Map_Overlay[settingsId][handle.index];
+}
+
+bool settings_get_bool_handle(setting_handle_t handle)
+{
+    if (handle.type != TYPE_BOOL)
+    {
+        return false;
+    }
+    return *((bool *)Option_Map_Overlay[0][handle.index].ptr);
+}
+
+uint32_t settings_get_unsigned_handle(setting_handle_t handle)
+{
+    if (handle.type != TYPE_UNSIGNED)
+    {
+        return 0;
+    }
+    return *((uint32_t *)Option_Map_Overlay[0][handle.index].ptr);
+}
+
+const char *settings_get_string_handle_id(setting_handle_t handle, uint8_t settingsId)
+{
+    if (handle.type != TYPE_STRING)
+    {
+        return NULL;
+    }
+    return *(const char **)Option_Map_Overlay[settingsId][handle.index].ptr;
 }
 
 bool settings_get_bool(const char *item)
@@ -1060,7 +1178,21 @@ bool settings_set_string_id(const char *item, const char *value, uint8_t setting
         return false;
     }
 
-    setting_item_t *opt = settings_get_by_name_id(item, settingsId);
+    return settings_set_string_item(settings_get_by_name_id(item, settingsId), value, settingsId);
+}
+
+bool settings_set_string_handle_id(setting_handle_t handle, const char *value, uint8_t settingsId)
+{
+    if (!value)
+    {
+        return false;
+    }
+
+    return settings_set_string_item(settings_get_by_handle_id(handle, settingsId), value, settingsId);
+}
+
+static bool settings_set_string_item(setting_item_t *opt, const char *value, uint8_t settingsId)
+{
     if (!opt || opt->type != TYPE_STRING)
     {
         return false;
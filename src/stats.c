@@ -8,6 +8,47 @@ STATS_ENTRY("reverse_requests", "Reverse proxy calls made by clients")
 STATS_ENTRY("cloud_requests", "Cloud requests executed")
 STATS_ENTRY("cloud_blocked", "Blocked cloud requests")
 STATS_ENTRY("cloud_failed", "Failed cloud requests")
+STATS_ENTRY("cloud_queue_added", "Requests queued for the cloud")
+STATS_ENTRY("cloud_queue_sent", "Queued requests delivered to the cloud")
+STATS_ENTRY("cloud_queue_retries", "Failed deliveries of queued requests")
+STATS_ENTRY("cloud_queue_merged", "Queued requests merged with a pending one")
+STATS_ENTRY("cloud_queue_dropped", "Queued requests dropped (overflow, expired)")
+STATS_ENTRY("freshness_cache_hit", "Freshness checks answered from cache")
+STATS_ENTRY("freshness_cache_miss", "Freshness checks waiting for the cloud")
+STATS_ENTRY("content_index_hit", "Tonie infos served from the content index")
+STATS_ENTRY("content_index_miss", "Tonie infos read from disk")
+STATS_ENTRY("dir_cache_hit", "Directory listings served from memory")
+STATS_ENTRY("dir_cache_miss", "Directory listings read from disk")
+STATS_ENTRY("taf_index_hit", "Seek indexes served from memory")
+STATS_ENTRY("taf_index_miss", "Seek indexes built from the file")
+STATS_ENTRY("taf_playlist_hit", "Playlists served from memory")
+STATS_ENTRY("taf_playlist_miss", "Playlists assembled from their TAFs")
+STATS_ENTRY("stream_buffer_overrun", "Live stream readers that fell behind and skipped audio")
+STATS_ENTRY("stream_session_started", "Live stream encoders started")
+STATS_ENTRY("stream_session_joined", "Listeners that joined a running live stream")
+STATS_ENTRY("encode_blocks", "TAF blocks encoded")
+STATS_ENTRY("encode_pad_bytes", "Bytes of TAF blocks filled with padding instead of audio")
+STATS_ENTRY("encode_filled_frames", "Frames encoded again to fill the rest of their block")
+STATS_ENTRY("transcode_cache_hit", "Streams served from the transcode cache")
+STATS_ENTRY("transcode_cache_miss", "Streams to be cached that had to be encoded")
+STATS_ENTRY("transcode_cache_stored", "Encodes kept in the transcode cache")
+STATS_ENTRY("stream_ttfb_count", "Live streams that delivered audio to a box")
+STATS_ENTRY("stream_ttfb_ms", "Sum of the time to first byte of live streams in ms")
+STATS_ENTRY("stream_ttfb_last_ms", "Time to first byte of the last live stream in ms")
+STATS_ENTRY("transcode_jobs", "Sources transcoded to TAF with ffmpeg")
+STATS_ENTRY("transcode_audio_s", "Seconds of audio transcoded")
+STATS_ENTRY("transcode_time_s", "Seconds spent transcoding")
+STATS_ENTRY("transcode_speed_last_pct", "Speed of the last transcode in percent of real time")
+STATS_ENTRY("decode_native", "Sources decoded in process")
+STATS_ENTRY("decode_ffmpeg", "Sources decoded with ffmpeg")
+STATS_ENTRY("decode_remux", "Opus sources copied into TAFs without encoding")
+STATS_ENTRY("jobs_queued", "Conversion jobs queued")
+STATS_ENTRY("jobs_done", "Conversion jobs finished")
+STATS_ENTRY("jobs_failed", "Conversion jobs failed")
+STATS_ENTRY("jobs_canceled", "Conversion jobs canceled")
+STATS_ENTRY("scrub_files", "TAF files checked in background")
+STATS_ENTRY("scrub_bad", "Broken TAF files found in background")
+STATS_ENTRY("scrub_quarantined", "Broken TAF files moved aside to be downloaded again")
 STATS_END()
 
 void stats_update(const char *item, int count)
@@ -24,6 +65,20 @@ void stats_update(const char *item, int count)
     }
 }
 
+void stats_set(const char *item, int value)
+{
+    int pos = 0;
+    while (statistics[pos].name)
+    {
+        if (!osStrcmp(item, statistics[pos].name))
+        {
+            statistics[pos].value = value;
+            return;
+        }
+        pos++;
+    }
+}
+
 stat_t *stats_get(int index)
 {
     int pos = 0;
@@ -0,0 +1,235 @@
+#include <string.h>
+
+#include "stream_buffer.h"
+#include "mutex_manager.h"
+#include "stats.h"
+#include "debug.h"
+
+struct stream_buffer_s
+{
+    uint32_t refCount;
+    uint8_t *prefix;
+    size_t prefixLength;
+    uint8_t *ring;
+    size_t size;
+    size_t blockSize;
+    /* total number of bytes ever written */
+    uint64_t written;
+    bool_t closed;
+    stream_reader_t *readers;
+};
+
+struct stream_reader_s
+{
+    stream_reader_t *next;
+    stream_buffer_t *buffer;
+    uint64_t position;
+    /* continue here after the prefix */
+    uint64_t start;
+    OsEvent event;
+};
+
+stream_buffer_t *stream_buffer_create(size_t size, size_t prefixLength, size_t blockSize)
+{
+    stream_buffer_t *buffer = osAllocMem(sizeof(stream_buffer_t));
+    osMemset(buffer, 0x00, sizeof(stream_buffer_t));
+    buffer->refCount = 1;
+    buffer->prefix = osAllocMem(prefixLength);
+    buffer->prefixLength = prefixLength;
+    buffer->ring = osAllocMem(size);
+    buffer->size = size;
+    buffer->blockSize = blockSize;
+
+    return buffer;
+}
+
+/* has to be called locked */
+static void stream_buffer_unref(stream_buffer_t *buffer)
+{
+    if (--buffer->refCount > 0)
+    {
+        return;
+    }
+    osFreeMem(buffer->prefix);
+    osFreeMem(buffer->ring);
+    osFreeMem(buffer);
+}
+
+void stream_buffer_release(stream_buffer_t *buffer)
+{
+    mutex_lock(MUTEX_STREAM_BUFFER);
+    stream_buffer_unref(buffer);
+    mutex_unlock(MUTEX_STREAM_BUFFER);
+}
+
+error_t stream_buffer_write(stream_buffer_t *buffer, const void *data, size_t length)
+{
+    const uint8_t *src = data;
+
+    mutex_lock(MUTEX_STREAM_BUFFER);
+    if (buffer->closed)
+    {
+        mutex_unlock(MUTEX_STREAM_BUFFER);
+        return ERROR_WRITE_FAILED;
+    }
+
+    if (buffer->written < buffer->prefixLength)
+    {
+        size_t prefixPart = MIN(length, buffer->prefixLength - buffer->written);
+        osMemcpy(&buffer->prefix[buffer->written], src, prefixPart);
+    }
+
+    /* only the last ring size bytes can be kept */
+    uint64_t position = buffer->written;
+    if (length > buffer->size)
+    {
+        position += length - buffer->size;
+        src += length - buffer->size;
+    }
+    size_t remaining = (size_t)(buffer->written + length - position);
+    while (remaining > 0)
+    {
+        size_t offset = position % buffer->size;
+        size_t part = MIN(remaining, buffer->size - offset);
+        osMemcpy(&buffer->ring[offset], src, part);
+        src += part;
+        position += part;
+        remaining -= part;
+    }
+    buffer->written += length;
+
+    for (stream_reader_t *reader = buffer->readers; reader; reader = reader->next)
+    {
+        osSetEvent(&reader->event);
+    }
+    mutex_unlock(MUTEX_STREAM_BUFFER);
+
+    return NO_ERROR;
+}
+
+void stream_buffer_close(stream_buffer_t *buffer)
+{
+    mutex_lock(MUTEX_STREAM_BUFFER);
+    buffer->closed = TRUE;
+    for (stream_reader_t *reader = buffer->readers; reader; reader = reader->next)
+    {
+        osSetEvent(&reader->event);
+    }
+    mutex_unlock(MUTEX_STREAM_BUFFER);
+}
+
+uint64_t stream_buffer_written(stream_buffer_t *buffer)
+{
+    mutex_lock(MUTEX_STREAM_BUFFER);
+    uint64_t written = buffer->written;
+    mutex_unlock(MUTEX_STREAM_BUFFER);
+
+    return written;
+}
+
+stream_reader_t *stream_reader_create(stream_buffer_t *buffer, size_t backlog)
+{
+    stream_reader_t *reader = osAllocMem(sizeof(stream_reader_t));
+    osMemset(reader, 0x00, sizeof(stream_reader_t));
+    reader->buffer = buffer;
+    osCreateEvent(&reader->event);
+
+    mutex_lock(MUTEX_STREAM_BUFFER);
+    buffer->refCount++;
+    if (buffer->written > buffer->prefixLength + backlog)
+    {
+        uint64_t start = (buffer->written - backlog) / buffer->blockSize * buffer->blockSize;
+        reader->start = MAX(start, buffer->prefixLength);
+    }
+    reader->next = buffer->readers;
+    buffer->readers = reader;
+    mutex_unlock(MUTEX_STREAM_BUFFER);
+
+    return reader;
+}
+
+void stream_reader_free(stream_reader_t *reader)
+{
+    stream_buffer_t *buffer = reader->buffer;
+
+    mutex_lock(MUTEX_STREAM_BUFFER);
+    for (stream_reader_t **prev = &buffer->readers; *prev; prev = &(*prev)->next)
+    {
+        if (*prev == reader)
+        {
+            *prev = reader->next;
+            break;
+        }
+    }
+    stream_buffer_unref(buffer);
+    mutex_unlock(MUTEX_STREAM_BUFFER);
+
+    osDeleteEvent(&reader->event);
+    osFreeMem(reader);
+}
+
+/* has to be called locked */
+static size_t stream_reader_copy(stream_reader_t *reader, uint8_t *data, size_t size)
+{
+    stream_buffer_t *buffer = reader->buffer;
+
+    if (reader->position < buffer->prefixLength)
+    {
+        size_t length = (size_t)MIN(size, MIN(buffer->written, buffer->prefixLength) - reader->position);
+        osMemcpy(data, &buffer->prefix[reader->position], length);
+        reader->position += length;
+        return length;
+    }
+
+    if (reader->position < reader->start)
+    {
+        reader->position = reader->start;
+    }
+
+    uint64_t oldest = (buffer->written > buffer->size) ? buffer->written - buffer->size : 0;
+    if (reader->position < oldest)
+    {
+        uint64_t skipTo = (oldest + buffer->blockSize - 1) / buffer->blockSize * buffer->blockSize;
+        TRACE_WARNING("Stream reader fell behind, skipping %" PRIu64 " bytes\r\n", skipTo - reader->position);
+        stats_update("stream_buffer_overrun", 1);
+        reader->position = skipTo;
+    }
+
+    size_t length = (size_t)MIN(size, buffer->written - reader->position);
+    size_t offset = reader->position % buffer->size;
+    size_t part = MIN(length, buffer->size - offset);
+    osMemcpy(data, &buffer->ring[offset], part);
+    osMemcpy(&data[part], buffer->ring, length - part);
+    reader->position += length;
+
+    return length;
+}
+
+error_t stream_reader_read(stream_reader_t *reader, void *data, size_t size, size_t *length, systime_t timeout)
+{
+    stream_buffer_t *buffer = reader->buffer;
+    *length = 0;
+
+    mutex_lock(MUTEX_STREAM_BUFFER);
+    while (reader->position >= buffer->written)
+    {
+        if (buffer->closed)
+        {
+            mutex_unlock(MUTEX_STREAM_BUFFER);
+            return ERROR_END_OF_STREAM;
+        }
+        /* writes after this point set the event again */
+        osResetEvent(&reader->event);
+        mutex_unlock(MUTEX_STREAM_BUFFER);
+
+        if (!osWaitForEvent(&reader->event, timeout))
+        {
+            return ERROR_TIMEOUT;
+        }
+        mutex_lock(MUTEX_STREAM_BUFFER);
+    }
+    *length = stream_reader_copy(reader, data, size);
+    mutex_unlock(MUTEX_STREAM_BUFFER);
+
+    return NO_ERROR;
+}
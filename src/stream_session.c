@@ -0,0 +1,274 @@
+#include <string.h>
+#include <time.h>
+
+#include "stream_session.h"
+#include "toniefile.h"
+#include "settings.h"
+#include "mutex_manager.h"
+#include "stats.h"
+#include "debug.h"
+#include "os_port.h"
+
+struct stream_session_s
+{
+    stream_session_t *next;
+    char *source;
+    size_t skip_seconds;
+    ffmpeg_stream_ctx_t ffmpeg;
+    uint32_t listeners;
+    uint32_t listenersTotal;
+    time_t started;
+    /* time the last listener left */
+    time_t idleSince;
+};
+
+static stream_session_t *stream_sessions = NULL;
+static bool_t stream_session_running = FALSE;
+static OsEvent stream_session_event;
+static OsEvent stream_session_stopped;
+
+/* must not be called locked, waits for the encoder task to finish */
+static void stream_session_stop(stream_session_t *session)
+{
+    session->ffmpeg.active = false;
+    osWaitForEvent(&session->ffmpeg.stopped_event, INFINITE_DELAY);
+    TRACE_INFO("Stopped stream of %s\r\n", session->source);
+}
+
+/* the encoder task has to be stopped already */
+static void stream_session_free(stream_session_t *session)
+{
+    stream_buffer_release(session->ffmpeg.buffer);
+    osDeleteEvent(&session->ffmpeg.ready_event);
+    osDeleteEvent(&session->ffmpeg.stopped_event);
+    osFreeMem(session->source);
+    osFreeMem(session);
+}
+
+stream_session_t *stream_session_join(const char *source, size_t skip_seconds, bool_t cache)
+{
+    mutex_lock(MUTEX_STREAM_SESSION);
+    for (stream_session_t *session = stream_sessions; session; session = session->next)
+    {
+        /* a finished encoder can't be joined, a new session is started beside it */
+        if (!session->ffmpeg.quit && session->skip_seconds == skip_seconds && !osStrcmp(session->source, source))
+        {
+            session->listeners++;
+            session->listenersTotal++;
+            mutex_unlock(MUTEX_STREAM_SESSION);
+            TRACE_INFO("Joined running stream of %s, %" PRIu32 " listeners\r\n", source, session->listeners);
+            stats_update("stream_session_joined", 1);
+            return session;
+        }
+    }
+
+    stream_session_t *session = osAllocMem(sizeof(stream_session_t));
+    osMemset(session, 0x00, sizeof(stream_session_t));
+    session->source = strdup(source);
+    session->skip_seconds = skip_seconds;
+    session->listeners = 1;
+    session->listenersTotal = 1;
+    session->started = time(NULL);
+    session->ffmpeg.active = true;
+    session->ffmpeg.quit = false;
+    session->ffmpeg.source = session->source;
+    session->ffmpeg.skip_seconds = skip_seconds;
+    session->ffmpeg.cache = cache;
+    session->ffmpeg.buffer = stream_buffer_create(STREAM_BUFFER_SIZE, 2 * TONIEFILE_FRAME_SIZE, TONIEFILE_FRAME_SIZE);
+    session->ffmpeg.error = NO_ERROR;
+    session->ffmpeg.jitter_target_ms = STREAM_JITTER_MIN_MS;
+    osCreateEvent(&session->ffmpeg.ready_event);
+    osCreateEvent(&session->ffmpeg.stopped_event);
+    session->ffmpeg.taskId = osCreateTask("ffmpeg stream", &ffmpeg_stream_task, &session->ffmpeg, 10 * 1024, 0);
+
+    if (session->ffmpeg.taskId == OS_INVALID_TASK_ID)
+    {
+        mutex_unlock(MUTEX_STREAM_SESSION);
+        TRACE_ERROR("Failed to start encoder for %s\r\n", source);
+        stream_buffer_release(session->ffmpeg.buffer);
+        osDeleteEvent(&session->ffmpeg.ready_event);
+        osDeleteEvent(&session->ffmpeg.stopped_event);
+        osFreeMem(session->source);
+        osFreeMem(session);
+        return NULL;
+    }
+    session->next = stream_sessions;
+    stream_sessions = session;
+    mutex_unlock(MUTEX_STREAM_SESSION);
+
+    TRACE_INFO("Started stream of %s\r\n", source);
+    stats_update("stream_session_started", 1);
+
+    return session;
+}
+
+void stream_session_leave(stream_session_t *session)
+{
+    mutex_lock(MUTEX_STREAM_SESSION);
+    if (--session->listeners == 0)
+    {
+        session->idleSince = time(NULL);
+    }
+    mutex_unlock(MUTEX_STREAM_SESSION);
+
+    osSetEvent(&stream_session_event);
+}
+
+error_t stream_session_wait(stream_session_t *session)
+{
+    if (!osWaitForEvent(&session->ffmpeg.ready_event, STREAM_SESSION_START_TIMEOUT_MS))
+    {
+        return ERROR_TIMEOUT;
+    }
+    /* the event resets when consumed, keep it set for the other listeners */
+    osSetEvent(&session->ffmpeg.ready_event);
+
+    return session->ffmpeg.error;
+}
+
+stream_buffer_t *stream_session_buffer(stream_session_t *session)
+{
+    return session->ffmpeg.buffer;
+}
+
+size_t stream_session_backlog(stream_session_t *session)
+{
+    size_t backlog = (size_t)session->ffmpeg.jitter_target_ms * (OPUS_BIT_RATE / 8) / 1000;
+
+    return MAX(backlog, TONIEFILE_FRAME_SIZE);
+}
+
+cJSON *stream_session_list()
+{
+    cJSON *jsonArray = cJSON_CreateArray();
+    time_t now = time(NULL);
+
+    mutex_lock(MUTEX_STREAM_SESSION);
+    for (stream_session_t *session = stream_sessions; session; session = session->next)
+    {
+        cJSON *jsonEntry = cJSON_CreateObject();
+        cJSON_AddStringToObject(jsonEntry, "source", session->source);
+        cJSON_AddNumberToObject(jsonEntry, "skip", session->skip_seconds);
+        cJSON_AddNumberToObject(jsonEntry, "listeners", session->listeners);
+        cJSON_AddNumberToObject(jsonEntry, "listenersTotal", session->listenersTotal);
+        cJSON_AddNumberToObject(jsonEntry, "uptime", (double)(now - session->started));
+        cJSON_AddNumberToObject(jsonEntry, "idle", session->listeners ? 0 : (double)(now - session->idleSince));
+        cJSON_AddNumberToObject(jsonEntry, "bytes", (double)stream_buffer_written(session->ffmpeg.buffer));
+        cJSON_AddBoolToObject(jsonEntry, "running", !session->ffmpeg.quit);
+        cJSON_AddNumberToObject(jsonEntry, "startup", session->ffmpeg.ready ? session->ffmpeg.startup_ms : 0);
+        cJSON_AddNumberToObject(jsonEntry, "jitterTarget", session->ffmpeg.jitter_target_ms);
+        cJSON_AddNumberToObject(jsonEntry, "speed", session->ffmpeg.speed_pct / 100.0);
+        cJSON_AddItemToArray(jsonArray, jsonEntry);
+    }
+    mutex_unlock(MUTEX_STREAM_SESSION);
+
+    return jsonArray;
+}
+
+/* the encoder closed the buffer, gives the listeners still sending it time to leave */
+static bool_t stream_session_drain(stream_session_t *session, systime_t timeout)
+{
+    systime_t start = osGetSystemTime();
+
+    mutex_lock(MUTEX_STREAM_SESSION);
+    while (session->listeners > 0)
+    {
+        systime_t elapsed = osGetSystemTime() - start;
+        if (elapsed >= timeout)
+        {
+            break;
+        }
+        mutex_unlock(MUTEX_STREAM_SESSION);
+        osWaitForEvent(&stream_session_event, timeout - elapsed);
+        mutex_lock(MUTEX_STREAM_SESSION);
+    }
+    bool_t drained = (session->listeners == 0);
+    mutex_unlock(MUTEX_STREAM_SESSION);
+
+    return drained;
+}
+
+/* removes the sessions without listeners whose grace period expired or whose encoder ended,
+ * with all set every session is stopped and its listeners are given a moment to leave */
+static void stream_session_cleanup(bool_t all)
+{
+    uint32_t grace = settings_get_unsigned("core.stream_grace");
+    time_t now = time(NULL);
+    stream_session_t *expired = NULL;
+
+    mutex_lock(MUTEX_STREAM_SESSION);
+    stream_session_t **prev = &stream_sessions;
+    while (*prev)
+    {
+        stream_session_t *session = *prev;
+        if (all || (session->listeners == 0 && (session->ffmpeg.quit || now - session->idleSince >= grace)))
+        {
+            *prev = session->next;
+            session->next = expired;
+            expired = session;
+            continue;
+        }
+        prev = &session->next;
+    }
+    mutex_unlock(MUTEX_STREAM_SESSION);
+
+    /* let all encoders wind down at once before joining them one by one */
+    for (stream_session_t *session = expired; session; session = session->next)
+    {
+        session->ffmpeg.active = false;
+    }
+
+    while (expired)
+    {
+        stream_session_t *session = expired;
+        expired = session->next;
+        stream_session_stop(session);
+        if (!stream_session_drain(session, 2 * STREAM_SESSION_CHECK_MS))
+        {
+            /* a listener still holds it, freeing would pull the buffer away under it */
+            TRACE_WARNING("Listeners did not leave stream of %s, not freeing it\r\n", session->source);
+            continue;
+        }
+        stream_session_free(session);
+    }
+}
+
+static void stream_session_thread(void *arg)
+{
+    setting_handle_t exitSetting = settings_handle("internal.exit");
+    while (!settings_get_bool_handle(exitSetting) && stream_session_running)
+    {
+        osWaitForEvent(&stream_session_event, STREAM_SESSION_CHECK_MS);
+        stream_session_cleanup(FALSE);
+    }
+    osSetEvent(&stream_session_stopped);
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void stream_session_init()
+{
+    stream_sessions = NULL;
+
+    osCreateEvent(&stream_session_event);
+    osCreateEvent(&stream_session_stopped);
+    stream_session_running = TRUE;
+    if (osCreateTask("StreamSessions", &stream_session_thread, NULL, 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start stream session thread\r\n");
+        stream_session_running = FALSE;
+    }
+}
+
+void stream_session_deinit()
+{
+    if (stream_session_running)
+    {
+        stream_session_running = FALSE;
+        osSetEvent(&stream_session_event);
+        osWaitForEvent(&stream_session_stopped, 2 * STREAM_SESSION_CHECK_MS);
+    }
+    stream_session_cleanup(TRUE);
+    osDeleteEvent(&stream_session_event);
+    osDeleteEvent(&stream_session_stopped);
+}
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "taf_edit.h"
+#include "taf_index.h"
+#include "toniefile.h"
+#include "server_helpers.h"
+#include "content_index.h"
+#include "fs_port.h"
+#include "debug.h"
+#include "os_port.h"
+
+typedef struct
+{
+    const char *path;
+    taf_index_t *index;
+    uint32_t first_block;
+    uint32_t end_block;
+    /* source blocks starting a chapter, ascending */
+    const uint32_t *chapters;
+    size_t chapter_count;
+} taf_edit_part_t;
+
+static bool_t taf_edit_is_chapter(const taf_edit_part_t *part, uint32_t block)
+{
+    for (size_t pos = 0; pos < part->chapter_count; pos++)
+    {
+        if (part->chapters[pos] == block)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static error_t taf_edit_copy_part(toniefile_t *taf, const taf_edit_part_t *part, bool_t first, uint8_t *block)
+{
+    const taf_index_t *index = part->index;
+
+    FsFile *file = fsOpenFile(part->path, FS_FILE_MODE_READ);
+    if (!file)
+    {
+        return ERROR_FILE_OPENING_FAILED;
+    }
+
+    error_t error = fsSeekFile(file, (int_t)taf_index_offset(part->first_block), FS_SEEK_SET);
+    for (uint32_t pos = part->first_block; pos < part->end_block && error == NO_ERROR; pos++)
+    {
+        size_t length = 0;
+        if (fsReadFile(file, block, TONIEFILE_FRAME_SIZE, &length) != NO_ERROR || length == 0)
+        {
+            error = ERROR_READ_FAILED;
+            break;
+        }
+
+        /* the first chapter of the target is there from the start */
+        bool_t chapter = (pos == part->first_block) ? !first : taf_edit_is_chapter(part, pos);
+        uint64_t granule_end = (pos + 1 < index->blocks) ? index->granules[pos + 1] : index->end_granule;
+        size_t start = (pos == 0) ? index->header_length : 0;
+
+        error = toniefile_append_block(taf, block, length, start, index->granules[pos], granule_end, chapter);
+    }
+    fsCloseFile(file);
+
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Could not copy blocks of %s, error=%" PRIu16 "\r\n", part->path, error);
+    }
+    return error;
+}
+
+/**
+ * @brief Writes the parts one after the other into a new TAF
+ *
+ * The SHA-1 and the chapter table are built while the blocks are written, the header
+ * is updated at the end.
+ */
+static error_t taf_edit_write(const char *target, uint32_t audio_id, const taf_edit_part_t *parts, size_t count)
+{
+    size_t chapters = 0;
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        if (parts[pos].first_block >= parts[pos].end_block || parts[pos].end_block > parts[pos].index->blocks)
+        {
+            return ERROR_INVALID_PARAMETER;
+        }
+        chapters += 1;
+        for (size_t chapter = 0; chapter < parts[pos].chapter_count; chapter++)
+        {
+            uint32_t block = parts[pos].chapters[chapter];
+            chapters += (block > parts[pos].first_block && block < parts[pos].end_block) ? 1 : 0;
+        }
+    }
+    if (count == 0 || chapters >= TONIEFILE_MAX_CHAPTERS)
+    {
+        TRACE_ERROR("Cannot write %" PRIuSIZE " chapters to %s\r\n", chapters, target);
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (audio_id == 0)
+    {
+        audio_id = parts[0].index->audio_id;
+    }
+
+    char *tmpPath = custom_asprintf("%s.tmp", target);
+    toniefile_t *taf = toniefile_create_serial(tmpPath, audio_id);
+    if (!taf)
+    {
+        osFreeMem(tmpPath);
+        return ERROR_FILE_OPENING_FAILED;
+    }
+
+    systime_t start = osGetSystemTime();
+    uint8_t *block = osAllocMem(TONIEFILE_FRAME_SIZE);
+    error_t error = NO_ERROR;
+    for (size_t pos = 0; pos < count && error == NO_ERROR; pos++)
+    {
+        error = taf_edit_copy_part(taf, &parts[pos], pos == 0, block);
+    }
+    osFreeMem(block);
+
+    if (toniefile_close(taf) != NO_ERROR && error == NO_ERROR)
+    {
+        error = ERROR_WRITE_FAILED;
+    }
+    if (error == NO_ERROR)
+    {
+        fsDeleteFile(target);
+        error = fsRenameFile(tmpPath, target);
+        content_index_invalidate(target);
+    }
+    if (error != NO_ERROR)
+    {
+        fsDeleteFile(tmpPath);
+    }
+    else
+    {
+        TRACE_INFO("Wrote %s with %" PRIuSIZE " chapters in %" PRIu32 " ms\r\n", target, chapters, (uint32_t)(osGetSystemTime() - start));
+    }
+    osFreeMem(tmpPath);
+
+    return error;
+}
+
+static void taf_edit_release(taf_edit_part_t *parts, size_t count)
+{
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        taf_index_release(parts[pos].index);
+    }
+}
+
+/* the whole TAF with its chapters */
+static error_t taf_edit_part_init(taf_edit_part_t *part, const char *path)
+{
+    osMemset(part, 0x00, sizeof(taf_edit_part_t));
+    part->path = path;
+    part->index = taf_index_get(path);
+    if (!part->index)
+    {
+        TRACE_ERROR("%s is no TAF with page aligned blocks\r\n", path);
+        return ERROR_INVALID_FILE;
+    }
+    part->end_block = part->index->blocks;
+    part->chapters = part->index->chapter_blocks;
+    part->chapter_count = part->index->chapters;
+
+    return NO_ERROR;
+}
+
+error_t taf_edit_concat(const char *target, const char *const *sources, size_t count, uint32_t audio_id)
+{
+    if (count == 0 || count > TONIEFILE_MAX_CHAPTERS)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    taf_edit_part_t *parts = osAllocMem(count * sizeof(taf_edit_part_t));
+    error_t error = NO_ERROR;
+    size_t ready = 0;
+    for (; ready < count && error == NO_ERROR; ready++)
+    {
+        error = taf_edit_part_init(&parts[ready], sources[ready]);
+    }
+    if (error == NO_ERROR)
+    {
+        error = taf_edit_write(target, audio_id, parts, count);
+    }
+    taf_edit_release(parts, ready);
+    osFreeMem(parts);
+
+    return error;
+}
+
+error_t taf_edit_extract(const char *source, const char *target, size_t first_chapter, size_t chapters, uint32_t audio_id)
+{
+    taf_edit_part_t part;
+    error_t error = taf_edit_part_init(&part, source);
+    if (error != NO_ERROR)
+    {
+        taf_edit_release(&part, 1);
+        return error;
+    }
+
+    const taf_index_t *index = part.index;
+    if (first_chapter >= index->chapters || chapters == 0)
+    {
+        taf_edit_release(&part, 1);
+        return ERROR_INVALID_PARAMETER;
+    }
+    size_t end_chapter = MIN(first_chapter + chapters, index->chapters);
+
+    part.first_block = index->chapter_blocks[first_chapter];
+    part.end_block = (end_chapter < index->chapters) ? index->chapter_blocks[end_chapter] : index->blocks;
+    part.chapters = &index->chapter_blocks[first_chapter];
+    part.chapter_count = end_chapter - first_chapter;
+
+    error = taf_edit_write(target, audio_id, &part, 1);
+    taf_edit_release(&part, 1);
+
+    return error;
+}
+
+error_t taf_edit_split(const char *source, size_t chapter, const char *first_target, const char *second_target, uint32_t audio_id)
+{
+    if (chapter == 0 || !osStrcmp(source, first_target) || !osStrcmp(source, second_target) || !osStrcmp(first_target, second_target))
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    error_t error = taf_edit_extract(source, first_target, 0, chapter, audio_id);
+    if (error == NO_ERROR)
+    {
+        error = taf_edit_extract(source, second_target, chapter, TONIEFILE_MAX_CHAPTERS, audio_id);
+    }
+    return error;
+}
+
+static int taf_edit_compare_blocks(const void *a, const void *b)
+{
+    uint32_t blockA = *(const uint32_t *)a;
+    uint32_t blockB = *(const uint32_t *)b;
+
+    return (blockA > blockB) - (blockA < blockB);
+}
+
+error_t taf_edit_chapters(const char *source, const char *target, const double *starts, size_t count, uint32_t audio_id)
+{
+    if (count >= TONIEFILE_MAX_CHAPTERS)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    taf_edit_part_t part;
+    error_t error = taf_edit_part_init(&part, source);
+    if (error != NO_ERROR)
+    {
+        taf_edit_release(&part, 1);
+        return error;
+    }
+
+    uint32_t blocks[TONIEFILE_MAX_CHAPTERS];
+    size_t chapters = 0;
+    blocks[chapters++] = 0;
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        blocks[chapters++] = taf_index_block_at(part.index, starts[pos]);
+    }
+    /* chapters landing in the same block are merged */
+    qsort(blocks, chapters, sizeof(uint32_t), taf_edit_compare_blocks);
+    size_t unique = 1;
+    for (size_t pos = 1; pos < chapters; pos++)
+    {
+        if (blocks[pos] != blocks[unique - 1])
+        {
+            blocks[unique++] = blocks[pos];
+        }
+    }
+    part.chapters = blocks;
+    part.chapter_count = unique;
+
+    error = taf_edit_write(target, audio_id, &part, 1);
+    taf_edit_release(&part, 1);
+
+    return error;
+}
+
+error_t taf_edit_audio_id(const char *source, const char *target, uint32_t audio_id)
+{
+    if (audio_id == 0)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    taf_edit_part_t part;
+    error_t error = taf_edit_part_init(&part, source);
+    if (error == NO_ERROR)
+    {
+        error = taf_edit_write(target, audio_id, &part, 1);
+    }
+    taf_edit_release(&part, 1);
+
+    return error;
+}
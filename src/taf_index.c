@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "taf_index.h"
+#include "handler.h"
+#include "mutex_manager.h"
+#include "stats.h"
+#include "debug.h"
+#include "os_port.h"
+
+typedef struct taf_index_file_s
+{
+    struct taf_index_file_s *next;
+    char *path;
+    taf_index_t *index;
+} taf_index_file_t;
+
+/* most recently used first */
+static taf_index_file_t *taf_index_files = NULL;
+static bool_t taf_index_running = FALSE;
+
+static void taf_index_free(taf_index_t *index)
+{
+    osFreeMem(index->granules);
+    osFreeMem(index);
+}
+
+/* has to be called locked */
+static void taf_index_unref(taf_index_t *index)
+{
+    if (index && --index->refCount == 0)
+    {
+        taf_index_free(index);
+    }
+}
+
+static void taf_index_file_free(taf_index_file_t *file)
+{
+    taf_index_unref(file->index);
+    osFreeMem(file->path);
+    osFreeMem(file);
+}
+
+/**
+ * @brief Walks the Ogg pages of a block, they must not cross the block boundary
+ *
+ * @param[out] granule Granule position of the last page that finishes a packet, unchanged if there is none
+ * @param[out] headerLength Length of the leading pages without audio (OpusHead, OpusTags), may be NULL
+ * @param[out] preSkip Pre-skip from an OpusHead page, may be NULL
+ */
+static bool_t taf_index_scan_block(const uint8_t *block, size_t length, uint64_t *granule, uint32_t *headerLength, uint16_t *preSkip)
+{
+    size_t pos = 0;
+    bool_t inHeader = TRUE;
+
+    while (pos < length)
+    {
+        if (pos + 27 > length || osMemcmp(&block[pos], "OggS", 4))
+        {
+            return FALSE;
+        }
+        uint8_t segments = block[pos + 26];
+        if (pos + 27 + segments > length)
+        {
+            return FALSE;
+        }
+        size_t bodyLength = 0;
+        for (uint8_t segment = 0; segment < segments; segment++)
+        {
+            bodyLength += block[pos + 27 + segment];
+        }
+        size_t pageLength = 27 + segments + bodyLength;
+        if (pos + pageLength > length)
+        {
+            return FALSE;
+        }
+
+        uint64_t pageGranule = 0;
+        for (int byte = 7; byte >= 0; byte--)
+        {
+            pageGranule = (pageGranule << 8) | block[pos + 6 + byte];
+        }
+        const uint8_t *body = &block[pos + 27 + segments];
+
+        if (preSkip && bodyLength >= 12 && !osMemcmp(body, "OpusHead", 8))
+        {
+            *preSkip = (uint16_t)(body[10] | (body[11] << 8));
+        }
+        if (pageGranule != UINT64_MAX)
+        {
+            if (pageGranule != 0)
+            {
+                inHeader = FALSE;
+            }
+            *granule = pageGranule;
+        }
+        pos += pageLength;
+        if (headerLength && inHeader)
+        {
+            *headerLength = pos;
+        }
+    }
+
+    return TRUE;
+}
+
+static taf_index_t *taf_index_build(const char *path, const FsFileStat *stat)
+{
+    if (stat->size <= TONIEFILE_FRAME_SIZE)
+    {
+        return NULL;
+    }
+
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    if (!file)
+    {
+        return NULL;
+    }
+
+    uint8_t *block = osAllocMem(TONIEFILE_FRAME_SIZE);
+    taf_index_t *index = osAllocMem(sizeof(taf_index_t));
+    osMemset(index, 0x00, sizeof(taf_index_t));
+    index->refCount = 1;
+    index->size = stat->size;
+    index->modified = stat->modified;
+    index->blocks = (stat->size - TONIEFILE_FRAME_SIZE + TONIEFILE_FRAME_SIZE - 1) / TONIEFILE_FRAME_SIZE;
+    index->granules = osAllocMem(index->blocks * sizeof(uint64_t));
+
+    bool_t valid = FALSE;
+    size_t read_length = 0;
+    toniefile_header_t header;
+
+    fsReadFile(file, block, TONIEFILE_FRAME_SIZE, &read_length);
+    if (read_length == TONIEFILE_FRAME_SIZE)
+    {
+        uint32_t protobufSize = (uint32_t)((block[0] << 24) | (block[1] << 16) | (block[2] << 8) | block[3]);
+        valid = (protobufSize <= TAF_HEADER_SIZE && toniefile_header_decode(&block[4], protobufSize, &header) == NO_ERROR);
+    }
+
+    uint64_t granule = 0;
+    for (uint32_t pos = 0; valid && pos < index->blocks; pos++)
+    {
+        index->granules[pos] = granule;
+
+        if (fsReadFile(file, block, TONIEFILE_FRAME_SIZE, &read_length) != NO_ERROR)
+        {
+            valid = FALSE;
+            break;
+        }
+        valid = taf_index_scan_block(block, read_length, &granule,
+                                     (pos == 0) ? &index->header_length : NULL,
+                                     (pos == 0) ? &index->pre_skip : NULL);
+    }
+    fsCloseFile(file);
+    osFreeMem(block);
+
+    if (!valid || index->header_length == 0)
+    {
+        TRACE_DEBUG("No seek index for '%s', blocks are not page aligned\r\n", path);
+        taf_index_free(index);
+        return NULL;
+    }
+
+    index->audio_id = header.audio_id;
+    index->end_granule = granule;
+    for (size_t pos = 0; pos < header.n_track_page_nums; pos++)
+    {
+        /* written by toniefile and the original encoder as block numbers, one page per block */
+        if (header.track_page_nums[pos] < index->blocks)
+        {
+            index->chapter_blocks[index->chapters++] = header.track_page_nums[pos];
+        }
+    }
+    if (index->chapters == 0)
+    {
+        index->chapter_blocks[index->chapters++] = 0;
+    }
+
+    return index;
+}
+
+taf_index_t *taf_index_get(const char *path)
+{
+    FsFileStat stat;
+    if (fsGetFileStat(path, &stat) != NO_ERROR)
+    {
+        return NULL;
+    }
+
+    if (taf_index_running)
+    {
+        mutex_lock(MUTEX_TAF_INDEX);
+        taf_index_file_t **prev = &taf_index_files;
+        for (taf_index_file_t *cached = taf_index_files; cached; prev = &cached->next, cached = cached->next)
+        {
+            if (osStrcmp(cached->path, path))
+            {
+                continue;
+            }
+            if (cached->index->size == stat.size && !compareDateTime(&cached->index->modified, &stat.modified))
+            {
+                /* move to front */
+                *prev = cached->next;
+                cached->next = taf_index_files;
+                taf_index_files = cached;
+
+                taf_index_t *index = cached->index;
+                index->refCount++;
+                mutex_unlock(MUTEX_TAF_INDEX);
+                stats_update("taf_index_hit", 1);
+                return index;
+            }
+            *prev = cached->next;
+            taf_index_file_free(cached);
+            break;
+        }
+        mutex_unlock(MUTEX_TAF_INDEX);
+        stats_update("taf_index_miss", 1);
+    }
+
+    taf_index_t *index = taf_index_build(path, &stat);
+
+    if (!index || !taf_index_running)
+    {
+        return index;
+    }
+
+    mutex_lock(MUTEX_TAF_INDEX);
+    taf_index_file_t *cached = osAllocMem(sizeof(taf_index_file_t));
+    cached->path = strdup(path);
+    cached->index = index;
+    cached->next = taf_index_files;
+    taf_index_files = cached;
+    index->refCount++;
+
+    /* drop a concurrently built index of the same file and the least recently used ones */
+    size_t files = 1;
+    taf_index_file_t **prev = &cached->next;
+    while (*prev)
+    {
+        taf_index_file_t *entry = *prev;
+        if (!osStrcmp(entry->path, path) || ++files > TAF_INDEX_FILES)
+        {
+            *prev = entry->next;
+            taf_index_file_free(entry);
+            continue;
+        }
+        prev = &entry->next;
+    }
+    mutex_unlock(MUTEX_TAF_INDEX);
+
+    return index;
+}
+
+void taf_index_release(taf_index_t *index)
+{
+    if (!index)
+    {
+        return;
+    }
+    if (!taf_index_running)
+    {
+        taf_index_free(index);
+        return;
+    }
+    mutex_lock(MUTEX_TAF_INDEX);
+    taf_index_unref(index);
+    mutex_unlock(MUTEX_TAF_INDEX);
+}
+
+uint32_t taf_index_block_at(const taf_index_t *index, double seconds)
+{
+    /* also catches NaN, which compares false against everything */
+    if (!(seconds > 0))
+    {
+        return 0;
+    }
+    /* beyond the end the last block is picked, keeps the cast below in range */
+    seconds = MIN(seconds, taf_index_duration(index));
+    uint64_t target = (uint64_t)(seconds * OPUS_SAMPLING_RATE) + index->pre_skip;
+
+    /* last block starting at or before the target */
+    uint32_t low = 0;
+    uint32_t high = index->blocks;
+    while (high - low > 1)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (index->granules[mid] <= target)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+double taf_index_time(const taf_index_t *index, uint32_t block)
+{
+    if (block >= index->blocks)
+    {
+        return taf_index_duration(index);
+    }
+    if (index->granules[block] <= index->pre_skip)
+    {
+        return 0;
+    }
+    return (double)(index->granules[block] - index->pre_skip) / OPUS_SAMPLING_RATE;
+}
+
+double taf_index_duration(const taf_index_t *index)
+{
+    if (index->end_granule <= index->pre_skip)
+    {
+        return 0;
+    }
+    return (double)(index->end_granule - index->pre_skip) / OPUS_SAMPLING_RATE;
+}
+
+uint32_t taf_index_offset(uint32_t block)
+{
+    return TONIEFILE_FRAME_SIZE * (block + 1);
+}
+
+void taf_index_init()
+{
+    taf_index_files = NULL;
+    taf_index_running = TRUE;
+}
+
+void taf_index_deinit()
+{
+    mutex_lock(MUTEX_TAF_INDEX);
+    taf_index_running = FALSE;
+    while (taf_index_files)
+    {
+        taf_index_file_t *file = taf_index_files;
+        taf_index_files = file->next;
+        taf_index_file_free(file);
+    }
+    mutex_unlock(MUTEX_TAF_INDEX);
+}
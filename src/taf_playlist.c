@@ -0,0 +1,706 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "taf_playlist.h"
+#include "taf_index.h"
+#include "toniefile.h"
+#include "server_helpers.h"
+#include "mutex_manager.h"
+#include "stats.h"
+#include "debug.h"
+#include "os_port.h"
+#include "hash/sha1.h"
+#include "ogg/ogg.h"
+
+typedef struct
+{
+    char *path;
+    uint32_t size;
+    DateTime modified;
+    /* position of the part in the blocks of the assembled TAF */
+    uint32_t first_block;
+    uint32_t blocks;
+    /* added to the granule positions of the repacked block and of the following source blocks */
+    uint64_t repacked_granule;
+    int64_t granule_offset;
+    /* the audio of the first source block, moved in front of its header pages, NULL for the first part */
+    uint8_t *repacked;
+    uint32_t repacked_blocks;
+} taf_playlist_part_t;
+
+struct taf_playlist_s
+{
+    uint32_t refCount;
+    char *path;
+    uint32_t size;
+    DateTime modified;
+
+    uint8_t header[TONIEFILE_FRAME_SIZE];
+    uint32_t audio_id;
+    taf_playlist_part_t *parts;
+    size_t part_count;
+    /* audio blocks and the sequence number of the first page in each of them, with one more for the end */
+    uint32_t blocks;
+    uint32_t *sequences;
+};
+
+struct taf_playlist_reader_s
+{
+    taf_playlist_t *playlist;
+    FsFile *file;
+    size_t file_part;
+    /* block in data, 0 is the header */
+    uint32_t block;
+    bool_t loaded;
+    uint8_t data[TONIEFILE_FRAME_SIZE];
+};
+
+typedef struct taf_playlist_file_s
+{
+    struct taf_playlist_file_s *next;
+    taf_playlist_t *playlist;
+} taf_playlist_file_t;
+
+/* most recently used first */
+static taf_playlist_file_t *taf_playlist_files = NULL;
+static bool_t taf_playlist_running = FALSE;
+
+static void taf_playlist_free(taf_playlist_t *playlist)
+{
+    for (size_t pos = 0; pos < playlist->part_count; pos++)
+    {
+        osFreeMem(playlist->parts[pos].path);
+        osFreeMem(playlist->parts[pos].repacked);
+    }
+    osFreeMem(playlist->parts);
+    osFreeMem(playlist->sequences);
+    osFreeMem(playlist->path);
+    osFreeMem(playlist);
+}
+
+/* has to be called locked */
+static void taf_playlist_unref(taf_playlist_t *playlist)
+{
+    if (playlist && --playlist->refCount == 0)
+    {
+        taf_playlist_free(playlist);
+    }
+}
+
+static void taf_playlist_file_free(taf_playlist_file_t *file)
+{
+    taf_playlist_unref(file->playlist);
+    osFreeMem(file);
+}
+
+bool_t taf_playlist_is_playlist(const char *source)
+{
+    size_t length = source ? osStrlen(source) : 0;
+    return (length > 4 && !osStrcasecmp(&source[length - 4], ".m3u")) ||
+           (length > 5 && !osStrcasecmp(&source[length - 5], ".m3u8"));
+}
+
+/**
+ * @brief Renumbers the pages of a block and moves their granule positions
+ *
+ * Serial and checksum are set for each page, the EOS flag is only kept at the end of the last part.
+ *
+ * @return Number of pages or 0 if the block is not made of whole pages
+ */
+static uint32_t taf_playlist_rewrite(uint8_t *block, uint32_t serial, uint32_t sequence, int64_t granule_offset, bool_t last)
+{
+    uint32_t pages = 0;
+    size_t pos = 0;
+
+    while (pos < TONIEFILE_FRAME_SIZE)
+    {
+        uint8_t *header = &block[pos];
+        if (pos + 27 > TONIEFILE_FRAME_SIZE || osMemcmp(header, "OggS", 4) || pos + 27 + header[26] > TONIEFILE_FRAME_SIZE)
+        {
+            return 0;
+        }
+        ogg_page og;
+        og.header = header;
+        og.header_len = 27 + header[26];
+        og.body = &header[og.header_len];
+        og.body_len = 0;
+        for (uint8_t segment = 0; segment < header[26]; segment++)
+        {
+            og.body_len += header[27 + segment];
+        }
+        if (pos + og.header_len + og.body_len > TONIEFILE_FRAME_SIZE)
+        {
+            return 0;
+        }
+
+        uint64_t granule = 0;
+        for (int byte = 7; byte >= 0; byte--)
+        {
+            granule = (granule << 8) | header[6 + byte];
+        }
+        if (granule != UINT64_MAX)
+        {
+            granule = (uint64_t)((int64_t)granule + granule_offset);
+            for (int byte = 0; byte < 8; byte++)
+            {
+                header[6 + byte] = (uint8_t)(granule >> (8 * byte));
+            }
+        }
+        for (int byte = 0; byte < 4; byte++)
+        {
+            header[14 + byte] = (uint8_t)(serial >> (8 * byte));
+            header[18 + byte] = (uint8_t)((sequence + pages) >> (8 * byte));
+        }
+        if (!last)
+        {
+            header[5] &= ~0x04;
+        }
+        ogg_page_checksum_set(&og);
+
+        pos += og.header_len + og.body_len;
+        pages++;
+    }
+
+    return pages;
+}
+
+/* the part playing an audio block */
+static size_t taf_playlist_part_at(const taf_playlist_t *playlist, uint32_t block)
+{
+    size_t low = 0;
+    size_t high = playlist->part_count;
+    while (high - low > 1)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (playlist->parts[mid].first_block <= block)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Loads an audio block of the assembled TAF, taken from its part and rewritten
+ *
+ * @param[out] pages Number of pages in the block
+ */
+static error_t taf_playlist_load(const taf_playlist_t *playlist, uint32_t block, FsFile **file, size_t *filePart, uint8_t *data, uint32_t sequence, uint32_t *pages)
+{
+    size_t partNum = taf_playlist_part_at(playlist, block);
+    const taf_playlist_part_t *part = &playlist->parts[partNum];
+    uint32_t local = block - part->first_block;
+    int64_t granuleOffset = part->granule_offset;
+
+    if (local < part->repacked_blocks)
+    {
+        osMemcpy(data, &part->repacked[local * TONIEFILE_FRAME_SIZE], TONIEFILE_FRAME_SIZE);
+        granuleOffset = (int64_t)part->repacked_granule;
+    }
+    else
+    {
+        /* the first source block was replaced by the repacked one */
+        uint32_t sourceBlock = local - part->repacked_blocks + (part->repacked ? 1 : 0);
+
+        if (*file == NULL || *filePart != partNum)
+        {
+            if (*file)
+            {
+                fsCloseFile(*file);
+            }
+            *filePart = partNum;
+            *file = fsOpenFile(part->path, FS_FILE_MODE_READ);
+            if (*file == NULL)
+            {
+                return ERROR_FILE_OPENING_FAILED;
+            }
+        }
+        size_t length = 0;
+        if (fsSeekFile(*file, (int_t)taf_index_offset(sourceBlock), FS_SEEK_SET) != NO_ERROR ||
+            fsReadFile(*file, data, TONIEFILE_FRAME_SIZE, &length) != NO_ERROR || length != TONIEFILE_FRAME_SIZE)
+        {
+            return ERROR_INVALID_FILE;
+        }
+    }
+
+    *pages = taf_playlist_rewrite(data, playlist->audio_id, sequence, granuleOffset, partNum + 1 == playlist->part_count);
+    return (*pages > 0) ? NO_ERROR : ERROR_INVALID_FILE;
+}
+
+/* lines of the M3U file, without comments, relative entries resolved against its directory */
+static size_t taf_playlist_parse(const char *path, char *content, char **entries, size_t maxEntries)
+{
+    char *dir = strdup(path);
+    char *sep = osStrrchr(dir, '/');
+    if (sep)
+    {
+        *sep = '\0';
+    }
+    else
+    {
+        osStrcpy(dir, ".");
+    }
+
+    size_t count = 0;
+    char *line = content;
+    while (line && *line && count < maxEntries)
+    {
+        char *next = osStrchr(line, '\n');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+        size_t length = osStrlen(line);
+        while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t'))
+        {
+            line[--length] = '\0';
+        }
+        while (*line == ' ' || *line == '\t')
+        {
+            line++;
+        }
+        /* the UTF-8 byte order mark of M3U8 files */
+        if (line == content && !osMemcmp(line, "\xEF\xBB\xBF", 3))
+        {
+            line += 3;
+        }
+
+        if (*line != '\0' && *line != '#')
+        {
+            entries[count++] = (*line == '/') ? strdup(line) : custom_asprintf("%s/%s", dir, line);
+        }
+        line = next;
+    }
+    osFreeMem(dir);
+
+    return count;
+}
+
+/* adds the parts and lays out their blocks, the chapters are collected in the header */
+static error_t taf_playlist_add_part(taf_playlist_t *playlist, const char *path, toniefile_header_t *header, uint64_t *granule)
+{
+    taf_index_t *index = taf_index_get(path);
+    if (!index)
+    {
+        TRACE_ERROR("Playlist entry %s is no TAF with page aligned blocks\r\n", path);
+        return ERROR_INVALID_FILE;
+    }
+    if (index->size != taf_index_offset(index->blocks))
+    {
+        TRACE_ERROR("Playlist entry %s does not end on a block boundary\r\n", path);
+        taf_index_release(index);
+        return ERROR_INVALID_FILE;
+    }
+
+    taf_playlist_part_t *part = &playlist->parts[playlist->part_count];
+    osMemset(part, 0x00, sizeof(taf_playlist_part_t));
+    part->path = strdup(path);
+    part->size = index->size;
+    part->modified = index->modified;
+    part->first_block = playlist->blocks;
+    part->repacked_granule = *granule;
+    part->granule_offset = (int64_t)*granule;
+    part->blocks = index->blocks;
+
+    error_t error = NO_ERROR;
+    uint64_t sourceGranules = index->end_granule;
+    if (playlist->part_count > 0)
+    {
+        /* the OpusHead and OpusTags pages of the part are dropped, its first audio moves to a block of its own */
+        uint8_t *block = osAllocMem(TONIEFILE_FRAME_SIZE);
+        size_t length = 0;
+        size_t repackedLength = 0;
+        uint64_t repackedGranules = 0;
+        FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+
+        error = ERROR_INVALID_FILE;
+        if (file && fsSeekFile(file, (int_t)taf_index_offset(0), FS_SEEK_SET) == NO_ERROR &&
+            fsReadFile(file, block, TONIEFILE_FRAME_SIZE, &length) == NO_ERROR && length == TONIEFILE_FRAME_SIZE)
+        {
+            error = toniefile_repack_block(block, length, index->header_length, playlist->audio_id, &part->repacked, &repackedLength, &repackedGranules);
+        }
+        if (file)
+        {
+            fsCloseFile(file);
+        }
+        osFreeMem(block);
+
+        uint64_t firstGranules = (index->blocks > 1) ? index->granules[1] : index->end_granule;
+        if (error == NO_ERROR && (repackedLength == 0 || repackedLength % TONIEFILE_FRAME_SIZE))
+        {
+            error = ERROR_FAILURE;
+        }
+        if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Could not repack the first block of %s, error=%" PRIu16 "\r\n", path, error);
+            osFreeMem(part->path);
+            osFreeMem(part->repacked);
+            taf_index_release(index);
+            return error;
+        }
+        part->repacked_blocks = repackedLength / TONIEFILE_FRAME_SIZE;
+        part->blocks = part->repacked_blocks + index->blocks - 1;
+        part->granule_offset = (int64_t)(*granule + repackedGranules) - (int64_t)firstGranules;
+        sourceGranules = repackedGranules + index->end_granule - firstGranules;
+    }
+
+    for (size_t chapter = 0; chapter < index->chapters; chapter++)
+    {
+        uint32_t block = index->chapter_blocks[chapter];
+        if (block == 0 || part->repacked == NULL)
+        {
+            block = part->first_block + block;
+        }
+        else
+        {
+            block = part->first_block + part->repacked_blocks + block - 1;
+        }
+        if (header->n_track_page_nums < TONIEFILE_MAX_CHAPTERS)
+        {
+            header->track_page_nums[header->n_track_page_nums++] = block;
+        }
+    }
+    taf_index_release(index);
+
+    playlist->blocks += part->blocks;
+    playlist->part_count++;
+    *granule += sourceGranules;
+
+    return NO_ERROR;
+}
+
+/* FNV-1a over the parts, the same parts keep the id across restarts so the boxes keep their cached copy */
+static uint32_t taf_playlist_audio_id(char *const *entries, size_t count)
+{
+    uint32_t hash = 0x811C9DC5;
+    for (size_t entry = 0; entry < count; entry++)
+    {
+        FsFileStat stat;
+        osMemset(&stat, 0x00, sizeof(stat));
+        fsGetFileStat(entries[entry], &stat);
+
+        char *id = custom_asprintf("%s|%" PRIu32 "|%" PRIu64 "|", entries[entry], stat.size, (uint64_t)convertDateToUnixTime(&stat.modified));
+        for (const char *pos = id; *pos; pos++)
+        {
+            hash ^= (uint8_t)*pos;
+            hash *= 0x01000193;
+        }
+        osFreeMem(id);
+    }
+    return hash;
+}
+
+static taf_playlist_t *taf_playlist_build(const char *path, const FsFileStat *stat)
+{
+    if (stat->size == 0 || stat->size > TAF_PLAYLIST_MAX_SIZE)
+    {
+        return NULL;
+    }
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    if (!file)
+    {
+        return NULL;
+    }
+    char *content = osAllocMem(stat->size + 1);
+    size_t pos = 0;
+    while (pos < stat->size)
+    {
+        size_t read = 0;
+        if (fsReadFile(file, &content[pos], stat->size - pos, &read) != NO_ERROR || read == 0)
+        {
+            break;
+        }
+        pos += read;
+    }
+    fsCloseFile(file);
+    content[pos] = '\0';
+
+    /* each part starts a chapter */
+    char *entries[TONIEFILE_MAX_CHAPTERS];
+    size_t count = taf_playlist_parse(path, content, entries, TONIEFILE_MAX_CHAPTERS);
+    osFreeMem(content);
+    if (count == 0)
+    {
+        TRACE_ERROR("Playlist %s has no entries\r\n", path);
+        return NULL;
+    }
+
+    systime_t start = osGetSystemTime();
+    taf_playlist_t *playlist = osAllocMem(sizeof(taf_playlist_t));
+    osMemset(playlist, 0x00, sizeof(taf_playlist_t));
+    playlist->refCount = 1;
+    playlist->path = strdup(path);
+    playlist->size = stat->size;
+    playlist->modified = stat->modified;
+    playlist->audio_id = taf_playlist_audio_id(entries, count);
+    playlist->parts = osAllocMem(count * sizeof(taf_playlist_part_t));
+
+    toniefile_header_t header;
+    osMemset(&header, 0x00, sizeof(header));
+    header.audio_id = playlist->audio_id;
+
+    error_t error = NO_ERROR;
+    uint64_t granule = 0;
+    for (size_t entry = 0; entry < count; entry++)
+    {
+        if (error == NO_ERROR)
+        {
+            error = taf_playlist_add_part(playlist, entries[entry], &header, &granule);
+        }
+        osFreeMem(entries[entry]);
+    }
+    /* sizes and ranges are 32 bit */
+    if (error == NO_ERROR && playlist->blocks >= UINT32_MAX / TONIEFILE_FRAME_SIZE)
+    {
+        error = ERROR_INVALID_LENGTH;
+    }
+
+    /* one pass over all blocks numbers the pages and hashes the audio for the header */
+    playlist->sequences = osAllocMem((playlist->blocks + 1) * sizeof(uint32_t));
+    uint8_t *block = osAllocMem(TONIEFILE_FRAME_SIZE);
+    Sha1Context sha1;
+    sha1Init(&sha1);
+    FsFile *partFile = NULL;
+    size_t partNum = 0;
+    uint32_t sequence = 0;
+    for (uint32_t pos = 0; pos < playlist->blocks && error == NO_ERROR; pos++)
+    {
+        uint32_t pages = 0;
+        playlist->sequences[pos] = sequence;
+        error = taf_playlist_load(playlist, pos, &partFile, &partNum, block, sequence, &pages);
+        sequence += pages;
+        sha1Update(&sha1, block, TONIEFILE_FRAME_SIZE);
+    }
+    playlist->sequences[playlist->blocks] = sequence;
+    if (partFile)
+    {
+        fsCloseFile(partFile);
+    }
+    osFreeMem(block);
+
+    if (error == NO_ERROR)
+    {
+        sha1Final(&sha1, header.sha1_hash);
+        header.sha1_hash_len = SHA1_DIGEST_SIZE;
+        header.num_bytes = (uint64_t)playlist->blocks * TONIEFILE_FRAME_SIZE;
+        error = toniefile_header_encode(&header, playlist->header);
+    }
+    if (error != NO_ERROR)
+    {
+        TRACE_ERROR("Could not assemble playlist %s, error=%" PRIu16 "\r\n", path, error);
+        taf_playlist_free(playlist);
+        return NULL;
+    }
+
+    TRACE_INFO("Assembled playlist %s, %" PRIuSIZE " parts, %" PRIuSIZE " chapters, %" PRIu32 " blocks in %" PRIu32 " ms\r\n",
+               path, playlist->part_count, header.n_track_page_nums, playlist->blocks, (uint32_t)(osGetSystemTime() - start));
+
+    return playlist;
+}
+
+/* the parts have to be unchanged as well */
+static bool_t taf_playlist_valid(const taf_playlist_t *playlist, const FsFileStat *stat)
+{
+    if (playlist->size != stat->size || compareDateTime(&playlist->modified, &stat->modified))
+    {
+        return FALSE;
+    }
+    for (size_t pos = 0; pos < playlist->part_count; pos++)
+    {
+        FsFileStat partStat;
+        const taf_playlist_part_t *part = &playlist->parts[pos];
+        if (fsGetFileStat(part->path, &partStat) != NO_ERROR || part->size != partStat.size || compareDateTime(&part->modified, &partStat.modified))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+taf_playlist_t *taf_playlist_get(const char *path)
+{
+    FsFileStat stat;
+    if (fsGetFileStat(path, &stat) != NO_ERROR)
+    {
+        return NULL;
+    }
+
+    if (taf_playlist_running)
+    {
+        mutex_lock(MUTEX_TAF_PLAYLIST);
+        taf_playlist_file_t **prev = &taf_playlist_files;
+        for (taf_playlist_file_t *cached = taf_playlist_files; cached; prev = &cached->next, cached = cached->next)
+        {
+            if (osStrcmp(cached->playlist->path, path))
+            {
+                continue;
+            }
+            if (taf_playlist_valid(cached->playlist, &stat))
+            {
+                /* move to front */
+                *prev = cached->next;
+                cached->next = taf_playlist_files;
+                taf_playlist_files = cached;
+
+                taf_playlist_t *playlist = cached->playlist;
+                playlist->refCount++;
+                mutex_unlock(MUTEX_TAF_PLAYLIST);
+                stats_update("taf_playlist_hit", 1);
+                return playlist;
+            }
+            *prev = cached->next;
+            taf_playlist_file_free(cached);
+            break;
+        }
+        mutex_unlock(MUTEX_TAF_PLAYLIST);
+        stats_update("taf_playlist_miss", 1);
+    }
+
+    taf_playlist_t *playlist = taf_playlist_build(path, &stat);
+
+    if (!playlist || !taf_playlist_running)
+    {
+        return playlist;
+    }
+
+    mutex_lock(MUTEX_TAF_PLAYLIST);
+    taf_playlist_file_t *cached = osAllocMem(sizeof(taf_playlist_file_t));
+    cached->playlist = playlist;
+    cached->next = taf_playlist_files;
+    taf_playlist_files = cached;
+    playlist->refCount++;
+
+    /* drop a concurrently built playlist of the same file and the least recently used ones */
+    size_t files = 1;
+    taf_playlist_file_t **prev = &cached->next;
+    while (*prev)
+    {
+        taf_playlist_file_t *entry = *prev;
+        if (!osStrcmp(entry->playlist->path, path) || ++files > TAF_PLAYLIST_FILES)
+        {
+            *prev = entry->next;
+            taf_playlist_file_free(entry);
+            continue;
+        }
+        prev = &entry->next;
+    }
+    mutex_unlock(MUTEX_TAF_PLAYLIST);
+
+    return playlist;
+}
+
+void taf_playlist_release(taf_playlist_t *playlist)
+{
+    if (!playlist)
+    {
+        return;
+    }
+    if (!taf_playlist_running)
+    {
+        taf_playlist_free(playlist);
+        return;
+    }
+    mutex_lock(MUTEX_TAF_PLAYLIST);
+    taf_playlist_unref(playlist);
+    mutex_unlock(MUTEX_TAF_PLAYLIST);
+}
+
+uint32_t taf_playlist_size(const taf_playlist_t *playlist)
+{
+    return taf_index_offset(playlist->blocks);
+}
+
+taf_playlist_reader_t *taf_playlist_reader_create(taf_playlist_t *playlist)
+{
+    taf_playlist_reader_t *reader = osAllocMem(sizeof(taf_playlist_reader_t));
+    if (!reader)
+    {
+        return NULL;
+    }
+    osMemset(reader, 0x00, sizeof(taf_playlist_reader_t));
+    reader->playlist = playlist;
+
+    return reader;
+}
+
+void taf_playlist_reader_free(taf_playlist_reader_t *reader)
+{
+    if (reader->file)
+    {
+        fsCloseFile(reader->file);
+    }
+    osFreeMem(reader);
+}
+
+error_t taf_playlist_read(taf_playlist_reader_t *reader, uint32_t offset, uint8_t *data, size_t length, size_t *read)
+{
+    const taf_playlist_t *playlist = reader->playlist;
+    uint32_t size = taf_playlist_size(playlist);
+
+    *read = 0;
+    if (offset >= size)
+    {
+        return ERROR_END_OF_STREAM;
+    }
+    length = MIN(length, size - offset);
+
+    while (*read < length)
+    {
+        uint32_t block = offset / TONIEFILE_FRAME_SIZE;
+        if (!reader->loaded || reader->block != block)
+        {
+            reader->loaded = FALSE;
+            if (block == 0)
+            {
+                osMemcpy(reader->data, playlist->header, TONIEFILE_FRAME_SIZE);
+            }
+            else
+            {
+                uint32_t pages = 0;
+                error_t error = taf_playlist_load(playlist, block - 1, &reader->file, &reader->file_part, reader->data, playlist->sequences[block - 1], &pages);
+                if (error == NO_ERROR && pages != playlist->sequences[block] - playlist->sequences[block - 1])
+                {
+                    error = ERROR_INVALID_FILE;
+                }
+                if (error != NO_ERROR)
+                {
+                    TRACE_ERROR("Playlist %s changed while it was read\r\n", playlist->path);
+                    return ERROR_INVALID_FILE;
+                }
+            }
+            reader->block = block;
+            reader->loaded = TRUE;
+        }
+
+        size_t blockPos = offset % TONIEFILE_FRAME_SIZE;
+        size_t part = MIN(length - *read, TONIEFILE_FRAME_SIZE - blockPos);
+        osMemcpy(&data[*read], &reader->data[blockPos], part);
+        *read += part;
+        offset += part;
+    }
+
+    return NO_ERROR;
+}
+
+void taf_playlist_init()
+{
+    taf_playlist_files = NULL;
+    taf_playlist_running = TRUE;
+}
+
+void taf_playlist_deinit()
+{
+    mutex_lock(MUTEX_TAF_PLAYLIST);
+    taf_playlist_running = FALSE;
+    while (taf_playlist_files)
+    {
+        taf_playlist_file_t *file = taf_playlist_files;
+        taf_playlist_files = file->next;
+        taf_playlist_file_free(file);
+    }
+    mutex_unlock(MUTEX_TAF_PLAYLIST);
+}
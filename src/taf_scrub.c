@@ -0,0 +1,335 @@
+#include <time.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "taf_scrub.h"
+#include "taf_verify.h"
+#include "transcode_cache.h"
+#include "content_index.h"
+#include "server_helpers.h"
+#include "platform.h"
+#include "settings.h"
+#include "stats.h"
+#include "fs_port.h"
+#include "debug.h"
+#include "os_port.h"
+
+#define TAF_SCRUB_STOP_TIMEOUT_MS 10000
+
+typedef enum
+{
+    /* <contentdir>/<8 hex digits>/<8 hex digits> */
+    TAF_SCRUB_CONTENT,
+    /* every .taf below the library */
+    TAF_SCRUB_LIBRARY,
+    /* the .taf files of the transcode cache */
+    TAF_SCRUB_TRANSCODE
+} taf_scrub_tree_t;
+
+typedef struct
+{
+    uint32_t files;
+    uint32_t bad;
+    uint64_t bytes;
+} taf_scrub_pass_t;
+
+static bool_t taf_scrub_running = FALSE;
+/* set to stop a running check */
+static bool_t taf_scrub_stop = FALSE;
+static OsEvent taf_scrub_event;
+static OsEvent taf_scrub_stopped;
+
+static bool_t taf_scrub_is_hex(const char *name)
+{
+    size_t length = 0;
+    while (name[length])
+    {
+        if (!isxdigit((unsigned char)name[length]))
+        {
+            return FALSE;
+        }
+        length++;
+    }
+    return length == 8;
+}
+
+static bool_t taf_scrub_is_taf(const char *name)
+{
+    size_t length = osStrlen(name);
+    return length > 4 && !osStrcasecmp(&name[length - 4], ".taf");
+}
+
+static void taf_scrub_add_name(char ***names, size_t *count, size_t *size, const char *name)
+{
+    if (*count == *size)
+    {
+        size_t grown = *size ? 2 * *size : 16;
+        char **buffer = osAllocMem(grown * sizeof(char *));
+        if (*names)
+        {
+            osMemcpy(buffer, *names, *count * sizeof(char *));
+            osFreeMem(*names);
+        }
+        *names = buffer;
+        *size = grown;
+    }
+    (*names)[(*count)++] = strdup(name);
+}
+
+static void taf_scrub_free_names(char **names, size_t count)
+{
+    for (size_t pos = 0; pos < count; pos++)
+    {
+        osFreeMem(names[pos]);
+    }
+    osFreeMem(names);
+}
+
+static void taf_scrub_quarantine(const char *path)
+{
+    char *badPath = custom_asprintf("%s.bad", path);
+    fsDeleteFile(badPath);
+    error_t error = fsRenameFile(path, badPath);
+    content_index_invalidate(path);
+
+    if (error == NO_ERROR)
+    {
+        TRACE_WARNING("Moved %s to %s, it is fetched from the cloud again\r\n", path, badPath);
+        stats_update("scrub_quarantined", 1);
+    }
+    else
+    {
+        TRACE_ERROR("Could not move %s aside, error=%" PRIu16 "\r\n", path, error);
+    }
+    osFreeMem(badPath);
+}
+
+static void taf_scrub_drop_transcode(const char *path)
+{
+    size_t length = osStrlen(path);
+    char *infoPath = custom_asprintf("%.*s.json", (int)(length - 4), path);
+    fsDeleteFile(path);
+    fsDeleteFile(infoPath);
+    TRACE_WARNING("Dropped %s, it is encoded again on its next use\r\n", path);
+    osFreeMem(infoPath);
+}
+
+static void taf_scrub_file(const char *path, taf_scrub_tree_t tree, taf_scrub_pass_t *pass)
+{
+    FsFileStat stat;
+    if (fsGetFileStat(path, &stat) != NO_ERROR)
+    {
+        return;
+    }
+    if ((int64_t)time(NULL) - (int64_t)convertDateToUnixTime(&stat.modified) < TAF_SCRUB_MIN_AGE_S)
+    {
+        return;
+    }
+
+    taf_verify_info_t info;
+    uint32_t rate = settings_get_unsigned("core.scrub_rate") * 1024 * 1024;
+    taf_verify_result_t result = taf_verify_file(path, rate, &taf_scrub_stop, &info);
+    if (result == TAF_VERIFY_CANCELED)
+    {
+        return;
+    }
+    pass->files++;
+    pass->bytes += info.bytes;
+    stats_update("scrub_files", 1);
+
+    bool_t nocloud = FALSE;
+    if (tree == TAF_SCRUB_CONTENT)
+    {
+        tonie_info_t tonieInfo;
+        osMemset(&tonieInfo, 0x00, sizeof(tonie_info_t));
+        content_index_get(path, TRUE, &tonieInfo);
+        nocloud = tonieInfo.contentConfig.nocloud;
+        free_content_json(&tonieInfo.contentConfig);
+        content_index_set_verify(path, &stat, result);
+    }
+
+    if (!taf_verify_failed(result))
+    {
+        return;
+    }
+    pass->bad++;
+    stats_update("scrub_bad", 1);
+    TRACE_WARNING("%s is broken, %s in block %" PRIu32 "\r\n", path, taf_verify_result_name(result), info.block);
+
+    switch (tree)
+    {
+    case TAF_SCRUB_CONTENT:
+        /* only moved aside when handleCloudContent may fetch it again, like its refetch of broken files.
+         * Custom tonies have no copy in the cloud, a broken file still plays partly. */
+        if (!nocloud && settings_get_bool("core.scrub_quarantine") && settings_get_bool("cloud.enabled") && settings_get_bool("cloud.enableV2Content"))
+        {
+            taf_scrub_quarantine(path);
+        }
+        break;
+    case TAF_SCRUB_TRANSCODE:
+        taf_scrub_drop_transcode(path);
+        break;
+    case TAF_SCRUB_LIBRARY:
+        break;
+    }
+}
+
+static void taf_scrub_dir(const char *path, taf_scrub_tree_t tree, size_t depth, taf_scrub_pass_t *pass)
+{
+    FsDir *dir = fsOpenDir(path);
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    /* the names are collected first, the directory must not stay open during the checks */
+    char **files = NULL;
+    size_t fileCount = 0;
+    size_t fileSize = 0;
+    char **dirs = NULL;
+    size_t dirCount = 0;
+    size_t dirSize = 0;
+
+    FsDirEntry dirEntry;
+    while (fsReadDir(dir, &dirEntry) == NO_ERROR)
+    {
+        if (!osStrcmp(dirEntry.name, ".") || !osStrcmp(dirEntry.name, ".."))
+        {
+            continue;
+        }
+        bool_t isDir = (dirEntry.attributes & FS_FILE_ATTR_DIRECTORY) != 0;
+        switch (tree)
+        {
+        case TAF_SCRUB_CONTENT:
+            if (isDir && depth == 0 && taf_scrub_is_hex(dirEntry.name))
+            {
+                taf_scrub_add_name(&dirs, &dirCount, &dirSize, dirEntry.name);
+            }
+            else if (!isDir && depth == 1 && taf_scrub_is_hex(dirEntry.name))
+            {
+                taf_scrub_add_name(&files, &fileCount, &fileSize, dirEntry.name);
+            }
+            break;
+        case TAF_SCRUB_LIBRARY:
+            if (isDir && depth < TAF_SCRUB_MAX_DEPTH)
+            {
+                taf_scrub_add_name(&dirs, &dirCount, &dirSize, dirEntry.name);
+            }
+            else if (!isDir && taf_scrub_is_taf(dirEntry.name))
+            {
+                taf_scrub_add_name(&files, &fileCount, &fileSize, dirEntry.name);
+            }
+            break;
+        case TAF_SCRUB_TRANSCODE:
+            if (!isDir && taf_scrub_is_taf(dirEntry.name))
+            {
+                taf_scrub_add_name(&files, &fileCount, &fileSize, dirEntry.name);
+            }
+            break;
+        }
+    }
+    fsCloseDir(dir);
+
+    for (size_t pos = 0; pos < fileCount && !taf_scrub_stop; pos++)
+    {
+        char *filePath = custom_asprintf("%s%c%s", path, '/', files[pos]);
+        taf_scrub_file(filePath, tree, pass);
+        osFreeMem(filePath);
+    }
+    for (size_t pos = 0; pos < dirCount && !taf_scrub_stop; pos++)
+    {
+        char *subdir = custom_asprintf("%s%c%s", path, '/', dirs[pos]);
+        taf_scrub_dir(subdir, tree, depth + 1, pass);
+        osFreeMem(subdir);
+    }
+    taf_scrub_free_names(files, fileCount);
+    taf_scrub_free_names(dirs, dirCount);
+}
+
+static void taf_scrub_pass()
+{
+    taf_scrub_pass_t pass;
+    osMemset(&pass, 0x00, sizeof(pass));
+    time_t start = time(NULL);
+
+    TRACE_INFO("Checking the TAF files\r\n");
+    char *transcodeDir = custom_asprintf("%s/%s", settings_get_string("internal.datadirfull"), TRANSCODE_CACHE_DIR);
+    taf_scrub_dir(settings_get_string("internal.contentdirfull"), TAF_SCRUB_CONTENT, 0, &pass);
+    taf_scrub_dir(settings_get_string("internal.librarydirfull"), TAF_SCRUB_LIBRARY, 0, &pass);
+    taf_scrub_dir(transcodeDir, TAF_SCRUB_TRANSCODE, 0, &pass);
+    osFreeMem(transcodeDir);
+
+    TRACE_INFO("%s %" PRIu32 " TAF files with %" PRIu64 " MB in %" PRIu32 " s, %" PRIu32 " broken\r\n",
+               taf_scrub_stop ? "Stopped after checking" : "Checked", pass.files, pass.bytes / (1024 * 1024),
+               (uint32_t)(time(NULL) - start), pass.bad);
+}
+
+static void taf_scrub_task(void *arg)
+{
+    platform_set_task_background();
+
+    systime_t start = osGetSystemTime();
+    bool_t passed = FALSE;
+    time_t lastPass = 0;
+
+    while (!taf_scrub_stop)
+    {
+        uint32_t interval = settings_get_unsigned("core.scrub_interval");
+        bool_t due = FALSE;
+        if (interval > 0)
+        {
+            due = passed ? (uint64_t)(time(NULL) - lastPass) >= (uint64_t)interval * 3600
+                         : osGetSystemTime() - start >= TAF_SCRUB_START_DELAY_MS;
+        }
+        if (!due)
+        {
+            osWaitForEvent(&taf_scrub_event, TAF_SCRUB_IDLE_MS);
+            continue;
+        }
+
+        taf_scrub_pass();
+        lastPass = time(NULL);
+        passed = TRUE;
+    }
+
+    osSetEvent(&taf_scrub_stopped);
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+void taf_scrub_init()
+{
+    taf_verify_init();
+
+    osCreateEvent(&taf_scrub_event);
+    osCreateEvent(&taf_scrub_stopped);
+    taf_scrub_stop = FALSE;
+    taf_scrub_running = TRUE;
+
+    if (osCreateTask("TafScrub", &taf_scrub_task, NULL, 10 * 1024, 0) == OS_INVALID_TASK_ID)
+    {
+        TRACE_ERROR("Failed to start the TAF scrubber\r\n");
+        osDeleteEvent(&taf_scrub_event);
+        osDeleteEvent(&taf_scrub_stopped);
+        taf_scrub_running = FALSE;
+    }
+}
+
+void taf_scrub_deinit()
+{
+    if (!taf_scrub_running)
+    {
+        return;
+    }
+    taf_scrub_running = FALSE;
+
+    /* a running check notices the flag with its next read */
+    taf_scrub_stop = TRUE;
+    osSetEvent(&taf_scrub_event);
+    if (!osWaitForEvent(&taf_scrub_stopped, TAF_SCRUB_STOP_TIMEOUT_MS))
+    {
+        TRACE_WARNING("TAF scrubber did not stop in time\r\n");
+        return;
+    }
+    osDeleteEvent(&taf_scrub_event);
+    osDeleteEvent(&taf_scrub_stopped);
+}
@@ -0,0 +1,394 @@
+#include <string.h>
+
+#include "taf_verify.h"
+#include "toniefile.h"
+#include "handler.h"
+#include "net_config.h"
+#include "fs_port.h"
+#include "debug.h"
+#include "hash/sha1.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define TAF_VERIFY_SHA_NI
+#endif
+
+/* the Ogg CRC, polynomial 0x04c11db7 without reflection, processed 8 bytes at once */
+static uint32_t taf_verify_crc_table[8][256];
+static bool_t taf_verify_sha_ni = FALSE;
+
+typedef struct
+{
+    /* SHA extensions */
+    uint32_t state[5];
+    uint8_t buffer[64];
+    size_t used;
+    uint64_t length;
+    /* without them */
+    Sha1Context context;
+} taf_verify_sha1_t;
+
+static const char *taf_verify_result_names[] = {
+    "unknown",
+    "ok",
+    "read_failed",
+    "bad_header",
+    "bad_length",
+    "bad_alignment",
+    "bad_crc",
+    "bad_hash",
+    "canceled",
+};
+
+static uint32_t taf_verify_crc(uint32_t crc, const uint8_t *data, size_t length)
+{
+    while (length >= 8)
+    {
+        crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+        crc = taf_verify_crc_table[7][crc >> 24] ^
+              taf_verify_crc_table[6][(crc >> 16) & 0xFF] ^
+              taf_verify_crc_table[5][(crc >> 8) & 0xFF] ^
+              taf_verify_crc_table[4][crc & 0xFF] ^
+              taf_verify_crc_table[3][data[4]] ^
+              taf_verify_crc_table[2][data[5]] ^
+              taf_verify_crc_table[1][data[6]] ^
+              taf_verify_crc_table[0][data[7]];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = (crc << 8) ^ taf_verify_crc_table[0][(crc >> 24) ^ *data++];
+    }
+    return crc;
+}
+
+#ifdef TAF_VERIFY_SHA_NI
+__attribute__((target("sha,sse4.1"))) static void taf_verify_sha1_ni(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    __m128i e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    while (blocks-- > 0)
+    {
+        __m128i abcdSave = abcd;
+        __m128i eSave = e0;
+        __m128i w[4];
+        for (int pos = 0; pos < 4; pos++)
+        {
+            w[pos] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[16 * pos]), mask);
+        }
+
+        /* 20 times four rounds, the schedule is kept in a ring of the last 16 words */
+        __m128i e = _mm_add_epi32(e0, w[0]);
+        __m128i prev = abcd;
+#pragma GCC unroll 20
+        for (int group = 0; group < 20; group++)
+        {
+            if (group >= 4)
+            {
+                w[group & 3] = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(w[group & 3], w[(group + 1) & 3]), w[(group + 2) & 3]), w[(group + 3) & 3]);
+            }
+            if (group > 0)
+            {
+                e = _mm_sha1nexte_epu32(prev, w[group & 3]);
+            }
+            prev = abcd;
+            if (group < 5)
+            {
+                abcd = _mm_sha1rnds4_epu32(abcd, e, 0);
+            }
+            else if (group < 10)
+            {
+                abcd = _mm_sha1rnds4_epu32(abcd, e, 1);
+            }
+            else if (group < 15)
+            {
+                abcd = _mm_sha1rnds4_epu32(abcd, e, 2);
+            }
+            else
+            {
+                abcd = _mm_sha1rnds4_epu32(abcd, e, 3);
+            }
+        }
+        e0 = _mm_sha1nexte_epu32(prev, eSave);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+#endif
+
+static void taf_verify_sha1_init(taf_verify_sha1_t *sha1)
+{
+    static const uint32_t init[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+    if (!taf_verify_sha_ni)
+    {
+        sha1Init(&sha1->context);
+        return;
+    }
+    osMemcpy(sha1->state, init, sizeof(init));
+    sha1->used = 0;
+    sha1->length = 0;
+}
+
+static void taf_verify_sha1_update(taf_verify_sha1_t *sha1, const uint8_t *data, size_t length)
+{
+#ifdef TAF_VERIFY_SHA_NI
+    if (taf_verify_sha_ni)
+    {
+        sha1->length += length;
+        if (sha1->used > 0)
+        {
+            size_t part = MIN(length, sizeof(sha1->buffer) - sha1->used);
+            osMemcpy(&sha1->buffer[sha1->used], data, part);
+            sha1->used += part;
+            data += part;
+            length -= part;
+            if (sha1->used < sizeof(sha1->buffer))
+            {
+                return;
+            }
+            taf_verify_sha1_ni(sha1->state, sha1->buffer, 1);
+            sha1->used = 0;
+        }
+        taf_verify_sha1_ni(sha1->state, data, length / 64);
+        sha1->used = length % 64;
+        osMemcpy(sha1->buffer, &data[length - sha1->used], sha1->used);
+        return;
+    }
+#endif
+    sha1Update(&sha1->context, data, length);
+}
+
+static void taf_verify_sha1_final(taf_verify_sha1_t *sha1, uint8_t *digest)
+{
+#ifdef TAF_VERIFY_SHA_NI
+    if (taf_verify_sha_ni)
+    {
+        uint64_t bits = sha1->length * 8;
+        uint8_t padding[72];
+        size_t padLength = (sha1->used < 56) ? 56 - sha1->used : 120 - sha1->used;
+
+        osMemset(padding, 0x00, sizeof(padding));
+        padding[0] = 0x80;
+        for (int pos = 0; pos < 8; pos++)
+        {
+            padding[padLength + pos] = (uint8_t)(bits >> (56 - 8 * pos));
+        }
+        taf_verify_sha1_update(sha1, padding, padLength + 8);
+
+        for (int pos = 0; pos < 5; pos++)
+        {
+            digest[4 * pos + 0] = (uint8_t)(sha1->state[pos] >> 24);
+            digest[4 * pos + 1] = (uint8_t)(sha1->state[pos] >> 16);
+            digest[4 * pos + 2] = (uint8_t)(sha1->state[pos] >> 8);
+            digest[4 * pos + 3] = (uint8_t)sha1->state[pos];
+        }
+        return;
+    }
+#endif
+    sha1Final(&sha1->context, digest);
+}
+
+/* checks the pages of one block, they have to fill it exactly */
+static taf_verify_result_t taf_verify_block(const uint8_t *block)
+{
+    static const uint8_t zeros[4] = {0};
+    size_t pos = 0;
+
+    while (pos < TONIEFILE_FRAME_SIZE)
+    {
+        if (pos + 27 > TONIEFILE_FRAME_SIZE || osMemcmp(&block[pos], "OggS", 4))
+        {
+            return TAF_VERIFY_BAD_ALIGNMENT;
+        }
+        uint8_t segments = block[pos + 26];
+        if (pos + 27 + segments > TONIEFILE_FRAME_SIZE)
+        {
+            return TAF_VERIFY_BAD_ALIGNMENT;
+        }
+        size_t bodyLength = 0;
+        for (uint8_t segment = 0; segment < segments; segment++)
+        {
+            bodyLength += block[pos + 27 + segment];
+        }
+        size_t pageLength = 27 + segments + bodyLength;
+        if (pos + pageLength > TONIEFILE_FRAME_SIZE)
+        {
+            return TAF_VERIFY_BAD_ALIGNMENT;
+        }
+
+        /* the CRC is calculated with its own field set to zero */
+        const uint8_t *page = &block[pos];
+        uint32_t crc = taf_verify_crc(0, page, 22);
+        crc = taf_verify_crc(crc, zeros, sizeof(zeros));
+        crc = taf_verify_crc(crc, &page[26], pageLength - 26);
+        uint32_t stored = (uint32_t)page[22] | ((uint32_t)page[23] << 8) | ((uint32_t)page[24] << 16) | ((uint32_t)page[25] << 24);
+        if (crc != stored)
+        {
+            return TAF_VERIFY_BAD_CRC;
+        }
+        pos += pageLength;
+    }
+
+    return TAF_VERIFY_OK;
+}
+
+/* sleeps until the bytes read so far fit into the rate */
+static void taf_verify_throttle(systime_t start, uint64_t bytes, uint32_t rate)
+{
+    if (rate == 0)
+    {
+        return;
+    }
+    systime_t due = (systime_t)(bytes * 1000 / rate);
+    systime_t elapsed = osGetSystemTime() - start;
+    if (due > elapsed)
+    {
+        osDelayTask(due - elapsed);
+    }
+}
+
+void taf_verify_init()
+{
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        uint32_t crc = byte << 24;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+        }
+        taf_verify_crc_table[0][byte] = crc;
+    }
+    for (int table = 1; table < 8; table++)
+    {
+        for (uint32_t byte = 0; byte < 256; byte++)
+        {
+            uint32_t crc = taf_verify_crc_table[table - 1][byte];
+            taf_verify_crc_table[table][byte] = (crc << 8) ^ taf_verify_crc_table[0][crc >> 24];
+        }
+    }
+
+#ifdef TAF_VERIFY_SHA_NI
+    unsigned int eax, ebx, ecx, edx;
+    bool_t sse41 = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+    bool_t sha = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+    taf_verify_sha_ni = sse41 && sha;
+#endif
+    TRACE_DEBUG("TAF verification uses %s SHA-1\r\n", taf_verify_sha_ni ? "SHA extensions for" : "the generic");
+}
+
+taf_verify_result_t taf_verify_file(const char *path, uint32_t rate, const bool_t *cancel, taf_verify_info_t *info)
+{
+    osMemset(info, 0x00, sizeof(taf_verify_info_t));
+
+    uint32_t size = 0;
+    if (fsGetFileSize(path, &size) != NO_ERROR)
+    {
+        info->result = TAF_VERIFY_READ_FAILED;
+        return info->result;
+    }
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    if (!file)
+    {
+        info->result = TAF_VERIFY_READ_FAILED;
+        return info->result;
+    }
+
+    size_t bufferSize = TAF_VERIFY_READ_BLOCKS * TONIEFILE_FRAME_SIZE;
+    uint8_t *buffer = osAllocMem(bufferSize);
+    systime_t start = osGetSystemTime();
+    taf_verify_result_t result = TAF_VERIFY_OK;
+    toniefile_header_t header;
+    size_t readLength = 0;
+
+    if (size < 2 * TONIEFILE_FRAME_SIZE)
+    {
+        result = TAF_VERIFY_BAD_LENGTH;
+    }
+    else if (fsReadFile(file, buffer, TONIEFILE_FRAME_SIZE, &readLength) != NO_ERROR || readLength != TONIEFILE_FRAME_SIZE)
+    {
+        result = TAF_VERIFY_READ_FAILED;
+    }
+    else
+    {
+        uint32_t protobufSize = (uint32_t)((buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3]);
+        if (protobufSize > TAF_HEADER_SIZE || toniefile_header_decode(&buffer[4], protobufSize, &header) != NO_ERROR)
+        {
+            result = TAF_VERIFY_BAD_HEADER;
+        }
+    }
+
+    if (result == TAF_VERIFY_OK)
+    {
+        info->bytes = TONIEFILE_FRAME_SIZE;
+        info->stream = (header.num_bytes == TONIE_LENGTH_MAX);
+        if (!info->stream && (size % TONIEFILE_FRAME_SIZE != 0 || header.num_bytes != size - TONIEFILE_FRAME_SIZE))
+        {
+            result = TAF_VERIFY_BAD_LENGTH;
+        }
+    }
+
+    /* a stream is still growing, only its complete blocks are checked */
+    uint32_t blocks = (size - TONIEFILE_FRAME_SIZE) / TONIEFILE_FRAME_SIZE;
+    taf_verify_sha1_t sha1;
+    taf_verify_sha1_init(&sha1);
+    while (result == TAF_VERIFY_OK && info->blocks < blocks)
+    {
+        if (cancel && *cancel)
+        {
+            result = TAF_VERIFY_CANCELED;
+            break;
+        }
+
+        uint32_t count = MIN(blocks - info->blocks, TAF_VERIFY_READ_BLOCKS);
+        if (fsReadFile(file, buffer, count * TONIEFILE_FRAME_SIZE, &readLength) != NO_ERROR || readLength != count * TONIEFILE_FRAME_SIZE)
+        {
+            info->block = info->blocks;
+            result = TAF_VERIFY_READ_FAILED;
+            break;
+        }
+        for (uint32_t pos = 0; pos < count && result == TAF_VERIFY_OK; pos++)
+        {
+            info->block = info->blocks + pos;
+            result = taf_verify_block(&buffer[pos * TONIEFILE_FRAME_SIZE]);
+        }
+        taf_verify_sha1_update(&sha1, buffer, readLength);
+        info->blocks += count;
+        info->bytes += readLength;
+
+        taf_verify_throttle(start, info->bytes, rate);
+    }
+    fsCloseFile(file);
+    osFreeMem(buffer);
+
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    taf_verify_sha1_final(&sha1, digest);
+    if (result == TAF_VERIFY_OK && !info->stream && header.sha1_hash_len == SHA1_DIGEST_SIZE && osMemcmp(digest, header.sha1_hash, SHA1_DIGEST_SIZE))
+    {
+        result = TAF_VERIFY_BAD_HASH;
+    }
+
+    info->result = result;
+    return result;
+}
+
+const char *taf_verify_result_name(taf_verify_result_t result)
+{
+    if ((size_t)result >= sizeof(taf_verify_result_names) / sizeof(taf_verify_result_names[0]))
+    {
+        return "unknown";
+    }
+    return taf_verify_result_names[result];
+}
+
+bool_t taf_verify_failed(taf_verify_result_t result)
+{
+    return result != TAF_VERIFY_UNKNOWN && result != TAF_VERIFY_OK && result != TAF_VERIFY_CANCELED;
+}
@@ -308,10 +308,13 @@ error_t read_certificate(const char_t *filename, char_t **buffer, size_t *length
     return error;
 }
 
+/* resolved in tls_adapter_init, the key log is written for every handshake */
+static setting_handle_t keylog_setting;
+
 static void keylog_write(TlsContext *context, const char_t *key)
 {
     static bool failed = false;
-    const char *logfile = settings_get_string("core.sslkeylogfile");
+    const char *logfile = settings_get_string_handle_id(keylog_setting, 0);
     if (!logfile || !osStrlen(logfile))
         return;
 
@@ -409,6 +412,8 @@ error_t tls_adapter_init()
         return error;
     }
 
+    keylog_setting = settings_handle("core.sslkeylogfile");
+
     TRACE_INFO("Loading certificates...\r\n");
     settings_load_certs_id(0);
 
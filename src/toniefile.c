@@ -17,6 +17,16 @@
 #include "opus.h"
 #include "ogg/ogg.h"
 #include "server_helpers.h"
+#include "content_index.h"
+#include "stream_buffer.h"
+#include "pcm_ring.h"
+#include "audio_decoder.h"
+#include "opus_reader.h"
+#include "toniefile_parallel.h"
+#include "platform.h"
+#include "stats.h"
+#include "transcode_cache.h"
+#include "settings.h"
 #include "version.h"
 #include "proto/toniebox.pb.taf-header.pb-c.h"
 
@@ -24,14 +34,53 @@ struct toniefile_s
 {
     const char *fullPath;
     FsFile *file;
+    /* live streams are published here instead of a file, the file is an optional copy then */
+    stream_buffer_t *stream;
+    size_t copy_length;
+    /* pages are collected and written out as whole blocks */
+    uint8_t block[TONIEFILE_FRAME_SIZE];
+    size_t block_used;
+    /* segments of the parallel encoder are collected in memory */
+    bool_t segment;
+    uint8_t *memory;
+    size_t memory_length;
+    size_t memory_size;
+    /* set when the audio is encoded by a worker pool */
+    toniefile_parallel_t *parallel;
     size_t file_pos;
     size_t audio_length;
 
     /* opus */
     OpusEncoder *enc;
+    /* state before a frame that may close the block, to encode it again so it fills the block */
+    OpusEncoder *enc_snapshot;
+    opus_int32 bitrate;
+    /* the one of the quality, bitrate is nudged below it */
+    opus_int32 target_bitrate;
+    /* resolved, never TONIEFILE_QUALITY_DEFAULT */
+    toniefile_quality_t quality;
+    /* length of the last frame the block did not limit */
+    int vbr_len;
+    /* bytes filled frames took beyond their first encode, taken from the bitrate of the following ones */
+    int64_t fill_debt;
+    uint64_t pad_bytes;
+    uint64_t filled_frames;
     opus_int16 audio_frame[OPUS_CHANNELS * OPUS_FRAME_SIZE];
     int audio_frame_used;
 
+    /* remux, frames merged into the next packet and the packets of the page being filled */
+    OpusRepacketizer *merge;
+    OpusRepacketizer *split;
+    uint8_t remux_frames[TONIEFILE_FRAME_SIZE];
+    size_t remux_frames_used;
+    uint32_t remux_frames_samples;
+    uint8_t remux_page[TONIEFILE_FRAME_SIZE];
+    size_t remux_page_used;
+    size_t remux_page_lacing;
+    size_t remux_count;
+    uint16_t remux_lengths[TONIEFILE_REMUX_LACING];
+    uint16_t remux_samples[TONIEFILE_REMUX_LACING];
+
     /* ogg */
     ogg_stream_state os;
     uint64_t ogg_granule_position;
@@ -41,8 +90,21 @@ struct toniefile_s
     TonieboxAudioFileHeader taf;
     Sha1Context sha1;
     size_t taf_block_num;
+
+    /* time of the encoding stages, only measured when set */
+    toniefile_profile_t *profile;
 };
 
+#define TONIEFILE_PROFILE_START(ctx) ((ctx)->profile ? platform_time_ns() : 0)
+#define TONIEFILE_PROFILE_ADD(ctx, field, start)                   \
+    do                                                             \
+    {                                                              \
+        if ((ctx)->profile)                                        \
+        {                                                          \
+            (ctx)->profile->field += platform_time_ns() - (start); \
+        }                                                          \
+    } while (0)
+
 static void toniefile_comment_add(uint8_t *buffer, size_t *length, const char *str)
 {
     uint32_t value = strlen(str);
@@ -52,6 +114,94 @@ static void toniefile_comment_add(uint8_t *buffer, size_t *length, const char *s
     *length += strlen(str);
 }
 
+struct ffmpeg_decoder_s
+{
+    /* set for sources decoded in process, the other fields are unused then */
+    audio_decoder_t *native;
+    platform_process_t *process;
+    pcm_ring_t *ring;
+    OsEvent stopped;
+    /* ffmpeg closed its output, it exits on its own */
+    bool_t ended;
+};
+
+static error_t toniefile_add_chapter(toniefile_t *ctx);
+static error_t toniefile_finish(toniefile_t *ctx);
+static error_t toniefile_remux_end(toniefile_t *ctx);
+
+static error_t toniefile_flush(toniefile_t *ctx)
+{
+    error_t error = NO_ERROR;
+
+    if (ctx->block_used == 0)
+    {
+        return NO_ERROR;
+    }
+    if (ctx->stream)
+    {
+        error = stream_buffer_write(ctx->stream, ctx->block, ctx->block_used);
+        ctx->copy_length += ctx->block_used;
+        /* the copy must not hold up the stream, it is given up instead */
+        if (ctx->file && (ctx->copy_length > TONIEFILE_COPY_MAX_SIZE || fsWriteFile(ctx->file, ctx->block, ctx->block_used) != NO_ERROR))
+        {
+            TRACE_WARNING("Gave up the copy of the stream in %s\r\n", ctx->fullPath);
+            fsCloseFile(ctx->file);
+            fsDeleteFile(ctx->fullPath);
+            ctx->file = NULL;
+        }
+    }
+    else
+    {
+        error = fsWriteFile(ctx->file, ctx->block, ctx->block_used);
+    }
+    ctx->block_used = 0;
+
+    return error;
+}
+
+static error_t toniefile_write(toniefile_t *ctx, const void *data, size_t length)
+{
+    const uint8_t *src = data;
+
+    if (ctx->segment)
+    {
+        if (ctx->memory_length + length > ctx->memory_size)
+        {
+            size_t size = MAX(MAX(2 * ctx->memory_size, ctx->memory_length + length), 16 * TONIEFILE_FRAME_SIZE);
+            uint8_t *memory = osAllocMem(size);
+            if (!memory)
+            {
+                return ERROR_OUT_OF_MEMORY;
+            }
+            if (ctx->memory)
+            {
+                osMemcpy(memory, ctx->memory, ctx->memory_length);
+                osFreeMem(ctx->memory);
+            }
+            ctx->memory = memory;
+            ctx->memory_size = size;
+        }
+        osMemcpy(&ctx->memory[ctx->memory_length], src, length);
+        ctx->memory_length += length;
+        return NO_ERROR;
+    }
+
+    while (length > 0)
+    {
+        size_t part = MIN(length, sizeof(ctx->block) - ctx->block_used);
+        osMemcpy(&ctx->block[ctx->block_used], src, part);
+        ctx->block_used += part;
+        src += part;
+        length -= part;
+
+        if (ctx->block_used == sizeof(ctx->block) && toniefile_flush(ctx) != NO_ERROR)
+        {
+            return ERROR_WRITE_FAILED;
+        }
+    }
+    return NO_ERROR;
+}
+
 static size_t toniefile_header(uint8_t *buffer, size_t length, TonieboxAudioFileHeader *tafHeader)
 {
     uint16_t proto_frame_size = TONIEFILE_FRAME_SIZE - 4;
@@ -89,10 +239,264 @@ static size_t toniefile_header(uint8_t *buffer, size_t length, TonieboxAudioFile
     return size;
 }
 
-toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id)
+static error_t toniefile_header_varint(const uint8_t *data, size_t length, size_t *pos, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 70; shift += 7)
+    {
+        if (*pos >= length)
+        {
+            return ERROR_INVALID_LENGTH;
+        }
+        uint8_t byte = data[(*pos)++];
+        if (shift < 64)
+        {
+            *value |= (uint64_t)(byte & 0x7F) << shift;
+        }
+        if (!(byte & 0x80))
+        {
+            return NO_ERROR;
+        }
+    }
+    return ERROR_INVALID_SYNTAX;
+}
+
+error_t toniefile_header_decode(const uint8_t *data, size_t length, toniefile_header_t *header)
+{
+    /* TonieboxAudioFileHeader fields, 1: sha1_hash, 2: num_bytes, 3: audio_id, 4: track_page_nums, 5: _fill */
+    const uint8_t required = (1 << 1) | (1 << 2) | (1 << 3) | (1 << 5);
+    uint8_t seen = 0;
+    size_t pos = 0;
+
+    osMemset(header, 0x00, sizeof(toniefile_header_t));
+
+    while (pos < length)
+    {
+        uint64_t tag;
+        uint64_t value;
+        if (toniefile_header_varint(data, length, &pos, &tag) != NO_ERROR)
+        {
+            return ERROR_INVALID_HEADER;
+        }
+        uint64_t field = tag >> 3;
+        uint8_t wireType = tag & 0x07;
+
+        if (field == 0)
+        {
+            return ERROR_INVALID_HEADER;
+        }
+
+        switch (wireType)
+        {
+        case 0: /* varint */
+            if (toniefile_header_varint(data, length, &pos, &value) != NO_ERROR)
+            {
+                return ERROR_INVALID_HEADER;
+            }
+            if (field == 2)
+            {
+                header->num_bytes = value;
+            }
+            else if (field == 3)
+            {
+                header->audio_id = (uint32_t)value;
+            }
+            else if (field == 4)
+            {
+                /* unpacked repeated encoding */
+                if (header->n_track_page_nums < TONIEFILE_MAX_CHAPTERS)
+                {
+                    header->track_page_nums[header->n_track_page_nums++] = (uint32_t)value;
+                }
+            }
+            else if (field == 1 || field == 5)
+            {
+                return ERROR_INVALID_HEADER;
+            }
+            break;
+
+        case 2: /* length delimited */
+        {
+            if (toniefile_header_varint(data, length, &pos, &value) != NO_ERROR || value > length - pos)
+            {
+                return ERROR_INVALID_HEADER;
+            }
+            const uint8_t *payload = &data[pos];
+            size_t payloadLength = (size_t)value;
+            pos += payloadLength;
+
+            if (field == 1)
+            {
+                header->sha1_hash_len = MIN(payloadLength, sizeof(header->sha1_hash));
+                osMemcpy(header->sha1_hash, payload, header->sha1_hash_len);
+            }
+            else if (field == 4)
+            {
+                size_t payloadPos = 0;
+                while (payloadPos < payloadLength)
+                {
+                    if (toniefile_header_varint(payload, payloadLength, &payloadPos, &value) != NO_ERROR)
+                    {
+                        return ERROR_INVALID_HEADER;
+                    }
+                    if (header->n_track_page_nums < TONIEFILE_MAX_CHAPTERS)
+                    {
+                        header->track_page_nums[header->n_track_page_nums++] = (uint32_t)value;
+                    }
+                }
+            }
+            else if (field == 2 || field == 3)
+            {
+                return ERROR_INVALID_HEADER;
+            }
+            /* field 5 (_fill) and unknown fields are skipped */
+            break;
+        }
+
+        case 1: /* 64 bit */
+        case 5: /* 32 bit */
+        {
+            size_t size = (wireType == 1) ? 8 : 4;
+            if (field <= 5 || size > length - pos)
+            {
+                return ERROR_INVALID_HEADER;
+            }
+            pos += size;
+            break;
+        }
+
+        default:
+            return ERROR_INVALID_HEADER;
+        }
+
+        if (field <= 5)
+        {
+            seen |= 1 << field;
+        }
+    }
+
+    if ((seen & required) != required)
+    {
+        return ERROR_INVALID_HEADER;
+    }
+
+    return NO_ERROR;
+}
+
+error_t toniefile_header_encode(const toniefile_header_t *header, uint8_t *block)
+{
+    TonieboxAudioFileHeader tafHeader;
+    uint32_t track_page_nums[TONIEFILE_MAX_CHAPTERS];
+    uint8_t sha1[SHA1_DIGEST_SIZE];
+
+    toniebox_audio_file_header__init(&tafHeader);
+    osMemcpy(sha1, header->sha1_hash, sizeof(sha1));
+    tafHeader.sha1_hash.data = sha1;
+    tafHeader.sha1_hash.len = MIN(header->sha1_hash_len, sizeof(sha1));
+    tafHeader.num_bytes = header->num_bytes;
+    tafHeader.audio_id = header->audio_id;
+    tafHeader.n_track_page_nums = MIN(header->n_track_page_nums, TONIEFILE_MAX_CHAPTERS);
+    osMemcpy(track_page_nums, header->track_page_nums, tafHeader.n_track_page_nums * sizeof(uint32_t));
+    tafHeader.track_page_nums = track_page_nums;
+
+    osMemset(block, 0x00, TONIEFILE_FRAME_SIZE);
+    uint32_t proto_size = (uint32_t)toniefile_header(&block[4], TONIEFILE_FRAME_SIZE - 4, &tafHeader);
+    if (proto_size == 0)
+    {
+        return ERROR_FAILURE;
+    }
+    block[0] = proto_size >> 24;
+    block[1] = proto_size >> 16;
+    block[2] = proto_size >> 8;
+    block[3] = proto_size;
+
+    return NO_ERROR;
+}
+
+static const struct
+{
+    const char *name;
+    opus_int32 bitrate;
+    int complexity;
+} toniefile_qualities[TONIEFILE_QUALITY_COUNT] = {
+    /* the defaults of libopus */
+    [TONIEFILE_QUALITY_STANDARD] = {"standard", OPUS_BIT_RATE, 9},
+    /* about 1.4 times as fast, slightly worse at the same size */
+    [TONIEFILE_QUALITY_FAST] = {"fast", OPUS_BIT_RATE, 5},
+    /* a third less space, for audio books and radio plays */
+    [TONIEFILE_QUALITY_SMALL] = {"small", 64000, 9},
+};
+
+error_t toniefile_quality_parse(const char *name, toniefile_quality_t *quality)
+{
+    if (!name || !name[0])
+    {
+        *quality = TONIEFILE_QUALITY_DEFAULT;
+        return NO_ERROR;
+    }
+    for (int pos = TONIEFILE_QUALITY_DEFAULT + 1; pos < TONIEFILE_QUALITY_COUNT; pos++)
+    {
+        if (!osStrcasecmp(name, toniefile_qualities[pos].name))
+        {
+            *quality = (toniefile_quality_t)pos;
+            return NO_ERROR;
+        }
+    }
+    return ERROR_INVALID_PARAMETER;
+}
+
+static toniefile_quality_t toniefile_quality_resolve(toniefile_quality_t quality)
+{
+    if (quality > TONIEFILE_QUALITY_DEFAULT && quality < TONIEFILE_QUALITY_COUNT)
+    {
+        return quality;
+    }
+    if (toniefile_quality_parse(settings_get_string("core.encode_quality"), &quality) != NO_ERROR || quality == TONIEFILE_QUALITY_DEFAULT)
+    {
+        quality = TONIEFILE_QUALITY_STANDARD;
+    }
+    return quality;
+}
+
+const char *toniefile_quality_name(toniefile_quality_t quality)
+{
+    return toniefile_qualities[toniefile_quality_resolve(quality)].name;
+}
+
+/* takes a resolved quality, the parallel workers must not look up core.encode_quality per segment */
+static void toniefile_apply_quality(toniefile_t *ctx, toniefile_quality_t quality)
+{
+    opus_encoder_ctl(ctx->enc, OPUS_SET_BITRATE(toniefile_qualities[quality].bitrate));
+    opus_encoder_ctl(ctx->enc, OPUS_SET_COMPLEXITY(toniefile_qualities[quality].complexity));
+    ctx->bitrate = toniefile_qualities[quality].bitrate;
+    ctx->target_bitrate = toniefile_qualities[quality].bitrate;
+    ctx->quality = quality;
+}
+
+static bool_t toniefile_init_codec(toniefile_t *ctx, uint32_t audio_id, toniefile_quality_t quality)
 {
     int err;
 
+    /* init OPUS */
+    ctx->enc = opus_encoder_create(OPUS_SAMPLING_RATE, OPUS_CHANNELS, OPUS_APPLICATION_AUDIO, &err);
+    if (err != OPUS_OK)
+    {
+        TRACE_ERROR("Cannot create opus encoder: %s\n", opus_strerror(err));
+        return FALSE;
+    }
+
+    opus_encoder_ctl(ctx->enc, OPUS_SET_VBR(1));
+    opus_encoder_ctl(ctx->enc, OPUS_SET_EXPERT_FRAME_DURATION(OPUS_FRAME_SIZE_MS));
+    toniefile_apply_quality(ctx, quality);
+
+    /* init OGG */
+    ogg_stream_init(&ctx->os, audio_id);
+
+    return TRUE;
+}
+
+static toniefile_t *toniefile_create_ctx(const char *fullPath, stream_buffer_t *stream, uint32_t audio_id)
+{
     toniefile_t *ctx = osAllocMem(sizeof(toniefile_t));
     osMemset(ctx, 0x00, sizeof(toniefile_t));
 
@@ -103,44 +507,51 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id)
     ctx->taf.n_track_page_nums = 0;
     ctx->taf.track_page_nums = osAllocMem(sizeof(uint32_t) * TONIEFILE_MAX_CHAPTERS);
     sha1Init(&ctx->sha1);
-    toniefile_new_chapter(ctx);
-
-    /* open file */
-    ctx->fullPath = fullPath;
-    ctx->file = fsOpenFile(fullPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    toniefile_add_chapter(ctx);
 
-    if (ctx->file == NULL)
+    if (stream)
     {
-        TRACE_ERROR("Cannot create file: %s\n", fullPath);
-        osFreeMem(ctx->taf.track_page_nums);
-        osFreeMem(ctx);
-        return NULL;
+        ctx->stream = stream;
+        if (fullPath)
+        {
+            ctx->fullPath = fullPath;
+            ctx->file = fsOpenFile(fullPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+            if (ctx->file == NULL)
+            {
+                TRACE_WARNING("Cannot create copy of the stream: %s\n", fullPath);
+            }
+        }
+        toniefile_write_header(ctx);
+    }
+    else
+    {
+        /* open file */
+        ctx->fullPath = fullPath;
+        ctx->file = fsOpenFile(fullPath, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+
+        if (ctx->file == NULL)
+        {
+            TRACE_ERROR("Cannot create file: %s\n", fullPath);
+            osFreeMem(ctx->taf.track_page_nums);
+            osFreeMem(ctx);
+            return NULL;
+        }
+        toniefile_write_header(ctx);
+        fsSeekFile(ctx->file, TONIEFILE_FRAME_SIZE, SEEK_SET);
     }
-    toniefile_write_header(ctx);
-    fsSeekFile(ctx->file, TONIEFILE_FRAME_SIZE, SEEK_SET);
 
-    /* init OPUS */
-    ctx->enc = opus_encoder_create(OPUS_SAMPLING_RATE, OPUS_CHANNELS, OPUS_APPLICATION_AUDIO, &err);
-    if (err != OPUS_OK)
+    if (!toniefile_init_codec(ctx, audio_id, toniefile_quality_resolve(TONIEFILE_QUALITY_DEFAULT)))
     {
-        TRACE_ERROR("Cannot create opus encoder: %s\n", opus_strerror(err));
         osFreeMem(ctx->taf.track_page_nums);
         osFreeMem(ctx);
         return NULL;
     }
 
-    opus_encoder_ctl(ctx->enc, OPUS_SET_BITRATE(OPUS_BIT_RATE));
-    opus_encoder_ctl(ctx->enc, OPUS_SET_VBR(1));
-    opus_encoder_ctl(ctx->enc, OPUS_SET_EXPERT_FRAME_DURATION(OPUS_FRAME_SIZE_MS));
-
-    /* init OGG */
-    ogg_stream_init(&ctx->os, audio_id);
-
     unsigned char header_data[] = {
         'O', 'p', 'u', 's', 'H', 'e', 'a', 'd',                         // "OpusHead" string
         1,                                                              // Version
         OPUS_CHANNELS,                                                  // Channel count
-        0x38, 0x01,                                                     // Pre-skip
+        OPUS_PRE_SKIP & 0xFF, OPUS_PRE_SKIP >> 8,                       // Pre-skip
         OPUS_SAMPLING_RATE & 0xFF, OPUS_SAMPLING_RATE >> 8, 0x00, 0x00, // Original sample rate; 0xFFFFFFF implies unknown
         0, 0,                                                           // Output gain
         0                                                               // Channel mapping family
@@ -209,12 +620,12 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id)
     while (ogg_stream_flush(&ctx->os, &og))
     {
         /* write the freshly padded block of frames*/
-        if (fsWriteFile(ctx->file, og.header, og.header_len) != NO_ERROR)
+        if (toniefile_write(ctx, og.header, og.header_len) != NO_ERROR)
         {
             return NULL;
         }
         /* write the freshly padded block of frames*/
-        if (fsWriteFile(ctx->file, og.body, og.body_len) != NO_ERROR)
+        if (toniefile_write(ctx, og.body, og.body_len) != NO_ERROR)
         {
             return NULL;
         }
@@ -228,6 +639,66 @@ toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id)
     return ctx;
 }
 
+toniefile_t *toniefile_create(const char *fullPath, uint32_t audio_id)
+{
+    toniefile_t *ctx = toniefile_create_ctx(fullPath, NULL, audio_id);
+
+    if (ctx)
+    {
+        ctx->parallel = toniefile_parallel_create(ctx, audio_id, ctx->file_pos, ctx->quality);
+    }
+    return ctx;
+}
+
+toniefile_t *toniefile_create_serial(const char *fullPath, uint32_t audio_id)
+{
+    return toniefile_create_ctx(fullPath, NULL, audio_id);
+}
+
+toniefile_t *toniefile_create_stream(stream_buffer_t *stream, uint32_t audio_id)
+{
+    return toniefile_create_ctx(NULL, stream, audio_id);
+}
+
+error_t toniefile_set_quality(toniefile_t *ctx, toniefile_quality_t quality)
+{
+    if (quality >= TONIEFILE_QUALITY_COUNT)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (ctx->ogg_granule_position > 0 || ctx->audio_frame_used > 0)
+    {
+        return ERROR_WRONG_STATE;
+    }
+    quality = toniefile_quality_resolve(quality);
+    if (ctx->parallel)
+    {
+        error_t error = toniefile_parallel_set_quality(ctx->parallel, quality);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
+    toniefile_apply_quality(ctx, quality);
+
+    return NO_ERROR;
+}
+
+error_t toniefile_profile(toniefile_t *ctx, toniefile_profile_t *profile)
+{
+    if (ctx->parallel)
+    {
+        return ERROR_NOT_IMPLEMENTED;
+    }
+    ctx->profile = profile;
+    return NO_ERROR;
+}
+
+toniefile_t *toniefile_create_stream_copy(stream_buffer_t *stream, uint32_t audio_id, const char *copyPath)
+{
+    return toniefile_create_ctx(copyPath, stream, audio_id);
+}
+
 error_t toniefile_write_header(toniefile_t *ctx)
 {
     uint8_t buffer[TONIEFILE_FRAME_SIZE];
@@ -241,21 +712,21 @@ error_t toniefile_write_header(toniefile_t *ctx)
     }
 
     osMemset(buffer, 0x00, sizeof(buffer));
-    uint32_t proto_size = (uint32_t)toniefile_header(buffer, sizeof(buffer), &ctx->taf);
+    uint32_t proto_size = (uint32_t)toniefile_header(&buffer[4], sizeof(buffer) - 4, &ctx->taf);
 
-    fsSeekFile(ctx->file, 0, SEEK_SET);
-    uint8_t proto_be[4];
-    proto_be[0] = proto_size >> 24;
-    proto_be[1] = proto_size >> 16;
-    proto_be[2] = proto_size >> 8;
-    proto_be[3] = proto_size;
-    if (fsWriteFile(ctx->file, proto_be, sizeof(proto_be)) != NO_ERROR)
+    buffer[0] = proto_size >> 24;
+    buffer[1] = proto_size >> 16;
+    buffer[2] = proto_size >> 8;
+    buffer[3] = proto_size;
+
+    /* streams can't be rewound, the header is sent once as a whole block in front of the audio */
+    if (ctx->stream)
     {
-        return ERROR_WRITE_FAILED;
+        return toniefile_write(ctx, buffer, sizeof(buffer));
     }
 
-    fsSeekFile(ctx->file, 4, SEEK_SET);
-    if (fsWriteFile(ctx->file, buffer, proto_size) != NO_ERROR)
+    fsSeekFile(ctx->file, 0, SEEK_SET);
+    if (fsWriteFile(ctx->file, buffer, 4 + proto_size) != NO_ERROR)
     {
         return ERROR_WRITE_FAILED;
     }
@@ -264,18 +735,63 @@ error_t toniefile_write_header(toniefile_t *ctx)
 
 error_t toniefile_close(toniefile_t *ctx)
 {
+    error_t error = NO_ERROR;
+
+    if (ctx->parallel)
+    {
+        error = toniefile_parallel_close(ctx->parallel);
+        ctx->parallel = NULL;
+    }
+    if (toniefile_finish(ctx) != NO_ERROR)
+    {
+        error = ERROR_FAILURE;
+    }
+
     ctx->taf.sha1_hash.data = osAllocMem(SHA1_DIGEST_SIZE);
     ctx->taf.sha1_hash.len = SHA1_DIGEST_SIZE;
     ctx->taf.num_bytes = ctx->audio_length;
     sha1Final(&ctx->sha1, ctx->taf.sha1_hash.data);
 
-    error_t error = toniefile_write_header(ctx);
+    if (toniefile_flush(ctx) != NO_ERROR)
+    {
+        error = ERROR_WRITE_FAILED;
+    }
+
+    if (ctx->taf_block_num > 0)
+    {
+        TRACE_INFO("Padded %" PRIu64 " bytes in %" PRIuSIZE " blocks, %" PRIu64 " frames filled up to the end of their block\r\n",
+                   ctx->pad_bytes, ctx->taf_block_num, ctx->filled_frames);
+        stats_update("encode_pad_bytes", (int)ctx->pad_bytes);
+        stats_update("encode_filled_frames", (int)ctx->filled_frames);
+        stats_update("encode_blocks", (int)ctx->taf_block_num);
+    }
+
+    if (ctx->stream)
+    {
+        stream_buffer_close(ctx->stream);
+        /* the header of the copy is completed like the one of a file */
+        ctx->stream = NULL;
+    }
+    if (ctx->file)
+    {
+        if (toniefile_write_header(ctx) != NO_ERROR)
+        {
+            error = ERROR_WRITE_FAILED;
+        }
 
-    fsCloseFile(ctx->file);
+        fsCloseFile(ctx->file);
+        content_index_invalidate(ctx->fullPath);
+    }
 
     osFreeMem(ctx->taf.sha1_hash.data);
     osFreeMem(ctx->taf.track_page_nums);
     opus_encoder_destroy(ctx->enc);
+    osFreeMem(ctx->enc_snapshot);
+    if (ctx->merge)
+    {
+        opus_repacketizer_destroy(ctx->merge);
+        opus_repacketizer_destroy(ctx->split);
+    }
     ogg_stream_clear(&ctx->os);
 
     osFreeMem(ctx);
@@ -290,7 +806,7 @@ static void toniefile_samples_copy(opus_int16 *dst, int *dst_used, opus_int16 *s
     *src_used += samples;
 }
 
-error_t toniefile_new_chapter(toniefile_t *ctx)
+static error_t toniefile_add_chapter(toniefile_t *ctx)
 {
     if (ctx->taf.n_track_page_nums >= TONIEFILE_MAX_CHAPTERS - 1)
     {
@@ -302,11 +818,296 @@ error_t toniefile_new_chapter(toniefile_t *ctx)
     return NO_ERROR;
 }
 
-error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available)
+error_t toniefile_new_chapter(toniefile_t *ctx)
+{
+    if (ctx->parallel)
+    {
+        return toniefile_parallel_new_chapter(ctx->parallel);
+    }
+    return toniefile_add_chapter(ctx);
+}
+
+typedef enum
+{
+    TONIEFILE_FRAME_NORMAL,
+    /* leaves a rest of the block the next frame is able to fill completely */
+    TONIEFILE_FRAME_BEFORE_LAST,
+    /* fills up the rest of the block if a single packet can do so */
+    TONIEFILE_FRAME_LAST
+} toniefile_frame_mode_t;
+
+/* writes the packets of the ogg stream as pages, which have to end on the block boundary */
+static error_t toniefile_write_pages(toniefile_t *ctx)
+{
+    ogg_page og;
+    while (TRUE)
+    {
+        uint64_t start = TONIEFILE_PROFILE_START(ctx);
+        int flushed = ogg_stream_flush(&ctx->os, &og);
+        TONIEFILE_PROFILE_ADD(ctx, ogg_ns, start);
+        if (!flushed)
+        {
+            break;
+        }
+
+        start = TONIEFILE_PROFILE_START(ctx);
+        if (toniefile_write(ctx, og.header, og.header_len) != NO_ERROR)
+        {
+            return ERROR_FAILURE;
+        }
+        if (toniefile_write(ctx, og.body, og.body_len) != NO_ERROR)
+        {
+            return ERROR_FAILURE;
+        }
+        TONIEFILE_PROFILE_ADD(ctx, io_ns, start);
+        size_t prev = ctx->file_pos;
+        ctx->file_pos += og.header_len + og.body_len;
+        ctx->audio_length += og.header_len + og.body_len;
+
+        start = TONIEFILE_PROFILE_START(ctx);
+        sha1Update(&ctx->sha1, og.header, og.header_len);
+        sha1Update(&ctx->sha1, og.body, og.body_len);
+        TONIEFILE_PROFILE_ADD(ctx, sha1_ns, start);
+
+        if ((prev / TONIEFILE_FRAME_SIZE) != (ctx->file_pos / TONIEFILE_FRAME_SIZE))
+        {
+            ctx->taf_block_num++;
+            if (ctx->file_pos % TONIEFILE_FRAME_SIZE)
+            {
+                TRACE_ERROR("Block alignment mismatch 0x%08" PRIXSIZE "\r\n", ctx->file_pos)
+                return ERROR_FAILURE;
+            }
+        }
+    }
+    return NO_ERROR;
+}
+
+static void toniefile_count_padding(toniefile_t *ctx, int bytes)
+{
+    ctx->pad_bytes += bytes;
+    if (ctx->profile)
+    {
+        ctx->profile->padded_frames++;
+        ctx->profile->pad_bytes += bytes;
+    }
+}
+
+/* lowers the bitrate of the next frame while filled frames took more than their share */
+static void toniefile_nudge_bitrate(toniefile_t *ctx)
+{
+    opus_int32 bitrate = ctx->target_bitrate;
+
+    if (ctx->fill_debt > 0)
+    {
+        int64_t nudge = MIN(ctx->fill_debt, TONIEFILE_NUDGE_MAX);
+        ctx->fill_debt -= nudge;
+        bitrate -= (opus_int32)(nudge * 8 * OPUS_SAMPLING_RATE / OPUS_FRAME_SIZE);
+    }
+    if (bitrate != ctx->bitrate)
+    {
+        opus_encoder_ctl(ctx->enc, OPUS_SET_BITRATE(bitrate));
+        ctx->bitrate = bitrate;
+    }
+}
+
+/**
+ * @brief Encodes a frame with exactly the given length
+ *
+ * Turns the bytes the block would be padded with into audio. The encoder runs in CBR
+ * for this frame, which fills the packet to the maximum length.
+ */
+static int toniefile_encode_filled(toniefile_t *ctx, const opus_int16 *frame, uint8_t *output_frame, int frame_payload)
+{
+    opus_encoder_ctl(ctx->enc, OPUS_SET_VBR(0));
+    opus_encoder_ctl(ctx->enc, OPUS_SET_BITRATE(OPUS_BITRATE_MAX));
+
+    uint64_t start = TONIEFILE_PROFILE_START(ctx);
+    int frame_len = opus_encode(ctx->enc, frame, OPUS_FRAME_SIZE, output_frame, frame_payload);
+    TONIEFILE_PROFILE_ADD(ctx, opus_ns, start);
+
+    opus_encoder_ctl(ctx->enc, OPUS_SET_VBR(1));
+    opus_encoder_ctl(ctx->enc, OPUS_SET_BITRATE(ctx->bitrate));
+
+    return frame_len;
+}
+
+static error_t toniefile_encode_frame(toniefile_t *ctx, const opus_int16 *frame, toniefile_frame_mode_t mode)
 {
-    int samples_processed = 0;
     uint8_t output_frame[TONIEFILE_FRAME_SIZE];
 
+    int page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + 27 + ctx->os.lacing_fill - ctx->os.lacing_returned + ctx->os.body_fill - ctx->os.body_returned;
+    int page_remain = TONIEFILE_FRAME_SIZE - page_used;
+
+    int frame_payload = (page_remain / 256) * 255 + (page_remain % 256) - 1;
+    int reconstructed = (frame_payload / 255) + 1 + frame_payload;
+    bool_t fill = (mode == TONIEFILE_FRAME_LAST && page_remain == reconstructed);
+
+    /* when due to segment sizes we would end up with a 1 byte gap, make sure that the next run will have at least 64 byte.
+     * reason why this could happen is that "adding one byte" would require one segment more and thus occupies two byte more.
+     * if this would happen, just reduce the calculated free space such that there is room for another segment.
+     */
+    if (page_remain != reconstructed && frame_payload > OPUS_PACKET_MINSIZE)
+    {
+        frame_payload -= OPUS_PACKET_MINSIZE;
+    }
+    if (frame_payload < (fill ? OPUS_PACKET_LAST_MINSIZE : OPUS_PACKET_MINSIZE))
+    {
+        TRACE_ERROR("Not enough space in this block\r\n");
+        return ERROR_FAILURE;
+    }
+
+    /* a frame that does not fit the block at its usual size is encoded in CBR, filling the rest of the block with audio.
+     * one that might fit is encoded normally, from a kept state it can be encoded again if it ended up short of the block.
+     */
+    bool_t filled = (mode == TONIEFILE_FRAME_NORMAL && ctx->vbr_len > 0 && frame_payload <= ctx->vbr_len);
+    bool_t trial = (mode == TONIEFILE_FRAME_NORMAL && !filled && frame_payload < ctx->vbr_len + TONIEFILE_FILL_RANGE);
+    if (trial && !ctx->enc_snapshot)
+    {
+        ctx->enc_snapshot = osAllocMem(opus_encoder_get_size(OPUS_CHANNELS));
+        trial = (ctx->enc_snapshot != NULL);
+    }
+    if (trial)
+    {
+        osMemcpy(ctx->enc_snapshot, ctx->enc, opus_encoder_get_size(OPUS_CHANNELS));
+    }
+    if (mode == TONIEFILE_FRAME_NORMAL)
+    {
+        toniefile_nudge_bitrate(ctx);
+    }
+
+    int frame_len;
+    if (filled)
+    {
+        frame_len = toniefile_encode_filled(ctx, frame, output_frame, frame_payload);
+    }
+    else
+    {
+        uint64_t start = TONIEFILE_PROFILE_START(ctx);
+        frame_len = opus_encode(ctx->enc, frame, OPUS_FRAME_SIZE, output_frame, frame_payload);
+        TONIEFILE_PROFILE_ADD(ctx, opus_ns, start);
+        // TRACE_INFO("opus_encode: %d/%d\r\n", frame_len, frame_dest);
+    }
+
+    if (frame_len <= 0)
+    {
+        TRACE_ERROR("Cannot encode: %s\r\n", opus_strerror(frame_len));
+        return ERROR_FAILURE;
+    }
+    if (mode == TONIEFILE_FRAME_NORMAL && !filled && frame_len < frame_payload)
+    {
+        ctx->vbr_len = frame_len;
+    }
+
+    if (trial && frame_payload - frame_len < OPUS_PACKET_PAD && frame_payload - frame_len >= TONIEFILE_FILL_MIN)
+    {
+        osMemcpy(ctx->enc, ctx->enc_snapshot, opus_encoder_get_size(OPUS_CHANNELS));
+        int filled_len = toniefile_encode_filled(ctx, frame, output_frame, frame_payload);
+        if (filled_len <= 0)
+        {
+            TRACE_ERROR("Cannot encode: %s\r\n", opus_strerror(filled_len));
+            return ERROR_FAILURE;
+        }
+        ctx->fill_debt += filled_len - frame_len;
+        frame_len = filled_len;
+        filled = TRUE;
+    }
+    if (filled)
+    {
+        ctx->filled_frames++;
+        if (ctx->profile)
+        {
+            ctx->profile->filled_frames++;
+        }
+    }
+
+    /* we did not exactly hit the destination size and are close to block size. pad packet */
+    if (fill || frame_payload - frame_len < OPUS_PACKET_PAD)
+    {
+        int target_length = frame_payload;
+
+        int ret = opus_packet_pad(output_frame, frame_len, target_length);
+        // TRACE_INFO("opus_packet_pad: %d -> %d\r\n", frame_len, target_length);
+        if (ret < 0)
+        {
+            TRACE_ERROR("Cannot pad: %s\r\n", opus_strerror(ret));
+            return ERROR_FAILURE;
+        }
+        if (target_length > frame_len)
+        {
+            toniefile_count_padding(ctx, target_length - frame_len);
+        }
+        frame_len = target_length;
+    }
+    else if (mode == TONIEFILE_FRAME_BEFORE_LAST && (page_remain - (frame_len / 255) - 1 - frame_len) % 256 == 0)
+    {
+        /* no single packet fills a rest of a multiple of 256 bytes, one more byte here avoids it */
+        int ret = opus_packet_pad(output_frame, frame_len, frame_len + 1);
+        if (ret < 0)
+        {
+            TRACE_ERROR("Cannot pad: %s\r\n", opus_strerror(ret));
+            return ERROR_FAILURE;
+        }
+        toniefile_count_padding(ctx, 1);
+        frame_len++;
+    }
+
+    /* we have to retrieve the actually encoded samples in this frame */
+    int frames = opus_packet_get_samples_per_frame(output_frame, OPUS_SAMPLING_RATE) * opus_packet_get_nb_frames(output_frame, frame_len);
+    if (frames != OPUS_FRAME_SIZE)
+    {
+        TRACE_ERROR("frame count unexpected: %d instead of %d\r\n", frames, OPUS_FRAME_SIZE);
+    }
+    ctx->ogg_granule_position += frames;
+
+    /* now fill output page */
+    ogg_packet op;
+    op.packet = output_frame;
+    op.bytes = frame_len;
+    op.b_o_s = 0;
+    op.e_o_s = 0;
+    op.granulepos = ctx->ogg_granule_position;
+    op.packetno = ctx->ogg_packet_count;
+
+    ctx->ogg_packet_count++;
+
+    uint64_t start = TONIEFILE_PROFILE_START(ctx);
+    ogg_stream_packetin(&ctx->os, &op);
+    TONIEFILE_PROFILE_ADD(ctx, ogg_ns, start);
+    if (ctx->profile)
+    {
+        ctx->profile->frames++;
+    }
+
+    page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + 27 + ctx->os.lacing_fill + ctx->os.body_fill;
+    page_remain = TONIEFILE_FRAME_SIZE - page_used;
+
+    if (page_remain < TONIEFILE_PAD_END)
+    {
+        if (page_remain)
+        {
+            TRACE_INFO("unexpected small padding at %" PRIu64 " (%" PRIu64 " s)\r\n", ctx->ogg_granule_position, ctx->ogg_granule_position / OPUS_FRAME_SIZE * 60 / 1000)
+            return ERROR_FAILURE;
+        }
+        return toniefile_write_pages(ctx);
+    }
+
+    return NO_ERROR;
+}
+
+error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available)
+{
+    int samples_processed = 0;
+
+    if (ctx->parallel)
+    {
+        return toniefile_parallel_encode(ctx->parallel, sample_buffer, samples_available);
+    }
+    error_t error = toniefile_remux_end(ctx);
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+
     // TRACE_INFO("samples_available: %lu\n", samples_available);
     while (samples_processed < samples_available)
     {
@@ -315,222 +1116,798 @@ error_t toniefile_encode(toniefile_t *ctx, int16_t *sample_buffer, size_t sample
         size_t samples_remaining = samples_available - samples_processed;
         if (samples > samples_remaining)
         {
-            samples = samples_remaining;
+            samples = samples_remaining;
+        }
+        // TRACE_INFO("  samples: %lu (%lu/%lu)\n", samples, samples_processed, samples_available);
+
+        opus_int16 *frame = ctx->audio_frame;
+        if (ctx->audio_frame_used == 0 && samples == OPUS_FRAME_SIZE)
+        {
+            /* whole frames are encoded right from the caller's buffer */
+            frame = &sample_buffer[samples_processed * OPUS_CHANNELS];
+            ctx->audio_frame_used = samples;
+            samples_processed += samples;
+        }
+        else
+        {
+            toniefile_samples_copy(ctx->audio_frame, &ctx->audio_frame_used, sample_buffer, &samples_processed, samples);
+        }
+
+        /* buffer full? */
+        if (ctx->audio_frame_used >= OPUS_FRAME_SIZE)
+        {
+            error = toniefile_encode_frame(ctx, frame, TONIEFILE_FRAME_NORMAL);
+            if (error != NO_ERROR)
+            {
+                return error;
+            }
+            /* fill again */
+            ctx->audio_frame_used = 0;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+/**
+ * @brief Pads the pending samples with silence and encodes until the current block is complete
+ *
+ * Without this the audio in the last, partially filled block would be lost.
+ */
+static error_t toniefile_finish(toniefile_t *ctx)
+{
+    error_t error = toniefile_remux_end(ctx);
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+
+    while (ctx->audio_frame_used > 0 || ctx->os.lacing_fill > 0 || (ctx->file_pos % TONIEFILE_FRAME_SIZE) != 0)
+    {
+        osMemset(&ctx->audio_frame[ctx->audio_frame_used * OPUS_CHANNELS], 0x00, (OPUS_FRAME_SIZE - ctx->audio_frame_used) * OPUS_CHANNELS * sizeof(opus_int16));
+        ctx->audio_frame_used = 0;
+
+        error = toniefile_encode_frame(ctx, ctx->audio_frame, TONIEFILE_FRAME_LAST);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
+    return NO_ERROR;
+}
+
+/* bytes a packet occupies in a page, with its lacing values */
+static size_t toniefile_remux_footprint(size_t length)
+{
+    return length + length / 255 + 1;
+}
+
+/**
+ * @brief Returns the length a packet has to be padded to, so it occupies extra bytes more in its page
+ *
+ * Lengths of 255 * n need one more lacing value, so footprints of 256 * n can't be reached.
+ *
+ * @return New length or 0 if there is none
+ */
+static size_t toniefile_remux_grow(size_t length, size_t extra)
+{
+    size_t target = toniefile_remux_footprint(length) + extra;
+
+    if (target % 256 == 0)
+    {
+        return 0;
+    }
+    return (target / 256) * 255 + target % 256 - 1;
+}
+
+static size_t toniefile_remux_page_space(toniefile_t *ctx)
+{
+    size_t used = ctx->remux_page_used + ctx->remux_page_lacing;
+    return TONIEFILE_FRAME_SIZE - (ctx->file_pos % TONIEFILE_FRAME_SIZE) - 27 - used;
+}
+
+static bool_t toniefile_remux_fits(toniefile_t *ctx, size_t length)
+{
+    return toniefile_remux_footprint(length) <= toniefile_remux_page_space(ctx) &&
+           ctx->remux_page_lacing + length / 255 + 1 <= TONIEFILE_REMUX_LACING;
+}
+
+/**
+ * @brief Pads the packets of the page so it ends on the block boundary and writes it
+ *
+ * Usually the last packet absorbs the rest. If its footprint can't grow by exactly that
+ * much, another packet is padded by one byte first.
+ */
+static error_t toniefile_remux_close_page(toniefile_t *ctx)
+{
+    size_t lengths[TONIEFILE_REMUX_LACING];
+    size_t rest = toniefile_remux_page_space(ctx);
+    bool_t filled = (rest == 0);
+
+    if (ctx->remux_count == 0)
+    {
+        return NO_ERROR;
+    }
+    for (size_t pos = 0; pos < ctx->remux_count; pos++)
+    {
+        lengths[pos] = ctx->remux_lengths[pos];
+    }
+    for (size_t pos = ctx->remux_count; pos-- > 0 && !filled;)
+    {
+        size_t length = toniefile_remux_grow(lengths[pos], rest);
+        if (length)
+        {
+            lengths[pos] = length;
+            filled = TRUE;
+        }
+    }
+    for (size_t first = 0; first < ctx->remux_count && !filled; first++)
+    {
+        size_t firstLength = toniefile_remux_grow(lengths[first], 1);
+        for (size_t pos = ctx->remux_count; pos-- > 0 && firstLength && !filled;)
+        {
+            size_t length = toniefile_remux_grow(lengths[pos], rest - 1);
+            if (pos != first && length)
+            {
+                lengths[first] = firstLength;
+                lengths[pos] = length;
+                filled = TRUE;
+            }
+        }
+    }
+    if (!filled)
+    {
+        TRACE_ERROR("Cannot fill block 0x%08" PRIXSIZE " with %" PRIuSIZE " packets\r\n", ctx->taf_block_num, ctx->remux_count);
+        return ERROR_FAILURE;
+    }
+
+    uint8_t packet[TONIEFILE_FRAME_SIZE];
+    size_t offset = 0;
+    for (size_t pos = 0; pos < ctx->remux_count; pos++)
+    {
+        size_t length = ctx->remux_lengths[pos];
+        osMemcpy(packet, &ctx->remux_page[offset], length);
+        offset += length;
+
+        if (lengths[pos] != length)
+        {
+            int ret = opus_packet_pad(packet, (opus_int32)length, (opus_int32)lengths[pos]);
+            if (ret < 0)
+            {
+                TRACE_ERROR("Cannot pad: %s\r\n", opus_strerror(ret));
+                return ERROR_FAILURE;
+            }
+        }
+        ctx->ogg_granule_position += ctx->remux_samples[pos];
+
+        ogg_packet op;
+        op.packet = packet;
+        op.bytes = lengths[pos];
+        op.b_o_s = 0;
+        op.e_o_s = 0;
+        op.granulepos = ctx->ogg_granule_position;
+        op.packetno = ctx->ogg_packet_count++;
+        ogg_stream_packetin(&ctx->os, &op);
+    }
+    ctx->remux_page_used = 0;
+    ctx->remux_page_lacing = 0;
+    ctx->remux_count = 0;
+
+    error_t error = toniefile_write_pages(ctx);
+    if (error == NO_ERROR && ctx->file_pos % TONIEFILE_FRAME_SIZE)
+    {
+        TRACE_ERROR("Block alignment mismatch 0x%08" PRIXSIZE "\r\n", ctx->file_pos);
+        error = ERROR_FAILURE;
+    }
+    return error;
+}
+
+/**
+ * @brief Moves the merged frames into the page, as many as fit, the rest starts the next page
+ */
+static error_t toniefile_remux_emit(toniefile_t *ctx)
+{
+    uint8_t packet[TONIEFILE_FRAME_SIZE];
+    int frames = opus_repacketizer_get_nb_frames(ctx->merge);
+    uint32_t frame_samples = frames > 0 ? ctx->remux_frames_samples / frames : 0;
+    int begin = 0;
+
+    while (begin < frames)
+    {
+        int end = frames;
+        int length = 0;
+        for (; end > begin; end--)
+        {
+            length = opus_repacketizer_out_range(ctx->merge, begin, end, packet, sizeof(packet));
+            if (length > 0 && toniefile_remux_fits(ctx, length))
+            {
+                break;
+            }
+        }
+
+        if (end == begin)
+        {
+            if (ctx->remux_count == 0)
+            {
+                TRACE_ERROR("Opus frame does not fit into a block\r\n");
+                return ERROR_FAILURE;
+            }
+            error_t error = toniefile_remux_close_page(ctx);
+            if (error != NO_ERROR)
+            {
+                return error;
+            }
+            continue;
+        }
+
+        osMemcpy(&ctx->remux_page[ctx->remux_page_used], packet, length);
+        ctx->remux_page_used += length;
+        ctx->remux_page_lacing += length / 255 + 1;
+        ctx->remux_lengths[ctx->remux_count] = (uint16_t)length;
+        ctx->remux_samples[ctx->remux_count] = (uint16_t)((end - begin) * frame_samples);
+        ctx->remux_count++;
+        begin = end;
+    }
+
+    opus_repacketizer_init(ctx->merge);
+    ctx->remux_frames_used = 0;
+    ctx->remux_frames_samples = 0;
+
+    return NO_ERROR;
+}
+
+/* completes the block of remuxed packets, before encoded audio follows or the file ends */
+static error_t toniefile_remux_end(toniefile_t *ctx)
+{
+    if (!ctx->merge)
+    {
+        return NO_ERROR;
+    }
+    error_t error = toniefile_remux_emit(ctx);
+    if (error == NO_ERROR)
+    {
+        error = toniefile_remux_close_page(ctx);
+    }
+    return error;
+}
+
+error_t toniefile_remux_packet(toniefile_t *ctx, const uint8_t *packet, size_t length)
+{
+    if (ctx->parallel)
+    {
+        return ERROR_NOT_IMPLEMENTED;
+    }
+    if (!ctx->merge)
+    {
+        ctx->merge = opus_repacketizer_create();
+        ctx->split = opus_repacketizer_create();
+        if (!ctx->merge || !ctx->split)
+        {
+            return ERROR_OUT_OF_MEMORY;
+        }
+    }
+    /* encoded audio before is completed to a whole block first */
+    if (ctx->audio_frame_used > 0 || ctx->os.lacing_fill > 0)
+    {
+        error_t error = toniefile_finish(ctx);
+        if (error != NO_ERROR)
+        {
+            return error;
+        }
+    }
+
+    opus_repacketizer_init(ctx->split);
+    if (opus_repacketizer_cat(ctx->split, packet, (opus_int32)length) != OPUS_OK)
+    {
+        TRACE_ERROR("Invalid Opus packet\r\n");
+        return ERROR_INVALID_FILE;
+    }
+    int frames = opus_repacketizer_get_nb_frames(ctx->split);
+    uint32_t frame_samples = (uint32_t)opus_packet_get_samples_per_frame(packet, OPUS_SAMPLING_RATE);
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        /* frames are collected until OPUS_FRAME_SIZE, a full buffer or a different configuration closes the packet */
+        uint8_t *data = &ctx->remux_frames[ctx->remux_frames_used];
+        int frame_length = opus_repacketizer_out_range(ctx->split, frame, frame + 1, data, sizeof(ctx->remux_frames) - ctx->remux_frames_used);
+
+        if (frame_length <= 0 || ctx->remux_frames_samples + frame_samples > OPUS_FRAME_SIZE ||
+            opus_repacketizer_cat(ctx->merge, data, frame_length) != OPUS_OK)
+        {
+            error_t error = toniefile_remux_emit(ctx);
+            if (error != NO_ERROR)
+            {
+                return error;
+            }
+            data = ctx->remux_frames;
+            frame_length = opus_repacketizer_out_range(ctx->split, frame, frame + 1, data, sizeof(ctx->remux_frames));
+            if (frame_length <= 0 || opus_repacketizer_cat(ctx->merge, data, frame_length) != OPUS_OK)
+            {
+                TRACE_ERROR("Cannot repacketize Opus frame\r\n");
+                return ERROR_FAILURE;
+            }
+        }
+        ctx->remux_frames_used += frame_length;
+        ctx->remux_frames_samples += frame_samples;
+
+        if (ctx->remux_frames_samples >= OPUS_FRAME_SIZE)
+        {
+            error_t error = toniefile_remux_emit(ctx);
+            if (error != NO_ERROR)
+            {
+                return error;
+            }
+        }
+    }
+
+    return NO_ERROR;
+}
+
+toniefile_t *toniefile_create_segment(uint32_t audio_id, size_t start_pos, toniefile_quality_t quality)
+{
+    toniefile_t *ctx = osAllocMem(sizeof(toniefile_t));
+    osMemset(ctx, 0x00, sizeof(toniefile_t));
+    ctx->segment = TRUE;
+    ctx->file_pos = start_pos;
+
+    if (!toniefile_init_codec(ctx, audio_id, toniefile_quality_resolve(quality)))
+    {
+        osFreeMem(ctx);
+        return NULL;
+    }
+    /* continues a stream, libogg would put the first packet on a page of its own */
+    ctx->os.b_o_s = 1;
+
+    return ctx;
+}
+
+error_t toniefile_warmup(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available)
+{
+    uint8_t output_frame[TONIEFILE_FRAME_SIZE];
+
+    for (size_t pos = 0; pos + OPUS_FRAME_SIZE <= samples_available; pos += OPUS_FRAME_SIZE)
+    {
+        int frame_len = opus_encode(ctx->enc, &sample_buffer[pos * OPUS_CHANNELS], OPUS_FRAME_SIZE, output_frame, sizeof(output_frame));
+        if (frame_len <= 0)
+        {
+            TRACE_ERROR("Cannot encode: %s\r\n", opus_strerror(frame_len));
+            return ERROR_FAILURE;
+        }
+    }
+    return NO_ERROR;
+}
+
+void toniefile_add_padding(toniefile_t *ctx, const toniefile_padding_t *padding)
+{
+    ctx->pad_bytes += padding->pad_bytes;
+    ctx->filled_frames += padding->filled_frames;
+}
+
+error_t toniefile_finish_segment(toniefile_t *ctx, int16_t *sample_buffer, size_t samples_available, uint8_t **data, size_t *length, uint64_t *granules, toniefile_padding_t *padding)
+{
+    error_t error = NO_ERROR;
+    size_t frames = (samples_available + OPUS_FRAME_SIZE - 1) / OPUS_FRAME_SIZE;
+    size_t pos = 0;
+
+    *data = NULL;
+    *length = 0;
+    *granules = 0;
+
+    if (frames > 2)
+    {
+        pos = (frames - 2) * OPUS_FRAME_SIZE;
+        error = toniefile_encode(ctx, sample_buffer, pos);
+    }
+    /* the second to last frame makes sure the last one can close the block without a silent frame */
+    if (error == NO_ERROR && samples_available - pos > OPUS_FRAME_SIZE)
+    {
+        error = toniefile_encode_frame(ctx, &sample_buffer[pos * OPUS_CHANNELS], TONIEFILE_FRAME_BEFORE_LAST);
+        pos += OPUS_FRAME_SIZE;
+    }
+    if (error == NO_ERROR)
+    {
+        int processed = 0;
+        toniefile_samples_copy(ctx->audio_frame, &ctx->audio_frame_used, &sample_buffer[pos * OPUS_CHANNELS], &processed, samples_available - pos);
+        error = toniefile_finish(ctx);
+    }
+
+    if (error == NO_ERROR)
+    {
+        *data = ctx->memory;
+        *length = ctx->memory_length;
+        *granules = ctx->ogg_granule_position;
+    }
+    else
+    {
+        osFreeMem(ctx->memory);
+    }
+    if (padding)
+    {
+        padding->pad_bytes = ctx->pad_bytes;
+        padding->filled_frames = ctx->filled_frames;
+    }
+    opus_encoder_destroy(ctx->enc);
+    osFreeMem(ctx->enc_snapshot);
+    if (ctx->merge)
+    {
+        opus_repacketizer_destroy(ctx->merge);
+        opus_repacketizer_destroy(ctx->split);
+    }
+    ogg_stream_clear(&ctx->os);
+    osFreeMem(ctx);
+
+    return error;
+}
+
+error_t toniefile_append_segment(toniefile_t *ctx, uint8_t *data, size_t length, uint64_t granules, bool_t chapter)
+{
+    size_t pos = 0;
+
+    if (chapter)
+    {
+        toniefile_add_chapter(ctx);
+    }
+
+    while (pos < length)
+    {
+        if (pos + 27 > length || osMemcmp(&data[pos], "OggS", 4) || pos + 27 + data[pos + 26] > length)
+        {
+            return ERROR_INVALID_FILE;
+        }
+        ogg_page og;
+        og.header = &data[pos];
+        og.header_len = 27 + data[pos + 26];
+        og.body = &data[pos + og.header_len];
+        og.body_len = 0;
+        for (uint8_t segment = 0; segment < data[pos + 26]; segment++)
+        {
+            og.body_len += data[pos + 27 + segment];
+        }
+        if (pos + og.header_len + og.body_len > length)
+        {
+            return ERROR_INVALID_FILE;
         }
-        // TRACE_INFO("  samples: %lu (%lu/%lu)\n", samples, samples_processed, samples_available);
 
-        toniefile_samples_copy(ctx->audio_frame, &ctx->audio_frame_used, sample_buffer, &samples_processed, samples);
+        /* the segment was encoded as an ogg stream of its own, continue the one of the file */
+        og.header[5] &= ~0x02;
+        uint64_t granule = 0;
+        for (int byte = 7; byte >= 0; byte--)
+        {
+            granule = (granule << 8) | og.header[6 + byte];
+        }
+        if (granule != UINT64_MAX)
+        {
+            granule += ctx->ogg_granule_position;
+            for (int byte = 0; byte < 8; byte++)
+            {
+                og.header[6 + byte] = (uint8_t)(granule >> (8 * byte));
+            }
+        }
+        uint32_t sequence = (uint32_t)ctx->os.pageno++;
+        for (int byte = 0; byte < 4; byte++)
+        {
+            og.header[14 + byte] = (uint8_t)((uint32_t)ctx->os.serialno >> (8 * byte));
+            og.header[18 + byte] = (uint8_t)(sequence >> (8 * byte));
+        }
+        ogg_page_checksum_set(&og);
 
-        /* buffer full? */
-        if (ctx->audio_frame_used >= OPUS_FRAME_SIZE)
+        if (toniefile_write(ctx, og.header, og.header_len) != NO_ERROR || toniefile_write(ctx, og.body, og.body_len) != NO_ERROR)
         {
-            int page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + 27 + ctx->os.lacing_fill - ctx->os.lacing_returned + ctx->os.body_fill - ctx->os.body_returned;
-            int page_remain = TONIEFILE_FRAME_SIZE - page_used;
+            return ERROR_WRITE_FAILED;
+        }
+        sha1Update(&ctx->sha1, og.header, og.header_len);
+        sha1Update(&ctx->sha1, og.body, og.body_len);
+
+        size_t prev = ctx->file_pos;
+        ctx->file_pos += og.header_len + og.body_len;
+        ctx->audio_length += og.header_len + og.body_len;
+        ctx->taf_block_num += (ctx->file_pos / TONIEFILE_FRAME_SIZE) - (prev / TONIEFILE_FRAME_SIZE);
+        pos += og.header_len + og.body_len;
+    }
+    ctx->ogg_granule_position += granules;
+
+    if (ctx->file_pos % TONIEFILE_FRAME_SIZE)
+    {
+        TRACE_ERROR("Block alignment mismatch 0x%08" PRIXSIZE "\r\n", ctx->file_pos);
+        return ERROR_FAILURE;
+    }
+    return NO_ERROR;
+}
+
+error_t toniefile_append_block(toniefile_t *ctx, const uint8_t *block, size_t length, size_t start, uint64_t granule_start, uint64_t granule_end, bool_t chapter)
+{
+    error_t error = NO_ERROR;
+
+    /* segments have no chapter table */
+    if (ctx->parallel || (ctx->segment && chapter) || start > length || granule_end < granule_start)
+    {
+        return ERROR_INVALID_PARAMETER;
+    }
+    /* whatever is pending is completed to a whole block first */
+    if (ctx->audio_frame_used > 0 || ctx->os.lacing_fill > 0)
+    {
+        error = toniefile_finish(ctx);
+    }
+    else
+    {
+        error = toniefile_remux_end(ctx);
+    }
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
 
-            int frame_payload = (page_remain / 256) * 255 + (page_remain % 256) - 1;
-            int reconstructed = (frame_payload / 255) + 1 + frame_payload;
+    uint8_t data[TONIEFILE_FRAME_SIZE];
+    size_t data_length = length - start;
+    osMemcpy(data, &block[start], data_length);
 
-            /* when due to segment sizes we would end up with a 1 byte gap, make sure that the next run will have at least 64 byte.
-             * reason why this could happen is that "adding one byte" would require one segment more and thus occupies two byte more.
-             * if this would happen, just reduce the calculated free space such that there is room for another segment.
-             */
-            if (page_remain != reconstructed && frame_payload > OPUS_PACKET_MINSIZE)
+    if (length == TONIEFILE_FRAME_SIZE && ctx->file_pos % TONIEFILE_FRAME_SIZE == start)
+    {
+        /* the pages line up, only their granule positions have to start where the file is */
+        for (size_t pos = 0; pos + 27 <= data_length;)
+        {
+            uint8_t *header = &data[pos];
+            if (pos + 27 + header[26] > data_length)
             {
-                frame_payload -= OPUS_PACKET_MINSIZE;
+                break;
             }
-            if (frame_payload < OPUS_PACKET_MINSIZE)
+            size_t body_length = 0;
+            for (uint8_t segment = 0; segment < header[26]; segment++)
             {
-                TRACE_ERROR("Not enough space in this block\r\n");
-                return ERROR_FAILURE;
+                body_length += header[27 + segment];
             }
-
-            int frame_len = opus_encode(ctx->enc, ctx->audio_frame, OPUS_FRAME_SIZE, output_frame, frame_payload);
-            // TRACE_INFO("opus_encode: %d/%d\r\n", frame_len, frame_dest);
-
-            if (frame_len <= 0)
+            uint64_t granule = 0;
+            for (int byte = 7; byte >= 0; byte--)
             {
-                TRACE_ERROR("Cannot encode: %s\r\n", opus_strerror(frame_len));
-                return ERROR_FAILURE;
+                granule = (granule << 8) | header[6 + byte];
             }
-
-            /* we did not exactly hit the destination size and are close to block size. pad packet */
-            if (frame_payload - frame_len < OPUS_PACKET_PAD)
+            if (granule != UINT64_MAX)
             {
-                int target_length = frame_payload;
-
-                int ret = opus_packet_pad(output_frame, frame_len, target_length);
-                // TRACE_INFO("opus_packet_pad: %d -> %d\r\n", frame_len, target_length);
-                if (ret < 0)
+                granule = (granule > granule_start) ? granule - granule_start : 0;
+                for (int byte = 0; byte < 8; byte++)
                 {
-                    TRACE_ERROR("Cannot pad: %s\r\n", opus_strerror(ret));
-                    return ERROR_FAILURE;
+                    header[6 + byte] = (uint8_t)(granule >> (8 * byte));
                 }
-                frame_len = target_length;
             }
+            pos += 27 + header[26] + body_length;
+        }
+        return toniefile_append_segment(ctx, data, data_length, granule_end - granule_start, chapter);
+    }
 
-            /* we have to retrieve the actually encoded samples in this frame */
-            int frames = opus_packet_get_samples_per_frame(output_frame, OPUS_SAMPLING_RATE) * opus_packet_get_nb_frames(output_frame, frame_len);
-            if (frames != OPUS_FRAME_SIZE)
+    /* otherwise the packets are laid out again and padded, like remuxed ones */
+    if (chapter && toniefile_add_chapter(ctx) != NO_ERROR)
+    {
+        return ERROR_FAILURE;
+    }
+    uint8_t packet[TONIEFILE_FRAME_SIZE];
+    size_t packet_length = 0;
+    size_t pos = 0;
+    while (pos < data_length && error == NO_ERROR)
+    {
+        const uint8_t *header = &data[pos];
+        if (pos + 27 > data_length || osMemcmp(header, "OggS", 4) || pos + 27 + header[26] > data_length)
+        {
+            return ERROR_INVALID_FILE;
+        }
+        /* packets must not continue from the previous block */
+        if (pos == 0 && (header[5] & 0x01))
+        {
+            return ERROR_INVALID_FILE;
+        }
+        const uint8_t *body = &header[27 + header[26]];
+        size_t body_pos = 0;
+        for (uint8_t segment = 0; segment < header[26] && error == NO_ERROR; segment++)
+        {
+            uint8_t size = header[27 + segment];
+            if (body + body_pos + size > &data[data_length] || packet_length + size > sizeof(packet))
             {
-                TRACE_ERROR("frame count unexpected: %d instead of %d\r\n", frames, OPUS_FRAME_SIZE);
+                return ERROR_INVALID_FILE;
             }
-            ctx->ogg_granule_position += frames;
+            osMemcpy(&packet[packet_length], &body[body_pos], size);
+            packet_length += size;
+            body_pos += size;
 
-            /* now fill output page */
-            ogg_packet op;
-            op.packet = output_frame;
-            op.bytes = frame_len;
-            op.b_o_s = 0;
-            op.e_o_s = 0;
-            op.granulepos = ctx->ogg_granule_position;
-            op.packetno = ctx->ogg_packet_count;
-
-            ctx->ogg_packet_count++;
+            if (size < 255)
+            {
+                error = toniefile_remux_packet(ctx, packet, packet_length);
+                packet_length = 0;
+            }
+        }
+        pos += 27 + header[26] + body_pos;
+    }
+    if (error == NO_ERROR && packet_length > 0)
+    {
+        return ERROR_INVALID_FILE;
+    }
+    return error;
+}
 
-            ogg_stream_packetin(&ctx->os, &op);
+error_t toniefile_repack_block(const uint8_t *block, size_t length, size_t start, uint32_t serial, uint8_t **data, size_t *data_length, uint64_t *granules)
+{
+    toniefile_t *ctx = toniefile_create_segment(serial, 0, TONIEFILE_QUALITY_DEFAULT);
+    if (!ctx)
+    {
+        return ERROR_OUT_OF_MEMORY;
+    }
 
-            page_used = (ctx->file_pos % TONIEFILE_FRAME_SIZE) + 27 + ctx->os.lacing_fill + ctx->os.body_fill;
-            page_remain = TONIEFILE_FRAME_SIZE - page_used;
+    /* the segment starts on a block boundary, so pages behind start are laid out again */
+    int16_t silence[OPUS_CHANNELS] = {0};
+    error_t error = toniefile_append_block(ctx, block, length, start, 0, 0, FALSE);
+    error_t finishError = toniefile_finish_segment(ctx, silence, 0, data, data_length, granules, NULL);
+    if (error == NO_ERROR)
+    {
+        return finishError;
+    }
+    osFreeMem(*data);
+    *data = NULL;
+    *data_length = 0;
 
-            if (page_remain < TONIEFILE_PAD_END)
-            {
-                if (page_remain)
-                {
-                    TRACE_INFO("unexpected small padding at %" PRIu64 " (%" PRIu64 " s)\r\n", ctx->ogg_granule_position, ctx->ogg_granule_position / OPUS_FRAME_SIZE * 60 / 1000)
-                    return ERROR_FAILURE;
-                }
+    return error;
+}
 
-                ogg_page og;
-                while (ogg_stream_flush(&ctx->os, &og))
-                {
-                    if (fsWriteFile(ctx->file, og.header, og.header_len) != NO_ERROR)
-                    {
-                        return ERROR_FAILURE;
-                    }
-                    if (fsWriteFile(ctx->file, og.body, og.body_len) != NO_ERROR)
-                    {
-                        return ERROR_FAILURE;
-                    }
-                    size_t prev = ctx->file_pos;
-                    ctx->file_pos += og.header_len + og.body_len;
-                    ctx->audio_length += og.header_len + og.body_len;
+/* moves the PCM output of ffmpeg into the ring until it ends or the encoder gives up */
+static void ffmpeg_decoder_task(void *param)
+{
+    ffmpeg_decoder_t *decoder = (ffmpeg_decoder_t *)param;
 
-                    sha1Update(&ctx->sha1, og.header, og.header_len);
-                    sha1Update(&ctx->sha1, og.body, og.body_len);
+    while (TRUE)
+    {
+        uint8_t *data;
+        size_t size;
+        size_t length;
 
-                    if ((prev / TONIEFILE_FRAME_SIZE) != (ctx->file_pos / TONIEFILE_FRAME_SIZE))
-                    {
-                        ctx->taf_block_num++;
-                        if (ctx->file_pos % TONIEFILE_FRAME_SIZE)
-                        {
-                            TRACE_ERROR("Block alignment mismatch 0x%08" PRIXSIZE "\r\n", ctx->file_pos)
-                            return ERROR_FAILURE;
-                        }
-                    }
-                }
-            }
-            /* fill again */
-            ctx->audio_frame_used = 0;
+        if (pcm_ring_write_begin(decoder->ring, &data, &size, INFINITE_DELAY) != NO_ERROR)
+        {
+            break;
+        }
+        error_t error = platform_process_read(decoder->process, data, MIN(size, FFMPEG_PCM_READ_SIZE), &length);
+        if (error != NO_ERROR)
+        {
+            decoder->ended = (error == ERROR_END_OF_STREAM);
+            break;
         }
+        pcm_ring_write_commit(decoder->ring, length);
     }
+    pcm_ring_close(decoder->ring);
+    osSetEvent(&decoder->stopped);
 
-    return NO_ERROR;
+    osDeleteTask(OS_SELF_TASK_ID);
 }
 
-// Function to decode audio from FFmpeg's standard output
-FILE *ffmpeg_decode_audio_start(const char *input_source)
+ffmpeg_decoder_t *ffmpeg_decode_audio_start(const char *input_source)
 {
     return ffmpeg_decode_audio_start_skip(input_source, 0);
 }
-FILE *ffmpeg_decode_audio_start_skip(const char *input_source, size_t skip_seconds)
+ffmpeg_decoder_t *ffmpeg_decode_audio_start_skip(const char *input_source, size_t skip_seconds)
+{
+    audio_decoder_t *native = audio_decoder_open(input_source, skip_seconds);
+    if (native)
+    {
+        ffmpeg_decoder_t *decoder = osAllocMem(sizeof(ffmpeg_decoder_t));
+        if (!decoder)
+        {
+            audio_decoder_close(native);
+            return NULL;
+        }
+        osMemset(decoder, 0x00, sizeof(ffmpeg_decoder_t));
+        decoder->native = native;
+        stats_update("decode_native", 1);
+        return decoder;
+    }
+
+    return ffmpeg_decode_audio_start_process(input_source, skip_seconds);
+}
+ffmpeg_decoder_t *ffmpeg_decode_audio_start_process(const char *input_source, size_t skip_seconds)
 {
 #ifdef FFMPEG_DECODING
-    // Construct the FFmpeg command based on the input source
-    char ffmpeg_command[1024]; // Adjust the buffer size as needed
-    snprintf(ffmpeg_command, sizeof(ffmpeg_command), "ffmpeg -i \"%s\" -f s16le -acodec pcm_s16le -ar 48000 -ac 2 -ss %" PRIuSIZE " -", input_source, skip_seconds);
+    char skip[24];
+    osSnprintf(skip, sizeof(skip), "%" PRIuSIZE, skip_seconds);
+
+    /* no shell involved, the source is passed as it is */
+    const char *argv[] = {"ffmpeg", "-i", input_source, "-f", "s16le", "-acodec", "pcm_s16le", "-ar", "48000", "-ac", "2", "-ss", skip, "-", NULL};
+
+    platform_process_t *process = platform_process_spawn(argv);
+    if (process == NULL)
+    {
+        TRACE_ERROR("Could not start FFmpeg\r\n");
+        return NULL;
+    }
 
-    FILE *ffmpeg_pipe = NULL;
+    ffmpeg_decoder_t *decoder = osAllocMem(sizeof(ffmpeg_decoder_t));
+    pcm_ring_t *ring = pcm_ring_create(FFMPEG_PCM_RING_SIZE);
+    if (!decoder || !ring)
+    {
+        TRACE_ERROR("Could not allocate the FFmpeg decoder\r\n");
+        platform_process_terminate(process);
+        platform_process_wait(process);
+        if (ring)
+        {
+            pcm_ring_free(ring);
+        }
+        osFreeMem(decoder);
+        return NULL;
+    }
+    osMemset(decoder, 0x00, sizeof(ffmpeg_decoder_t));
+    decoder->process = process;
+    decoder->ring = ring;
+    osCreateEvent(&decoder->stopped);
 
-    // Open a pipe to execute the FFmpeg command
-    ffmpeg_pipe = popen(ffmpeg_command, "r");
-    if (ffmpeg_pipe == NULL)
+    if (osCreateTask("ffmpeg decode", &ffmpeg_decoder_task, decoder, 1024, 0) == OS_INVALID_TASK_ID)
     {
-        TRACE_ERROR("Could not open FFmpeg pipe\n");
-        return ffmpeg_pipe;
+        TRACE_ERROR("Could not start FFmpeg decoder task\r\n");
+        platform_process_terminate(process);
+        platform_process_wait(process);
+        pcm_ring_free(decoder->ring);
+        osDeleteEvent(&decoder->stopped);
+        osFreeMem(decoder);
+        return NULL;
     }
-    return ffmpeg_pipe;
+    stats_update("decode_ffmpeg", 1);
+    return decoder;
 #else
     return NULL;
 #endif
 }
-error_t ffmpeg_decode_audio_end(FILE *ffmpeg_pipe, error_t error)
+error_t ffmpeg_decode_audio_end(ffmpeg_decoder_t *decoder, error_t error)
 {
-#ifdef FFMPEG_DECODING
-    if (ffmpeg_pipe == NULL)
-        return ERROR_ABORTED;
-    /*
-    char line[1024]; // Adjust the buffer size as needed
-    if (error == NO_ERROR)
+    if (decoder && decoder->native)
     {
-        TRACE_INFO("%s", "");
+        audio_decoder_close(decoder->native);
+        osFreeMem(decoder);
+        return NO_ERROR;
     }
-    else
-    {
-        TRACE_ERROR("%s", "");
-    }
-    while (fgets(line, sizeof(line), ffmpeg_pipe) != NULL)
+
+#ifdef FFMPEG_DECODING
+    if (decoder == NULL)
+        return ERROR_ABORTED;
+
+    /* a decoder task blocked on a full ring or on the pipe returns */
+    pcm_ring_abort(decoder->ring);
+    bool_t terminated = !decoder->ended;
+    if (terminated)
     {
-        if (error == NO_ERROR)
-        {
-            TRACE_INFO_RESUME("%s", (const char *)line);
-        }
-        else
-        {
-            TRACE_ERROR_RESUME("%s", (const char *)line);
-        }
+        platform_process_terminate(decoder->process);
     }
-    if (error == NO_ERROR)
+    osWaitForEvent(&decoder->stopped, INFINITE_DELAY);
+
+    /* a source that ended early, like a dropped connection, looks like a regular end to the reader.
+     * ffmpeg exits with an error when it is terminated while flushing, that is no failure of the source. */
+    error_t result = NO_ERROR;
+    int exitCode = platform_process_wait(decoder->process);
+    if (error == NO_ERROR && !terminated && exitCode > 0)
     {
-        TRACE_INFO_RESUME("%s", "\r\n");
+        TRACE_WARNING("FFmpeg exited with code %d\r\n", exitCode);
+        result = ERROR_FAILURE;
     }
-    else
-    {
-        TRACE_ERROR_RESUME("%s", "\r\n");
-    }*/
-    // Close the FFmpeg pipe
-    pclose(ffmpeg_pipe);
-    return NO_ERROR;
+
+    pcm_ring_free(decoder->ring);
+    osDeleteEvent(&decoder->stopped);
+    osFreeMem(decoder);
+    return result;
 #else
     return ERROR_NOT_IMPLEMENTED;
 #endif
 }
-error_t ffmpeg_decode_audio(FILE *ffmpeg_pipe, int16_t *buffer, size_t size, size_t *blocks_read)
+error_t ffmpeg_decode_audio(ffmpeg_decoder_t *decoder, int16_t *buffer, size_t size, size_t *samples_read)
 {
-    if (ffmpeg_pipe == NULL)
+    if (decoder == NULL)
         return ERROR_ABORTED;
-    *blocks_read = 0;
-    // Read and process audio data from the FFmpeg pipe
-    while (*blocks_read < size)
+
+    if (decoder->native)
     {
-        // Read a chunk of audio data from the pipe
-        int16_t sample;
-        size_t read = fread(&sample, sizeof(int16_t), 1, ffmpeg_pipe);
-        if (read != 1)
-        {
-            if (*blocks_read > 0)
-            {
-                return NO_ERROR;
-            }
-            else
-            {
-                return ERROR_END_OF_STREAM; // End of audio data
-            }
-        }
-        // Store the audio sample in the buffer
-        buffer[*blocks_read] = sample;
-        *blocks_read += read;
+        /* whole opus frames, like the ring delivers them */
+        size_t frames = size / OPUS_CHANNELS / OPUS_FRAME_SIZE * OPUS_FRAME_SIZE;
+        size_t frames_read = 0;
+        error_t error = audio_decoder_read(decoder->native, buffer, frames, &frames_read);
+        *samples_read = frames_read * OPUS_CHANNELS;
+        return error;
     }
-    return NO_ERROR;
+
+    size_t length = 0;
+    error_t error = pcm_ring_read(decoder->ring, buffer, size * sizeof(int16_t), FFMPEG_PCM_FRAME_BYTES, &length, FFMPEG_PCM_TIMEOUT_MS);
+    *samples_read = length / sizeof(int16_t);
+
+    return error;
 }
 
 error_t ffmpeg_convert(char *source, char *target_taf, size_t skip_seconds)
@@ -538,60 +1915,258 @@ error_t ffmpeg_convert(char *source, char *target_taf, size_t skip_seconds)
     bool_t active = true;
     return ffmpeg_stream(source, target_taf, skip_seconds, &active);
 }
-error_t ffmpeg_stream(char *source, char *target_taf, size_t skip_seconds, bool_t *active)
+typedef struct
 {
-    TRACE_INFO("Encode source %s as TAF to %s and skip %" PRIuSIZE " seconds\r\n", source, target_taf, skip_seconds);
+    systime_t start;
+    systime_t last_read;
+    uint64_t samples_received;
+    int32_t jitter_ms;
+} ffmpeg_stream_jitter_t;
+
+/**
+ * @brief Tracks the arrival of source audio and signals readiness once the jitter buffer is filled
+ *
+ * The jitter is the smoothed deviation of the time between two reads from the audio duration
+ * they delivered (like RFC 3550). The start depth is a multiple of it, or the maximum when
+ * the source delivers slower than real time.
+ */
+static void ffmpeg_stream_jitter_update(ffmpeg_stream_ctx_t *ctx, ffmpeg_stream_jitter_t *jitter, size_t samples)
+{
+    systime_t now = osGetSystemTime();
+    uint32_t chunk_ms = samples * 1000 / OPUS_SAMPLING_RATE;
 
-    FILE *ffmpeg_pipe = NULL;
-    error_t error = NO_ERROR;
-    ffmpeg_pipe = ffmpeg_decode_audio_start_skip(source, skip_seconds);
-    if (ffmpeg_pipe == NULL)
+    if (jitter->samples_received > 0)
     {
-        return -1;
+        int32_t deviation = (int32_t)(now - jitter->last_read) - (int32_t)chunk_ms;
+        jitter->jitter_ms += ((deviation < 0 ? -deviation : deviation) - jitter->jitter_ms) / 16;
     }
+    jitter->last_read = now;
+    jitter->samples_received += samples;
 
-    toniefile_t *taf = toniefile_create(target_taf, time(NULL));
-    if (!taf)
+    uint32_t audio_ms = jitter->samples_received * 1000 / OPUS_SAMPLING_RATE;
+    uint32_t elapsed_ms = now - jitter->start;
+    uint32_t target_ms = STREAM_JITTER_MIN_MS + 4 * (uint32_t)jitter->jitter_ms;
+
+    if (elapsed_ms >= STREAM_JITTER_RATE_MS && (uint64_t)audio_ms * 100 < (uint64_t)elapsed_ms * 98)
     {
-        TRACE_ERROR("toniefile_create() failed, aborting\r\n");
-        ffmpeg_decode_audio_end(ffmpeg_pipe, error);
-        return -1;
+        target_ms = STREAM_JITTER_MAX_MS;
     }
+    ctx->jitter_target_ms = MIN(target_ms, STREAM_JITTER_MAX_MS);
 
-    int16_t sample_buffer[2 * 4096];
-    size_t samples = sizeof(sample_buffer) / sizeof(uint16_t);
-    size_t blocks_read = 0;
+    if (!ctx->ready && (audio_ms >= ctx->jitter_target_ms || elapsed_ms >= STREAM_JITTER_MAX_MS))
+    {
+        TRACE_INFO("Stream ready after %" PRIu32 " ms with %" PRIu32 " ms buffered\r\n", elapsed_ms, audio_ms);
+        ctx->startup_ms = elapsed_ms;
+        ctx->ready = true;
+        osSetEvent(&ctx->ready_event);
+    }
+}
+
+/* logs and records how much faster than real time a job was encoded */
+static uint32_t ffmpeg_stream_speed(uint64_t samples, systime_t start, bool_t final)
+{
+    uint32_t elapsed_ms = osGetSystemTime() - start;
+    uint64_t audio_ms = samples * 1000 / OPUS_SAMPLING_RATE;
+    uint32_t speed_pct = (uint32_t)(audio_ms * 100 / MAX(elapsed_ms, 1));
+
+    if (final)
+    {
+        TRACE_INFO("Encoded %" PRIu64 ".%01" PRIu64 " s of audio in %" PRIu32 ".%01" PRIu32 " s, %.2fx real time\r\n",
+                   audio_ms / 1000, audio_ms % 1000 / 100, elapsed_ms / 1000, elapsed_ms % 1000 / 100, speed_pct / 100.0);
+        stats_update("transcode_jobs", 1);
+        stats_update("transcode_audio_s", (int)(audio_ms / 1000));
+        stats_update("transcode_time_s", (int)(elapsed_ms / 1000));
+        stats_set("transcode_speed_last_pct", (int)speed_pct);
+    }
+    return speed_pct;
+}
+
+static error_t ffmpeg_stream_encode(ffmpeg_decoder_t *decoder, toniefile_t *taf, bool_t *active, ffmpeg_stream_ctx_t *ctx)
+{
+    error_t error = NO_ERROR;
 
-    osDelayTask(5000); // buffer incomming stream
+    size_t samples = FFMPEG_PCM_FRAMES * FFMPEG_PCM_FRAME_BYTES / sizeof(int16_t);
+    int16_t *sample_buffer = osAllocMem(samples * sizeof(int16_t));
+    if (!sample_buffer)
+    {
+        TRACE_ERROR("Could not allocate the sample buffer\r\n");
+        ffmpeg_decode_audio_end(decoder, ERROR_OUT_OF_MEMORY);
+        toniefile_close(taf);
+        return ERROR_OUT_OF_MEMORY;
+    }
+    size_t samples_read = 0;
+    uint64_t samples_total = 0;
+    systime_t start = osGetSystemTime();
+
+    ffmpeg_stream_jitter_t jitter;
+    osMemset(&jitter, 0x00, sizeof(jitter));
+    jitter.start = start;
 
-    *active = true;
     while (*active)
     {
-        error = ffmpeg_decode_audio(ffmpeg_pipe, sample_buffer, samples, &blocks_read);
-        if (error != NO_ERROR && error != ERROR_END_OF_STREAM)
+        error = ffmpeg_decode_audio(decoder, sample_buffer, samples, &samples_read);
+        if (error == ERROR_TIMEOUT)
         {
-            TRACE_ERROR("Could not decode sample error=%" PRIu16 " read=%" PRIuSIZE "\r\n", error, blocks_read);
-            break;
+            /* nothing from the source yet, check if the encoder is still wanted */
+            error = NO_ERROR;
+            continue;
         }
         else if (error == ERROR_END_OF_STREAM)
         {
             error = NO_ERROR;
             break;
         }
-        error = toniefile_encode(taf, sample_buffer, blocks_read / 2);
+        else if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Could not decode sample error=%" PRIu16 " read=%" PRIuSIZE "\r\n", error, samples_read);
+            break;
+        }
+        error = toniefile_encode(taf, sample_buffer, samples_read / OPUS_CHANNELS);
         if (error != NO_ERROR && error != ERROR_END_OF_STREAM)
         {
             TRACE_ERROR("Could not encode toniesample error=%" PRIu16 "\r\n", error);
             break;
         }
+        samples_total += samples_read / OPUS_CHANNELS;
+        if (ctx)
+        {
+            ffmpeg_stream_jitter_update(ctx, &jitter, samples_read / OPUS_CHANNELS);
+            ctx->speed_pct = ffmpeg_stream_speed(samples_total, start, false);
+        }
         // toniefile_new_chapter(taf);
     }
 
-    ffmpeg_decode_audio_end(ffmpeg_pipe, error);
-    toniefile_close(taf);
+    error_t end_error = ffmpeg_decode_audio_end(decoder, error);
+    if (error == NO_ERROR)
+    {
+        error = end_error;
+    }
+    /* the header is written last, a copy for the transcode cache is only complete with it */
+    if (toniefile_close(taf) != NO_ERROR && error == NO_ERROR)
+    {
+        error = ERROR_WRITE_FAILED;
+    }
+    osFreeMem(sample_buffer);
+
+    if (error == NO_ERROR)
+    {
+        TRACE_INFO("TAF encoding successful\r\n");
+        ffmpeg_stream_speed(samples_total, start, true);
+    }
+
+    return error;
+}
+
+/* copies the packets of an Opus source, which runs at the speed of the disk */
+static error_t ffmpeg_stream_remux(opus_reader_t *reader, toniefile_t *taf, bool_t *active)
+{
+    error_t error = NO_ERROR;
+    uint64_t samples_total = 0;
+    systime_t start = osGetSystemTime();
+
+    while (*active)
+    {
+        const uint8_t *packet;
+        size_t length;
+        uint32_t samples;
+
+        error = opus_reader_read(reader, &packet, &length, &samples);
+        if (error == ERROR_END_OF_STREAM)
+        {
+            error = NO_ERROR;
+            break;
+        }
+        if (error == NO_ERROR)
+        {
+            error = toniefile_remux_packet(taf, packet, length);
+        }
+        if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Could not remux packet error=%" PRIu16 "\r\n", error);
+            break;
+        }
+        samples_total += samples;
+    }
+
+    opus_reader_close(reader);
+    if (toniefile_close(taf) != NO_ERROR && error == NO_ERROR)
+    {
+        error = ERROR_FAILURE;
+    }
+
+    uint32_t elapsed_ms = osGetSystemTime() - start;
+    TRACE_INFO("Remuxed %" PRIu64 " s of audio in %" PRIu32 ".%01" PRIu32 " s\r\n", samples_total / OPUS_SAMPLING_RATE, elapsed_ms / 1000, elapsed_ms % 1000 / 100);
+
+    return error;
+}
+
+error_t ffmpeg_stream(char *source, char *target_taf, size_t skip_seconds, bool_t *active)
+{
+    TRACE_INFO("Encode source %s as TAF to %s and skip %" PRIuSIZE " seconds\r\n", source, target_taf, skip_seconds);
+
+    opus_reader_t *reader = (skip_seconds == 0) ? opus_reader_open(source) : NULL;
+    if (reader)
+    {
+        toniefile_t *taf = toniefile_create_serial(target_taf, time(NULL));
+        if (!taf)
+        {
+            TRACE_ERROR("toniefile_create() failed, aborting\r\n");
+            opus_reader_close(reader);
+            return -1;
+        }
+        stats_update("decode_remux", 1);
+        return ffmpeg_stream_remux(reader, taf, active);
+    }
+
+    ffmpeg_decoder_t *decoder = ffmpeg_decode_audio_start_skip(source, skip_seconds);
+    if (decoder == NULL)
+    {
+        return -1;
+    }
+
+    toniefile_t *taf = toniefile_create(target_taf, time(NULL));
+    if (!taf)
+    {
+        TRACE_ERROR("toniefile_create() failed, aborting\r\n");
+        ffmpeg_decode_audio_end(decoder, ERROR_FAILURE);
+        return -1;
+    }
+
+    return ffmpeg_stream_encode(decoder, taf, active, NULL);
+}
+
+error_t ffmpeg_stream_buffer(ffmpeg_stream_ctx_t *ctx)
+{
+    TRACE_INFO("Encode source %s as TAF stream and skip %" PRIuSIZE " seconds\r\n", ctx->source, ctx->skip_seconds);
+
+    ffmpeg_decoder_t *decoder = ffmpeg_decode_audio_start_skip(ctx->source, ctx->skip_seconds);
+    if (decoder == NULL)
+    {
+        stream_buffer_close(ctx->buffer);
+        return -1;
+    }
 
-    TRACE_INFO("TAF encoding successful\r\n");
+    transcode_cache_entry_t *cache = ctx->cache ? transcode_cache_begin(ctx->source, ctx->skip_seconds) : NULL;
+    toniefile_t *taf = cache ? toniefile_create_stream_copy(ctx->buffer, time(NULL), transcode_cache_path(cache))
+                             : toniefile_create_stream(ctx->buffer, time(NULL));
+    if (!taf)
+    {
+        TRACE_ERROR("toniefile_create_stream() failed, aborting\r\n");
+        ffmpeg_decode_audio_end(decoder, ERROR_FAILURE);
+        stream_buffer_close(ctx->buffer);
+        if (cache)
+        {
+            transcode_cache_commit(cache, FALSE);
+        }
+        return -1;
+    }
 
+    error_t error = ffmpeg_stream_encode(decoder, taf, &ctx->active, ctx);
+    if (cache)
+    {
+        /* sessions stopped early only hold the start of the source */
+        transcode_cache_commit(cache, error == NO_ERROR && ctx->active);
+    }
     return error;
 }
 
@@ -599,7 +2174,10 @@ void ffmpeg_stream_task(void *param)
 {
     ffmpeg_stream_ctx_t *ctx = (ffmpeg_stream_ctx_t *)param;
 
-    ctx->error = ffmpeg_stream(ctx->source, ctx->targetFile, ctx->skip_seconds, &ctx->active);
+    ctx->error = ffmpeg_stream_buffer(ctx);
+    /* also wake up listeners waiting for a stream that never got ready */
+    osSetEvent(&ctx->ready_event);
     ctx->quit = true;
+    osSetEvent(&ctx->stopped_event);
     osDeleteTask(OS_SELF_TASK_ID);
 }
\ No newline at end of file
@@ -0,0 +1,365 @@
+#include <string.h>
+
+#include "toniefile_parallel.h"
+#include "platform.h"
+#include "settings.h"
+#include "mutex_manager.h"
+#include "debug.h"
+#include "os_port.h"
+
+#define TONIEFILE_SEGMENT_WARMUP (TONIEFILE_SEGMENT_WARMUP_FRAMES * OPUS_FRAME_SIZE)
+#define TONIEFILE_SEGMENT_BUFFER (TONIEFILE_SEGMENT_WARMUP + TONIEFILE_SEGMENT_SAMPLES)
+
+typedef struct toniefile_segment_s
+{
+    struct toniefile_segment_s *next;
+    struct toniefile_segment_s *nextQueued;
+    uint32_t index;
+    size_t start_pos;
+    bool_t chapter;
+    /* interleaved, the warmup samples are followed by the ones of the segment */
+    int16_t *samples;
+    size_t warmup;
+    size_t count;
+
+    bool_t done;
+    error_t error;
+    uint8_t *data;
+    size_t length;
+    uint64_t granules;
+    toniefile_padding_t padding;
+} toniefile_segment_t;
+
+struct toniefile_parallel_s
+{
+    toniefile_t *taf;
+    uint32_t audio_id;
+    toniefile_quality_t quality;
+    size_t start_pos;
+    uint32_t workers;
+    uint32_t workersRunning;
+    bool_t closing;
+    error_t error;
+
+    /* waiting for a worker */
+    toniefile_segment_t *queue;
+    toniefile_segment_t **queueTail;
+    /* dispatched and not appended yet, in order */
+    toniefile_segment_t *segments;
+    toniefile_segment_t **segmentsTail;
+    uint32_t segmentCount;
+    uint32_t nextIndex;
+    OsEvent workEvent;
+    OsEvent doneEvent;
+
+    /* samples of the next segment, behind the end of the previous one as warmup */
+    int16_t *buffer;
+    size_t warmup;
+    size_t used;
+    bool_t chapter;
+};
+
+static void toniefile_parallel_encode_segment(toniefile_parallel_t *ctx, toniefile_segment_t *segment)
+{
+    toniefile_t *encoder = toniefile_create_segment(ctx->audio_id, segment->start_pos, ctx->quality);
+    if (!encoder)
+    {
+        segment->error = ERROR_FAILURE;
+        return;
+    }
+
+    error_t error = toniefile_warmup(encoder, segment->samples, segment->warmup);
+    /* frees the encoder in any case */
+    segment->error = toniefile_finish_segment(encoder, &segment->samples[segment->warmup * OPUS_CHANNELS], segment->count - segment->warmup,
+                                              &segment->data, &segment->length, &segment->granules, &segment->padding);
+    if (error != NO_ERROR)
+    {
+        osFreeMem(segment->data);
+        segment->data = NULL;
+        segment->error = error;
+    }
+}
+
+static void toniefile_parallel_worker(void *arg)
+{
+    toniefile_parallel_t *ctx = (toniefile_parallel_t *)arg;
+
+    while (TRUE)
+    {
+        mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+        toniefile_segment_t *segment = ctx->queue;
+        if (segment)
+        {
+            ctx->queue = segment->nextQueued;
+            if (!ctx->queue)
+            {
+                ctx->queueTail = &ctx->queue;
+            }
+        }
+        bool_t closing = ctx->closing;
+        bool_t queued = (ctx->queue != NULL);
+        mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+
+        if (!segment)
+        {
+            if (closing)
+            {
+                break;
+            }
+            osWaitForEvent(&ctx->workEvent, 100);
+            continue;
+        }
+        /* the event only wakes one worker, pass it on */
+        if (queued)
+        {
+            osSetEvent(&ctx->workEvent);
+        }
+
+        toniefile_parallel_encode_segment(ctx, segment);
+
+        mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+        osFreeMem(segment->samples);
+        segment->samples = NULL;
+        segment->done = TRUE;
+        mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+        osSetEvent(&ctx->doneEvent);
+    }
+
+    mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+    ctx->workersRunning--;
+    mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+    osSetEvent(&ctx->doneEvent);
+
+    osDeleteTask(OS_SELF_TASK_ID);
+}
+
+/* appends the finished segments in order until no more than pending are left */
+static void toniefile_parallel_collect(toniefile_parallel_t *ctx, uint32_t pending)
+{
+    while (TRUE)
+    {
+        mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+        toniefile_segment_t *segment = ctx->segments;
+        if (!segment || !segment->done)
+        {
+            bool_t wait = (ctx->segmentCount > pending);
+            mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+            if (!wait)
+            {
+                break;
+            }
+            osWaitForEvent(&ctx->doneEvent, 100);
+            continue;
+        }
+        ctx->segments = segment->next;
+        if (!ctx->segments)
+        {
+            ctx->segmentsTail = &ctx->segments;
+        }
+        ctx->segmentCount--;
+        mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+
+        if (ctx->error == NO_ERROR)
+        {
+            ctx->error = segment->error;
+        }
+        if (ctx->error == NO_ERROR)
+        {
+            ctx->error = toniefile_append_segment(ctx->taf, segment->data, segment->length, segment->granules, segment->chapter);
+            toniefile_add_padding(ctx->taf, &segment->padding);
+        }
+        if (ctx->error != NO_ERROR && segment->error == NO_ERROR)
+        {
+            TRACE_ERROR("Failed to append segment %" PRIu32 "\r\n", segment->index);
+        }
+        osFreeMem(segment->data);
+        osFreeMem(segment);
+    }
+}
+
+/* hands the first count buffered samples to the workers, the rest is carried over to the next segment */
+static void toniefile_parallel_dispatch(toniefile_parallel_t *ctx, size_t count)
+{
+    if (count <= ctx->warmup || ctx->error != NO_ERROR)
+    {
+        return;
+    }
+
+    /* the samples stay in the current buffer when there is no room for the next one */
+    toniefile_segment_t *segment = osAllocMem(sizeof(toniefile_segment_t));
+    int16_t *buffer = osAllocMem(TONIEFILE_SEGMENT_BUFFER * OPUS_CHANNELS * sizeof(int16_t));
+    if (!segment || !buffer)
+    {
+        TRACE_ERROR("Failed to allocate segment %" PRIu32 "\r\n", ctx->nextIndex);
+        osFreeMem(segment);
+        osFreeMem(buffer);
+        ctx->error = ERROR_OUT_OF_MEMORY;
+        return;
+    }
+    osMemset(segment, 0x00, sizeof(toniefile_segment_t));
+    segment->index = ctx->nextIndex++;
+    segment->start_pos = (segment->index == 0) ? ctx->start_pos : 0;
+    segment->chapter = ctx->chapter;
+    segment->samples = ctx->buffer;
+    segment->warmup = ctx->warmup;
+    segment->count = count;
+
+    size_t warmup = MIN(count, (size_t)TONIEFILE_SEGMENT_WARMUP) / OPUS_FRAME_SIZE * OPUS_FRAME_SIZE;
+    size_t carry = ctx->used - count;
+    ctx->buffer = buffer;
+    osMemcpy(ctx->buffer, &segment->samples[(count - warmup) * OPUS_CHANNELS], (warmup + carry) * OPUS_CHANNELS * sizeof(int16_t));
+    ctx->warmup = warmup;
+    ctx->used = warmup + carry;
+    ctx->chapter = FALSE;
+
+    /* keeps the memory bounded when the source delivers faster than the workers encode */
+    toniefile_parallel_collect(ctx, ctx->workers);
+
+    mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+    *ctx->queueTail = segment;
+    ctx->queueTail = &segment->nextQueued;
+    *ctx->segmentsTail = segment;
+    ctx->segmentsTail = &segment->next;
+    ctx->segmentCount++;
+    mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+
+    osSetEvent(&ctx->workEvent);
+}
+
+toniefile_parallel_t *toniefile_parallel_create(toniefile_t *taf, uint32_t audio_id, size_t start_pos, toniefile_quality_t quality)
+{
+    uint32_t workers = settings_get_unsigned("core.encode_threads");
+    /* more workers than cores would only hold more segments in memory */
+    if (workers == 0 || workers > platform_get_cpu_count())
+    {
+        workers = platform_get_cpu_count();
+    }
+    if (workers <= 1)
+    {
+        return NULL;
+    }
+
+    toniefile_parallel_t *ctx = osAllocMem(sizeof(toniefile_parallel_t));
+    if (!ctx)
+    {
+        TRACE_ERROR("Failed to allocate encoder threads, encoding serially\r\n");
+        return NULL;
+    }
+    osMemset(ctx, 0x00, sizeof(toniefile_parallel_t));
+    ctx->taf = taf;
+    ctx->audio_id = audio_id;
+    ctx->quality = quality;
+    ctx->start_pos = start_pos;
+    ctx->queueTail = &ctx->queue;
+    ctx->segmentsTail = &ctx->segments;
+    ctx->buffer = osAllocMem(TONIEFILE_SEGMENT_BUFFER * OPUS_CHANNELS * sizeof(int16_t));
+    if (!ctx->buffer)
+    {
+        TRACE_ERROR("Failed to allocate encoder threads, encoding serially\r\n");
+        osFreeMem(ctx);
+        return NULL;
+    }
+    osCreateEvent(&ctx->workEvent);
+    osCreateEvent(&ctx->doneEvent);
+
+    for (uint32_t worker = 0; worker < workers; worker++)
+    {
+        mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+        ctx->workersRunning++;
+        mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+
+        if (osCreateTask("TafEncoder", &toniefile_parallel_worker, ctx, 10 * 1024, 0) == OS_INVALID_TASK_ID)
+        {
+            mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+            ctx->workersRunning--;
+            mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+            break;
+        }
+        ctx->workers++;
+    }
+
+    if (ctx->workers == 0)
+    {
+        TRACE_ERROR("Failed to start encoder threads, encoding serially\r\n");
+        osDeleteEvent(&ctx->workEvent);
+        osDeleteEvent(&ctx->doneEvent);
+        osFreeMem(ctx->buffer);
+        osFreeMem(ctx);
+        return NULL;
+    }
+    TRACE_INFO("Encoding with %" PRIu32 " threads\r\n", ctx->workers);
+
+    return ctx;
+}
+
+error_t toniefile_parallel_encode(toniefile_parallel_t *ctx, int16_t *sample_buffer, size_t samples_available)
+{
+    while (samples_available > 0 && ctx->error == NO_ERROR)
+    {
+        size_t part = MIN(samples_available, TONIEFILE_SEGMENT_BUFFER - ctx->used);
+        osMemcpy(&ctx->buffer[ctx->used * OPUS_CHANNELS], sample_buffer, part * OPUS_CHANNELS * sizeof(int16_t));
+        ctx->used += part;
+        sample_buffer += part * OPUS_CHANNELS;
+        samples_available -= part;
+
+        if (ctx->used == TONIEFILE_SEGMENT_BUFFER)
+        {
+            toniefile_parallel_dispatch(ctx, ctx->used);
+        }
+    }
+
+    return ctx->error;
+}
+
+error_t toniefile_parallel_set_quality(toniefile_parallel_t *ctx, toniefile_quality_t quality)
+{
+    /* the workers read it without the lock, only before the first segment was queued */
+    if (ctx->nextIndex > 0 || ctx->used > 0)
+    {
+        return ERROR_WRONG_STATE;
+    }
+    ctx->quality = quality;
+
+    return NO_ERROR;
+}
+
+error_t toniefile_parallel_new_chapter(toniefile_parallel_t *ctx)
+{
+    /* like the serial encoder, an incomplete frame becomes part of the new chapter */
+    size_t frames = (ctx->used - ctx->warmup) / OPUS_FRAME_SIZE;
+    toniefile_parallel_dispatch(ctx, ctx->warmup + frames * OPUS_FRAME_SIZE);
+    ctx->chapter = TRUE;
+
+    return ctx->error;
+}
+
+error_t toniefile_parallel_close(toniefile_parallel_t *ctx)
+{
+    toniefile_parallel_dispatch(ctx, ctx->used);
+    toniefile_parallel_collect(ctx, 0);
+
+    mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+    ctx->closing = TRUE;
+    mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+
+    while (TRUE)
+    {
+        osSetEvent(&ctx->workEvent);
+        mutex_lock(MUTEX_TONIEFILE_PARALLEL);
+        uint32_t running = ctx->workersRunning;
+        mutex_unlock(MUTEX_TONIEFILE_PARALLEL);
+        if (running == 0)
+        {
+            break;
+        }
+        osWaitForEvent(&ctx->doneEvent, 100);
+    }
+
+    error_t error = ctx->error;
+    osDeleteEvent(&ctx->workEvent);
+    osDeleteEvent(&ctx->doneEvent);
+    osFreeMem(ctx->buffer);
+    osFreeMem(ctx);
+
+    return error;
+}
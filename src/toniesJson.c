@@ -1,21 +1,58 @@
 #include "toniesJson.h"
 #include "fs_port.h"
 #include "settings.h"
+#include "server_helpers.h"
 #include "debug.h"
 #include "cJSON.h"
 
 #define TONIES_JSON_CACHED 1
 #if TONIES_JSON_CACHED == 1
-static size_t toniesCount;
-static toniesJson_item_t *toniesJsonCache;
+typedef struct
+{
+    size_t count;
+    toniesJson_item_t *items;
+} toniesJson_cache_t;
+
+/* replaced as a whole on reload, the previous one is kept until the next reload for running lookups */
+static toniesJson_cache_t *toniesJsonCache;
+static toniesJson_cache_t *toniesJsonCachePrev;
+
+static void tonies_freeCache(toniesJson_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < cache->count; i++)
+    {
+        toniesJson_item_t *item = &cache->items[i];
+        osFreeMem(item->model);
+        osFreeMem(item->audio_ids);
+        osFreeMem(item->title);
+        osFreeMem(item->episodes);
+        osFreeMem(item->language);
+        osFreeMem(item->category);
+        osFreeMem(item->picture);
+    }
+    osFreeMem(cache->items);
+    osFreeMem(cache);
+}
 #endif
 
 void tonies_init()
 {
-    toniesCount = 0;
+#if TONIES_JSON_CACHED == 1
+    toniesJsonCache = NULL;
+    toniesJsonCachePrev = NULL;
+#endif
     tonies_readJson();
 }
 
+char *tonies_jsonPath()
+{
+    return custom_asprintf("%s/%s/tonies.json", get_settings()->internal.datadirfull, get_settings()->core.wwwdir);
+}
+
 char *tonies_jsonGetString(cJSON *jsonElement, char *name)
 {
 
@@ -38,23 +75,13 @@ uint32_t tonies_jsonGetUInt32(cJSON *jsonElement, char *name)
 void tonies_readJson()
 {
 #if TONIES_JSON_CACHED == 1
-    if (toniesCount > 0)
-    {
-        toniesCount = 0;
-        osFreeMem(toniesJsonCache);
-    }
-
-    char jsonPath[256];
+    char *jsonPath = tonies_jsonPath();
     size_t fileSize = 0;
-    osStrcpy(jsonPath, get_settings()->internal.datadirfull);
-    osStrcat(jsonPath, "/");
-    osStrcat(jsonPath, get_settings()->core.wwwdir);
-    osStrcat(jsonPath, "/");
-    osStrcat(jsonPath, "tonies.json");
     fsGetFileSize(jsonPath, (uint32_t *)(&fileSize));
     TRACE_INFO("Trying to read %s with size %" PRIuSIZE "\r\n", jsonPath, fileSize);
 
     FsFile *fsFile = fsOpenFile(jsonPath, FS_FILE_MODE_READ);
+    osFreeMem(jsonPath);
     if (fsFile != NULL)
     {
         size_t sizeRead;
@@ -84,12 +111,13 @@ void tonies_readJson()
         else
         {
             size_t line = 0;
-            toniesCount = cJSON_GetArraySize(toniesJson);
-            toniesJsonCache = osAllocMem(toniesCount * sizeof(toniesJson_item_t));
+            toniesJson_cache_t *cache = osAllocMem(sizeof(toniesJson_cache_t));
+            cache->count = cJSON_GetArraySize(toniesJson);
+            cache->items = osAllocMem(cache->count * sizeof(toniesJson_item_t));
             cJSON_ArrayForEach(tonieJson, toniesJson)
             {
                 cJSON *arrayJson;
-                toniesJson_item_t *item = &toniesJsonCache[line++];
+                toniesJson_item_t *item = &cache->items[line++];
                 char *no_str = tonies_jsonGetString(tonieJson, "no");
                 item->no = atoi(no_str);
                 free(no_str);
@@ -107,12 +135,18 @@ void tonies_readJson()
                 item->title = tonies_jsonGetString(tonieJson, "title");
                 item->episodes = tonies_jsonGetString(tonieJson, "episodes");
                 // TODO Tracks
-                item->release = atoi(tonies_jsonGetString(tonieJson, "release"));
+                char *release_str = tonies_jsonGetString(tonieJson, "release");
+                item->release = atoi(release_str);
+                free(release_str);
                 item->language = tonies_jsonGetString(tonieJson, "language");
                 item->category = tonies_jsonGetString(tonieJson, "category");
                 item->picture = tonies_jsonGetString(tonieJson, "pic");
             }
             cJSON_Delete(toniesJson);
+
+            tonies_freeCache(toniesJsonCachePrev);
+            toniesJsonCachePrev = toniesJsonCache;
+            toniesJsonCache = cache;
         }
     }
 #endif
@@ -120,12 +154,13 @@ void tonies_readJson()
 toniesJson_item_t *tonies_byAudioId(uint32_t audio_id)
 {
 #if TONIES_JSON_CACHED == 1
-    for (size_t i = 0; i < toniesCount; i++)
+    toniesJson_cache_t *cache = toniesJsonCache;
+    for (size_t i = 0; cache && i < cache->count; i++)
     {
-        for (size_t j = 0; j < toniesJsonCache[i].audio_ids_count; j++)
+        for (size_t j = 0; j < cache->items[i].audio_ids_count; j++)
         {
-            if (toniesJsonCache[i].audio_ids[j] == audio_id)
-                return &toniesJsonCache[i];
+            if (cache->items[i].audio_ids[j] == audio_id)
+                return &cache->items[i];
         }
     }
 #else
@@ -136,18 +171,9 @@ toniesJson_item_t *tonies_byAudioId(uint32_t audio_id)
 void tonies_deinit()
 {
 #if TONIES_JSON_CACHED == 1
-    for (size_t i = 0; i < toniesCount; i++)
-    {
-        toniesJson_item_t *item = &toniesJsonCache[i];
-        osFreeMem(item->model);
-        osFreeMem(item->audio_ids);
-        osFreeMem(item->title);
-        osFreeMem(item->episodes);
-        osFreeMem(item->language);
-        osFreeMem(item->category);
-        osFreeMem(item->picture);
-    }
-    toniesCount = 0;
-    osFreeMem(toniesJsonCache);
+    tonies_freeCache(toniesJsonCachePrev);
+    tonies_freeCache(toniesJsonCache);
+    toniesJsonCachePrev = NULL;
+    toniesJsonCache = NULL;
 #endif
 }
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include <string.h>
+#include <time.h>
+
+#include "transcode_cache.h"
+#include "toniefile.h"
+#include "settings.h"
+#include "server_helpers.h"
+#include "stats.h"
+#include "cJSON.h"
+#include "debug.h"
+#include "os_port.h"
+
+struct transcode_cache_entry_s
+{
+    char *source;
+    size_t skip_seconds;
+    char *basePath;
+    char *tmpPath;
+    bool_t url;
+    /* the source when the encode started */
+    uint32_t size;
+    DateTime modified;
+};
+
+static bool_t transcode_cache_is_url(const char *source)
+{
+    return osStrstr(source, "://") != NULL;
+}
+
+/* <datadir>/cache/transcode/<key>, FNV-1a over the source and everything the encoder output depends on */
+static char *transcode_cache_base(const char *source, size_t skip_seconds)
+{
+    char *id = custom_asprintf("%s|%" PRIuSIZE "|%s|%d|%d", source, skip_seconds, toniefile_quality_name(TONIEFILE_QUALITY_DEFAULT), OPUS_FRAME_SIZE, TRANSCODE_CACHE_VERSION);
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (const char *pos = id; *pos; pos++)
+    {
+        hash ^= (uint8_t)*pos;
+        hash *= 0x100000001B3ULL;
+    }
+    osFreeMem(id);
+
+    return custom_asprintf("%s/%s/%016" PRIx64, settings_get_string("internal.datadirfull"), TRANSCODE_CACHE_DIR, hash);
+}
+
+static cJSON *transcode_cache_read_info(const char *path)
+{
+    uint32_t size = 0;
+    if (fsGetFileSize(path, &size) != NO_ERROR || size == 0 || size > 64 * 1024)
+    {
+        return NULL;
+    }
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_READ);
+    if (!file)
+    {
+        return NULL;
+    }
+
+    char *data = osAllocMem(size);
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t read = 0;
+        if (fsReadFile(file, &data[pos], size - pos, &read) != NO_ERROR || read == 0)
+        {
+            break;
+        }
+        pos += read;
+    }
+    fsCloseFile(file);
+
+    cJSON *json = (pos == size) ? cJSON_ParseWithLengthOpts(data, size, 0, 0) : NULL;
+    osFreeMem(data);
+
+    return json;
+}
+
+static double transcode_cache_number(const cJSON *json, const char *name)
+{
+    const cJSON *item = cJSON_GetObjectItemCaseSensitive(json, name);
+    return cJSON_IsNumber(item) ? item->valuedouble : -1;
+}
+
+static bool_t transcode_cache_valid(const cJSON *info, const char *source, size_t skip_seconds)
+{
+    const cJSON *jsonSource = cJSON_GetObjectItemCaseSensitive(info, "source");
+    if (!cJSON_IsString(jsonSource) || osStrcmp(jsonSource->valuestring, source) || transcode_cache_number(info, "skip") != (double)skip_seconds)
+    {
+        return FALSE;
+    }
+
+    if (transcode_cache_is_url(source))
+    {
+        /* there is no ETag to compare without a request to the source, entries of URLs expire instead */
+        uint32_t maxAge = settings_get_unsigned("core.transcode_cache_max_age");
+        double created = transcode_cache_number(info, "created");
+        return created >= 0 && (double)time(NULL) - created < maxAge;
+    }
+
+    FsFileStat stat;
+    if (fsGetFileStat(source, &stat) != NO_ERROR)
+    {
+        return FALSE;
+    }
+    return transcode_cache_number(info, "size") == (double)stat.size && transcode_cache_number(info, "modified") == (double)convertDateToUnixTime(&stat.modified);
+}
+
+char *transcode_cache_lookup(const char *source, size_t skip_seconds)
+{
+    char *basePath = transcode_cache_base(source, skip_seconds);
+    char *infoPath = custom_asprintf("%s.json", basePath);
+    char *tafPath = custom_asprintf("%s.taf", basePath);
+    osFreeMem(basePath);
+
+    cJSON *info = transcode_cache_read_info(infoPath);
+    bool_t valid = info && transcode_cache_valid(info, source, skip_seconds) && fsFileExists(tafPath);
+    cJSON_Delete(info);
+
+    if (!valid && (info || fsFileExists(tafPath)))
+    {
+        TRACE_INFO("Dropped stale transcode of %s\r\n", source);
+        fsDeleteFile(tafPath);
+        fsDeleteFile(infoPath);
+    }
+    osFreeMem(infoPath);
+    if (!valid)
+    {
+        stats_update("transcode_cache_miss", 1);
+        osFreeMem(tafPath);
+        return NULL;
+    }
+
+    stats_update("transcode_cache_hit", 1);
+    return tafPath;
+}
+
+transcode_cache_entry_t *transcode_cache_begin(const char *source, size_t skip_seconds)
+{
+    bool_t url = transcode_cache_is_url(source);
+    FsFileStat stat;
+    osMemset(&stat, 0x00, sizeof(stat));
+
+    if (url && settings_get_unsigned("core.transcode_cache_max_age") == 0)
+    {
+        return NULL;
+    }
+    if (!url && fsGetFileStat(source, &stat) != NO_ERROR)
+    {
+        return NULL;
+    }
+
+    char *dir = custom_asprintf("%s/%s", settings_get_string("internal.datadirfull"), TRANSCODE_CACHE_DIR);
+    if (!fsDirExists(dir))
+    {
+        char *parent = custom_asprintf("%s/cache", settings_get_string("internal.datadirfull"));
+        fsCreateDir(parent);
+        fsCreateDir(dir);
+        osFreeMem(parent);
+    }
+    osFreeMem(dir);
+
+    transcode_cache_entry_t *entry = osAllocMem(sizeof(transcode_cache_entry_t));
+    osMemset(entry, 0x00, sizeof(transcode_cache_entry_t));
+    entry->source = strdup(source);
+    entry->skip_seconds = skip_seconds;
+    entry->basePath = transcode_cache_base(source, skip_seconds);
+    entry->tmpPath = custom_asprintf("%s.taf.tmp", entry->basePath);
+    entry->url = url;
+    entry->size = stat.size;
+    entry->modified = stat.modified;
+
+    return entry;
+}
+
+const char *transcode_cache_path(const transcode_cache_entry_t *entry)
+{
+    return entry->tmpPath;
+}
+
+static error_t transcode_cache_write_info(const transcode_cache_entry_t *entry, const char *path)
+{
+    cJSON *info = cJSON_CreateObject();
+    cJSON_AddStringToObject(info, "source", entry->source);
+    cJSON_AddNumberToObject(info, "skip", (double)entry->skip_seconds);
+    cJSON_AddNumberToObject(info, "created", (double)time(NULL));
+    if (!entry->url)
+    {
+        cJSON_AddNumberToObject(info, "size", entry->size);
+        cJSON_AddNumberToObject(info, "modified", (double)convertDateToUnixTime(&entry->modified));
+    }
+    char *data = cJSON_PrintUnformatted(info);
+    cJSON_Delete(info);
+
+    error_t error = ERROR_WRITE_FAILED;
+    FsFile *file = fsOpenFile(path, FS_FILE_MODE_WRITE | FS_FILE_MODE_CREATE | FS_FILE_MODE_TRUNC);
+    if (file)
+    {
+        error = fsWriteFile(file, data, osStrlen(data));
+        fsCloseFile(file);
+    }
+    osFreeMem(data);
+
+    return error;
+}
+
+void transcode_cache_commit(transcode_cache_entry_t *entry, bool_t complete)
+{
+    FsFileStat stat;
+    bool_t unchanged = entry->url || (fsGetFileStat(entry->source, &stat) == NO_ERROR && stat.size == entry->size && !compareDateTime(&stat.modified, &entry->modified));
+
+    /* the copy is gone if the encoder gave up on it */
+    if (complete && unchanged && fsFileExists(entry->tmpPath))
+    {
+        char *infoPath = custom_asprintf("%s.json", entry->basePath);
+        char *tafPath = custom_asprintf("%s.taf", entry->basePath);
+
+        fsDeleteFile(tafPath);
+        error_t error = fsRenameFile(entry->tmpPath, tafPath);
+        if (error == NO_ERROR)
+        {
+            error = transcode_cache_write_info(entry, infoPath);
+        }
+        if (error != NO_ERROR)
+        {
+            TRACE_ERROR("Could not cache transcode of %s, error=%" PRIu16 "\r\n", entry->source, error);
+            fsDeleteFile(tafPath);
+            fsDeleteFile(infoPath);
+        }
+        else
+        {
+            TRACE_INFO("Cached transcode of %s as %s\r\n", entry->source, tafPath);
+            stats_update("transcode_cache_stored", 1);
+        }
+        osFreeMem(infoPath);
+        osFreeMem(tafPath);
+    }
+    fsDeleteFile(entry->tmpPath);
+
+    osFreeMem(entry->source);
+    osFreeMem(entry->basePath);
+    osFreeMem(entry->tmpPath);
+    osFreeMem(entry);
+}